@@ -0,0 +1,47 @@
+/**
+ * Arena allocation and path interning.
+ *
+ * An arena hands out memory from large chunks and frees it all at once,
+ * so the many small, equally long-lived objects of a command (paths,
+ * manifest entries) cost a pointer bump each instead of a malloc() and a
+ * free(). Arenas are not thread-safe.
+ *
+ * Paths in the index and in manifests are interned: path_intern() keeps
+ * one copy of each distinct path, in arena_command, so two interned paths
+ * are equal exactly if they are the same pointer, and a path shared by
+ * the index and several manifests is stored once. Interned paths live
+ * until path_intern_reset(). beargit daemon calls it whenever it reads the
+ * index and manifest it keeps again, so it only holds their paths, which
+ * its children inherit.
+ *
+ * With tracing on (see trace.h), the "memory" counters report the number
+ * of allocations, the most bytes held by arenas at once and the number of
+ * distinct paths.
+ */
+#ifndef _BEARGIT_ARENA_H_
+#define _BEARGIT_ARENA_H_
+
+#include <stddef.h>
+
+// Size of a chunk; larger allocations get a chunk of their own
+#define ARENA_CHUNK_SIZE (64 << 10)
+
+struct arena_chunk;
+
+struct arena {
+  struct arena_chunk* chunks;
+};
+
+#define ARENA_EMPTY { NULL }
+
+// The arena of the running command
+extern struct arena arena_command;
+
+void* arena_alloc(struct arena* a, size_t size);
+char* arena_strndup(struct arena* a, const char* s, size_t len);
+void arena_free(struct arena* a);
+
+const char* path_intern(const char* path, size_t len);
+void path_intern_reset(void);
+
+#endif // _BEARGIT_ARENA_H_
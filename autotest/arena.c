@@ -0,0 +1,136 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "trace.h"
+#include "util.h"
+
+// Alignment of every allocation, enough for any type
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+  struct arena_chunk* next;
+  size_t size;
+  size_t used;
+  char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct arena arena_command = ARENA_EMPTY;
+
+// Bytes held by all arenas
+static size_t arena_held;
+
+/* Allocate <size> bytes from <a>, aligned for any type. */
+void* arena_alloc(struct arena* a, size_t size) {
+  trace_count(TRACE_ARENA_ALLOCS, 1);
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  struct arena_chunk* c = a->chunks;
+  if (!c || c->size - c->used < size) {
+    size_t chunk_size = size > ARENA_CHUNK_SIZE / 4 ? size : ARENA_CHUNK_SIZE;
+    c = malloc(sizeof(struct arena_chunk) + chunk_size);
+    ASSERT_ERROR_MESSAGE(c != NULL, "out of memory");
+    c->size = chunk_size;
+    c->used = 0;
+    // An oversized allocation goes behind the current chunk, which may
+    // still have room for small ones.
+    if (a->chunks && chunk_size != ARENA_CHUNK_SIZE) {
+      c->next = a->chunks->next;
+      a->chunks->next = c;
+    } else {
+      c->next = a->chunks;
+      a->chunks = c;
+    }
+    arena_held += sizeof(struct arena_chunk) + chunk_size;
+    trace_max(TRACE_ARENA_PEAK, arena_held);
+  }
+  void* p = c->data + c->used;
+  c->used += size;
+  return p;
+}
+
+/* Copy the <len> bytes at <s> into <a>, NUL-terminated. */
+char* arena_strndup(struct arena* a, const char* s, size_t len) {
+  char* copy = arena_alloc(a, len + 1);
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+/* Free everything allocated from <a>. */
+void arena_free(struct arena* a) {
+  while (a->chunks) {
+    struct arena_chunk* next = a->chunks->next;
+    arena_held -= sizeof(struct arena_chunk) + a->chunks->size;
+    free(a->chunks);
+    a->chunks = next;
+  }
+}
+
+struct intern_slot {
+  const char* path;  // NULL for a free slot
+  uint32_t hash;
+};
+
+static struct intern_slot* intern_table;
+static size_t intern_size;
+static size_t intern_count;
+
+/* FNV-1a hash of the <len> bytes at <path>. */
+static uint32_t intern_hash(const char* path, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char) path[i]) * 16777619u;
+  }
+  return h;
+}
+
+static struct intern_slot* intern_slot(const char* path, size_t len, uint32_t hash) {
+  size_t mask = intern_size - 1;
+  for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+    struct intern_slot* s = &intern_table[i];
+    if (!s->path || (s->hash == hash && strncmp(s->path, path, len) == 0 && !s->path[len])) {
+      return s;
+    }
+  }
+}
+
+/* Return the interned copy of the <len> bytes at <path> (which needn't be
+ * NUL-terminated), adding it if it is new. Not thread-safe.
+ */
+const char* path_intern(const char* path, size_t len) {
+  if (2 * (intern_count + 1) > intern_size) {
+    struct intern_slot* old = intern_table;
+    size_t old_size = intern_size;
+    intern_size = intern_size ? intern_size * 2 : 1024;
+    intern_table = calloc(intern_size, sizeof(struct intern_slot));
+    ASSERT_ERROR_MESSAGE(intern_table != NULL, "out of memory");
+    for (size_t i = 0; i < old_size; i++) {
+      if (old[i].path) {
+        *intern_slot(old[i].path, strlen(old[i].path), old[i].hash) = old[i];
+      }
+    }
+    free(old);
+  }
+
+  uint32_t hash = intern_hash(path, len);
+  struct intern_slot* s = intern_slot(path, len, hash);
+  if (!s->path) {
+    s->path = arena_strndup(&arena_command, path, len);
+    s->hash = hash;
+    intern_count++;
+    trace_count(TRACE_PATHS, 1);
+  }
+  return s->path;
+}
+
+/* Forget every interned path and free arena_command, which holds them.
+ * Nothing may use a path interned before.
+ */
+void path_intern_reset(void) {
+  free(intern_table);
+  intern_table = NULL;
+  intern_size = 0;
+  intern_count = 0;
+  arena_free(&arena_command);
+}
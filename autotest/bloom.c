@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <endian.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bloom.h"
+#include "commit.h"
+#include "graph.h"
+#include "manifest.h"
+#include "util.h"
+
+#define BLOOM_SIGNATURE "BBLM"
+#define BLOOM_VERSION 1
+#define BLOOM_HEADER_SIZE 8
+
+static uint64_t get_u64(const unsigned char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return be64toh(v);
+}
+
+static void put_u64(unsigned char* p, uint64_t v) {
+  v = htobe64(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+/* Map the filters. Missing or unreadable ones are opened as none; a
+ * partially written last offset is ignored.
+ */
+void bloom_open(struct bloom* b) {
+  memset(b, 0, sizeof(struct bloom));
+  if (!fs_view_open(BLOOM_INDEX_FILE, &b->index_view)) {
+    return;
+  }
+  const unsigned char* index = (const unsigned char*) b->index_view.data;
+  uint32_t version = 0;
+  if (b->index_view.size >= BLOOM_HEADER_SIZE) {
+    memcpy(&version, index + 4, sizeof(version));
+  }
+  if (b->index_view.size < BLOOM_HEADER_SIZE || memcmp(index, BLOOM_SIGNATURE, 4) != 0
+      || ntohl(version) != BLOOM_VERSION) {
+    fs_view_close(&b->index_view);
+    return;
+  }
+  b->ends = index + BLOOM_HEADER_SIZE;
+  b->count = (b->index_view.size - BLOOM_HEADER_SIZE) / 8;
+  if (fs_view_open(BLOOM_DATA_FILE, &b->data_view)) {
+    b->data = (const unsigned char*) b->data_view.data;
+    b->data_size = b->data_view.size;
+  }
+}
+
+void bloom_close(struct bloom* b) {
+  fs_view_close(&b->index_view);
+  fs_view_close(&b->data_view);
+  memset(b, 0, sizeof(struct bloom));
+}
+
+// Where the filter of <pos> ends in the data file
+static uint64_t bloom_end(const struct bloom* b, uint32_t pos) {
+  return get_u64(b->ends + (size_t) pos * 8);
+}
+
+/* Hash the <len> bytes of <path> into <key>: FNV-1a, then the MurmurHash3
+ * finalizer to spread its bits. The second half is odd, so that the
+ * BLOOM_HASHES positions of a key differ.
+ */
+void bloom_key(const char* path, size_t len, struct bloom_key* key) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char) path[i]) * 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  key->h1 = (uint32_t) h;
+  key->h2 = (uint32_t) (h >> 32) | 1;
+}
+
+static uint32_t bloom_bit(const struct bloom_key* key, int i, uint64_t bits) {
+  return (key->h1 + (uint64_t) i * key->h2) % bits;
+}
+
+/* Returns 0 if the commit at graph position <pos> definitely didn't change
+ * the path of <key>, and 1 if it may have or there is no filter for it.
+ */
+int bloom_maybe(struct bloom* b, uint32_t pos, const struct bloom_key* key) {
+  if (pos >= b->count) {
+    return 1;
+  }
+  uint64_t start = pos > 0 ? bloom_end(b, pos - 1) : 0;
+  uint64_t end = bloom_end(b, pos);
+  if (start > end || end > b->data_size) {
+    return 1;
+  }
+  const unsigned char* filter = b->data + start;
+  uint64_t bits = (end - start) * 8;
+  for (int i = 0; i < BLOOM_HASHES && bits > 0; i++) {
+    uint32_t bit = bloom_bit(key, i, bits);
+    if (!(filter[bit / 8] & (1 << (bit % 8)))) {
+      return 0;
+    }
+  }
+  return bits > 0;
+}
+
+struct bloom_paths {
+  struct bloom_key* keys;
+  int count;
+  int capacity;
+};
+
+// Add <path> and the directories above it to <p>.
+static void bloom_add_path(struct bloom_paths* p, const char* path) {
+  for (size_t len = strlen(path); len > 0; ) {
+    if (p->count == p->capacity) {
+      p->capacity = p->capacity ? 2 * p->capacity : 64;
+      p->keys = realloc(p->keys, p->capacity * sizeof(struct bloom_key));
+      ASSERT_ERROR_MESSAGE(p->keys != NULL, "out of memory");
+    }
+    bloom_key(path, len, &p->keys[p->count++]);
+    while (len > 0 && path[--len] != '/') {
+    }
+  }
+}
+
+static int bloom_key_cmp(const void* a, const void* b) {
+  const struct bloom_key* ka = a;
+  const struct bloom_key* kb = b;
+  if (ka->h1 != kb->h1) {
+    return ka->h1 < kb->h1 ? -1 : 1;
+  }
+  return ka->h2 < kb->h2 ? -1 : ka->h2 > kb->h2;
+}
+
+/* Collect the paths that differ between manifests <m> and <parent>, both
+ * sorted by filename, into <p>.
+ */
+static void bloom_diff(const struct manifest* m, const struct manifest* parent,
+                       struct bloom_paths* p) {
+  int i = 0, j = 0;
+  while (i < m->count || j < parent->count) {
+    int cmp = i == m->count ? 1 : j == parent->count ? -1
+              : strcmp(m->entries[i].filename, parent->entries[j].filename);
+    if (cmp < 0) {
+      bloom_add_path(p, m->entries[i++].filename);
+    } else if (cmp > 0) {
+      bloom_add_path(p, parent->entries[j++].filename);
+    } else {
+      if (strcmp(m->entries[i].id, parent->entries[j].id) != 0) {
+        bloom_add_path(p, m->entries[i].filename);
+      }
+      i++;
+      j++;
+    }
+  }
+}
+
+/* Append the filter of <p>, or with <every_path> the one that holds every
+ * path, to the <*size> bytes at <*data>.
+ */
+static void bloom_write_filter(struct bloom_paths* p, int every_path, unsigned char** data,
+                               size_t* size, size_t* capacity) {
+  qsort(p->keys, p->count, sizeof(struct bloom_key), bloom_key_cmp);
+  int unique = every_path ? BLOOM_MAX_PATHS + 1 : 0;
+  for (int i = 0; i < p->count && !every_path; i++) {
+    if (unique == 0 || bloom_key_cmp(&p->keys[unique - 1], &p->keys[i]) != 0) {
+      p->keys[unique++] = p->keys[i];
+    }
+  }
+  size_t bytes = unique > BLOOM_MAX_PATHS ? 1 : ((size_t) unique * BLOOM_BITS_PER_PATH + 7) / 8;
+  if (*size + bytes > *capacity) {
+    *capacity = *size + bytes > 2 * *capacity ? *size + bytes : 2 * *capacity;
+    *data = realloc(*data, *capacity);
+    ASSERT_ERROR_MESSAGE(*data != NULL, "out of memory");
+  }
+  unsigned char* filter = *data + *size;
+  memset(filter, unique > BLOOM_MAX_PATHS ? 0xff : 0, bytes);
+  for (int i = 0; i < unique && unique <= BLOOM_MAX_PATHS; i++) {
+    for (int k = 0; k < BLOOM_HASHES; k++) {
+      uint32_t bit = bloom_bit(&p->keys[i], k, bytes * 8);
+      filter[bit / 8] |= 1 << (bit % 8);
+    }
+  }
+  *size += bytes;
+  p->count = 0;
+}
+
+/* Add the filters of the commits the commit graph has and the filters
+ * don't (see the top of bloom.h). A commit that can't be read gets a
+ * filter holding every path.
+ */
+void bloom_update(void) {
+  int lock = graph_lock();
+  struct graph g;
+  struct bloom b;
+  graph_open(&g);
+  bloom_open(&b);
+  int fresh = b.ends == NULL || b.count > g.count
+              || (b.count > 0 && bloom_end(&b, b.count - 1) > b.data_size);
+  uint32_t first = fresh ? 0 : b.count;
+  uint64_t offset = first > 0 ? bloom_end(&b, first - 1) : 0;
+  bloom_close(&b);
+  if (first >= g.count) {
+    graph_close(&g);
+    graph_unlock(lock);
+    return;
+  }
+
+  unsigned char* data = NULL;
+  size_t size = 0, capacity = 0;
+  unsigned char* ends = malloc((size_t) (g.count - first) * 8);
+  ASSERT_ERROR_MESSAGE(ends != NULL, "out of memory");
+  struct bloom_paths paths = { NULL, 0, 0 };
+  // The manifest of the previous position, usually the next one's parent
+  struct manifest last;
+  int have_last = 0;
+  for (uint32_t pos = first; pos < g.count; pos++) {
+    char id[COMMIT_ID_SIZE], parent_id[COMMIT_ID_SIZE];
+    uint32_t parent = graph_parent(&g, pos);
+    graph_commit_id(&g, pos, id);
+    if (parent < pos) {
+      graph_commit_id(&g, parent, parent_id);
+    } else {
+      strcpy(parent_id, NULL_COMMIT_ID);
+    }
+
+    int have_parent = have_last && parent == pos - 1;
+    if (have_last && !have_parent) {
+      manifest_free(&last);
+    }
+    have_last = 0;
+    if (!commit_exists(id)
+        || (strcmp(parent_id, NULL_COMMIT_ID) != 0 && !commit_exists(parent_id))) {
+      bloom_write_filter(&paths, 1, &data, &size, &capacity);
+      if (have_parent) {
+        manifest_free(&last);
+      }
+    } else {
+      struct manifest m;
+      manifest_load(id, &m);
+      if (!have_parent) {
+        manifest_load(parent_id, &last);
+      }
+      bloom_diff(&m, &last, &paths);
+      bloom_write_filter(&paths, 0, &data, &size, &capacity);
+      manifest_free(&last);
+      last = m;
+      have_last = 1;
+    }
+    put_u64(ends + (size_t) (pos - first) * 8, offset + size);
+  }
+  if (have_last) {
+    manifest_free(&last);
+  }
+  free(paths.keys);
+
+  // Start over if the filters are missing, unreadable or don't fit the
+  // graph; otherwise cut off partially written data before appending.
+  if (fresh) {
+    bloom_reset();
+  }
+  int fd = open(BLOOM_INDEX_FILE, O_WRONLY | O_CREAT, 0644);
+  int data_fd = open(BLOOM_DATA_FILE, O_WRONLY | O_CREAT, 0644);
+  ASSERT_ERROR_MESSAGE(fd != -1 && data_fd != -1, "opening bloom filters failed");
+  off_t end = BLOOM_HEADER_SIZE + (off_t) first * 8;
+  ASSERT_ERROR_MESSAGE(ftruncate(data_fd, offset) == 0
+                       && lseek(data_fd, offset, SEEK_SET) == (off_t) offset
+                       && ftruncate(fd, fresh ? 0 : end) == 0
+                       && lseek(fd, fresh ? 0 : end, SEEK_SET) == (fresh ? 0 : end),
+                       "truncating bloom filters failed");
+  if (fresh) {
+    unsigned char header[BLOOM_HEADER_SIZE];
+    uint32_t version = htonl(BLOOM_VERSION);
+    memcpy(header, BLOOM_SIGNATURE, 4);
+    memcpy(header + 4, &version, sizeof(version));
+    ASSERT_ERROR_MESSAGE(write(fd, header, sizeof(header)) == (ssize_t) sizeof(header),
+                         "writing bloom filters failed");
+  }
+  size_t ends_size = (size_t) (g.count - first) * 8;
+  ASSERT_ERROR_MESSAGE(write(data_fd, data, size) == (ssize_t) size
+                       && write(fd, ends, ends_size) == (ssize_t) ends_size,
+                       "writing bloom filters failed");
+  close(fd);
+  close(data_fd);
+  free(data);
+  free(ends);
+  graph_close(&g);
+  graph_unlock(lock);
+}
+
+/* Delete the filters, for a graph whose positions changed. */
+void bloom_reset(void) {
+  unlink(BLOOM_INDEX_FILE);
+  unlink(BLOOM_DATA_FILE);
+}
@@ -0,0 +1,64 @@
+/**
+ * Changed-path Bloom filters of the commit graph (beargit log -- <path>).
+ *
+ * For each commit in the commit graph (graph.h) a Bloom filter holds the
+ * paths the commit changed against its parent: every file added, removed
+ * or modified, and each directory above one. A path the filter doesn't
+ * hold was definitely not changed, so a path-limited log only diffs the
+ * manifests of the commits whose filter may hold it.
+ *
+ * A filter has BLOOM_BITS_PER_PATH bits per path, rounded up to whole
+ * bytes, and BLOOM_HASHES bit positions per path, derived from one 64-bit
+ * hash by double hashing. A commit that changed no path has an empty
+ * filter; one that changed more than BLOOM_MAX_PATHS has the single byte
+ * 0xff, which holds every path.
+ *
+ * The filters are stored back to back in BLOOM_DATA_FILE. BLOOM_INDEX_FILE
+ * is a header ("BBLM", version) followed by, for each graph position, the
+ * offset in the data file where its filter ends (8 bytes), so the filter
+ * of position p spans from the end of p - 1 to the end of p. Integers are
+ * in network byte order.
+ *
+ * Like the graph, both files are only appended to: bloom_update() adds the
+ * filters of the positions the graph has and the index doesn't, data
+ * before index. Since filters are keyed by position, graph_add() deletes
+ * them when it starts a new graph.
+ */
+#ifndef _BEARGIT_BLOOM_H_
+#define _BEARGIT_BLOOM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+#define BLOOM_INDEX_FILE ".beargit/commit-graph.bidx"
+#define BLOOM_DATA_FILE ".beargit/commit-graph.bdat"
+
+#define BLOOM_BITS_PER_PATH 10
+#define BLOOM_HASHES 7
+#define BLOOM_MAX_PATHS 512
+
+struct bloom {
+  const unsigned char* ends;
+  uint32_t count;
+  const unsigned char* data;
+  size_t data_size;
+  // Views of the files, for bloom_close()
+  struct fs_view index_view;
+  struct fs_view data_view;
+};
+
+struct bloom_key {
+  uint32_t h1;
+  uint32_t h2;
+};
+
+void bloom_open(struct bloom* b);
+void bloom_close(struct bloom* b);
+void bloom_key(const char* path, size_t len, struct bloom_key* key);
+int bloom_maybe(struct bloom* b, uint32_t pos, const struct bloom_key* key);
+void bloom_update(void);
+void bloom_reset(void);
+
+#endif // _BEARGIT_BLOOM_H_
@@ -0,0 +1,94 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "config.h"
+
+// Zero bits a cut needs below and above CHUNK_AVG (16 bits for 64 KiB)
+#define CHUNK_MASK_SMALL (~0ULL << (64 - 18))
+#define CHUNK_MASK_LARGE (~0ULL << (64 - 14))
+
+#define CHUNK_GEAR_SEED 0x62656172676974ULL  // "beargit"
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// Fill the Gear table with splitmix64 of the fixed seed.
+static void chunk_init_gear(void) {
+  uint64_t state = CHUNK_GEAR_SEED;
+  for (int i = 0; i < 256; i++) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    gear[i] = z ^ (z >> 31);
+  }
+}
+
+/* Returns the length of the chunk at the start of <data>, which holds the
+ * <size> bytes that are left of a file.
+ */
+size_t chunk_next(const unsigned char* data, size_t size) {
+  if (size <= CHUNK_MIN) {
+    return size;
+  }
+  pthread_once(&gear_once, chunk_init_gear);
+  size_t normal = size < CHUNK_AVG ? size : CHUNK_AVG;
+  size_t end = size < CHUNK_MAX ? size : CHUNK_MAX;
+  uint64_t h = 0;
+  size_t i = CHUNK_MIN;
+  for (; i < normal; i++) {
+    h = (h << 1) + gear[data[i]];
+    if (!(h & CHUNK_MASK_SMALL)) {
+      return i + 1;
+    }
+  }
+  for (; i < end; i++) {
+    h = (h << 1) + gear[data[i]];
+    if (!(h & CHUNK_MASK_LARGE)) {
+      return i + 1;
+    }
+  }
+  return end;
+}
+
+static uint64_t threshold;
+static pthread_once_t threshold_once = PTHREAD_ONCE_INIT;
+
+// Parse "<n>[K|M|G]" into <bytes>. Returns 0 if <s> isn't a size.
+static int chunk_parse_size(const char* s, uint64_t* bytes) {
+  char* end;
+  unsigned long long n = strtoull(s, &end, 10);
+  if (end == s) {
+    return 0;
+  }
+  int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+  if (shift && *++end != '\0') {
+    return 0;
+  }
+  *bytes = (uint64_t) n << shift;
+  return *end == '\0';
+}
+
+static void chunk_read_setting(void) {
+  char value[CONFIG_VALUE_SIZE];
+  if (!config_get("chunking", value)) {
+    strcpy(value, CHUNK_DEFAULT_THRESHOLD);
+  }
+  if (strcmp(value, "off") == 0) {
+    threshold = UINT64_MAX;
+  } else if (!chunk_parse_size(value, &threshold) || threshold <= CHUNK_MIN) {
+    fprintf(stderr, "ERROR:  Invalid chunking %s in %s; using %s.\n", value, CONFIG_FILE,
+            CHUNK_DEFAULT_THRESHOLD);
+    chunk_parse_size(CHUNK_DEFAULT_THRESHOLD, &threshold);
+  }
+}
+
+/* The size from which files are chunked. The setting is read once per
+ * process, like the compression setting.
+ */
+uint64_t chunk_threshold(void) {
+  pthread_once(&threshold_once, chunk_read_setting);
+  return threshold;
+}
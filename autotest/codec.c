@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <zlib.h>
+
+#include "codec.h"
+#include "config.h"
+#include "util.h"
+
+/* Read up to <size> bytes of <in> into <buf>, retrying interrupted reads.
+ * Returns the number of bytes read, 0 at the end of the file.
+ */
+static size_t codec_read(int in, unsigned char* buf, size_t size) {
+  for (;;) {
+    ssize_t n = read(in, buf, size);
+    if (n >= 0) {
+      return n;
+    }
+    ASSERT_ERROR_MESSAGE(errno == EINTR, "reading object source failed");
+  }
+}
+
+/* Read the next block from the file descriptor <arg> points to. */
+size_t codec_source_fd(void* arg, unsigned char* buf, size_t size) {
+  return codec_read(*(int*) arg, buf, size);
+}
+
+/* Take the next block from the struct codec_buffer <arg> points to. */
+size_t codec_source_buffer(void* arg, unsigned char* buf, size_t size) {
+  struct codec_buffer* b = arg;
+  size_t n = b->size < size ? b->size : size;
+  memcpy(buf, b->data, n);
+  b->data += n;
+  b->size -= n;
+  return n;
+}
+
+/* Write every block to the file descriptor <arg> points to. */
+void codec_sink_fd(void* arg, const unsigned char* data, size_t size) {
+  int fd = *(int*) arg;
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0) {
+      ASSERT_ERROR_MESSAGE(errno == EINTR, "writing object data failed");
+      continue;
+    }
+    data += n;
+    size -= n;
+  }
+}
+
+static uint64_t none_compress(codec_source source, void* source_arg, int level,
+                              codec_sink sink, void* arg) {
+  unsigned char* buf = malloc(CODEC_BLOCK_SIZE);
+  ASSERT_ERROR_MESSAGE(buf != NULL, "out of memory");
+  uint64_t total = 0;
+  size_t n;
+  while ((n = source(source_arg, buf, CODEC_BLOCK_SIZE)) > 0) {
+    sink(arg, buf, n);
+    total += n;
+  }
+  free(buf);
+  return total;
+}
+
+static int none_decompress(int in, uint64_t size, codec_sink sink, void* arg) {
+  unsigned char* buf = malloc(CODEC_BLOCK_SIZE);
+  ASSERT_ERROR_MESSAGE(buf != NULL, "out of memory");
+  uint64_t total = 0;
+  size_t n;
+  while ((n = codec_read(in, buf, CODEC_BLOCK_SIZE)) > 0 && total + n <= size) {
+    sink(arg, buf, n);
+    total += n;
+  }
+  free(buf);
+  return n == 0 && total == size;
+}
+
+static uint64_t zlib_compress(codec_source source, void* source_arg, int level,
+                              codec_sink sink, void* arg) {
+  unsigned char* buf = malloc(2 * CODEC_BLOCK_SIZE);
+  ASSERT_ERROR_MESSAGE(buf != NULL, "out of memory");
+  unsigned char* out = buf + CODEC_BLOCK_SIZE;
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  ASSERT_ERROR_MESSAGE(deflateInit(&zs, level) == Z_OK, "deflateInit failed");
+
+  int flush;
+  do {
+    zs.avail_in = source(source_arg, buf, CODEC_BLOCK_SIZE);
+    zs.next_in = buf;
+    flush = zs.avail_in == 0 ? Z_FINISH : Z_NO_FLUSH;
+    do {
+      zs.next_out = out;
+      zs.avail_out = CODEC_BLOCK_SIZE;
+      ASSERT_ERROR_MESSAGE(deflate(&zs, flush) != Z_STREAM_ERROR, "compressing object failed");
+      if (zs.avail_out < CODEC_BLOCK_SIZE) {
+        sink(arg, out, CODEC_BLOCK_SIZE - zs.avail_out);
+      }
+    } while (zs.avail_out == 0);
+  } while (flush != Z_FINISH);
+
+  uint64_t total = zs.total_in;
+  deflateEnd(&zs);
+  free(buf);
+  return total;
+}
+
+static int zlib_decompress(int in, uint64_t size, codec_sink sink, void* arg) {
+  unsigned char* buf = malloc(2 * CODEC_BLOCK_SIZE);
+  ASSERT_ERROR_MESSAGE(buf != NULL, "out of memory");
+  unsigned char* out = buf + CODEC_BLOCK_SIZE;
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  ASSERT_ERROR_MESSAGE(inflateInit(&zs) == Z_OK, "inflateInit failed");
+
+  int ret = Z_OK;
+  while (ret == Z_OK) {
+    zs.avail_in = codec_read(in, buf, CODEC_BLOCK_SIZE);
+    zs.next_in = buf;
+    if (zs.avail_in == 0) {
+      break;
+    }
+    do {
+      zs.next_out = out;
+      zs.avail_out = CODEC_BLOCK_SIZE;
+      ret = inflate(&zs, Z_NO_FLUSH);
+      if (ret == Z_BUF_ERROR) {
+        ret = Z_OK;  // no progress possible until more input arrives
+      }
+      if (ret != Z_OK && ret != Z_STREAM_END) {
+        break;
+      }
+      // Don't pass on more than the header promised.
+      size_t n = CODEC_BLOCK_SIZE - zs.avail_out;
+      if (zs.total_out > size) {
+        ret = Z_DATA_ERROR;
+        break;
+      }
+      sink(arg, out, n);
+    } while (ret == Z_OK && zs.avail_out == 0);
+  }
+
+  int ok = ret == Z_STREAM_END && zs.total_out == size && zs.avail_in == 0
+      && codec_read(in, buf, 1) == 0;
+  inflateEnd(&zs);
+  free(buf);
+  return ok;
+}
+
+const struct codec codecs[] = {
+  { "none", CODEC_NONE, 0, 0, 0, none_compress, none_decompress },
+  { "zlib", CODEC_ZLIB, 1, 9, 6, zlib_compress, zlib_decompress },
+};
+const int num_codecs = sizeof(codecs) / sizeof(codecs[0]);
+
+// The codec "fast" and "best" refer to
+#define CODEC_DEFAULT CODEC_ZLIB
+
+/* Returns the codec with id <id>, or NULL if it isn't built in. */
+const struct codec* codec_find(int id) {
+  for (int i = 0; i < num_codecs; i++) {
+    if (codecs[i].id == id) {
+      return &codecs[i];
+    }
+  }
+  return NULL;
+}
+
+/* Parse a "compression" setting (see codec.h) and store its level in
+ * <level>. Returns NULL if the setting is invalid.
+ */
+const struct codec* codec_parse(const char* setting, int* level) {
+  const struct codec* c = codec_find(CODEC_DEFAULT);
+  if (strcmp(setting, "fast") == 0) {
+    *level = c->min_level;
+    return c;
+  } else if (strcmp(setting, "best") == 0) {
+    *level = c->max_level;
+    return c;
+  }
+
+  const char* colon = strchr(setting, ':');
+  size_t len = colon ? (size_t) (colon - setting) : strlen(setting);
+  for (int i = 0; i < num_codecs; i++) {
+    c = &codecs[i];
+    if (strlen(c->name) != len || strncmp(c->name, setting, len) != 0) {
+      continue;
+    }
+    if (!colon) {
+      *level = c->default_level;
+      return c;
+    }
+    char* end;
+    long l = strtol(colon + 1, &end, 10);
+    if (end == colon + 1 || *end != '\0' || l < c->min_level || l > c->max_level) {
+      return NULL;
+    }
+    *level = l;
+    return c;
+  }
+  return NULL;
+}
+
+static const struct codec* setting_codec;
+static int setting_level;
+static pthread_once_t setting_once = PTHREAD_ONCE_INIT;
+
+static void codec_read_setting(void) {
+  char value[CONFIG_VALUE_SIZE];
+  if (!config_get("compression", value)) {
+    strcpy(value, "fast");
+  }
+  setting_codec = codec_parse(value, &setting_level);
+  if (setting_codec == NULL) {
+    fprintf(stderr, "ERROR:  Invalid compression %s in %s; using fast.\n", value, CONFIG_FILE);
+    setting_codec = codec_parse("fast", &setting_level);
+  }
+}
+
+/* The codec new objects are written with, and its level in <level>. The
+ * setting is read once per process; the object store is written from the
+ * worker pool.
+ */
+const struct codec* codec_setting(int* level) {
+  pthread_once(&setting_once, codec_read_setting);
+  *level = setting_level;
+  return setting_codec;
+}
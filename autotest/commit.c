@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "commit.h"
+#include "util.h"
+
+/* Returns 1 if <commit_id> names a commit, loose or packed. */
+int commit_exists(const char* commit_id) {
+  char commit_dir[PATH_MAX];
+  snprintf(commit_dir, PATH_MAX, ".beargit/%s", commit_id);
+  if (fs_check_dir_exists(commit_dir)) {
+    return 1;
+  }
+
+  int type;
+  return strlen(commit_id) == COMMIT_ID_SIZE - 1 && pack_lookup(commit_id, &type)
+      && type == PACK_OBJ_COMMIT;
+}
+
+/* Load the parent and message of <commit_id> into <c>. For packed commits
+ * <c> also points at the manifest lines; release it with commit_free().
+ *
+ * Returns 1 on success, 0 if there is no such commit.
+ */
+int commit_load(const char* commit_id, struct commit_object* c) {
+  memset(c, 0, sizeof(struct commit_object));
+
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, ".beargit/%s", commit_id);
+  if (fs_check_dir_exists(path)) {
+    snprintf(path, PATH_MAX, ".beargit/%s/.prev", commit_id);
+    read_string_from_file(path, c->prev, COMMIT_ID_SIZE);
+    snprintf(path, PATH_MAX, ".beargit/%s/.msg", commit_id);
+    ASSERT_ERROR_MESSAGE(fs_view_open(path, &c->msg_view), "commit has no message");
+    c->msg = c->msg_view.data;
+    c->msg_len = fs_view_strlen(&c->msg_view);
+    return 1;
+  }
+
+  int type;
+  size_t size;
+  if (strlen(commit_id) != COMMIT_ID_SIZE - 1 || !pack_read(commit_id, &type, &c->data, &size)) {
+    return 0;
+  }
+  ASSERT_ERROR_MESSAGE(type == PACK_OBJ_COMMIT, "object is not a commit");
+
+  const char* cur = (const char*) c->data;
+  const char* end = cur + size;
+  char* next;
+  ASSERT_ERROR_MESSAGE(size > COMMIT_ID_SIZE && cur[COMMIT_ID_SIZE - 1] == '\n', "corrupt commit");
+  memcpy(c->prev, cur, COMMIT_ID_SIZE - 1);
+  cur += COMMIT_ID_SIZE;
+  size_t msg_len = strtoul(cur, &next, 10);
+  ASSERT_ERROR_MESSAGE(next < end && *next == '\n' && msg_len <= (size_t) (end - next - 1),
+                       "corrupt commit");
+  cur = next + 1;
+  c->msg = cur;
+  c->msg_len = msg_len;
+  c->manifest = cur + msg_len;
+  c->manifest_size = end - c->manifest;
+  return 1;
+}
+
+void commit_free(struct commit_object* c) {
+  if (c->msg_view.data) {
+    fs_view_close(&c->msg_view);
+  }
+  free(c->data);
+  c->data = NULL;
+  c->manifest = NULL;
+}
+
+/* Fill <o> with the packed form of <commit_id>, whose manifest is <m>. */
+void commit_pack(const char* commit_id, struct manifest* m, struct pack_object* o) {
+  struct commit_object c;
+  ASSERT_ERROR_MESSAGE(commit_load(commit_id, &c), "commit to pack is missing");
+
+  size_t msg_len = c.msg_len;
+  size_t size = COMMIT_ID_SIZE + 21 + msg_len;
+  for (int i = 0; i < m->count; i++) {
+    size += OBJECT_ID_SIZE + strlen(m->entries[i].filename) + 1;
+  }
+  char* data = malloc(size);
+  ASSERT_ERROR_MESSAGE(data != NULL, "out of memory");
+  size_t n = sprintf(data, "%s\n%zu\n%.*s", c.prev, msg_len, (int) msg_len, c.msg);
+  for (int i = 0; i < m->count; i++) {
+    n += sprintf(data + n, "%s %s\n", m->entries[i].id, m->entries[i].filename);
+  }
+  commit_free(&c);
+
+  memset(o, 0, sizeof(struct pack_object));
+  snprintf(o->id, OBJECT_ID_SIZE, "%s", commit_id);
+  o->type = PACK_OBJ_COMMIT;
+  o->data = (unsigned char*) data;
+  o->size = n;
+}
@@ -0,0 +1,51 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "util.h"
+
+// Strip leading and trailing whitespace from <s> in place.
+static char* config_trim(char* s) {
+  while (isspace((unsigned char) *s)) {
+    s++;
+  }
+  size_t len = strlen(s);
+  while (len > 0 && isspace((unsigned char) s[len - 1])) {
+    s[--len] = '\0';
+  }
+  return s;
+}
+
+/* Look up setting <key> in CONFIG_FILE. Returns 1 and stores its value in
+ * <value> if it is set; the last setting of a key wins.
+ */
+int config_get(const char* key, char value[CONFIG_VALUE_SIZE]) {
+  struct fs_view v;
+  if (!fs_view_open(CONFIG_FILE, &v)) {
+    return 0;
+  }
+  int found = 0;
+  size_t off = 0, len;
+  const char* line;
+  while (fs_view_line(&v, &off, &line, &len)) {
+    char buf[1024];
+    if (len >= sizeof(buf)) {
+      continue;
+    }
+    memcpy(buf, line, len);
+    buf[len] = '\0';
+    char* eq = strchr(buf, '=');
+    char* k = config_trim(buf);
+    if (!eq || *k == '#') {
+      continue;
+    }
+    *eq = '\0';
+    if (strcmp(config_trim(k), key) == 0) {
+      snprintf(value, CONFIG_VALUE_SIZE, "%s", config_trim(eq + 1));
+      found = 1;
+    }
+  }
+  fs_view_close(&v);
+  return found;
+}
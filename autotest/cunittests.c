@@ -0,0 +1,1769 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <CUnit/Basic.h>
+#include "beargit.h"
+#include "arena.h"
+#include "bloom.h"
+#include "cache.h"
+#include "chunk.h"
+#include "codec.h"
+#include "config.h"
+#include "fsmonitor.h"
+#include "gc.h"
+#include "graph.h"
+#include "hash.h"
+#include "index.h"
+#include "manifest.h"
+#include "object.h"
+#include "pack.h"
+#include "refs.h"
+#include "search.h"
+#include "trace.h"
+#include "txn.h"
+#include "util.h"
+
+/* printf/fprintf calls in this tester will NOT go to file. */
+
+#undef printf
+#undef fprintf
+
+/* The suite initialization function.
+ * You'll probably want to delete any leftover files in .beargit from previous
+ * tests, along with the .beargit directory itself.
+ *
+ * You'll most likely be able to share this across suites.
+ */
+int init_suite(void)
+{
+    // preps to run tests by deleting the .beargit directory if it exists
+    fs_force_rm_beargit_dir();
+    pack_reload();
+    unlink("TEST_STDOUT");
+    unlink("TEST_STDERR");
+    return 0;
+}
+
+/* You can also delete leftover files after a test suite runs, but there's
+ * no need to duplicate code between this and init_suite 
+ */
+int clean_suite(void)
+{
+    return 0;
+}
+
+/* Simple test of fread().
+ * Reads the data previously written by testFPRINTF()
+ * and checks whether the expected characters are present.
+ * Must be run after testFPRINTF().
+ */
+void simple_sample_test(void)
+{
+    // This is a very basic test. Your tests should likely do more than this.
+    // We suggest checking the outputs of printfs/fprintfs to both stdout
+    // and stderr. To make this convenient for you, the tester replaces
+    // printf and fprintf with copies that write data to a file for you
+    // to access. To access all output written to stdout, you can read 
+    // from the "TEST_STDOUT" file. To access all output written to stderr,
+    // you can read from the "TEST_STDERR" file.
+    int retval;
+    retval = beargit_init();
+    CU_ASSERT(0==retval);
+    retval = beargit_add("asdf.txt");
+    CU_ASSERT(0==retval);
+}
+
+struct commit {
+  char msg[MSG_SIZE];
+  struct commit* next;
+};
+
+
+void free_commit_list(struct commit** commit_list) {
+  if (*commit_list) {
+    free_commit_list(&((*commit_list)->next));
+    free(*commit_list);
+  }
+
+  *commit_list = NULL;
+}
+
+void run_commit(struct commit** commit_list, const char* msg) {
+    int retval = beargit_commit(msg);
+    CU_ASSERT(0==retval);
+
+    struct commit* new_commit = (struct commit*)malloc(sizeof(struct commit));
+    new_commit->next = *commit_list;
+    strcpy(new_commit->msg, msg);
+    *commit_list = new_commit;
+}
+
+void simple_log_test(void)
+{
+    struct commit* commit_list = NULL;
+    int retval;
+    retval = beargit_init();
+    CU_ASSERT(0==retval);
+    FILE* asdf = fopen("asdf.txt", "w");
+    fclose(asdf);
+    retval = beargit_add("asdf.txt");
+    CU_ASSERT(0==retval);
+    run_commit(&commit_list, "THIS IS BEAR TERRITORY!1");
+    run_commit(&commit_list, "THIS IS BEAR TERRITORY!2");
+    run_commit(&commit_list, "THIS IS BEAR TERRITORY!3");
+
+    retval = beargit_log(10, NULL, NULL);
+    CU_ASSERT(0==retval);
+
+    struct commit* cur_commit = commit_list;
+
+    const int LINE_SIZE = 512;
+    char line[LINE_SIZE];
+
+    FILE* fstdout = fopen("TEST_STDOUT", "r");
+    CU_ASSERT_PTR_NOT_NULL(fstdout);
+
+    while (cur_commit != NULL) {
+      char refline[LINE_SIZE];
+
+      // First line is commit -- don't check the ID.
+      CU_ASSERT_PTR_NOT_NULL(fgets(line, LINE_SIZE, fstdout));
+      CU_ASSERT(!strncmp(line,"commit", strlen("commit")));
+
+      // Second line is msg
+      sprintf(refline, "   %s\n", cur_commit->msg);
+      CU_ASSERT_PTR_NOT_NULL(fgets(line, LINE_SIZE, fstdout));
+      CU_ASSERT_STRING_EQUAL(line, refline);
+
+      // Third line is empty
+      CU_ASSERT_PTR_NOT_NULL(fgets(line, LINE_SIZE, fstdout));
+      CU_ASSERT(!strcmp(line,"\n"));
+
+      cur_commit = cur_commit->next;
+    }
+
+    CU_ASSERT_PTR_NULL(fgets(line, LINE_SIZE, fstdout));
+
+    // It's the end of output
+    CU_ASSERT(feof(fstdout));
+    fclose(fstdout);
+
+    free_commit_list(&commit_list);
+}
+
+/*
+* Simple test for rm. Tests whether calling rm multiple times on the same
+* file results in an error. Tests whether the file is removed from the 
+* output to stdout. Tests whether the number of line for rm is correct.
+* Tests whether rm only removes the file that it is called on.
+*/
+void rm_test(void) {
+    FILE *file1 = fopen("test1.txt", "w");
+    fclose(file1);
+    FILE *file2 = fopen("test2.txt", "w");
+    fclose(file2);
+    
+    int retval = beargit_init();
+    CU_ASSERT(0==retval);
+    retval = beargit_add("test1.txt");
+    CU_ASSERT(0==retval);
+    retval = beargit_add("test2.txt");
+    CU_ASSERT(0==retval);
+    retval = beargit_rm("test1.txt");
+    CU_ASSERT(0==retval);
+    retval = beargit_rm("test1.txt");
+    CU_ASSERT(1==retval);
+    
+    struct index idx;
+    index_load(&idx);
+    CU_ASSERT(idx.count == 1);
+    CU_ASSERT_PTR_NOT_NULL(index_find(&idx, "test2.txt"));
+    CU_ASSERT_PTR_NULL(index_find(&idx, "test1.txt"));
+    index_free(&idx);
+}
+
+/*
+* Simple test for add. Tests whether a file can be added
+* without error. Tests that the same file cannot be added
+* twice. Tests that add puts the correct file name onto the 
+* .index file. Tests that adding the same file twice does not 
+* it onto the .index file twice.
+*/
+void add_test(void) {
+    FILE *file = fopen("test.txt", "w");
+    fclose(file);
+   
+    int retval = beargit_init();
+    CU_ASSERT(0==retval);
+    retval = beargit_add("test.txt");
+    CU_ASSERT(0==retval);
+    retval = beargit_add("test.txt");
+    CU_ASSERT(3==retval);
+    
+    struct index idx;
+    index_load(&idx);
+    CU_ASSERT(idx.count == 1);
+    CU_ASSERT(strcmp(idx.entries[0].filename, "test.txt") == 0);
+    index_free(&idx);
+}
+
+/*
+* Tests that status reports tracked files that were modified or deleted
+* since the last commit, and nothing for unchanged files.
+*/
+void status_changes_test(void) {
+    FILE *file = fopen("changed.txt", "w");
+    fprintf(file, "before\n");
+    fclose(file);
+    file = fopen("deleted.txt", "w");
+    fclose(file);
+    file = fopen("same.txt", "w");
+    fclose(file);
+
+    int retval = beargit_init();
+    CU_ASSERT(0==retval);
+    CU_ASSERT(0==beargit_add("changed.txt"));
+    CU_ASSERT(0==beargit_add("deleted.txt"));
+    CU_ASSERT(0==beargit_add("same.txt"));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!"));
+
+    file = fopen("changed.txt", "w");
+    fprintf(file, "after!\n");
+    fclose(file);
+    unlink("deleted.txt");
+
+    retval = beargit_status();
+    CU_ASSERT(0==retval);
+
+    char line[512];
+    int modified = 0, deleted = 0, other = 0;
+    FILE* fstdout = fopen("TEST_STDOUT", "r");
+    CU_ASSERT_PTR_NOT_NULL(fstdout);
+    while (fgets(line, sizeof(line), fstdout)) {
+        if (strcmp(line, "   modified: changed.txt\n") == 0) {
+            modified++;
+        } else if (strcmp(line, "   deleted:  deleted.txt\n") == 0) {
+            deleted++;
+        } else if (strstr(line, "modified:") || strstr(line, "deleted:")) {
+            other++;
+        }
+    }
+    fclose(fstdout);
+
+    CU_ASSERT(modified == 1);
+    CU_ASSERT(deleted == 1);
+    CU_ASSERT(other == 0);
+}
+
+/*
+* Tests bulk add and rm: a directory is added recursively (skipping hidden
+* files), a failing path leaves the index unchanged, and removing a
+* directory removes every tracked file below it.
+*/
+void bulk_add_rm_test(void) {
+    mkdir("bulk", 0755);
+    mkdir("bulk/sub", 0755);
+    FILE *file = fopen("bulk/a.txt", "w");
+    fclose(file);
+    file = fopen("bulk/sub/b.txt", "w");
+    fclose(file);
+    file = fopen("bulk/.hidden", "w");
+    fclose(file);
+    file = fopen("top.txt", "w");
+    fclose(file);
+
+    int retval = beargit_init();
+    CU_ASSERT(0==retval);
+    CU_ASSERT(0==beargit_add("top.txt"));
+
+    const char* dup[] = { "bulk", "top.txt" };
+    CU_ASSERT(3==beargit_add_paths(2, dup));
+    struct index idx;
+    index_load(&idx);
+    CU_ASSERT(idx.count == 1);
+    index_free(&idx);
+
+    const char* dirs[] = { "bulk" };
+    CU_ASSERT(0==beargit_add_paths(1, dirs));
+    index_load(&idx);
+    CU_ASSERT(idx.count == 3);
+    CU_ASSERT_PTR_NOT_NULL(index_find(&idx, "bulk/a.txt"));
+    CU_ASSERT_PTR_NOT_NULL(index_find(&idx, "bulk/sub/b.txt"));
+    CU_ASSERT_PTR_NULL(index_find(&idx, "bulk/.hidden"));
+    index_free(&idx);
+
+    CU_ASSERT(0==beargit_rm_paths(1, dirs));
+    index_load(&idx);
+    CU_ASSERT(idx.count == 1);
+    CU_ASSERT_PTR_NOT_NULL(index_find(&idx, "top.txt"));
+    index_free(&idx);
+}
+
+/*
+* Tests that an index in the old text format (one filename per line) is
+* read correctly, and that the next write converts it to the binary format.
+*/
+void index_upgrade_test(void) {
+    int retval = beargit_init();
+    CU_ASSERT(0==retval);
+
+    FILE *findex = fopen(".beargit/.index", "w");
+    fprintf(findex, "b.txt\na.txt\nb.txt\n");
+    fclose(findex);
+
+    struct index idx;
+    index_load(&idx);
+    CU_ASSERT(idx.count == 2);
+    CU_ASSERT_PTR_NOT_NULL(index_find(&idx, "a.txt"));
+    CU_ASSERT_PTR_NOT_NULL(index_find(&idx, "b.txt"));
+    index_write(&idx);
+    index_free(&idx);
+
+    char signature[4];
+    findex = fopen(".beargit/.index", "r");
+    CU_ASSERT(fread(signature, 1, 4, findex) == 4);
+    CU_ASSERT(memcmp(signature, INDEX_SIGNATURE, 4) == 0);
+    fclose(findex);
+
+    index_load(&idx);
+    CU_ASSERT(idx.count == 2);
+    CU_ASSERT(strcmp(idx.entries[0].filename, "a.txt") == 0);
+    CU_ASSERT(strcmp(idx.entries[1].filename, "b.txt") == 0);
+    index_free(&idx);
+
+    // A commit straight from an unsorted text index writes a sorted manifest.
+    const char* names[] = { "c.txt", "b.txt", "a.txt" };
+    for (int i = 0; i < 3; i++) {
+      FILE* file = fopen(names[i], "w");
+      fprintf(file, "%s\n", names[i]);
+      fclose(file);
+    }
+    findex = fopen(".beargit/.index", "w");
+    fprintf(findex, "c.txt\nb.txt\na.txt\n");
+    fclose(findex);
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!"));
+
+    char commit_id[COMMIT_ID_SIZE];
+    read_string_from_file(".beargit/.prev", commit_id, COMMIT_ID_SIZE);
+    struct manifest m;
+    manifest_load(commit_id, &m);
+    CU_ASSERT(3==m.count);
+    CU_ASSERT_PTR_NOT_NULL(manifest_find(&m, "a.txt"));
+    CU_ASSERT_PTR_NOT_NULL(manifest_find(&m, "c.txt"));
+    manifest_free(&m);
+}
+
+/*
+* Simple test for the object store. Tests that committing the same
+* contents twice stores a single object, that a changed file adds exactly
+* one new object, and that the manifest of a commit records the object id
+* of each tracked file.
+*/
+void object_store_test(void) {
+    FILE *file = fopen("test.txt", "w");
+    fprintf(file, "version 1\n");
+    fclose(file);
+
+    int retval = beargit_init();
+    CU_ASSERT(0==retval);
+    retval = beargit_add("test.txt");
+    CU_ASSERT(0==retval);
+    retval = beargit_commit("THIS IS BEAR TERRITORY!1");
+    CU_ASSERT(0==retval);
+
+    char id[OBJECT_ID_SIZE];
+    CU_ASSERT(0==object_write_file("test.txt", id));
+    CU_ASSERT(object_exists(id));
+
+    // Objects are readable as the umask allows, like files fopen() creates.
+    mode_t mask = umask(022);
+    umask(mask);
+    char path[OBJECT_PATH_SIZE];
+    struct stat st;
+    object_path(id, path);
+    CU_ASSERT(0==stat(path, &st));
+    CU_ASSERT((st.st_mode & 0777)==(0666 & ~mask));
+
+    retval = beargit_commit("THIS IS BEAR TERRITORY!2");
+    CU_ASSERT(0==retval);
+    CU_ASSERT(0==object_write_file("test.txt", id));
+
+    file = fopen("test.txt", "w");
+    fprintf(file, "version 2\n");
+    fclose(file);
+    retval = beargit_commit("THIS IS BEAR TERRITORY!3");
+    CU_ASSERT(0==retval);
+
+    char new_id[OBJECT_ID_SIZE];
+    CU_ASSERT(0==object_write_file("test.txt", new_id));
+    CU_ASSERT(strcmp(id, new_id) != 0);
+
+    char commit_id[COMMIT_ID_SIZE];
+    read_string_from_file(".beargit/.prev", commit_id, COMMIT_ID_SIZE);
+    struct manifest m;
+    manifest_load(commit_id, &m);
+    CU_ASSERT(1==m.count);
+    struct manifest_entry* entry = manifest_find(&m, "test.txt");
+    CU_ASSERT_PTR_NOT_NULL(entry);
+    if (entry) {
+      CU_ASSERT_STRING_EQUAL(entry->id, new_id);
+    }
+    manifest_free(&m);
+
+    // A file edited after it was hashed is stored under its new id.
+    char stale_id[OBJECT_ID_SIZE];
+    file = fopen("test.txt", "w");
+    fprintf(file, "version 3\n");
+    fclose(file);
+    cryptohash_file("test.txt", stale_id);
+    file = fopen("test.txt", "w");
+    fprintf(file, "version 4\n");
+    fclose(file);
+    CU_ASSERT(1==object_store_file("test.txt", stale_id, NULL));
+    cryptohash_file("test.txt", new_id);
+    CU_ASSERT_STRING_EQUAL(stale_id, new_id);
+    CU_ASSERT(object_exists(new_id));
+}
+
+/* Repack the history of a file with three versions and check that the
+ * commit directories and loose objects are gone, the versions were stored
+ * as deltas, and log and checkout read the packed commits.
+ */
+void repack_test(void) {
+    int retval = beargit_init();
+    CU_ASSERT(0==retval);
+
+    char commit_ids[3][COMMIT_ID_SIZE];
+    char ids[3][OBJECT_ID_SIZE];
+    for (int v = 0; v < 3; v++) {
+      FILE* file = fopen("data.txt", "w");
+      for (int i = 0; i < 1000; i++) {
+        fprintf(file, "line %d%s\n", i, i == 500 && v > 0 ? (v == 1 ? " changed" : " again") : "");
+      }
+      fclose(file);
+      if (v == 0) {
+        CU_ASSERT(0==beargit_add("data.txt"));
+      }
+      char msg[MSG_SIZE];
+      sprintf(msg, "THIS IS BEAR TERRITORY!%d", v);
+      CU_ASSERT(0==beargit_commit(msg));
+      read_string_from_file(".beargit/.prev", commit_ids[v], COMMIT_ID_SIZE);
+      cryptohash_file("data.txt", ids[v]);
+    }
+
+    CU_ASSERT(0==beargit_repack());
+
+    char** packs;
+    int num_packs = pack_list(&packs);
+    CU_ASSERT(1==num_packs);
+    for (int i = 0; i < num_packs; i++) {
+      free(packs[i]);
+    }
+    free(packs);
+
+    for (int v = 0; v < 3; v++) {
+      char path[COMMIT_ID_SIZE + 10];
+      sprintf(path, ".beargit/%s", commit_ids[v]);
+      CU_ASSERT(!fs_check_dir_exists(path));
+
+      char object[OBJECT_PATH_SIZE];
+      struct stat st;
+      int type;
+      object_path(ids[v], object);
+      CU_ASSERT(stat(object, &st) == -1);
+      *strrchr(object, '/') = '\0';
+      CU_ASSERT(fs_check_dir_exists(object));
+      CU_ASSERT(object_exists(ids[v]));
+      CU_ASSERT(pack_lookup(commit_ids[v], &type) && type == PACK_OBJ_COMMIT);
+    }
+
+    CU_ASSERT(0==beargit_log(10, NULL, NULL));
+    FILE* fstdout = fopen("TEST_STDOUT", "r");
+    char line[512];
+    int commits = 0;
+    while (fgets(line, sizeof(line), fstdout)) {
+      commits += !strncmp(line, "commit", strlen("commit"));
+    }
+    fclose(fstdout);
+    CU_ASSERT(3==commits);
+
+    CU_ASSERT(0==beargit_checkout(commit_ids[0], 0));
+    char id[OBJECT_ID_SIZE];
+    cryptohash_file("data.txt", id);
+    CU_ASSERT_STRING_EQUAL(id, ids[0]);
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    cryptohash_file("data.txt", id);
+    CU_ASSERT_STRING_EQUAL(id, ids[2]);
+}
+
+/* Log reads the commit graph, honours -n, and works without the graph;
+ * the next commit rebuilds the graph with correct generation numbers.
+ */
+void commit_graph_test(void) {
+    int retval = beargit_init();
+    CU_ASSERT(0==retval);
+    FILE* file = fopen("g.txt", "w");
+    fclose(file);
+    CU_ASSERT(0==beargit_add("g.txt"));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!1"));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!2"));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!3"));
+
+    char head[COMMIT_ID_SIZE];
+    read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+    struct graph g;
+    graph_open(&g);
+    CU_ASSERT(3==g.count);
+    CU_ASSERT(2==graph_find(&g, head));
+    CU_ASSERT(3==graph_generation(&g, 2));
+    CU_ASSERT(1==graph_parent(&g, 2));
+    CU_ASSERT(GRAPH_NONE==graph_parent(&g, 0));
+    graph_close(&g);
+
+    CU_ASSERT(0==beargit_log(2, NULL, NULL));
+    FILE* fstdout = fopen("TEST_STDOUT", "r");
+    char line[512];
+    CU_ASSERT_PTR_NOT_NULL(fgets(line, sizeof(line), fstdout));
+    CU_ASSERT_PTR_NOT_NULL(fgets(line, sizeof(line), fstdout));
+    CU_ASSERT_STRING_EQUAL(line, "   THIS IS BEAR TERRITORY!3\n");
+    CU_ASSERT_PTR_NOT_NULL(fgets(line, sizeof(line), fstdout));
+    CU_ASSERT_PTR_NOT_NULL(fgets(line, sizeof(line), fstdout));
+    CU_ASSERT_PTR_NOT_NULL(fgets(line, sizeof(line), fstdout));
+    CU_ASSERT_STRING_EQUAL(line, "   THIS IS BEAR TERRITORY!2\n");
+    CU_ASSERT_PTR_NOT_NULL(fgets(line, sizeof(line), fstdout));
+    CU_ASSERT_PTR_NULL(fgets(line, sizeof(line), fstdout));
+    fclose(fstdout);
+
+    unlink(GRAPH_FILE);
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!4"));
+    read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+    graph_open(&g);
+    CU_ASSERT(4==g.count);
+    CU_ASSERT(3==graph_find(&g, head));
+    CU_ASSERT(4==graph_generation(&g, 3));
+    graph_close(&g);
+
+    // A writer waits for the one holding the lock.
+    unlink(GRAPH_FILE);
+    int lock = graph_lock();
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(lock);
+      graph_add(head);
+      _exit(0);
+    }
+    usleep(100000);
+    int status;
+    CU_ASSERT(0==waitpid(pid, &status, WNOHANG));
+    graph_open(&g);
+    CU_ASSERT(0==g.count);
+    graph_close(&g);
+    graph_unlock(lock);
+    CU_ASSERT(pid==waitpid(pid, &status, 0));
+    CU_ASSERT(WIFEXITED(status) && 0==WEXITSTATUS(status));
+    graph_open(&g);
+    CU_ASSERT(4==g.count);
+    graph_close(&g);
+}
+
+/* Streaming hashes match one-shot hashes and known digests, and hex
+ * conversion round-trips and rejects non-hex input.
+ */
+void hash_test(void) {
+    const char* abc_sha1 = "a9993e364706816aba3e25717850c26c9cd0d89d";
+    const char* abc_sha256 = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";
+    unsigned char raw[HASH_MAX_RAW];
+    char hex[HASH_MAX_HEX + 1];
+
+    struct hash_ctx ctx;
+    hash_init(&ctx, HASH_SHA1);
+    hash_update(&ctx, "a", 1);
+    hash_update(&ctx, "bc", 2);
+    CU_ASSERT(SHA_DIGEST_LENGTH==hash_final(&ctx, raw));
+    hash_to_hex(raw, SHA_DIGEST_LENGTH, hex);
+    CU_ASSERT_STRING_EQUAL(hex, abc_sha1);
+
+    hash_buffer(HASH_SHA256, "abc", 3, raw);
+    hash_to_hex(raw, SHA256_DIGEST_LENGTH, hex);
+    CU_ASSERT_STRING_EQUAL(hex, abc_sha256);
+
+    FILE* file = fopen("abc.txt", "w");
+    fprintf(file, "abc");
+    fclose(file);
+    cryptohash_file("abc.txt", hex);
+    CU_ASSERT_STRING_EQUAL(hex, abc_sha1);
+
+    unsigned char back[HASH_MAX_RAW];
+    CU_ASSERT(hex_to_hash(abc_sha256, SHA256_DIGEST_LENGTH, back));
+    CU_ASSERT(0==memcmp(raw, back, SHA256_DIGEST_LENGTH));
+    CU_ASSERT(hex_to_hash("00FFa0", 3, back) && back[1] == 0xff && back[2] == 0xa0);
+    CU_ASSERT(!hex_to_hash("00fg", 2, back));
+    CU_ASSERT(!hex_to_hash("abc", 2, back));
+
+    for (int i = 0; i < 256; i++) {
+      unsigned char byte = i;
+      char expected[3];
+      sprintf(expected, "%02x", i);
+      hash_to_hex(&byte, 1, hex);
+      CU_ASSERT_STRING_EQUAL(hex, expected);
+    }
+}
+
+/* Switching branches rewrites only files that differ, deletes unmodified
+ * files the target doesn't have and keeps modified ones untracked.
+ */
+void checkout_incremental_test(void) {
+    CU_ASSERT(0==beargit_init());
+    const char* files[] = { "same.txt", "changed.txt", "gone.txt", "edited.txt" };
+    for (int i = 0; i < 4; i++) {
+      FILE* file = fopen(files[i], "w");
+      fprintf(file, "%s\n", files[i]);
+      fclose(file);
+      CU_ASSERT(0==beargit_add(files[i]));
+    }
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!1"));
+
+    CU_ASSERT(0==beargit_checkout("side", 1));
+    FILE* file = fopen("changed.txt", "w");
+    fprintf(file, "side\n");
+    fclose(file);
+    CU_ASSERT(0==beargit_rm("gone.txt"));
+    CU_ASSERT(0==beargit_rm("edited.txt"));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!2"));
+    CU_ASSERT(0==beargit_checkout("master", 0));
+
+    struct stat before, after;
+    CU_ASSERT(0==stat("same.txt", &before));
+    file = fopen("edited.txt", "w");
+    fprintf(file, "local edit\n");
+    fclose(file);
+    CU_ASSERT(0==beargit_checkout("side", 0));
+    CU_ASSERT(0==stat("same.txt", &after));
+    CU_ASSERT(before.st_ino == after.st_ino && before.st_mtime == after.st_mtime);
+    CU_ASSERT(0!=access("gone.txt", F_OK));
+    CU_ASSERT(0==access("edited.txt", F_OK));
+
+    char contents[16] = "";
+    read_string_from_file("changed.txt", contents, sizeof(contents) - 1);
+    CU_ASSERT_STRING_EQUAL(contents, "side\n");
+
+    struct index idx;
+    index_load(&idx);
+    CU_ASSERT(2==idx.count);
+    CU_ASSERT_PTR_NULL(index_find(&idx, "edited.txt"));
+    index_free(&idx);
+}
+
+static void write_file(const char* filename, const char* contents) {
+    FILE* file = fopen(filename, "w");
+    fprintf(file, "%s", contents);
+    fclose(file);
+}
+
+/* A three-way merge takes changes made on one side, ignores changes made
+ * identically on both, and only reports a conflict when both sides
+ * changed a file differently.
+ */
+void three_way_merge_test(void) {
+    CU_ASSERT(0==beargit_init());
+    write_file("a.txt", "base\n");
+    write_file("b.txt", "base\n");
+    write_file("c.txt", "base\n");
+    CU_ASSERT(0==beargit_add("a.txt"));
+    CU_ASSERT(0==beargit_add("b.txt"));
+    CU_ASSERT(0==beargit_add("c.txt"));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!base"));
+
+    CU_ASSERT(0==beargit_checkout("side", 1));
+    write_file("a.txt", "side\n");
+    write_file("b.txt", "both\n");
+    write_file("c.txt", "side\n");
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!side"));
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    write_file("b.txt", "both\n");
+    write_file("c.txt", "master\n");
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!master"));
+
+    unlink("TEST_STDOUT");
+    CU_ASSERT(0==beargit_merge("side"));
+    FILE* fstdout = fopen("TEST_STDOUT", "r");
+    char line[512];
+    CU_ASSERT_PTR_NOT_NULL(fgets(line, sizeof(line), fstdout));
+    CU_ASSERT_STRING_EQUAL(line, "a.txt updated\n");
+    CU_ASSERT_PTR_NOT_NULL(fgets(line, sizeof(line), fstdout));
+    CU_ASSERT_STRING_EQUAL(line, "c.txt conflicted copy created\n");
+    CU_ASSERT_PTR_NULL(fgets(line, sizeof(line), fstdout));
+    fclose(fstdout);
+
+    char contents[16] = "";
+    read_string_from_file("a.txt", contents, sizeof(contents) - 1);
+    CU_ASSERT_STRING_EQUAL(contents, "side\n");
+    memset(contents, 0, sizeof(contents));
+    read_string_from_file("c.txt", contents, sizeof(contents) - 1);
+    CU_ASSERT_STRING_EQUAL(contents, "master\n");
+}
+
+/* merge-base finds where two branches forked off a long history, and
+ * ancestry queries agree with it.
+ */
+void merge_base_test(void) {
+    CU_ASSERT(0==beargit_init());
+    write_file("m.txt", "0\n");
+    CU_ASSERT(0==beargit_add("m.txt"));
+
+    // Enough commits that the older ones are found through the lookup.
+    char fork[COMMIT_ID_SIZE], head[COMMIT_ID_SIZE], side[COMMIT_ID_SIZE];
+    for (int i = 0; i < GRAPH_LOOKUP_BATCH + 100; i++) {
+      char msg[MSG_SIZE];
+      sprintf(msg, "THIS IS BEAR TERRITORY!%d", i);
+      CU_ASSERT(0==beargit_commit(msg));
+      if (i == 37) {
+        read_string_from_file(".beargit/.prev", fork, COMMIT_ID_SIZE);
+      }
+    }
+    read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+
+    CU_ASSERT(0==beargit_checkout(fork, 0));
+    CU_ASSERT(0==beargit_checkout("side", 1));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!side"));
+    read_string_from_file(".beargit/.prev", side, COMMIT_ID_SIZE);
+
+    char base[COMMIT_ID_SIZE];
+    CU_ASSERT(graph_merge_base(head, side, base));
+    CU_ASSERT_STRING_EQUAL(base, fork);
+    CU_ASSERT(graph_merge_base(head, fork, base));
+    CU_ASSERT_STRING_EQUAL(base, fork);
+    CU_ASSERT(graph_is_ancestor(fork, head));
+    CU_ASSERT(graph_is_ancestor(fork, side));
+    CU_ASSERT(!graph_is_ancestor(side, head));
+    CU_ASSERT(!graph_is_ancestor(head, fork));
+
+    struct graph g;
+    graph_open(&g);
+    CU_ASSERT(GRAPH_LOOKUP_BATCH==g.lookup_count);
+    CU_ASSERT(GRAPH_LOOKUP_BATCH + 101==g.count);
+    int found = 0;
+    for (uint32_t pos = 0; pos < g.count; pos++) {
+      char id[COMMIT_ID_SIZE];
+      graph_commit_id(&g, pos, id);
+      found += graph_find(&g, id) == pos;
+    }
+    CU_ASSERT(found==(int) g.count);
+    CU_ASSERT(GRAPH_NONE==graph_find(&g, NULL_COMMIT_ID));
+    graph_close(&g);
+
+    unlink("TEST_STDOUT");
+    CU_ASSERT(0==beargit_merge_base("side", head, 0));
+    FILE* fstdout = fopen("TEST_STDOUT", "r");
+    char line[512];
+    CU_ASSERT_PTR_NOT_NULL(fgets(line, sizeof(line), fstdout));
+    CU_ASSERT(0==strncmp(line, fork, COMMIT_ID_BYTES));
+    fclose(fstdout);
+}
+
+void refs_test(void) {
+    CU_ASSERT(0==beargit_init());
+    write_file("r.txt", "0\n");
+    CU_ASSERT(0==beargit_add("r.txt"));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!"));
+    char head[COMMIT_ID_SIZE];
+    read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+
+    // Many branches, some nested, all packed.
+    for (int i = 0; i < 200; i++) {
+      char name[BRANCHNAME_SIZE];
+      sprintf(name, i % 2 ? "topic/b%03d" : "b%03d", i);
+      CU_ASSERT(0==refs_update(name, head));
+    }
+    CU_ASSERT(201==refs_pack());
+    struct stat st;
+    CU_ASSERT(-1==stat(REFS_DIR "/topic", &st));
+
+    char id[COMMIT_ID_SIZE];
+    CU_ASSERT(refs_read("b000", id));
+    CU_ASSERT_STRING_EQUAL(id, head);
+    CU_ASSERT(refs_read("topic/b199", id));
+    CU_ASSERT(refs_read("master", id));
+    CU_ASSERT(!refs_read("b001", id));
+    CU_ASSERT(!refs_read("topic", id));
+
+    // A loose ref overrides the packed one; a lock blocks updates.
+    CU_ASSERT(0==refs_update("b100", NULL_COMMIT_ID));
+    CU_ASSERT(refs_read("b100", id));
+    CU_ASSERT_STRING_EQUAL(id, NULL_COMMIT_ID);
+    struct ref* refs;
+    CU_ASSERT(201==refs_list(&refs));
+    CU_ASSERT_STRING_EQUAL(refs[0].name, "b000");
+    CU_ASSERT_STRING_EQUAL(refs[50].name, "b100");
+    CU_ASSERT_STRING_EQUAL(refs[50].id, NULL_COMMIT_ID);
+    free(refs);
+    write_file(REFS_DIR "/master.lock", "");
+    CU_ASSERT(1==refs_update("master", head));
+    CU_ASSERT(1==beargit_commit("THIS IS BEAR TERRITORY!"));
+    unlink(REFS_DIR "/master.lock");
+
+    CU_ASSERT(0==beargit_branch_delete("b100"));
+    CU_ASSERT(!refs_read("b100", id));
+    CU_ASSERT(1==beargit_branch_delete("b100"));
+    CU_ASSERT(1==beargit_branch_delete("master"));
+    CU_ASSERT(1==beargit_checkout("bad name", 1));
+
+    // A branch can't be both a file and a directory of refs, even when
+    // one of them is packed.
+    CU_ASSERT(0==beargit_checkout("x", 1));
+    CU_ASSERT(1==beargit_checkout("x/y", 1));
+    CU_ASSERT(1==beargit_checkout("topic/b001/z", 1));
+    CU_ASSERT(1==beargit_checkout("topic", 1));
+    CU_ASSERT(0==beargit_checkout("topic/b001x", 1));
+    char conflict[BRANCHNAME_SIZE];
+    CU_ASSERT(refs_find_conflict("x/y", conflict));
+    CU_ASSERT_STRING_EQUAL(conflict, "x");
+    CU_ASSERT(refs_pack() > 0);
+    CU_ASSERT(0==refs_update("x/c", head));
+    CU_ASSERT(1==refs_update("x", head));
+    CU_ASSERT(-1==stat(REFS_DIR "/x.lock", &st));
+    CU_ASSERT(0==beargit_branch_delete("x/c"));
+    CU_ASSERT(0==refs_update("x", head));
+
+    // Branch files from before refs are migrated on first use.
+    fs_rm_tree(REFS_DIR);
+    unlink(PACKED_REFS_FILE);
+    write_file(".beargit/.branches", "master\nold\n");
+    write_file(".beargit/.branch_old", NULL_COMMIT_ID);
+    CU_ASSERT(refs_read("master", id));
+    CU_ASSERT_STRING_EQUAL(id, head);
+    CU_ASSERT(refs_read("old", id));
+    CU_ASSERT_STRING_EQUAL(id, NULL_COMMIT_ID);
+    CU_ASSERT(-1==stat(".beargit/.branches", &st));
+    CU_ASSERT(-1==stat(".beargit/.branch_old", &st));
+}
+
+void trace_test(void) {
+    write_file("t.txt", "0123456789\n");
+    uint64_t files = trace_counters[TRACE_FILES];
+    fs_cp("t.txt", "t2.txt");
+    char id[SHA_HEX_BYTES + 1];
+    cryptohash_file("t.txt", id);
+    CU_ASSERT(files==trace_counters[TRACE_FILES]);
+
+    trace_enabled = 1;
+    uint64_t copied = trace_counters[TRACE_BYTES_COPIED];
+    uint64_t hashed = trace_counters[TRACE_BYTES_HASHED];
+    uint64_t fopens = trace_counters[TRACE_FOPEN];
+    fs_cp("t.txt", "t2.txt");
+    cryptohash_file("t.txt", id);
+    FILE* f = fopen("t.txt", "r");
+    fclose(f);
+    trace_enabled = 0;
+    CU_ASSERT(files + 4==trace_counters[TRACE_FILES]);
+    CU_ASSERT(copied + 11==trace_counters[TRACE_BYTES_COPIED]);
+    CU_ASSERT(hashed + 11==trace_counters[TRACE_BYTES_HASHED]);
+    CU_ASSERT(fopens + 1==trace_counters[TRACE_FOPEN]);
+}
+
+void daemon_cache_test(void) {
+    CU_ASSERT(0==beargit_init());
+    write_file("c1.txt", "1\n");
+    write_file("c2.txt", "2\n");
+    CU_ASSERT(0==beargit_add("c1.txt"));
+
+    struct cache_stamp stamp = CACHE_STAMP_EMPTY;
+    CU_ASSERT(!cache_stamp_valid(&stamp, INDEX_FILE));
+    CU_ASSERT(cache_stamp_fill(&stamp, INDEX_FILE));
+    CU_ASSERT(cache_stamp_valid(&stamp, INDEX_FILE) == !stamp.racy);
+    stamp.racy = 0;
+    CU_ASSERT(cache_stamp_valid(&stamp, INDEX_FILE));
+    CU_ASSERT(0==beargit_add("c2.txt"));
+    CU_ASSERT(!cache_stamp_valid(&stamp, INDEX_FILE));
+    cache_stamp_clear(&stamp);
+    CU_ASSERT(!cache_stamp_fill(&stamp, ".beargit/missing"));
+
+    // A file rewritten in place within the same clock tick is racy.
+    write_file("c3.txt", "3\n");
+    CU_ASSERT(cache_stamp_fill(&stamp, "c3.txt"));
+    write_file("c3.txt", "4\n");
+    CU_ASSERT(!cache_stamp_valid(&stamp, "c3.txt"));
+    cache_stamp_clear(&stamp);
+
+    // The index kept in memory is handed over once, while it is current.
+    usleep(20000);
+    index_cache_refresh();
+    struct index idx;
+    index_load(&idx);
+    CU_ASSERT(2==idx.count);
+    CU_ASSERT_PTR_NOT_NULL(index_find(&idx, "c2.txt"));
+    index_free(&idx);
+    index_cache_refresh();
+    CU_ASSERT(0==beargit_rm("c2.txt"));
+    index_load(&idx);
+    CU_ASSERT(1==idx.count);
+    index_free(&idx);
+}
+
+/* The filesystem monitor reports paths changed after a token, everything
+ * below a new directory, and refuses tokens it can't answer for.
+ */
+void fsmonitor_test(void) {
+    CU_ASSERT(0==beargit_init());
+    fs_mkdir("fsmon");
+    write_file("fsmon/a.txt", "a\n");
+    write_file("fsmon/b.txt", "b\n");
+    CU_ASSERT(0==beargit_add("fsmon/a.txt"));
+    CU_ASSERT(0==beargit_add("fsmon/b.txt"));
+
+    char token[FSMONITOR_TOKEN_SIZE], later[FSMONITOR_TOKEN_SIZE];
+    fsmonitor_token(token);
+    CU_ASSERT(0==strcmp(token, ""));
+    CU_ASSERT(!fsmonitor_begin(token));
+    CU_ASSERT(fsmonitor_start());
+    fsmonitor_token(token);
+    CU_ASSERT(fsmonitor_begin(token));
+    CU_ASSERT(!fsmonitor_is_dirty("fsmon/a.txt"));
+
+    write_file("fsmon/a.txt", "aa\n");
+    fsmonitor_poll();
+    CU_ASSERT(fsmonitor_begin(token));
+    CU_ASSERT(fsmonitor_is_dirty("fsmon/a.txt"));
+    CU_ASSERT(!fsmonitor_is_dirty("fsmon/b.txt"));
+    fsmonitor_token(later);
+    CU_ASSERT(fsmonitor_begin(later));
+    CU_ASSERT(!fsmonitor_is_dirty("fsmon/a.txt"));
+
+    fs_mkdir("fsmon/sub");
+    fsmonitor_poll();
+    CU_ASSERT(fsmonitor_begin(later));
+    CU_ASSERT(fsmonitor_is_dirty("fsmon/sub/c.txt"));
+    CU_ASSERT(!fsmonitor_begin("0:1"));
+
+    // The first status scans everything and saves the token in the index.
+    usleep(20000);
+    CU_ASSERT(0==beargit_status());
+    struct index idx;
+    index_load(&idx);
+    fsmonitor_token(token);
+    CU_ASSERT(0==strcmp(token, idx.fsmonitor_token));
+    CU_ASSERT(index_fsmonitor_begin(&idx));
+    CU_ASSERT(!index_entry_maybe_dirty(index_find(&idx, "fsmon/b.txt"), 1));
+    index_free(&idx);
+
+    // A deleted file is still reported once the index took a newer token.
+    unlink("fsmon/a.txt");
+    write_file("fsmon/b.txt", "bb\n");
+    fsmonitor_poll();
+    CU_ASSERT(0==beargit_status());
+    fsmonitor_poll();
+    CU_ASSERT(0==beargit_status());
+    char line[512];
+    int deleted = 0;
+    FILE* fstdout = fopen("TEST_STDOUT", "r");
+    CU_ASSERT_PTR_NOT_NULL(fstdout);
+    while (fgets(line, sizeof(line), fstdout)) {
+        deleted += strcmp(line, "   deleted:  fsmon/a.txt\n") == 0;
+    }
+    fclose(fstdout);
+    CU_ASSERT(2==deleted);
+
+    fsmonitor_forked();
+    fs_rm_tree("fsmon");
+}
+
+/* Files of a transaction only appear when it commits, at every
+ * durability, and an aborted transaction leaves nothing behind.
+ */
+void txn_test(void) {
+    CU_ASSERT(0==beargit_init());
+    CU_ASSERT(DURABILITY_NORMAL==txn_durability());
+    write_file(CONFIG_FILE, "# comment\n  durability =  full \nother=1\n");
+    CU_ASSERT(DURABILITY_FULL==txn_durability());
+    char value[CONFIG_VALUE_SIZE];
+    CU_ASSERT(config_get("other", value) && 0==strcmp(value, "1"));
+    CU_ASSERT(!config_get("missing", value));
+
+    const char* levels[] = { "durability = none\n", "durability = normal\n",
+                             "durability = full\n" };
+    for (int i = 0; i < 3; i++) {
+        write_file(CONFIG_FILE, levels[i]);
+        struct txn t;
+        txn_begin(&t);
+        CU_ASSERT(i==t.durability);
+        write_file(".beargit/txn.tmp", "data\n");
+        txn_rename(&t, ".beargit/txn.tmp", ".beargit/txn");
+        txn_write_string(&t, ".beargit/txn2", "str");
+        CU_ASSERT(0!=access(".beargit/txn", F_OK));
+        txn_commit(&t);
+        CU_ASSERT(0==access(".beargit/txn", F_OK) && 0!=access(".beargit/txn.tmp", F_OK));
+        char str[8];
+        read_string_from_file(".beargit/txn2", str, sizeof(str));
+        CU_ASSERT(0==strcmp(str, "str"));
+        unlink(".beargit/txn");
+    }
+
+    struct txn t;
+    txn_begin(&t);
+    CU_ASSERT(0==refs_stage_update(&t, "master", NULL_COMMIT_ID));
+    CU_ASSERT(1==refs_update("master", NULL_COMMIT_ID));
+    txn_abort(&t);
+    CU_ASSERT(0==refs_update("master", NULL_COMMIT_ID));
+
+    write_file("t1.txt", "1\n");
+    CU_ASSERT(0==beargit_add("t1.txt"));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!"));
+    char head[COMMIT_ID_SIZE], ref[COMMIT_ID_SIZE];
+    read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+    CU_ASSERT(refs_read("master", ref) && 0==strcmp(head, ref));
+    CU_ASSERT(0==beargit_log(10, NULL, NULL));
+}
+
+/* Views of small files are read, large ones mapped; both split into the
+ * same lines.
+ */
+void fs_view_test(void) {
+    write_file("view.txt", "one\n\nthree");
+    struct fs_view v;
+    CU_ASSERT(!fs_view_open("view_missing.txt", &v));
+    CU_ASSERT(fs_view_open("view.txt", &v));
+    CU_ASSERT(0==v.mapped && 10==v.size);
+    size_t off = 0, len;
+    const char* line;
+    CU_ASSERT(fs_view_line(&v, &off, &line, &len) && 3==len && 0==strncmp(line, "one", 3));
+    CU_ASSERT(fs_view_line(&v, &off, &line, &len) && 0==len);
+    CU_ASSERT(fs_view_line(&v, &off, &line, &len) && 5==len && 0==strncmp(line, "three", 5));
+    CU_ASSERT(!fs_view_line(&v, &off, &line, &len));
+    CU_ASSERT(10==fs_view_strlen(&v));
+    fs_view_close(&v);
+
+    FILE* f = fopen("view.txt", "w");
+    for (int i = 0; i < FS_VIEW_MMAP_MIN / 4; i++) {
+        fputs("abc\n", f);
+    }
+    fclose(f);
+    CU_ASSERT(fs_view_open("view.txt", &v));
+    CU_ASSERT(FS_VIEW_MMAP_MIN==v.mapped);
+    int lines = 0;
+    off = 0;
+    while (fs_view_line(&v, &off, &line, &len)) {
+        lines += 3==len;
+    }
+    CU_ASSERT(FS_VIEW_MMAP_MIN / 4==lines);
+    fs_view_close(&v);
+    unlink("view.txt");
+
+    char str[8];
+    write_string_to_file("view.txt", "1234567");
+    read_string_from_file("view.txt", str, sizeof(str));
+    CU_ASSERT(0==strcmp(str, "1234567"));
+    unlink("view.txt");
+}
+
+/* Arena allocations are aligned and survive until the arena is freed;
+ * interned paths are shared, so the index and a manifest hold the same
+ * pointer, paths are no longer limited to 512 bytes, and a reset frees
+ * them.
+ */
+void arena_test(void) {
+    struct arena a = ARENA_EMPTY;
+    char* small = arena_alloc(&a, 3);
+    char* big = arena_alloc(&a, ARENA_CHUNK_SIZE * 2);
+    char* next = arena_strndup(&a, "abcdef", 3);
+    CU_ASSERT(0==((uintptr_t) small % 16) && 0==((uintptr_t) big % 16));
+    CU_ASSERT(next==small + 16);
+    CU_ASSERT(0==strcmp(next, "abc"));
+    memset(big, 'x', ARENA_CHUNK_SIZE * 2);
+    arena_free(&a);
+    CU_ASSERT_PTR_NULL(a.chunks);
+
+    const char* p = path_intern("dir/file.txt", 12);
+    CU_ASSERT(p==path_intern("dir/file.txt!", 12));
+    CU_ASSERT(p!=path_intern("dir/file.tx", 11));
+
+    char dir[600] = "";
+    for (int i = 0; i < 10; i++) {
+        strcat(dir, i ? "/dddddddddddddddddddddddddddddddddddddddddddddddddddddddddddd" : "long");
+        mkdir(dir, 0755);
+    }
+    char file[700];
+    sprintf(file, "%s/file.txt", dir);
+    CU_ASSERT(strlen(file) > 512);
+    write_file(file, "long\n");
+    CU_ASSERT(0==beargit_init());
+    CU_ASSERT(0==beargit_add(file));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!"));
+    char head[COMMIT_ID_SIZE];
+    read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+    struct manifest m;
+    struct index idx;
+    manifest_load(head, &m);
+    index_load(&idx);
+    CU_ASSERT(1==m.count && 1==idx.count);
+    CU_ASSERT(m.entries[0].filename==idx.entries[0].filename);
+    CU_ASSERT(m.entries[0].filename==path_intern(file, strlen(file)));
+    manifest_free(&m);
+    index_free(&idx);
+    fs_rm_tree("long");
+
+    // Starting over, as beargit daemon does, frees the interned paths.
+    index_cache_clear();
+    manifest_cache_clear();
+    path_intern_reset();
+    CU_ASSERT_PTR_NULL(arena_command.chunks);
+    p = path_intern("dir/file.txt", 12);
+    CU_ASSERT(0==strcmp(p, "dir/file.txt"));
+    CU_ASSERT(p==path_intern("dir/file.txt", 12));
+}
+
+/* Settings pick a codec and level; compressible objects are stored
+ * compressed and come back intact through object_read() and
+ * object_checkout(), and a file that starts with the object magic isn't
+ * mistaken for a compressed object.
+ */
+void codec_test(void) {
+    int level;
+    CU_ASSERT(CODEC_ZLIB==codec_parse("fast", &level)->id && 1==level);
+    CU_ASSERT(CODEC_ZLIB==codec_parse("best", &level)->id && 9==level);
+    CU_ASSERT(CODEC_ZLIB==codec_parse("zlib:4", &level)->id && 4==level);
+    CU_ASSERT(CODEC_NONE==codec_parse("none", &level)->id);
+    CU_ASSERT_PTR_NULL(codec_parse("zlib:12", &level));
+    CU_ASSERT_PTR_NULL(codec_parse("zstd", &level));
+
+    char text[8192] = "";
+    while (strlen(text) < sizeof(text) - 32) {
+        strcat(text, "THIS IS BEAR TERRITORY!\n");
+    }
+    write_file("text.txt", text);
+    FILE* f = fopen("magic.txt", "w");
+    fwrite("\0BGO", 1, 4, f);
+    fclose(f);
+    CU_ASSERT(0==beargit_init());
+
+    char id[OBJECT_ID_SIZE], path[OBJECT_PATH_SIZE];
+    CU_ASSERT(1==object_write_file("text.txt", id));
+    object_path(id, path);
+    struct stat st;
+    CU_ASSERT(0==stat(path, &st) && st.st_size < (off_t) strlen(text) / 4);
+    size_t size;
+    CU_ASSERT(object_loose_size(id, &size) && size==strlen(text));
+    unsigned char* data;
+    CU_ASSERT(object_read(id, &data, &size));
+    CU_ASSERT(size==strlen(text) && 0==memcmp(data, text, size));
+    free(data);
+    object_checkout(id, "out.txt");
+    CU_ASSERT(0==stat("out.txt", &st) && st.st_size==(off_t) strlen(text));
+
+    char magic_id[OBJECT_ID_SIZE];
+    CU_ASSERT(1==object_write_file("magic.txt", magic_id));
+    CU_ASSERT(object_read(magic_id, &data, &size));
+    CU_ASSERT(4==size && 0==memcmp(data, "\0BGO", 4));
+    free(data);
+}
+
+/* Chunk boundaries stay within bounds and follow the contents, so an
+ * insertion only changes the chunks around it; a file above the threshold
+ * is stored as a chunk list and checked out intact.
+ */
+void chunk_test(void) {
+    size_t size = (size_t) 9 << 20;
+    unsigned char* data = malloc(size + 8);
+    unsigned int seed = 61;
+    for (size_t i = 0; i < size; i++) {
+        data[i] = rand_r(&seed);
+    }
+    size_t cuts[1024], count = 0;
+    for (size_t off = 0; off < size; count++) {
+        size_t len = chunk_next(data + off, size - off);
+        CU_ASSERT(len <= CHUNK_MAX && (len >= CHUNK_MIN || off + len == size));
+        off += len;
+        cuts[count] = off;
+    }
+    CU_ASSERT(count > size / CHUNK_MAX && count < size / CHUNK_MIN);
+
+    // Insert 8 bytes into the middle: cut points after it move by 8.
+    memmove(data + size / 2 + 8, data + size / 2, size / 2);
+    memcpy(data + size / 2, "inserted", 8);
+    size_t shifted = 0;
+    for (size_t off = 0, i = 0; off < size + 8; ) {
+        off += chunk_next(data + off, size + 8 - off);
+        while (i < count && cuts[i] + (cuts[i] > size / 2 ? 8 : 0) < off) {
+            i++;
+        }
+        if (i < count && cuts[i] + (cuts[i] > size / 2 ? 8 : 0) == off) {
+            shifted++;
+        }
+    }
+    CU_ASSERT(shifted + 3 >= count);
+
+    FILE* f = fopen("big.bin", "w");
+    fwrite(data, 1, size + 8, f);
+    fclose(f);
+    free(data);
+    CU_ASSERT(0==beargit_init());
+    CU_ASSERT(size + 8 >= chunk_threshold());
+    char id[OBJECT_ID_SIZE];
+    CU_ASSERT(1==object_write_file("big.bin", id));
+    CU_ASSERT(object_is_chunked(id));
+    size_t loose;
+    CU_ASSERT(object_loose_size(id, &loose) && loose==size + 8);
+    object_checkout(id, "big.out");
+    char out_id[OBJECT_ID_SIZE];
+    cryptohash_file("big.out", out_id);
+    CU_ASSERT(0==strcmp(id, out_id));
+
+    // A checkout that fails on a missing chunk leaves the file as it was.
+    char (*chunk_ids)[OBJECT_ID_SIZE];
+    size_t chunks = object_chunk_ids(id, &chunk_ids);
+    CU_ASSERT(chunks > 1);
+    char path[OBJECT_PATH_SIZE];
+    object_path(chunk_ids[chunks - 1], path);
+    CU_ASSERT(0==unlink(path));
+    free(chunk_ids);
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+      object_checkout(id, "big.out");
+      _exit(0);
+    }
+    int status;
+    CU_ASSERT(pid==waitpid(pid, &status, 0));
+    CU_ASSERT(WIFEXITED(status) && WEXITSTATUS(status)==1);
+    cryptohash_file("big.out", out_id);
+    CU_ASSERT(0==strcmp(id, out_id));
+
+    // Storing the file again writes the missing chunk back.
+    CU_ASSERT(1==object_store_file("big.bin", id, NULL));
+    CU_ASSERT(0==access(path, F_OK));
+    CU_ASSERT(0==object_store_file("big.bin", id, NULL));
+    object_checkout(id, "big.out");
+    cryptohash_file("big.out", out_id);
+    CU_ASSERT(0==strcmp(id, out_id));
+}
+
+/* gc removes an abandoned branch's commit and objects once the grace
+ * period has passed, keeps what HEAD reaches, and an incremental run
+ * appends to the saved marks.
+ */
+void gc_test(void) {
+    CU_ASSERT(0==beargit_init());
+    write_file("a.txt", "a\n");
+    CU_ASSERT(0==beargit_add("a.txt"));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!1"));
+    char kept[COMMIT_ID_SIZE];
+    read_string_from_file(".beargit/.prev", kept, COMMIT_ID_SIZE);
+
+    CU_ASSERT(0==beargit_checkout("side", 1));
+    write_file("b.txt", "b\n");
+    CU_ASSERT(0==beargit_add("b.txt"));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!2"));
+    char dropped[COMMIT_ID_SIZE], object[OBJECT_ID_SIZE], path[OBJECT_PATH_SIZE];
+    read_string_from_file(".beargit/.prev", dropped, COMMIT_ID_SIZE);
+    cryptohash_file("b.txt", object);
+    CU_ASSERT(0==beargit_checkout("master", 0));
+    CU_ASSERT(0==beargit_branch_delete("side"));
+
+    struct gc_stats stats;
+    CU_ASSERT(GC_DONE==gc_run(GC_DEFAULT_GRACE, 0, &stats));
+    CU_ASSERT(0==stats.commits && 0==stats.objects);
+    CU_ASSERT(GC_DONE==gc_run(0, 0, &stats));
+    CU_ASSERT(1==stats.commits && 1==stats.objects && GC_SLICES==stats.slices);
+    char dir[COMMIT_ID_SIZE + 9];
+    sprintf(dir, ".beargit/%s", dropped);
+    CU_ASSERT(!fs_check_dir_exists(dir));
+    object_path(object, path);
+    struct stat st;
+    CU_ASSERT(0!=stat(path, &st));
+    // The fan-out directory stays for commits writing into it, and the
+    // object can be stored again.
+    *strrchr(path, '/') = '\0';
+    CU_ASSERT(fs_check_dir_exists(path));
+    write_file("b.txt", "b\n");
+    CU_ASSERT(1==object_store_file("b.txt", object, NULL));
+    CU_ASSERT(object_exists(object));
+    object_path(object, path);
+    unlink(path);
+    unlink("b.txt");
+    sprintf(dir, ".beargit/%s", kept);
+    CU_ASSERT(fs_check_dir_exists(dir));
+
+    CU_ASSERT(0==stat(GC_MARKS_FILE, &st));
+    off_t marks_size = st.st_size;
+    write_file("n.txt", "n\n");
+    CU_ASSERT(0==beargit_add("n.txt"));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!3"));
+    CU_ASSERT(GC_DONE==gc_run(0, 1000, &stats));
+    CU_ASSERT(0==stats.commits && 0==stats.objects && stats.slices > 0);
+    CU_ASSERT(0==stat(GC_MARKS_FILE, &st) && st.st_size==marks_size + 2 * SHA_DIGEST_LENGTH);
+    CU_ASSERT(0==beargit_checkout(kept, 0));
+    CU_ASSERT(0==beargit_checkout("master", 0));
+
+    // A chunk list a commit reuses keeps its chunks, even where they are
+    // older than the list.
+    size_t size = (size_t) 9 << 20;
+    unsigned char* data = malloc(size);
+    unsigned int seed = 67;
+    for (size_t i = 0; i < size; i++) {
+        data[i] = rand_r(&seed);
+    }
+    FILE* f = fopen("c.bin", "w");
+    fwrite(data, 1, size, f);
+    fclose(f);
+    free(data);
+    CU_ASSERT(1==object_write_file("c.bin", object));
+    char (*chunk_ids)[OBJECT_ID_SIZE];
+    size_t chunks = object_chunk_ids(object, &chunk_ids);
+    CU_ASSERT(chunks > 1);
+    struct timespec old[2] = { { time(NULL) - 7200, 0 }, { time(NULL) - 7200, 0 } };
+    for (size_t i = 0; i <= chunks; i++) {
+        object_path(i < chunks ? chunk_ids[i] : object, path);
+        CU_ASSERT(0==utimensat(AT_FDCWD, path, old, 0));
+    }
+    CU_ASSERT(0==object_write_file("c.bin", object));
+    CU_ASSERT(GC_DONE==gc_run(3600, 0, &stats));
+    CU_ASSERT(0==stats.objects);
+    for (size_t i = 0; i < chunks; i++) {
+        object_path(chunk_ids[i], path);
+        CU_ASSERT(0==utimensat(AT_FDCWD, path, old, 0));
+    }
+    CU_ASSERT(GC_DONE==gc_run(3600, 0, &stats));
+    CU_ASSERT(0==stats.objects);
+    CU_ASSERT(GC_DONE==gc_run(0, 0, &stats));
+    CU_ASSERT(chunks + 1==(size_t) stats.objects);
+    free(chunk_ids);
+    unlink("c.bin");
+}
+
+/* The search index covers the history in segments once enough commits
+ * are made, and yields exactly the commits with a pattern's trigrams.
+ */
+void search_test(void) {
+    CU_ASSERT(0==beargit_init());
+    write_file("s.txt", "s\n");
+    CU_ASSERT(0==beargit_add("s.txt"));
+    for (int i = 0; i < 2 * SEARCH_BATCH; i++) {
+      char msg[64];
+      sprintf(msg, "THIS IS BEAR TERRITORY! %s %d", i % 10 == 3 ? "Needle" : "hay", i);
+      CU_ASSERT(0==beargit_commit(msg));
+    }
+    char path[sizeof(SEARCH_DIR) + 24];
+    sprintf(path, "%s/seg-%08x-%08x", SEARCH_DIR, 0, 2 * SEARCH_BATCH);
+    struct stat st;
+    CU_ASSERT(0==stat(path, &st));
+
+    struct graph g;
+    graph_open(&g);
+    struct search s;
+    CU_ASSERT(1==search_begin(&s, &g, "neEDLE [0-9]+$"));
+    int count = 0;
+    uint32_t pos, last = GRAPH_NONE;
+    while ((pos = search_next(&s)) != GRAPH_NONE) {
+      const char* msg;
+      size_t len;
+      CU_ASSERT(pos < last && graph_msg(&g, pos, &msg, &len) && memmem(msg, len, "Needle", 6));
+      last = pos;
+      count++;
+    }
+    search_end(&s);
+    CU_ASSERT(2 * SEARCH_BATCH / 10 + 1==count);
+    CU_ASSERT(0==search_begin(&s, &g, "N.edle|hay"));
+    graph_close(&g);
+
+    CU_ASSERT(0==beargit_log(3, "Needle 1[0-9]3$", NULL));
+    CU_ASSERT(1==beargit_log(3, "Needle (", NULL));
+}
+
+/* Each commit gets a changed-path Bloom filter that holds the files it
+ * added or removed and the directories above them.
+ */
+void bloom_test(void) {
+    CU_ASSERT(0==beargit_init());
+    mkdir("d", 0755);
+    write_file("a.txt", "a\n");
+    write_file("d/b.txt", "b\n");
+    write_file("c.txt", "c\n");
+    CU_ASSERT(0==beargit_add("a.txt"));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!1"));
+    CU_ASSERT(0==beargit_add("d/b.txt"));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!2"));
+    CU_ASSERT(0==beargit_add("c.txt"));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!3"));
+    CU_ASSERT(0==beargit_rm("a.txt"));
+    CU_ASSERT(0==beargit_commit("THIS IS BEAR TERRITORY!4"));
+
+    struct graph g;
+    struct bloom b;
+    graph_open(&g);
+    bloom_open(&b);
+    CU_ASSERT(4==g.count && 4==b.count);
+    struct bloom_key a, d, db;
+    bloom_key("a.txt", 5, &a);
+    bloom_key("d", 1, &d);
+    bloom_key("d/b.txt", 7, &db);
+    CU_ASSERT(bloom_maybe(&b, 0, &a) && bloom_maybe(&b, 3, &a));
+    CU_ASSERT(bloom_maybe(&b, 1, &d) && bloom_maybe(&b, 1, &db));
+    CU_ASSERT(!bloom_maybe(&b, 2, &db) && !bloom_maybe(&b, 3, &d));
+    bloom_close(&b);
+    graph_close(&g);
+
+    CU_ASSERT(0==beargit_log(10, NULL, "d"));
+    CU_ASSERT(0==beargit_log(10, "TERRITORY", "./a.txt"));
+}
+
+/* The main() function for setting up and running the tests.
+ * Returns a CUE_SUCCESS on successful running, another
+ * CUnit error code on failure.
+ */
+int cunittester()
+{
+   CU_pSuite pSuite = NULL;
+   CU_pSuite pSuite2 = NULL;
+   CU_pSuite pSuite3 = NULL;   
+   CU_pSuite pSuite4 = NULL;
+   CU_pSuite pSuite5 = NULL;
+   CU_pSuite pSuite6 = NULL;
+   CU_pSuite pSuite7 = NULL;
+   CU_pSuite pSuite8 = NULL;
+   CU_pSuite pSuite9 = NULL;
+   CU_pSuite pSuite10 = NULL;
+   CU_pSuite pSuite11 = NULL;
+   CU_pSuite pSuite12 = NULL;
+   CU_pSuite pSuite13 = NULL;
+   CU_pSuite pSuite14 = NULL;
+   CU_pSuite pSuite15 = NULL;
+   CU_pSuite pSuite16 = NULL;
+   CU_pSuite pSuite17 = NULL;
+   CU_pSuite pSuite18 = NULL;
+   CU_pSuite pSuite19 = NULL;
+   CU_pSuite pSuite20 = NULL;
+   CU_pSuite pSuite21 = NULL;
+   CU_pSuite pSuite22 = NULL;
+   CU_pSuite pSuite23 = NULL;
+   CU_pSuite pSuite24 = NULL;
+   CU_pSuite pSuite25 = NULL;
+   CU_pSuite pSuite26 = NULL;
+
+   /* initialize the CUnit test registry */
+   if (CUE_SUCCESS != CU_initialize_registry())
+      return CU_get_error();
+
+   /* add a suite to the registry */
+   pSuite = CU_add_suite("Suite_1", init_suite, clean_suite);
+   if (NULL == pSuite) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #1 */
+   if (NULL == CU_add_test(pSuite, "Simple Test #1", simple_sample_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite2 = CU_add_suite("Suite_2", init_suite, clean_suite);
+   if (NULL == pSuite2) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Add tests to the Suite #2 */
+   if (NULL == CU_add_test(pSuite2, "Log output test", simple_log_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+   
+   pSuite3 = CU_add_suite("Suite_3", init_suite, clean_suite);
+   if (NULL == pSuite3) { 
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite3, "simple add test", add_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite4 = CU_add_suite("Suite_4", init_suite, clean_suite);
+   if (NULL == pSuite4) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite4, "simple rm test", rm_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite5 = CU_add_suite("Suite_5", init_suite, clean_suite);
+   if (NULL == pSuite5) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite5, "object store test", object_store_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite6 = CU_add_suite("Suite_6", init_suite, clean_suite);
+   if (NULL == pSuite6) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite6, "index upgrade test", index_upgrade_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite7 = CU_add_suite("Suite_7", init_suite, clean_suite);
+   if (NULL == pSuite7) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite7, "status changes test", status_changes_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite8 = CU_add_suite("Suite_8", init_suite, clean_suite);
+   if (NULL == pSuite8) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite8, "bulk add/rm test", bulk_add_rm_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite9 = CU_add_suite("Suite_9", init_suite, clean_suite);
+   if (NULL == pSuite9) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite9, "repack test", repack_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite10 = CU_add_suite("Suite_10", init_suite, clean_suite);
+   if (NULL == pSuite10) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite10, "commit graph test", commit_graph_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite11 = CU_add_suite("Suite_11", init_suite, clean_suite);
+   if (NULL == pSuite11) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite11, "hash test", hash_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite12 = CU_add_suite("Suite_12", init_suite, clean_suite);
+   if (NULL == pSuite12) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite12, "incremental checkout test", checkout_incremental_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite13 = CU_add_suite("Suite_13", init_suite, clean_suite);
+   if (NULL == pSuite13) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite13, "three-way merge test", three_way_merge_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite14 = CU_add_suite("Suite_14", init_suite, clean_suite);
+   if (NULL == pSuite14) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite14, "merge-base test", merge_base_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite15 = CU_add_suite("Suite_15", init_suite, clean_suite);
+   if (NULL == pSuite15) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite15, "refs test", refs_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite16 = CU_add_suite("Suite_16", init_suite, clean_suite);
+   if (NULL == pSuite16) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite16, "trace test", trace_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite17 = CU_add_suite("Suite_17", init_suite, clean_suite);
+   if (NULL == pSuite17) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite17, "daemon cache test", daemon_cache_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite18 = CU_add_suite("Suite_18", init_suite, clean_suite);
+   if (NULL == pSuite18) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite18, "fsmonitor test", fsmonitor_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite19 = CU_add_suite("Suite_19", init_suite, clean_suite);
+   if (NULL == pSuite19) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite19, "transaction test", txn_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite20 = CU_add_suite("Suite_20", init_suite, clean_suite);
+   if (NULL == pSuite20) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite20, "fs_view test", fs_view_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite21 = CU_add_suite("Suite_21", init_suite, clean_suite);
+   if (NULL == pSuite21) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite21, "arena test", arena_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite22 = CU_add_suite("Suite_22", init_suite, clean_suite);
+   if (NULL == pSuite22) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite22, "codec test", codec_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite23 = CU_add_suite("Suite_23", init_suite, clean_suite);
+   if (NULL == pSuite23) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite23, "chunk test", chunk_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite24 = CU_add_suite("Suite_24", init_suite, clean_suite);
+   if (NULL == pSuite24) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite24, "gc test", gc_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite25 = CU_add_suite("Suite_25", init_suite, clean_suite);
+   if (NULL == pSuite25) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite25, "search test", search_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   pSuite26 = CU_add_suite("Suite_26", init_suite, clean_suite);
+   if (NULL == pSuite26) {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   if (NULL == CU_add_test(pSuite26, "bloom test", bloom_test))
+   {
+      CU_cleanup_registry();
+      return CU_get_error();
+   }
+
+   /* Run all tests using the CUnit Basic interface */
+   CU_basic_set_mode(CU_BRM_VERBOSE);
+   CU_basic_run_tests();
+   CU_cleanup_registry();
+   return CU_get_error();
+}
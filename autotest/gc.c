@@ -0,0 +1,568 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "beargit.h"
+#include "bloom.h"
+#include "commit.h"
+#include "config.h"
+#include "gc.h"
+#include "graph.h"
+#include "hash.h"
+#include "index.h"
+#include "manifest.h"
+#include "object.h"
+#include "pack.h"
+#include "pool.h"
+#include "refs.h"
+#include "search.h"
+#include "trace.h"
+#include "util.h"
+
+#define GC_MARKS_SIGNATURE "BGCM"
+#define GC_MARKS_VERSION 1
+#define GC_MARKS_HEADER_SIZE 12
+
+static uint32_t get_u32(const unsigned char* p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static void put_u32(unsigned char* p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static void gc_write(int fd, const void* data, size_t size) {
+  const char* p = data;
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n < 0) {
+      ASSERT_ERROR_MESSAGE(errno == EINTR, "couldn't write gc marks");
+      continue;
+    }
+    p += n;
+    size -= n;
+  }
+}
+
+static double gc_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Marked ids, in the order they were marked
+struct gc_marks {
+  unsigned char (*ids)[SHA_DIGEST_LENGTH];
+  size_t count;
+  size_t capacity;
+  size_t* table;        // index + 1 into ids, 0 for free slots
+  size_t table_size;
+  size_t saved;         // ids [0, saved) came from GC_MARKS_FILE
+  size_t records;       // complete ids in GC_MARKS_FILE
+  int loaded;           // GC_MARKS_FILE was valid
+  uint32_t cursor;
+  pthread_mutex_t lock; // held by worker threads around gc_marks_add()
+};
+
+static size_t gc_marks_slot(const struct gc_marks* m, const unsigned char* raw) {
+  size_t hash;
+  memcpy(&hash, raw, sizeof(hash));
+  size_t mask = m->table_size - 1;
+  for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+    if (!m->table[i] || memcmp(m->ids[m->table[i] - 1], raw, SHA_DIGEST_LENGTH) == 0) {
+      return i;
+    }
+  }
+}
+
+static int gc_marks_has(const struct gc_marks* m, const unsigned char* raw) {
+  return m->table_size && m->table[gc_marks_slot(m, raw)];
+}
+
+/* Mark <raw>. Returns 1 if it wasn't marked yet. */
+static int gc_marks_add(struct gc_marks* m, const unsigned char* raw) {
+  if (2 * (m->count + 1) > m->table_size) {
+    free(m->table);
+    m->table_size = m->table_size ? 2 * m->table_size : 1024;
+    m->table = calloc(m->table_size, sizeof(size_t));
+    ASSERT_ERROR_MESSAGE(m->table != NULL, "out of memory");
+    for (size_t i = 0; i < m->count; i++) {
+      m->table[gc_marks_slot(m, m->ids[i])] = i + 1;
+    }
+  }
+  size_t slot = gc_marks_slot(m, raw);
+  if (m->table[slot]) {
+    return 0;
+  }
+  if (m->count == m->capacity) {
+    m->capacity = m->capacity ? 2 * m->capacity : 1024;
+    m->ids = realloc(m->ids, m->capacity * sizeof(*m->ids));
+    ASSERT_ERROR_MESSAGE(m->ids != NULL, "out of memory");
+  }
+  memcpy(m->ids[m->count], raw, SHA_DIGEST_LENGTH);
+  m->table[slot] = ++m->count;
+  return 1;
+}
+
+static int gc_marks_add_hex(struct gc_marks* m, const char* id) {
+  unsigned char raw[SHA_DIGEST_LENGTH];
+  return strlen(id) == OBJECT_ID_BYTES && strcmp(id, NULL_COMMIT_ID) != 0
+      && hex_to_hash(id, SHA_DIGEST_LENGTH, raw) && gc_marks_add(m, raw);
+}
+
+static void gc_marks_free(struct gc_marks* m) {
+  free(m->ids);
+  free(m->table);
+  pthread_mutex_destroy(&m->lock);
+}
+
+/* Load GC_MARKS_FILE into <m>. A torn append leaves a partial id at the
+ * end, which is ignored (and cut off by the next append).
+ */
+static void gc_marks_load(struct gc_marks* m) {
+  struct fs_view v;
+  if (!fs_view_open(GC_MARKS_FILE, &v)) {
+    return;
+  }
+  const unsigned char* data = (const unsigned char*) v.data;
+  if (v.size >= GC_MARKS_HEADER_SIZE && memcmp(data, GC_MARKS_SIGNATURE, 4) == 0
+      && get_u32(data + 4) == GC_MARKS_VERSION) {
+    m->loaded = 1;
+    m->cursor = get_u32(data + 8) % GC_SLICES;
+    m->records = (v.size - GC_MARKS_HEADER_SIZE) / SHA_DIGEST_LENGTH;
+    for (size_t i = 0; i < m->records; i++) {
+      gc_marks_add(m, data + GC_MARKS_HEADER_SIZE + i * SHA_DIGEST_LENGTH);
+    }
+  }
+  m->saved = m->count;
+  fs_view_close(&v);
+}
+
+/* Save the marks: rewrite GC_MARKS_FILE if it wasn't valid or this is a
+ * full run, else append the new ids, those from <objects_start> on (the
+ * objects) before the new commits, so that a torn append never records a
+ * commit without its objects.
+ */
+static void gc_marks_save(struct gc_marks* m, size_t objects_start, int full) {
+  unsigned char header[GC_MARKS_HEADER_SIZE];
+  memcpy(header, GC_MARKS_SIGNATURE, 4);
+  put_u32(header + 4, GC_MARKS_VERSION);
+  put_u32(header + 8, m->cursor);
+
+  if (full || !m->loaded) {
+    const char* tmp = GC_MARKS_FILE ".tmp";
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT_ERROR_MESSAGE(fd != -1, "couldn't write gc marks");
+    gc_write(fd, header, sizeof(header));
+    gc_write(fd, m->ids, m->count * SHA_DIGEST_LENGTH);
+    ASSERT_ERROR_MESSAGE(close(fd) == 0, "couldn't write gc marks");
+    fs_mv(tmp, GC_MARKS_FILE);
+  } else if (m->count > m->saved) {
+    int fd = open(GC_MARKS_FILE, O_WRONLY);
+    ASSERT_ERROR_MESSAGE(fd != -1, "couldn't write gc marks");
+    off_t end = GC_MARKS_HEADER_SIZE + (off_t) m->records * SHA_DIGEST_LENGTH;
+    ASSERT_ERROR_MESSAGE(ftruncate(fd, end) == 0 && lseek(fd, end, SEEK_SET) == end,
+                         "couldn't write gc marks");
+    size_t commits = objects_start - m->saved;
+    size_t objects = m->count - objects_start;
+    unsigned char* buf = malloc((commits + objects) * SHA_DIGEST_LENGTH);
+    ASSERT_ERROR_MESSAGE(buf != NULL, "out of memory");
+    memcpy(buf, m->ids[objects_start], objects * SHA_DIGEST_LENGTH);
+    memcpy(buf + objects * SHA_DIGEST_LENGTH, m->ids[m->saved], commits * SHA_DIGEST_LENGTH);
+    gc_write(fd, buf, (commits + objects) * SHA_DIGEST_LENGTH);
+    free(buf);
+    ASSERT_ERROR_MESSAGE(close(fd) == 0, "couldn't write gc marks");
+  }
+}
+
+/* Store the sweep cursor of <m> in GC_MARKS_FILE. */
+static void gc_marks_save_cursor(struct gc_marks* m) {
+  unsigned char cursor[4];
+  put_u32(cursor, m->cursor);
+  int fd = open(GC_MARKS_FILE, O_WRONLY);
+  ASSERT_ERROR_MESSAGE(fd != -1 && pwrite(fd, cursor, 4, 8) == 4 && close(fd) == 0,
+                       "couldn't write gc marks");
+}
+
+struct gc_mark_ctx {
+  struct gc_marks* m;
+  char (*commits)[COMMIT_ID_SIZE];
+  char (*objects)[OBJECT_ID_SIZE];
+  double deadline;
+  int out_of_time;
+};
+
+// Returns 1 (and tells the other workers) once the budget is spent.
+static int gc_out_of_time(struct gc_mark_ctx* ctx) {
+  if (__atomic_load_n(&ctx->out_of_time, __ATOMIC_RELAXED)) {
+    return 1;
+  } else if (ctx->deadline && gc_now() > ctx->deadline) {
+    __atomic_store_n(&ctx->out_of_time, 1, __ATOMIC_RELAXED);
+    return 1;
+  }
+  return 0;
+}
+
+struct gc_id_buffer {
+  unsigned char (*ids)[SHA_DIGEST_LENGTH];
+  size_t count;
+  size_t capacity;
+};
+
+static void gc_id_buffer_add(void* arg, const char* id) {
+  struct gc_id_buffer* b = arg;
+  if (b->count == b->capacity) {
+    b->capacity = b->capacity ? 2 * b->capacity : 256;
+    b->ids = realloc(b->ids, b->capacity * sizeof(*b->ids));
+    ASSERT_ERROR_MESSAGE(b->ids != NULL, "out of memory");
+  }
+  b->count += hex_to_hash(id, SHA_DIGEST_LENGTH, b->ids[b->count]);
+}
+
+/* Mark the objects of commit <i>. The manifest is read without the lock;
+ * only adding its ids takes it.
+ */
+static void gc_mark_commit(void* arg, int i) {
+  struct gc_mark_ctx* ctx = arg;
+  if (gc_out_of_time(ctx)) {
+    return;
+  }
+  struct gc_id_buffer b = { NULL, 0, 0 };
+  manifest_for_each_id(ctx->commits[i], gc_id_buffer_add, &b);
+  pthread_mutex_lock(&ctx->m->lock);
+  for (size_t j = 0; j < b.count; j++) {
+    gc_marks_add(ctx->m, b.ids[j]);
+  }
+  pthread_mutex_unlock(&ctx->m->lock);
+  free(b.ids);
+}
+
+/* Mark the chunks of object <i>, if it is chunked. */
+static void gc_mark_chunks(void* arg, int i) {
+  struct gc_mark_ctx* ctx = arg;
+  if (gc_out_of_time(ctx)) {
+    return;
+  }
+  char (*ids)[OBJECT_ID_SIZE];
+  size_t count = object_chunk_ids(ctx->objects[i], &ids);
+  if (count == 0) {
+    return;
+  }
+  pthread_mutex_lock(&ctx->m->lock);
+  for (size_t j = 0; j < count; j++) {
+    gc_marks_add_hex(ctx->m, ids[j]);
+  }
+  pthread_mutex_unlock(&ctx->m->lock);
+  free(ids);
+}
+
+/* Walk the history of <root> down to the first marked commit, marking and
+ * appending the commits to <ctx>. Returns 0 if the budget ran out.
+ */
+static int gc_walk(struct gc_mark_ctx* ctx, const char* root, size_t* count, size_t* capacity) {
+  char id[COMMIT_ID_SIZE];
+  snprintf(id, COMMIT_ID_SIZE, "%s", root);
+  while (strcmp(id, NULL_COMMIT_ID) != 0 && commit_exists(id) && gc_marks_add_hex(ctx->m, id)) {
+    if (*count == *capacity) {
+      *capacity = *capacity ? 2 * *capacity : 256;
+      ctx->commits = realloc(ctx->commits, *capacity * sizeof(*ctx->commits));
+      ASSERT_ERROR_MESSAGE(ctx->commits != NULL, "out of memory");
+    }
+    snprintf(ctx->commits[(*count)++], COMMIT_ID_SIZE, "%s", id);
+
+    struct commit_object c;
+    ASSERT_ERROR_MESSAGE(commit_load(id, &c), "commit is missing");
+    snprintf(id, COMMIT_ID_SIZE, "%s", c.prev);
+    commit_free(&c);
+    if (gc_out_of_time(ctx)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Mark everything reachable that <m> doesn't hold yet, and store where the
+ * new objects (after the new commits) start in <objects_start>. Returns 0
+ * if the budget ran out.
+ */
+static int gc_mark(struct gc_marks* m, double deadline, size_t* objects_start) {
+  struct trace_span span;
+  trace_begin(&span, "gc mark");
+  struct gc_mark_ctx ctx = { m, NULL, NULL, deadline, 0 };
+  size_t count = 0, capacity = 0;
+
+  char head[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+  int ok = gc_walk(&ctx, head, &count, &capacity);
+  struct ref* refs;
+  int num_refs = refs_list(&refs);
+  for (int i = 0; i < num_refs && ok; i++) {
+    ok = gc_walk(&ctx, refs[i].id, &count, &capacity);
+  }
+  free(refs);
+
+  *objects_start = m->count;
+  if (ok) {
+    pool_for(count, 1, gc_mark_commit, &ctx);
+  }
+  if (ok && !ctx.out_of_time) {
+    struct index idx;
+    index_load(&idx);
+    for (int i = 0; i < idx.count; i++) {
+      gc_marks_add_hex(m, idx.entries[i].id);
+    }
+    index_free(&idx);
+
+    size_t objects = m->count - *objects_start;
+    ctx.objects = malloc((objects ? objects : 1) * sizeof(*ctx.objects));
+    ASSERT_ERROR_MESSAGE(ctx.objects != NULL, "out of memory");
+    for (size_t i = 0; i < objects; i++) {
+      hash_to_hex(m->ids[*objects_start + i], SHA_DIGEST_LENGTH, ctx.objects[i]);
+    }
+    pool_for(objects, 64, gc_mark_chunks, &ctx);
+    free(ctx.objects);
+  }
+  free(ctx.commits);
+  trace_end(&span);
+  return ok && !ctx.out_of_time;
+}
+
+struct gc_sweep_ctx {
+  struct gc_marks* m;
+  struct timespec cutoff;
+  int commits;
+  int objects;
+  int temporaries;
+};
+
+// Returns 1 if <path> was last modified before the cutoff.
+static int gc_expired(const struct gc_sweep_ctx* ctx, const char* path) {
+  struct stat st;
+  return lstat(path, &st) == 0
+      && (st.st_mtim.tv_sec < ctx->cutoff.tv_sec
+          || (st.st_mtim.tv_sec == ctx->cutoff.tv_sec && st.st_mtim.tv_nsec < ctx->cutoff.tv_nsec));
+}
+
+/* Delete the expired temporary files "tmp_*" in <dir>. */
+static void gc_sweep_temporaries(struct gc_sweep_ctx* ctx, const char* dir) {
+  DIR* d = opendir(dir);
+  if (!d) {
+    return;
+  }
+  struct dirent* de;
+  while ((de = readdir(d)) != NULL) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+    if (strncmp(de->d_name, "tmp_", 4) == 0 && gc_expired(ctx, path)) {
+      if (fs_check_dir_exists(path)) {
+        fs_rm_tree(path);
+      } else {
+        unlink(path);
+      }
+      __atomic_add_fetch(&ctx->temporaries, 1, __ATOMIC_RELAXED);
+    }
+  }
+  closedir(d);
+}
+
+/* Mark the chunks of the unmarked chunk lists in object fan-out directory
+ * <slice> that aren't expired: the sweep keeps those lists, and a chunk
+ * may be older than a list that was written or reused recently.
+ */
+static void gc_keep_chunks(void* arg, int slice) {
+  struct gc_sweep_ctx* ctx = arg;
+  char dir[sizeof(OBJECT_DIR) + 4];
+  snprintf(dir, sizeof(dir), "%s/%02x", OBJECT_DIR, slice);
+  DIR* d = opendir(dir);
+  if (!d) {
+    return;
+  }
+  struct dirent* de;
+  while ((de = readdir(d)) != NULL) {
+    char id[OBJECT_ID_SIZE];
+    unsigned char raw[SHA_DIGEST_LENGTH];
+    snprintf(id, sizeof(id), "%02x%s", slice, de->d_name);
+    if (strlen(de->d_name) != OBJECT_ID_BYTES - 2 || !hex_to_hash(id, SHA_DIGEST_LENGTH, raw)) {
+      continue;
+    }
+    pthread_mutex_lock(&ctx->m->lock);
+    int marked = gc_marks_has(ctx->m, raw);
+    pthread_mutex_unlock(&ctx->m->lock);
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+    if (marked || gc_expired(ctx, path)) {
+      continue;
+    }
+    char (*ids)[OBJECT_ID_SIZE];
+    size_t count = object_chunk_ids(id, &ids);
+    if (count == 0) {
+      continue;
+    }
+    pthread_mutex_lock(&ctx->m->lock);
+    for (size_t i = 0; i < count; i++) {
+      gc_marks_add_hex(ctx->m, ids[i]);
+    }
+    pthread_mutex_unlock(&ctx->m->lock);
+    free(ids);
+  }
+  closedir(d);
+}
+
+/* Sweep slice <slice>: object fan-out directory <slice>, or for the last
+ * slice the commits and temporary files.
+ *
+ * Empty fan-out directories are kept: a concurrent commit creates the
+ * directory when it starts writing an object, but only renames the object
+ * into it when its transaction commits.
+ */
+static void gc_sweep_slice(void* arg, int slice) {
+  struct gc_sweep_ctx* ctx = arg;
+  char dir[sizeof(OBJECT_DIR) + 4];
+  if (slice == GC_SLICES - 1) {
+    snprintf(dir, sizeof(dir), ".beargit");
+  } else {
+    snprintf(dir, sizeof(dir), "%s/%02x", OBJECT_DIR, slice);
+  }
+  size_t name_len = slice == GC_SLICES - 1 ? COMMIT_ID_BYTES : OBJECT_ID_BYTES - 2;
+
+  DIR* d = opendir(dir);
+  if (!d) {
+    return;
+  }
+  struct dirent* de;
+  while ((de = readdir(d)) != NULL) {
+    char id[OBJECT_ID_SIZE];
+    unsigned char raw[SHA_DIGEST_LENGTH];
+    snprintf(id, sizeof(id), "%s%s", slice == GC_SLICES - 1 ? "" : dir + sizeof(OBJECT_DIR), de->d_name);
+    if (strlen(de->d_name) != name_len || !hex_to_hash(id, SHA_DIGEST_LENGTH, raw)
+        || gc_marks_has(ctx->m, raw)) {
+      continue;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+    if (!gc_expired(ctx, path)) {
+      continue;
+    }
+    if (slice == GC_SLICES - 1 && fs_check_dir_exists(path)) {
+      fs_rm_tree(path);
+      __atomic_add_fetch(&ctx->commits, 1, __ATOMIC_RELAXED);
+    } else if (slice < GC_SLICES - 1 && unlink(path) == 0) {
+      __atomic_add_fetch(&ctx->objects, 1, __ATOMIC_RELAXED);
+    }
+  }
+  closedir(d);
+
+  if (slice == GC_SLICES - 1) {
+    gc_sweep_temporaries(ctx, ".beargit");
+    gc_sweep_temporaries(ctx, OBJECT_DIR);
+    gc_sweep_temporaries(ctx, PACK_DIR);
+    gc_sweep_temporaries(ctx, SEARCH_DIR);
+  }
+}
+
+/* Collect garbage (see gc.h): keep everything younger than <grace>
+ * seconds, and with <budget_ms> > 0 run incrementally in about that many
+ * milliseconds. Fills in <stats>.
+ *
+ * Returns GC_DONE, GC_BUSY if another gc holds the lock, or GC_OUT_OF_TIME
+ * if the budget ran out while marking (nothing was deleted).
+ */
+int gc_run(long grace, int budget_ms, struct gc_stats* stats) {
+  memset(stats, 0, sizeof(struct gc_stats));
+  int lock = open(GC_LOCK_FILE, O_RDWR | O_CREAT, 0644);
+  ASSERT_ERROR_MESSAGE(lock != -1, "couldn't open gc lock");
+  if (flock(lock, LOCK_EX | LOCK_NB) != 0) {
+    ASSERT_ERROR_MESSAGE(errno == EWOULDBLOCK, "couldn't lock gc lock");
+    close(lock);
+    return GC_BUSY;
+  }
+
+  double deadline = budget_ms > 0 ? gc_now() + budget_ms / 1000.0 : 0;
+  struct gc_marks m;
+  memset(&m, 0, sizeof(m));
+  pthread_mutex_init(&m.lock, NULL);
+  if (budget_ms > 0) {
+    gc_marks_load(&m);
+  }
+  size_t objects_start;
+  if (!gc_mark(&m, deadline, &objects_start)) {
+    gc_marks_free(&m);
+    close(lock);
+    return GC_OUT_OF_TIME;
+  }
+  stats->marked = m.count;
+  int full = budget_ms <= 0;
+  if (full) {
+    m.cursor = 0;
+  }
+  gc_marks_save(&m, objects_start, full);
+
+  struct trace_span span;
+  trace_begin(&span, "gc sweep");
+  struct gc_sweep_ctx ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.m = &m;
+  clock_gettime(CLOCK_REALTIME, &ctx.cutoff);
+  ctx.cutoff.tv_sec -= grace;
+  // Not saved with the marks: the lists may still turn out to be garbage.
+  pool_for(GC_SLICES - 1, 1, gc_keep_chunks, &ctx);
+  if (full) {
+    pool_for(GC_SLICES, 1, gc_sweep_slice, &ctx);
+    stats->slices = GC_SLICES;
+  } else {
+    // At least one slice, so that every run makes progress.
+    do {
+      gc_sweep_slice(&ctx, m.cursor);
+      m.cursor = (m.cursor + 1) % GC_SLICES;
+      stats->slices++;
+    } while (stats->slices < GC_SLICES && gc_now() < deadline);
+    gc_marks_save_cursor(&m);
+  }
+  trace_end(&span);
+
+  // The commit graph may still list deleted commits; it heals itself, and
+  // the search index and Bloom filters are rebuilt with it.
+  if (ctx.commits > 0) {
+    int graph = graph_lock();
+    unlink(GRAPH_FILE);
+    unlink(GRAPH_MSGS_FILE);
+    unlink(GRAPH_LOOKUP_FILE);
+    search_reset();
+    bloom_reset();
+    graph_unlock(graph);
+  }
+  stats->commits = ctx.commits;
+  stats->objects = ctx.objects;
+  stats->temporaries = ctx.temporaries;
+  gc_marks_free(&m);
+  close(lock);
+  return GC_DONE;
+}
+
+/* Run an incremental gc if the "autogc" setting asks for one. */
+void gc_auto(void) {
+  char value[CONFIG_VALUE_SIZE];
+  if (!config_get("autogc", value) || strcmp(value, "off") == 0) {
+    return;
+  }
+  char* end;
+  long budget = strtol(value, &end, 10);
+  if (end == value || *end != '\0' || budget <= 0) {
+    fprintf(stderr, "ERROR:  Invalid autogc %s in %s; using off.\n", value, CONFIG_FILE);
+    return;
+  }
+  struct gc_stats stats;
+  gc_run(GC_DEFAULT_GRACE, budget, &stats);
+}
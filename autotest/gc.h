@@ -0,0 +1,62 @@
+/**
+ * Garbage collection (beargit gc).
+ *
+ * The mark phase finds everything reachable from HEAD (.beargit/.prev),
+ * the branches (refs.h) and the index: commits, the objects their
+ * manifests name, and the chunks of chunked objects (object.h). Commit
+ * chains are walked on the calling thread; manifests and chunk lists are
+ * read on the worker pool (pool.h). The sweep phase then deletes loose
+ * commit directories and loose objects that weren't marked, and the
+ * temporary files of interrupted writers. Packs are left alone; beargit
+ * repack only keeps reachable objects anyway.
+ *
+ * Nothing younger than the grace period (by modification time) is
+ * deleted, so a commit running at the same time is safe: it writes its
+ * objects and commit before it updates the branch that makes them
+ * reachable. An object a commit reuses instead of writing is freshened,
+ * and so are the chunks of a chunk list it reuses. The sweep also keeps
+ * the chunks of every chunk list it keeps, whether or not it is marked.
+ *
+ * The marks are saved in GC_MARKS_FILE: a header ("BGCM", version, and the
+ * sweep cursor) followed by raw 20-byte ids. A full gc rewrites the file.
+ * An incremental gc (with a time budget) loads it, walks from the roots
+ * only down to the first commit it already holds, and appends what is new;
+ * commits are appended after their objects. Marks only grow between full
+ * runs, which errs on the side of keeping things: garbage from deleted
+ * branches waits for the next full gc. An incremental run then sweeps
+ * GC_SLICES slices (the 256 object fan-out directories and the commits)
+ * from the cursor on, until the budget is spent. A run whose budget runs
+ * out while marking changes nothing.
+ *
+ * The "autogc" setting (config.h) runs an incremental gc with a budget of
+ * that many milliseconds after every commit; it is off by default.
+ */
+#ifndef _BEARGIT_GC_H_
+#define _BEARGIT_GC_H_
+
+#define GC_MARKS_FILE ".beargit/gc-marks"
+#define GC_LOCK_FILE ".beargit/gc.lock"
+
+// Default grace period, in seconds
+#define GC_DEFAULT_GRACE (14 * 24 * 60 * 60)
+
+// Object fan-out directories 00..ff, then the commits
+#define GC_SLICES 257
+
+// Results of gc_run()
+#define GC_DONE 0
+#define GC_BUSY 1
+#define GC_OUT_OF_TIME 2
+
+struct gc_stats {
+  int marked;
+  int commits;
+  int objects;
+  int temporaries;
+  int slices;
+};
+
+int gc_run(long grace, int budget_ms, struct gc_stats* stats);
+void gc_auto(void);
+
+#endif // _BEARGIT_GC_H_
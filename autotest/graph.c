@@ -0,0 +1,537 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <endian.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bloom.h"
+#include "cache.h"
+#include "commit.h"
+#include "graph.h"
+#include "hash.h"
+#include "search.h"
+#include "util.h"
+
+#define GRAPH_SIGNATURE "BCGR"
+#define GRAPH_VERSION 2
+#define GRAPH_HEADER_SIZE 8
+#define GRAPH_RECORD_SIZE 44
+
+#define GRAPH_LOOKUP_SIGNATURE "BCGL"
+#define GRAPH_LOOKUP_VERSION 1
+#define GRAPH_LOOKUP_HEADER_SIZE 32
+#define GRAPH_LOOKUP_FANOUT_SIZE (256 * 4)
+#define GRAPH_LOOKUP_ENTRY_SIZE 24
+
+static uint32_t get_u32(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohl(v);
+}
+
+static void put_u32(unsigned char* p, uint32_t v) {
+  v = htonl(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static const void* graph_map(const char* path, size_t* size) {
+  *size = 0;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  struct stat st;
+  void* map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    *size = st.st_size;
+  }
+  close(fd);
+  return map == MAP_FAILED ? NULL : map;
+}
+
+/* Map the commit graph. A missing or unreadable graph is opened as an
+ * empty one; a partially written last record is ignored.
+ */
+static void graph_map_files(struct graph* g) {
+  memset(g, 0, sizeof(struct graph));
+  g->map = (void*) graph_map(GRAPH_FILE, &g->map_size);
+  if (g->map && (g->map_size < GRAPH_HEADER_SIZE || memcmp(g->map, GRAPH_SIGNATURE, 4) != 0
+                 || get_u32((unsigned char*) g->map + 4) != GRAPH_VERSION)) {
+    munmap(g->map, g->map_size);
+    g->map = NULL;
+  }
+  if (!g->map) {
+    return;
+  }
+  g->records = (const unsigned char*) g->map + GRAPH_HEADER_SIZE;
+  g->count = (g->map_size - GRAPH_HEADER_SIZE) / GRAPH_RECORD_SIZE;
+
+  g->msgs_map = (void*) graph_map(GRAPH_MSGS_FILE, &g->msgs_size);
+  g->msgs = g->msgs_map;
+  if (!g->msgs) {
+    g->msgs_size = 0;
+  }
+
+  // A lookup that doesn't end at a record of this graph is ignored.
+  g->lookup_map = (void*) graph_map(GRAPH_LOOKUP_FILE, &g->lookup_map_size);
+  const unsigned char* lookup = g->lookup_map;
+  if (!lookup) {
+    return;
+  }
+  uint32_t count = g->lookup_map_size >= GRAPH_LOOKUP_HEADER_SIZE ? get_u32(lookup + 8) : 0;
+  if (count == 0 || count > g->count || memcmp(lookup, GRAPH_LOOKUP_SIGNATURE, 4) != 0
+      || get_u32(lookup + 4) != GRAPH_LOOKUP_VERSION
+      || g->lookup_map_size != GRAPH_LOOKUP_HEADER_SIZE + GRAPH_LOOKUP_FANOUT_SIZE
+                               + (size_t) count * GRAPH_LOOKUP_ENTRY_SIZE
+      || memcmp(lookup + 12, g->records + (size_t) (count - 1) * GRAPH_RECORD_SIZE,
+                SHA_DIGEST_LENGTH) != 0) {
+    munmap(g->lookup_map, g->lookup_map_size);
+    g->lookup_map = NULL;
+    return;
+  }
+  g->lookup = lookup + GRAPH_LOOKUP_HEADER_SIZE;
+  g->lookup_count = count;
+}
+
+// The graph kept by beargit daemon (see graph_cache_refresh())
+static struct graph graph_cached;
+static struct cache_stamp graph_stamp = CACHE_STAMP_EMPTY;
+static struct cache_stamp graph_msgs_stamp = CACHE_STAMP_EMPTY;
+
+static int graph_cache_valid(void) {
+  return cache_stamp_valid(&graph_stamp, GRAPH_FILE)
+         && cache_stamp_valid(&graph_msgs_stamp, GRAPH_MSGS_FILE);
+}
+
+void graph_open(struct graph* g) {
+  // A forked daemon child takes over the daemon's mappings.
+  if (graph_cache_valid()) {
+    *g = graph_cached;
+    memset(&graph_cached, 0, sizeof(struct graph));
+    cache_stamp_clear(&graph_stamp);
+    cache_stamp_clear(&graph_msgs_stamp);
+    return;
+  }
+  graph_map_files(g);
+}
+
+/* Map the commit graph for graph_open() in processes forked from now on,
+ * unless the mapping is still up to date.
+ */
+void graph_cache_refresh(void) {
+  if (graph_cache_valid()) {
+    return;
+  }
+  graph_close(&graph_cached);
+  if (cache_stamp_fill(&graph_stamp, GRAPH_FILE)
+      && cache_stamp_fill(&graph_msgs_stamp, GRAPH_MSGS_FILE)) {
+    graph_map_files(&graph_cached);
+  }
+}
+
+void graph_close(struct graph* g) {
+  if (g->map) {
+    munmap(g->map, g->map_size);
+  }
+  if (g->msgs_map) {
+    munmap(g->msgs_map, g->msgs_size);
+  }
+  if (g->lookup_map) {
+    munmap(g->lookup_map, g->lookup_map_size);
+  }
+  memset(g, 0, sizeof(struct graph));
+}
+
+/* Returns the position of <commit_id> in the graph, or GRAPH_NONE.
+ *
+ * The records the lookup doesn't cover yet are scanned from the newest
+ * back, since the commits asked for are usually recent ones; the others
+ * are found by a binary search within their fan-out bucket. Without a
+ * lookup every record is scanned.
+ */
+uint32_t graph_find(struct graph* g, const char* commit_id) {
+  if (g->count == 0 || strlen(commit_id) != COMMIT_ID_BYTES) {
+    return GRAPH_NONE;
+  }
+  unsigned char raw[SHA_DIGEST_LENGTH];
+  if (!hex_to_hash(commit_id, SHA_DIGEST_LENGTH, raw)) {
+    return GRAPH_NONE;
+  }
+  for (uint32_t pos = g->count; pos-- > g->lookup_count;) {
+    if (memcmp(g->records + (size_t) pos * GRAPH_RECORD_SIZE, raw, SHA_DIGEST_LENGTH) == 0) {
+      return pos;
+    }
+  }
+  if (!g->lookup) {
+    return GRAPH_NONE;
+  }
+
+  const unsigned char* entries = g->lookup + GRAPH_LOOKUP_FANOUT_SIZE;
+  uint32_t lo = raw[0] > 0 ? get_u32(g->lookup + (raw[0] - 1) * 4) : 0;
+  uint32_t hi = get_u32(g->lookup + raw[0] * 4);
+  hi = hi < g->lookup_count ? hi : g->lookup_count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const unsigned char* e = entries + (size_t) mid * GRAPH_LOOKUP_ENTRY_SIZE;
+    int cmp = memcmp(raw, e, SHA_DIGEST_LENGTH);
+    if (cmp == 0) {
+      uint32_t pos = get_u32(e + SHA_DIGEST_LENGTH);
+      return pos < g->lookup_count ? pos : GRAPH_NONE;
+    } else if (cmp < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return GRAPH_NONE;
+}
+
+void graph_commit_id(struct graph* g, uint32_t pos, char commit_id[COMMIT_ID_SIZE]) {
+  hash_to_hex(g->records + (size_t) pos * GRAPH_RECORD_SIZE, SHA_DIGEST_LENGTH, commit_id);
+}
+
+uint32_t graph_parent(struct graph* g, uint32_t pos) {
+  return get_u32(g->records + (size_t) pos * GRAPH_RECORD_SIZE + 20);
+}
+
+uint32_t graph_generation(struct graph* g, uint32_t pos) {
+  return get_u32(g->records + (size_t) pos * GRAPH_RECORD_SIZE + 24);
+}
+
+uint32_t graph_jump(struct graph* g, uint32_t pos) {
+  return get_u32(g->records + (size_t) pos * GRAPH_RECORD_SIZE + 28);
+}
+
+// Parent and jump of <pos>. Pointers that aren't older than their record
+// (a corrupt graph) end a walk instead of looping.
+static uint32_t graph_step(struct graph* g, uint32_t pos) {
+  uint32_t parent = graph_parent(g, pos);
+  return parent < pos ? parent : GRAPH_NONE;
+}
+
+static uint32_t graph_skip(struct graph* g, uint32_t pos) {
+  uint32_t jump = graph_jump(g, pos);
+  return jump < pos ? jump : graph_step(g, pos);
+}
+
+/* Returns the ancestor of <pos> with generation <generation>, or
+ * GRAPH_NONE if <pos> is older than that. Takes O(log n) steps.
+ */
+uint32_t graph_ancestor_at(struct graph* g, uint32_t pos, uint32_t generation) {
+  while (pos != GRAPH_NONE && graph_generation(g, pos) > generation) {
+    uint32_t jump = graph_skip(g, pos);
+    if (jump != GRAPH_NONE && graph_generation(g, jump) >= generation) {
+      pos = jump;
+    } else {
+      pos = graph_step(g, pos);
+    }
+  }
+  return pos != GRAPH_NONE && graph_generation(g, pos) == generation ? pos : GRAPH_NONE;
+}
+
+/* Returns the position of the nearest common ancestor of the commits at
+ * <a> and <b>, or GRAPH_NONE if they don't share history.
+ *
+ * Both are first brought to the same generation. From there, jump
+ * pointers of commits with the same generation lead to the same
+ * generation, so the two sides take a jump together whenever it lands
+ * below the common ancestor (the targets still differ) and a single
+ * step otherwise.
+ */
+uint32_t graph_lca(struct graph* g, uint32_t a, uint32_t b) {
+  if (a == GRAPH_NONE || b == GRAPH_NONE) {
+    return GRAPH_NONE;
+  }
+  uint32_t gen_a = graph_generation(g, a);
+  uint32_t gen_b = graph_generation(g, b);
+  if (gen_a > gen_b) {
+    a = graph_ancestor_at(g, a, gen_b);
+  } else if (gen_b > gen_a) {
+    b = graph_ancestor_at(g, b, gen_a);
+  }
+
+  while (a != b && a != GRAPH_NONE && b != GRAPH_NONE) {
+    uint32_t jump_a = graph_skip(g, a);
+    uint32_t jump_b = graph_skip(g, b);
+    if (jump_a != jump_b && jump_a != GRAPH_NONE && jump_b != GRAPH_NONE) {
+      a = jump_a;
+      b = jump_b;
+    } else {
+      a = graph_step(g, a);
+      b = graph_step(g, b);
+    }
+  }
+  return a == b ? a : GRAPH_NONE;
+}
+
+/* Add <a> and <b> to the graph and store the commit id of their nearest
+ * common ancestor in <base>.
+ *
+ * Returns 1 if there is one, 0 if they don't share history.
+ */
+int graph_merge_base(const char* a, const char* b, char base[COMMIT_ID_SIZE]) {
+  graph_add(a);
+  graph_add(b);
+
+  struct graph g;
+  graph_open(&g);
+  uint32_t pos = graph_lca(&g, graph_find(&g, a), graph_find(&g, b));
+  if (pos != GRAPH_NONE) {
+    graph_commit_id(&g, pos, base);
+  }
+  graph_close(&g);
+  return pos != GRAPH_NONE;
+}
+
+/* Returns 1 if commit <a> is <b> or one of its ancestors. */
+int graph_is_ancestor(const char* a, const char* b) {
+  graph_add(a);
+  graph_add(b);
+
+  struct graph g;
+  graph_open(&g);
+  uint32_t pos_a = graph_find(&g, a);
+  uint32_t pos_b = graph_find(&g, b);
+  int result = pos_a != GRAPH_NONE && pos_b != GRAPH_NONE
+               && graph_ancestor_at(&g, pos_b, graph_generation(&g, pos_a)) == pos_a;
+  graph_close(&g);
+  return result;
+}
+
+/* Point <msg> at the message of the commit at <pos> (not NUL-terminated)
+ * and store its length in <len>. Returns 0 if the message file doesn't
+ * hold it.
+ */
+int graph_msg(struct graph* g, uint32_t pos, const char** msg, size_t* len) {
+  const unsigned char* r = g->records + (size_t) pos * GRAPH_RECORD_SIZE;
+  uint64_t offset;
+  memcpy(&offset, r + 32, sizeof(offset));
+  offset = be64toh(offset);
+  *len = get_u32(r + 40);
+  if (offset > g->msgs_size || *len > g->msgs_size - offset) {
+    return 0;
+  }
+  *msg = g->msgs + offset;
+  return 1;
+}
+
+// Record <pos>, either in the mapped graph or among the <records> being
+// appended to it.
+static const unsigned char* graph_record(struct graph* g, const unsigned char* records,
+                                         uint32_t pos) {
+  if (pos < g->count) {
+    return g->records + (size_t) pos * GRAPH_RECORD_SIZE;
+  }
+  return records + (size_t) (pos - g->count) * GRAPH_RECORD_SIZE;
+}
+
+static int graph_lookup_entry_cmp(const void* a, const void* b) {
+  return memcmp(a, b, SHA_DIGEST_LENGTH);
+}
+
+/* Rewrite the lookup once GRAPH_LOOKUP_BATCH records are missing from it:
+ * the new records are sorted and merged with the entries it has.
+ */
+static void graph_lookup_update(void) {
+  struct graph g;
+  graph_map_files(&g);
+  if (g.count - g.lookup_count < GRAPH_LOOKUP_BATCH) {
+    graph_close(&g);
+    return;
+  }
+
+  uint32_t added = g.count - g.lookup_count;
+  unsigned char* sorted = malloc((size_t) added * GRAPH_LOOKUP_ENTRY_SIZE);
+  size_t size = GRAPH_LOOKUP_HEADER_SIZE + GRAPH_LOOKUP_FANOUT_SIZE
+                + (size_t) g.count * GRAPH_LOOKUP_ENTRY_SIZE;
+  unsigned char* buf = calloc(1, size);
+  ASSERT_ERROR_MESSAGE(sorted != NULL && buf != NULL, "out of memory");
+  for (uint32_t i = 0; i < added; i++) {
+    unsigned char* e = sorted + (size_t) i * GRAPH_LOOKUP_ENTRY_SIZE;
+    memcpy(e, g.records + (size_t) (g.lookup_count + i) * GRAPH_RECORD_SIZE, SHA_DIGEST_LENGTH);
+    put_u32(e + SHA_DIGEST_LENGTH, g.lookup_count + i);
+  }
+  qsort(sorted, added, GRAPH_LOOKUP_ENTRY_SIZE, graph_lookup_entry_cmp);
+
+  memcpy(buf, GRAPH_LOOKUP_SIGNATURE, 4);
+  put_u32(buf + 4, GRAPH_LOOKUP_VERSION);
+  put_u32(buf + 8, g.count);
+  memcpy(buf + 12, g.records + (size_t) (g.count - 1) * GRAPH_RECORD_SIZE, SHA_DIGEST_LENGTH);
+  unsigned char* fanout = buf + GRAPH_LOOKUP_HEADER_SIZE;
+  unsigned char* out = fanout + GRAPH_LOOKUP_FANOUT_SIZE;
+  const unsigned char* old = g.lookup ? g.lookup + GRAPH_LOOKUP_FANOUT_SIZE : NULL;
+  uint32_t i = 0, j = 0, counts[256] = { 0 };
+  while (i < g.lookup_count || j < added) {
+    const unsigned char* a = old + (size_t) i * GRAPH_LOOKUP_ENTRY_SIZE;
+    const unsigned char* b = sorted + (size_t) j * GRAPH_LOOKUP_ENTRY_SIZE;
+    const unsigned char* e = j == added || (i < g.lookup_count
+                                            && graph_lookup_entry_cmp(a, b) < 0) ? a : b;
+    if (e == a) {
+      i++;
+    } else {
+      j++;
+    }
+    memcpy(out, e, GRAPH_LOOKUP_ENTRY_SIZE);
+    out += GRAPH_LOOKUP_ENTRY_SIZE;
+    counts[e[0]]++;
+  }
+  for (int b = 0, total = 0; b < 256; b++) {
+    total += counts[b];
+    put_u32(fanout + b * 4, total);
+  }
+
+  char tmp[] = ".beargit/tmp_XXXXXX";
+  int fd = mkstemp(tmp);
+  ASSERT_ERROR_MESSAGE(fd != -1, "creating commit graph lookup failed");
+  fs_tmp_mode(fd);
+  ASSERT_ERROR_MESSAGE(write(fd, buf, size) == (ssize_t) size && close(fd) == 0,
+                       "writing commit graph lookup failed");
+  fs_mv(tmp, GRAPH_LOOKUP_FILE);
+  graph_close(&g);
+  free(sorted);
+  free(buf);
+}
+
+struct graph_pending {
+  char id[COMMIT_ID_SIZE];
+  char* msg;
+};
+
+/* Take the lock of the commit graph (see graph.h), waiting for another
+ * writer to finish. Returns the descriptor to pass to graph_unlock().
+ */
+int graph_lock(void) {
+  int lock = open(GRAPH_LOCK_FILE, O_RDWR | O_CREAT, 0644);
+  ASSERT_ERROR_MESSAGE(lock != -1, "couldn't open commit graph lock");
+  ASSERT_ERROR_MESSAGE(flock(lock, LOCK_EX) == 0, "couldn't lock commit graph lock");
+  return lock;
+}
+
+void graph_unlock(int lock) {
+  close(lock);
+}
+
+/* Add <commit_id> to the commit graph, along with any of its ancestors
+ * the graph doesn't have yet (e.g. commits from before the graph existed,
+ * or all of them if the graph was deleted). The caller holds the lock.
+ */
+static void graph_append(const char* commit_id) {
+  struct graph g;
+  graph_open(&g);
+
+  // Walk back to the newest ancestor the graph already knows.
+  struct graph_pending* pending = NULL;
+  int count = 0, capacity = 0;
+  char id[COMMIT_ID_SIZE];
+  snprintf(id, COMMIT_ID_SIZE, "%s", commit_id);
+  uint32_t parent = GRAPH_NONE;
+  while (strcmp(id, NULL_COMMIT_ID) != 0 && (parent = graph_find(&g, id)) == GRAPH_NONE) {
+    struct commit_object c;
+    if (!commit_load(id, &c)) {
+      break;
+    }
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      pending = realloc(pending, capacity * sizeof(struct graph_pending));
+      ASSERT_ERROR_MESSAGE(pending != NULL, "out of memory");
+    }
+    memcpy(pending[count].id, id, COMMIT_ID_SIZE);
+    pending[count++].msg = strndup(c.msg, c.msg_len);
+    snprintf(id, COMMIT_ID_SIZE, "%s", c.prev);
+    commit_free(&c);
+  }
+  if (count == 0) {
+    graph_close(&g);
+    return;
+  }
+
+  uint32_t pos = g.count;
+  int fresh = g.map == NULL;
+
+  // Start over if the graph is missing or unreadable; otherwise cut off
+  // a partially written record before appending. Positions start over
+  // too, so the lookup, the search index and the Bloom filters go first.
+  if (fresh) {
+    unlink(GRAPH_LOOKUP_FILE);
+    search_reset();
+    bloom_reset();
+  }
+  int fd = open(GRAPH_FILE, O_WRONLY | O_CREAT | (fresh ? O_TRUNC : 0), 0644);
+  int msgs_fd = open(GRAPH_MSGS_FILE, O_WRONLY | O_CREAT | O_APPEND | (fresh ? O_TRUNC : 0), 0644);
+  ASSERT_ERROR_MESSAGE(fd != -1 && msgs_fd != -1, "opening commit graph failed");
+  off_t end = fresh ? 0 : GRAPH_HEADER_SIZE + (off_t) pos * GRAPH_RECORD_SIZE;
+  ASSERT_ERROR_MESSAGE(ftruncate(fd, end) == 0 && lseek(fd, end, SEEK_SET) == end,
+                       "truncating commit graph failed");
+  struct stat st;
+  ASSERT_ERROR_MESSAGE(fstat(msgs_fd, &st) == 0, "couldn't stat commit graph messages");
+  uint64_t msg_offset = st.st_size;
+
+  size_t size = (fresh ? GRAPH_HEADER_SIZE : 0) + (size_t) count * GRAPH_RECORD_SIZE;
+  unsigned char* buf = malloc(size);
+  ASSERT_ERROR_MESSAGE(buf != NULL, "out of memory");
+  unsigned char* p = buf;
+  if (fresh) {
+    memcpy(p, GRAPH_SIGNATURE, 4);
+    put_u32(p + 4, GRAPH_VERSION);
+    p += GRAPH_HEADER_SIZE;
+  }
+  unsigned char* records = p;
+
+  // Oldest first, so that parents come before their children.
+  for (int i = count - 1; i >= 0; i--, p += GRAPH_RECORD_SIZE) {
+    size_t len = strlen(pending[i].msg);
+    ASSERT_ERROR_MESSAGE(write(msgs_fd, pending[i].msg, len) == (ssize_t) len,
+                         "writing commit graph messages failed");
+
+    // Jump pointers follow the skew-binary scheme: if the parent's jump
+    // spans as many generations as the jump after it, jump over both,
+    // otherwise to the parent. Any ancestor is then O(log n) jumps away.
+    uint32_t generation = 1;
+    uint32_t jump = pos;
+    if (parent != GRAPH_NONE) {
+      const unsigned char* rp = graph_record(&g, records, parent);
+      uint32_t j = get_u32(rp + 28);
+      j = j <= parent ? j : parent;
+      const unsigned char* rj = graph_record(&g, records, j);
+      uint32_t jj = get_u32(rj + 28);
+      jj = jj <= j ? jj : j;
+      const unsigned char* rjj = graph_record(&g, records, jj);
+      generation = get_u32(rp + 24) + 1;
+      jump = get_u32(rp + 24) - get_u32(rj + 24) == get_u32(rj + 24) - get_u32(rjj + 24)
+             ? jj : parent;
+    }
+
+    hex_to_hash(pending[i].id, SHA_DIGEST_LENGTH, p);
+    put_u32(p + 20, parent);
+    put_u32(p + 24, generation);
+    put_u32(p + 28, jump);
+    uint64_t offset = htobe64(msg_offset);
+    memcpy(p + 32, &offset, sizeof(offset));
+    put_u32(p + 40, len);
+    msg_offset += len;
+    parent = pos++;
+    free(pending[i].msg);
+  }
+  ASSERT_ERROR_MESSAGE(write(fd, buf, size) == (ssize_t) size, "writing commit graph failed");
+  graph_close(&g);
+  close(fd);
+  close(msgs_fd);
+  free(buf);
+  free(pending);
+  graph_lookup_update();
+}
+
+/* Add <commit_id> and its missing ancestors to the commit graph. */
+void graph_add(const char* commit_id) {
+  int lock = graph_lock();
+  graph_append(commit_id);
+  graph_unlock(lock);
+}
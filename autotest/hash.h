@@ -0,0 +1,45 @@
+/**
+ * Streaming content hashing.
+ *
+ * hash_init()/hash_update()/hash_final() hash data of any length in
+ * pieces, hash_fd() hashes everything readable from a file descriptor,
+ * and hash_to_hex()/hex_to_hash() convert digests to and from the
+ * lowercase hex form used for object and commit ids.
+ *
+ * Object ids are SHA-1. SHA-256 is available for callers that ask for it
+ * (beargit hash-object --sha256). Both use libcrypto's block functions,
+ * which pick SHA-NI, AVX2 or SSSE3 code at runtime from the CPU's
+ * features.
+ */
+#ifndef _BEARGIT_HASH_H_
+#define _BEARGIT_HASH_H_
+
+#include <stddef.h>
+#include <openssl/sha.h>
+
+// Hash algorithms
+#define HASH_SHA1 0
+#define HASH_SHA256 1
+
+// Largest digest of any algorithm, raw and hex encoded
+#define HASH_MAX_RAW SHA256_DIGEST_LENGTH
+#define HASH_MAX_HEX (HASH_MAX_RAW * 2)
+
+struct hash_ctx {
+  int algo;
+  union {
+    SHA_CTX sha1;
+    SHA256_CTX sha256;
+  } u;
+};
+
+size_t hash_size(int algo);
+void hash_init(struct hash_ctx* ctx, int algo);
+void hash_update(struct hash_ctx* ctx, const void* data, size_t size);
+size_t hash_final(struct hash_ctx* ctx, unsigned char* raw);
+void hash_buffer(int algo, const void* data, size_t size, unsigned char* raw);
+int hash_fd(int fd, int algo, unsigned char* raw);
+void hash_to_hex(const unsigned char* raw, size_t size, char* hex);
+int hex_to_hash(const char* hex, size_t size, unsigned char* raw);
+
+#endif // _BEARGIT_HASH_H_
@@ -0,0 +1,101 @@
+/**
+ * The staging index (.beargit/.index).
+ *
+ * On disk the index is a binary file:
+ *
+ *   header:  4-byte signature "BIDX", 4-byte version, 4-byte entry count
+ *   entries: sorted by filename; per entry the cached stat data (8-byte
+ *            inode, size and mtime in nanoseconds), the 20-byte object id
+ *            of the contents, 2-byte flags, a 2-byte filename length and
+ *            the filename (not NUL-terminated)
+ *   extensions: optional; per extension a 4-byte signature, a 4-byte
+ *            length and that many bytes of data. Readers skip unknown
+ *            extensions. "FSMN" holds the filesystem monitor token up to
+ *            which the stat data was checked (see fsmonitor.h).
+ *   trailer: SHA-1 of everything before it
+ *
+ * All integers are stored in network byte order. When loaded, the entries
+ * are kept in an array with an open-addressing hash table on top, so
+ * lookups, additions and removals are O(1); the array is only sorted again
+ * when the index is written.
+ *
+ * The stat data lets commit and status skip files that haven't changed
+ * since they were last hashed: if inode, size and mtime still match, the
+ * cached object id is trusted. A file modified within the same timestamp
+ * tick in which it was hashed would look unchanged ("racily clean"), so
+ * index_write() drops the cached data of every entry whose mtime is not
+ * older than the index file itself; those are hashed again next time.
+ *
+ * Version 1 indexes (no stat data) and older repositories that store the
+ * index as a text file with one filename per line are read too; the next
+ * index_write() converts them to the current format.
+ */
+#ifndef _BEARGIT_INDEX_H_
+#define _BEARGIT_INDEX_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "beargit.h"
+#include "fsmonitor.h"
+#include "object.h"
+
+#define INDEX_FILE ".beargit/.index"
+#define INDEX_SIGNATURE "BIDX"
+#define INDEX_VERSION 2
+
+// The cached stat data and object id are valid
+#define INDEX_ENTRY_VALID 0x1
+// The object with the cached id is known to be in the object store
+#define INDEX_ENTRY_STORED 0x2
+
+struct index_entry {
+  // Interned (see arena.h)
+  const char* filename;
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime_ns;
+  char id[OBJECT_ID_SIZE];
+  int flags;
+};
+
+struct index {
+  struct index_entry* entries;
+  int count;
+  int capacity;
+  // Hash table of entry positions (+1, so that 0 marks a free slot)
+  int* table;
+  int table_size;
+  // Whether entries are still in filename order
+  int sorted;
+  // Whether cached stat data changed since the index was loaded
+  int changed;
+  // Filesystem monitor token of the stat data, or ""
+  char fsmonitor_token[FSMONITOR_TOKEN_SIZE];
+};
+
+void index_init(struct index* idx);
+void index_load(struct index* idx);
+void index_write(struct index* idx);
+void index_free(struct index* idx);
+void index_cache_refresh(void);
+int index_cache_current(void);
+void index_cache_clear(void);
+struct index_entry* index_find(struct index* idx, const char* filename);
+struct index_entry* index_add(struct index* idx, const char* filename);
+int index_remove(struct index* idx, const char* filename);
+void index_clear(struct index* idx);
+
+// Results of index_refresh_entry()
+#define INDEX_CLEAN 0
+#define INDEX_REHASHED 1
+#define INDEX_DELETED 2
+
+int index_entry_uptodate(const struct index_entry* e, const struct stat* st);
+void index_entry_set_stat(struct index_entry* e, const struct stat* st, const char* id);
+int index_refresh_entry(struct index_entry* e);
+int index_fsmonitor_begin(struct index* idx);
+int index_entry_maybe_dirty(const struct index_entry* e, int monitored);
+void index_entry_checked_out(struct index* idx, struct index_entry* e, const char* id);
+
+#endif // _BEARGIT_INDEX_H_
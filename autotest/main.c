@@ -0,0 +1,339 @@
+/**
+ * This file contains functionality to parse command line arguments. Do not modify!
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "beargit.h"
+#include "cunittests.h"
+#include "daemon.h"
+#include "gc.h"
+#include "hash.h"
+#include "pool.h"
+#include "trace.h"
+
+int check_initialized(void) {
+  struct stat s;
+  int ret_code = stat(".beargit", &s);
+  return !(ret_code == -1 || !(S_ISDIR(s.st_mode)));
+}
+
+/* Normalize <path> in place: drop "./" prefixes, duplicate and trailing
+ * slashes. The current directory itself becomes ".".
+ */
+void normalize_path(char* path) {
+  char* out = path;
+  const char* in = path;
+  while (*in) {
+    if (in[0] == '.' && (in[1] == '/' || in[1] == '\0') && (out == path || out[-1] == '/')) {
+      in += in[1] ? 2 : 1;
+    } else if (in[0] == '/' && out != path && out[-1] == '/') {
+      in++;
+    } else {
+      *out++ = *in++;
+    }
+  }
+  while (out > path + 1 && out[-1] == '/') {
+    out--;
+  }
+  if (out == path) {
+    *out++ = '.';
+  }
+  *out = '\0';
+}
+
+/* Check a path given to add or rm. Hidden files, absolute paths and paths
+ * leading out of the repository are rejected. For add, the path must be an
+ * existing file or directory; "." adds the whole working directory.
+ */
+int check_filename(const char* filename, int must_exist) {
+  if (strlen(filename) > PATH_MAX-1 || strlen(filename) == 0)
+    return 0;
+
+  if (strcmp(filename, ".") != 0) {
+    if (filename[0] == '.' || filename[0] == '/' || strstr(filename, "/.") != NULL)
+      return 0;
+  } else if (!must_exist) {
+    return 0;
+  }
+
+  if (!must_exist)
+    return 1;
+
+  struct stat s;
+  return stat(filename, &s) != -1;
+}
+
+/* Read NUL-delimited paths from stdin (as produced by find -print0). The
+ * returned array and its strings live until the process exits.
+ */
+char** read_stdin_paths(int* count) {
+  size_t size = 0, capacity = 1 << 16;
+  char* buf = malloc(capacity);
+  size_t n;
+  while (buf && (n = fread(buf + size, 1, capacity - size - 1, stdin)) > 0) {
+    size += n;
+    if (size + 1 == capacity) {
+      capacity *= 2;
+      buf = realloc(buf, capacity);
+    }
+  }
+  if (!buf) {
+    return NULL;
+  }
+  buf[size] = '\0';
+
+  int num = 0;
+  for (size_t i = 0; i < size; i++) {
+    num += (buf[i] == '\0' || i + 1 == size);
+  }
+  char** paths = malloc((num + 1) * sizeof(char*));
+  *count = 0;
+  for (size_t i = 0; paths && i < size; i += strlen(buf + i) + 1) {
+    if (buf[i]) {
+      paths[(*count)++] = buf + i;
+    }
+  }
+  return paths;
+}
+
+#ifndef TESTING
+/* Run a command on an initialized repository, in this process or in a
+ * child of beargit daemon.
+ */
+int run_command(int argc, char **argv) {
+    if (strcmp(argv[1], "add") == 0 || strcmp(argv[1], "rm") == 0) {
+
+      int is_add = strcmp(argv[1], "add") == 0;
+      int count = 0;
+      char** paths = argv + 2;
+      if (argc == 3 && strcmp(argv[2], "--stdin") == 0) {
+        paths = read_stdin_paths(&count);
+      } else {
+        count = argc - 2;
+      }
+
+      if (paths == NULL || count == 0) {
+        fprintf(stderr, "ERROR: No or invalid filename given\n");
+        return 1;
+      }
+
+      for (int i = 0; i < count; i++) {
+        normalize_path(paths[i]);
+        if (!check_filename(paths[i], is_add)) {
+          fprintf(stderr, "ERROR: No or invalid filename given\n");
+          return 1;
+        }
+      }
+
+      if (is_add) {
+        return beargit_add_paths(count, (const char**) paths);
+      } else {
+        return beargit_rm_paths(count, (const char**) paths);
+      }
+
+    } else if (strcmp(argv[1], "commit") == 0) {
+
+      const char* msg = NULL;
+      for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+          msg = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+          pool_set_jobs(atoi(argv[++i]));
+        } else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2]) {
+          pool_set_jobs(atoi(argv[i] + 2));
+        } else {
+          msg = NULL;
+          break;
+        }
+      }
+
+      if (msg == NULL) {
+        fprintf(stderr, "ERROR: Need a commit message (-m <msg>)\n");
+        return 1;
+      }
+
+      if (strlen(msg) > MSG_SIZE-1) {
+        fprintf(stderr, "ERROR: Message is too long!\n");
+        return 1;
+      }
+
+      return beargit_commit(msg);
+
+    } else if (strcmp(argv[1], "status") == 0) {
+        return beargit_status();
+    } else if (strcmp(argv[1], "log") == 0) {
+        int limit = INT_MAX;
+        const char* pattern = NULL;
+        const char* path = NULL;
+        for (int i = 2; i < argc; i++) {
+          if (strcmp(argv[i], "-n") == 0){
+            if (i + 1 == argc){
+              fprintf(stderr, "ERROR: No log limit specified!\n");
+              return 1;
+            }
+            limit = atoi(argv[++i]);
+            if (limit < 0){
+              fprintf(stderr, "ERROR: Illegal log limit specified!\n");
+              return 1;
+            }
+          } else if (strcmp(argv[i], "--grep") == 0) {
+            if (i + 1 == argc){
+              fprintf(stderr, "ERROR: No log pattern specified!\n");
+              return 1;
+            }
+            pattern = argv[++i];
+          } else if (strcmp(argv[i], "--") == 0) {
+            if (i + 2 != argc){
+              fprintf(stderr, "ERROR: Need to specify one path after --\n");
+              return 1;
+            }
+            path = argv[++i];
+          }
+        }
+        return beargit_log(limit, pattern, path);
+    } else if (strcmp(argv[1], "branch") == 0) {
+        if (argc > 2 && strcmp(argv[2], "-d") == 0) {
+          if (argc != 4) {
+            fprintf(stderr, "ERROR: Need to specify a branch name\n");
+            return 1;
+          }
+          return beargit_branch_delete(argv[3]);
+        }
+        return beargit_branch();
+    } else if (strcmp(argv[1], "pack-refs") == 0) {
+        return beargit_pack_refs();
+    } else if (strcmp(argv[1], "checkout") == 0) {
+        int branch_new = 0;
+        char* arg = NULL;
+
+        for (int i = 2; i < argc; i++) {
+          if (argv[i][0] == '-') {
+            if (strcmp(argv[i], "-b") == 0) {
+              branch_new = 1;
+              continue;
+            } else {
+              fprintf(stderr, "ERROR: Invalid argument: %s", argv[i]);
+              return 1;
+            }
+          }
+
+          if (arg) {
+              fprintf(stderr, "ERROR: Too many arguments for checkout!");
+              return 1;
+          }
+
+          arg = argv[i];
+        }
+
+        return beargit_checkout(arg, branch_new);
+    } else if (strcmp(argv[1], "reset") == 0) {
+         if (argc < 4) {
+              fprintf(stderr,
+                      "ERROR: Need to specify a commit id and a filename");
+              return 1;
+         }
+
+         return beargit_reset(argv[2], argv[3]);
+    } else if (strcmp(argv[1], "merge") == 0) {
+         if (argc < 3) {
+              fprintf(stderr, "ERROR: Need to specify a commit id or branch name");
+              return 1;
+         }
+
+         return beargit_merge(argv[2]);
+    } else if (strcmp(argv[1], "merge-base") == 0) {
+         int is_ancestor = argc > 2 && strcmp(argv[2], "--is-ancestor") == 0;
+         if (argc != 4 + is_ancestor) {
+              fprintf(stderr, "ERROR: Need to specify two commit ids or branch names\n");
+              return 1;
+         }
+
+         return beargit_merge_base(argv[2 + is_ancestor], argv[3 + is_ancestor], is_ancestor);
+    } else if (strcmp(argv[1], "repack") == 0) {
+         return beargit_repack();
+    } else if (strcmp(argv[1], "gc") == 0) {
+         long grace = GC_DEFAULT_GRACE;
+         int budget = 0;
+         for (int i = 2; i < argc; i++) {
+              char* end = NULL;
+              if (strcmp(argv[i], "--grace") == 0 && i + 1 < argc) {
+                   grace = strtol(argv[++i], &end, 10);
+              } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+                   budget = strtol(argv[++i], &end, 10);
+              }
+              if (end == NULL || end == argv[i] || *end != '\0' || grace < 0 || budget < 0) {
+                   fprintf(stderr, "ERROR: Usage: beargit gc [--grace <seconds>] [--budget <ms>]\n");
+                   return 1;
+              }
+         }
+
+         return beargit_gc(grace, budget);
+    } else {
+        fprintf(stderr, "ERROR: Unknown command \"%s\"\n", argv[1]);
+        return 1;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <command> [<args>]\n", argv[0]);
+        return 2;
+    }
+
+    // TODO: If students aren't going to write this themselves, replace by clean
+    // implementation using function pointers.
+    if (strcmp(argv[1], "hash-object") == 0) {
+
+      int algo = HASH_SHA1;
+      int first = 2;
+      if (argc > 2 && strcmp(argv[2], "--sha256") == 0) {
+        algo = HASH_SHA256;
+        first++;
+      }
+      if (first == argc) {
+        fprintf(stderr, "ERROR: No filename given\n");
+        return 1;
+      }
+
+      return beargit_hash_object(argc - first, (const char**) argv + first, algo);
+
+    } else if (strcmp(argv[1], "init") == 0) {
+
+      if (check_initialized()) {
+        fprintf(stderr, "ERROR: Repository is already initialized\n");
+        return 1;
+      }
+
+      return beargit_init();
+
+    } else {
+
+        if (!check_initialized()) {
+            fprintf(stderr, "ERROR: Repository is not initialized\n");
+            return 1;
+        }
+
+        if (strcmp(argv[1], "daemon") == 0) {
+            return daemon_serve(run_command);
+        }
+
+        int status;
+        if (daemon_forward(argc - 1, argv + 1, &status)) {
+            return status;
+        }
+        trace_init(argv[1]);
+        return run_command(argc, argv);
+    }
+}
+#else
+/* Runs CUnit Tests that you must write. */
+int main(int argc, char **argv) {
+    return cunittester();
+}
+#endif
@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "commit.h"
+#include "manifest.h"
+#include "util.h"
+
+static void manifest_append(struct manifest* m, int* capacity,
+                            const char* id, const char* filename, size_t len) {
+  if (m->count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 16;
+    m->entries = realloc(m->entries, *capacity * sizeof(struct manifest_entry));
+    ASSERT_ERROR_MESSAGE(m->entries != NULL, "out of memory");
+  }
+
+  struct manifest_entry* e = &m->entries[m->count++];
+  snprintf(e->id, OBJECT_ID_SIZE, "%s", id);
+  e->filename = path_intern(filename, len);
+}
+
+static int manifest_entry_cmp(const void* a, const void* b) {
+  return strcmp(((const struct manifest_entry*) a)->filename,
+                ((const struct manifest_entry*) b)->filename);
+}
+
+/* Append the "<object_id> <filename>" lines in <data> to <m>. */
+static void manifest_parse(struct manifest* m, int* capacity, const char* data, size_t size) {
+  const char* end = data + size;
+  while (data < end) {
+    const char* eol = memchr(data, '\n', end - data);
+    if (!eol) {
+      eol = end;
+    }
+    size_t len = eol - data;
+    ASSERT_ERROR_MESSAGE(len > OBJECT_ID_BYTES + 1 && data[OBJECT_ID_BYTES] == ' ',
+                         "corrupt manifest");
+
+    char id[OBJECT_ID_SIZE];
+    memcpy(id, data, OBJECT_ID_BYTES);
+    id[OBJECT_ID_BYTES] = '\0';
+    manifest_append(m, capacity, id, data + OBJECT_ID_BYTES + 1, len - OBJECT_ID_BYTES - 1);
+    data = eol + 1;
+  }
+}
+
+// The manifest kept by beargit daemon (see manifest_cache_refresh())
+static struct manifest manifest_cached;
+
+static void manifest_read(const char* commit_id, struct manifest* m) {
+  int capacity = 0;
+  m->entries = NULL;
+  m->count = 0;
+  m->legacy = 0;
+  snprintf(m->commit_id, COMMIT_ID_SIZE, "%s", commit_id);
+
+  if (strcmp(commit_id, NULL_COMMIT_ID) == 0) {
+    return;
+  }
+
+  char path[COMMIT_ID_SIZE + 20];
+  sprintf(path, ".beargit/%s/.manifest", commit_id);
+  struct fs_view v;
+  if (fs_view_open(path, &v)) {
+    manifest_parse(m, &capacity, v.data, v.size);
+    fs_view_close(&v);
+    return;
+  }
+
+  struct commit_object c;
+  sprintf(path, ".beargit/%s", commit_id);
+  if (!fs_check_dir_exists(path) && commit_load(commit_id, &c)) {
+    manifest_parse(m, &capacity, c.manifest, c.manifest_size);
+    commit_free(&c);
+    return;
+  }
+
+  // Commit from before the object store: the file list is a plain index
+  // in no particular order, and the files are copies in the commit dir.
+  m->legacy = 1;
+  sprintf(path, ".beargit/%s/.index", commit_id);
+  ASSERT_ERROR_MESSAGE(fs_view_open(path, &v), "commit has no manifest");
+  size_t off = 0, len;
+  const char* line;
+  while (fs_view_line(&v, &off, &line, &len)) {
+    ASSERT_ERROR_MESSAGE(len > 0, "corrupt commit index");
+    char copy[COMMIT_ID_SIZE + len + 10];
+    char id[OBJECT_ID_SIZE];
+    sprintf(copy, ".beargit/%s/%.*s", commit_id, (int) len, line);
+    cryptohash_file(copy, id);
+    manifest_append(m, &capacity, id, line, len);
+  }
+  fs_view_close(&v);
+  qsort(m->entries, m->count, sizeof(struct manifest_entry), manifest_entry_cmp);
+}
+
+/* Load the manifest of commit <commit_id> into <m>.
+ *
+ * The all-zero commit id (no commit yet) yields an empty manifest.
+ */
+void manifest_load(const char* commit_id, struct manifest* m) {
+  // A forked daemon child takes over the daemon's copy. Manifests never
+  // change, so the commit id is all that needs to match.
+  if (manifest_cached.count > 0 && strcmp(manifest_cached.commit_id, commit_id) == 0) {
+    *m = manifest_cached;
+    memset(&manifest_cached, 0, sizeof(struct manifest));
+    return;
+  }
+  manifest_read(commit_id, m);
+}
+
+/* Call <fn> with the object id of every entry of the manifest of commit
+ * <commit_id>. Unlike manifest_load(), this leaves filenames alone and is
+ * safe to call from worker threads. Commits from before the object store
+ * reference no objects.
+ */
+void manifest_for_each_id(const char* commit_id, manifest_id_fn fn, void* arg) {
+  if (strcmp(commit_id, NULL_COMMIT_ID) == 0) {
+    return;
+  }
+
+  char path[COMMIT_ID_SIZE + 20];
+  sprintf(path, ".beargit/%s/.manifest", commit_id);
+  struct fs_view v;
+  struct commit_object c;
+  const char* data;
+  size_t size;
+  int packed = 0;
+  if (fs_view_open(path, &v)) {
+    data = v.data;
+    size = v.size;
+  } else {
+    sprintf(path, ".beargit/%s", commit_id);
+    if (fs_check_dir_exists(path) || !commit_load(commit_id, &c)) {
+      return;
+    }
+    data = c.manifest;
+    size = c.manifest_size;
+    packed = 1;
+  }
+
+  const char* end = data + size;
+  while (data < end) {
+    const char* eol = memchr(data, '\n', end - data);
+    if (!eol) {
+      eol = end;
+    }
+    ASSERT_ERROR_MESSAGE(eol - data > OBJECT_ID_BYTES + 1 && data[OBJECT_ID_BYTES] == ' ',
+                         "corrupt manifest");
+    char id[OBJECT_ID_SIZE];
+    memcpy(id, data, OBJECT_ID_BYTES);
+    id[OBJECT_ID_BYTES] = '\0';
+    fn(arg, id);
+    data = eol + 1;
+  }
+
+  if (packed) {
+    commit_free(&c);
+  } else {
+    fs_view_close(&v);
+  }
+}
+
+/* Returns 1 if manifest_cache_refresh(<commit_id>) has nothing to read. */
+int manifest_cache_current(const char* commit_id) {
+  return strcmp(manifest_cached.commit_id, commit_id) == 0 || !commit_exists(commit_id);
+}
+
+/* Drop the manifest kept in memory. */
+void manifest_cache_clear(void) {
+  if (manifest_cached.entries) {
+    manifest_free(&manifest_cached);
+  }
+  manifest_cached.commit_id[0] = '\0';
+}
+
+/* Keep the manifest of commit <commit_id> in memory for manifest_load()
+ * in processes forked from now on.
+ */
+void manifest_cache_refresh(const char* commit_id) {
+  if (strcmp(manifest_cached.commit_id, commit_id) != 0 && commit_exists(commit_id)) {
+    if (manifest_cached.entries) {
+      manifest_free(&manifest_cached);
+    }
+    manifest_read(commit_id, &manifest_cached);
+  }
+}
+
+void manifest_free(struct manifest* m) {
+  free(m->entries);
+  m->entries = NULL;
+  m->count = 0;
+}
+
+/* Returns the entry for <filename>, or NULL if it isn't in the manifest. */
+struct manifest_entry* manifest_find(struct manifest* m, const char* filename) {
+  int lo = 0;
+  int hi = m->count - 1;
+  while (lo <= hi) {
+    int mid = lo + (hi - lo) / 2;
+    int cmp = strcmp(m->entries[mid].filename, filename);
+    if (cmp == 0) {
+      return &m->entries[mid];
+    } else if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return NULL;
+}
+
+/* Write the committed contents of entry <e> of manifest <m> to <dst>,
+ * creating missing parent directories.
+ */
+void manifest_checkout(struct manifest* m, struct manifest_entry* e, const char* dst) {
+  if (strchr(dst, '/')) {
+    fs_mkdir_parents(dst);
+  }
+  if (!m->legacy) {
+    object_checkout(e->id, dst);
+  } else {
+    char src[COMMIT_ID_SIZE + strlen(e->filename) + 10];
+    sprintf(src, ".beargit/%s/%s", m->commit_id, e->filename);
+    fs_cp(src, dst);
+  }
+}
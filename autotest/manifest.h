@@ -0,0 +1,46 @@
+/**
+ * Commit manifests.
+ *
+ * A commit's manifest (.beargit/<commit_id>/.manifest) lists every file in
+ * the commit as one "<object_id> <filename>" line, sorted by filename. The
+ * file contents live in the object store.
+ *
+ * Commits made before the object store existed have no manifest; they keep
+ * their file list in .beargit/<commit_id>/.index and a full copy of each
+ * file in the commit directory. manifest_load() reads both layouts; for the
+ * old one it hashes the copies so that every entry has an object id. The
+ * manifest of a packed commit is part of the commit object (see commit.h).
+ */
+#ifndef _BEARGIT_MANIFEST_H_
+#define _BEARGIT_MANIFEST_H_
+
+#include "beargit.h"
+#include "object.h"
+
+struct manifest_entry {
+  // Interned (see arena.h)
+  const char* filename;
+  char id[OBJECT_ID_SIZE];
+};
+
+struct manifest {
+  char commit_id[COMMIT_ID_SIZE];
+  struct manifest_entry* entries;
+  int count;
+  // Commit without a manifest: file copies are in the commit directory
+  int legacy;
+};
+
+// Called by manifest_for_each_id() with each object id
+typedef void (*manifest_id_fn)(void* arg, const char* id);
+
+void manifest_load(const char* commit_id, struct manifest* m);
+void manifest_for_each_id(const char* commit_id, manifest_id_fn fn, void* arg);
+void manifest_free(struct manifest* m);
+void manifest_cache_refresh(const char* commit_id);
+int manifest_cache_current(const char* commit_id);
+void manifest_cache_clear(void);
+struct manifest_entry* manifest_find(struct manifest* m, const char* filename);
+void manifest_checkout(struct manifest* m, struct manifest_entry* e, const char* dst);
+
+#endif // _BEARGIT_MANIFEST_H_
@@ -0,0 +1,658 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "chunk.h"
+#include "codec.h"
+#include "hash.h"
+#include "object.h"
+#include "pack.h"
+#include "trace.h"
+#include "util.h"
+
+// Chunks written by one writev() of object_checkout()
+#define OBJECT_CHUNK_BATCH 64
+
+/* Create the .beargit/objects directory if it doesn't exist yet.
+ *
+ * Repositories created before the object store existed don't have it, so
+ * every writer calls this before storing anything.
+ */
+void object_store_init(void) {
+  if (!fs_check_dir_exists(OBJECT_DIR)) {
+    fs_mkdir(OBJECT_DIR);
+  }
+}
+
+/* Fill <path> with the location of object <id>. */
+void object_path(const char* id, char path[OBJECT_PATH_SIZE]) {
+  sprintf(path, "%s/%.2s/%s", OBJECT_DIR, id, id + 2);
+}
+
+/* Returns 1 if object <id> is in the store, loose or packed, 0 otherwise. */
+int object_exists(const char* id) {
+  char path[OBJECT_PATH_SIZE];
+  object_path(id, path);
+
+  struct stat s;
+  int type;
+  return (stat(path, &s) == 0 && S_ISREG(s.st_mode))
+      || (pack_lookup(id, &type) && type == PACK_OBJ_BLOB);
+}
+
+struct object_header {
+  int type;                   // PACK_OBJ_BLOB or OBJECT_TYPE_CHUNKS
+  const struct codec* codec;  // NULL for plain copies without a header
+  uint64_t size;              // size of the contents
+};
+
+/* Open loose object <path> and read its header into <h>. Returns the
+ * descriptor, positioned at the codec's stream, or -1 if the object isn't
+ * loose. Plain copies are positioned at the start of the contents.
+ */
+static int object_open(const char* path, struct object_header* h) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  unsigned char header[OBJECT_HEADER_SIZE];
+  ssize_t n = read(fd, header, sizeof(header));
+  if (n < 4 || memcmp(header, OBJECT_MAGIC, 4) != 0) {
+    struct stat st;
+    ASSERT_ERROR_MESSAGE(fstat(fd, &st) == 0 && lseek(fd, 0, SEEK_SET) == 0,
+                         "reading object failed");
+    h->type = PACK_OBJ_BLOB;
+    h->codec = NULL;
+    h->size = st.st_size;
+    return fd;
+  }
+  ASSERT_ERROR_MESSAGE(n == OBJECT_HEADER_SIZE && header[4] == OBJECT_VERSION
+                       && (header[5] == PACK_OBJ_BLOB || header[5] == OBJECT_TYPE_CHUNKS),
+                       "corrupt object header");
+  h->type = header[5];
+  h->codec = codec_find(header[6]);
+  ASSERT_ERROR_MESSAGE(h->codec != NULL, "object was written with an unknown codec");
+  h->size = 0;
+  for (int i = 8; i < OBJECT_HEADER_SIZE; i++) {
+    h->size = (h->size << 8) | header[i];
+  }
+  return fd;
+}
+
+/* Decompress the stream of object <fd> into <sink>. */
+static void object_decode(int fd, const struct object_header* h, codec_sink sink, void* arg) {
+  struct trace_span span;
+  trace_begin(&span, "decompress");
+  span.detail = h->codec->name;
+  ASSERT_ERROR_MESSAGE(h->codec->decompress(fd, h->size, sink, arg), "corrupt object");
+  trace_count(TRACE_FILES, 1);
+  trace_end(&span);
+}
+
+/* Map the chunk list object <path> into <v>. Returns the number of chunks;
+ * chunk_entry() reads them.
+ */
+static size_t object_chunks_open(const char* path, struct fs_view* v) {
+  ASSERT_ERROR_MESSAGE(fs_view_open(path, v), "couldn't open chunk list");
+  size_t n = (v->size - OBJECT_HEADER_SIZE) / OBJECT_CHUNK_ENTRY_SIZE;
+  ASSERT_ERROR_MESSAGE(v->size >= OBJECT_HEADER_SIZE
+                       && v->size == OBJECT_HEADER_SIZE + n * OBJECT_CHUNK_ENTRY_SIZE,
+                       "corrupt chunk list");
+  return n;
+}
+
+/* Store the id and length of chunk <i> of chunk list <v>. */
+static void object_chunk_entry(const struct fs_view* v, size_t i, char id[OBJECT_ID_SIZE],
+                               size_t* size) {
+  const unsigned char* e = (const unsigned char*) v->data + OBJECT_HEADER_SIZE
+      + i * OBJECT_CHUNK_ENTRY_SIZE;
+  hash_to_hex(e, SHA_DIGEST_LENGTH, id);
+  *size = (size_t) e[20] << 24 | e[21] << 16 | e[22] << 8 | e[23];
+}
+
+/* Returns 1 if object <id> is loose, and stores the size of its contents
+ * in <size>.
+ */
+int object_loose_size(const char* id, size_t* size) {
+  char path[OBJECT_PATH_SIZE];
+  object_path(id, path);
+  struct object_header h;
+  int fd = object_open(path, &h);
+  if (fd == -1) {
+    return 0;
+  }
+  close(fd);
+  *size = h.size;
+  return 1;
+}
+
+/* Returns 1 if object <id> is a loose chunk list, 0 otherwise. */
+int object_is_chunked(const char* id) {
+  char path[OBJECT_PATH_SIZE];
+  object_path(id, path);
+  struct object_header h;
+  int fd = object_open(path, &h);
+  if (fd == -1) {
+    return 0;
+  }
+  close(fd);
+  return h.type == OBJECT_TYPE_CHUNKS;
+}
+
+/* Returns the number of chunks of object <id> if it is a loose chunk list,
+ * and stores their ids in a newly allocated array in <ids>; 0 otherwise.
+ */
+size_t object_chunk_ids(const char* id, char (**ids)[OBJECT_ID_SIZE]) {
+  char path[OBJECT_PATH_SIZE];
+  object_path(id, path);
+  struct object_header h;
+  int fd = object_open(path, &h);
+  if (fd == -1) {
+    return 0;
+  }
+  close(fd);
+  if (h.type != OBJECT_TYPE_CHUNKS) {
+    return 0;
+  }
+
+  struct fs_view v;
+  size_t count = object_chunks_open(path, &v);
+  *ids = malloc((count ? count : 1) * sizeof(**ids));
+  ASSERT_ERROR_MESSAGE(*ids != NULL, "out of memory");
+  for (size_t i = 0; i < count; i++) {
+    size_t size;
+    object_chunk_entry(&v, i, (*ids)[i], &size);
+  }
+  fs_view_close(&v);
+  return count;
+}
+
+/* Set the modification time of loose object <id> to now, so that beargit
+ * gc counts an object a new commit reuses as recent (see gc.h).
+ *
+ * Returns 1 if the object is in the store, 0 if it isn't, which includes
+ * one a concurrent gc just removed: the caller writes it again then.
+ */
+static int object_freshen_blob(const char* id) {
+  char path[OBJECT_PATH_SIZE];
+  object_path(id, path);
+  if (utimensat(AT_FDCWD, path, NULL, 0) == 0) {
+    return 1;
+  }
+  int type;
+  return pack_lookup(id, &type) && type == PACK_OBJ_BLOB;
+}
+
+/* Like object_freshen_blob(), but for a chunk list also freshen its
+ * chunks. Returns 0 if any of them is missing, so that the caller writes
+ * the object again, chunks and all.
+ */
+static int object_freshen(const char* id) {
+  if (!object_freshen_blob(id)) {
+    return 0;
+  }
+  char (*ids)[OBJECT_ID_SIZE];
+  size_t count = object_chunk_ids(id, &ids);
+  int ok = 1;
+  for (size_t i = 0; i < count && ok; i++) {
+    ok = object_freshen_blob(ids[i]);
+  }
+  if (count > 0) {
+    free(ids);
+  }
+  return ok;
+}
+
+struct memory_sink {
+  unsigned char* data;
+  size_t size;
+};
+
+static void object_sink_memory(void* arg, const unsigned char* data, size_t size) {
+  struct memory_sink* m = arg;
+  memcpy(m->data + m->size, data, size);
+  m->size += size;
+}
+
+/* Read the contents of object <id> into a newly allocated buffer. Chunked
+ * objects are put back together.
+ *
+ * Returns 1 on success, 0 if the object isn't in the store.
+ */
+int object_read(const char* id, unsigned char** data, size_t* size) {
+  char path[OBJECT_PATH_SIZE];
+  object_path(id, path);
+
+  struct object_header h;
+  int fd = object_open(path, &h);
+  if (fd == -1) {
+    int type;
+    return pack_read(id, &type, data, size);
+  } else if (!h.codec) {
+    close(fd);
+    *data = fs_read_file(path, size);
+    return 1;
+  }
+
+  struct memory_sink m = { malloc(h.size ? h.size : 1), 0 };
+  ASSERT_ERROR_MESSAGE(m.data != NULL, "out of memory");
+  if (h.type == PACK_OBJ_BLOB) {
+    object_decode(fd, &h, object_sink_memory, &m);
+  } else {
+    struct fs_view v;
+    size_t count = object_chunks_open(path, &v);
+    for (size_t i = 0; i < count; i++) {
+      char chunk_id[OBJECT_ID_SIZE];
+      size_t chunk_size, read_size;
+      unsigned char* chunk;
+      object_chunk_entry(&v, i, chunk_id, &chunk_size);
+      ASSERT_ERROR_MESSAGE(m.size + chunk_size <= h.size && object_read(chunk_id, &chunk, &read_size)
+                           && read_size == chunk_size, "chunk is missing from the object store");
+      object_sink_memory(&m, chunk, chunk_size);
+      free(chunk);
+    }
+    fs_view_close(&v);
+    ASSERT_ERROR_MESSAGE(m.size == h.size, "corrupt chunk list");
+  }
+  close(fd);
+  *data = m.data;
+  *size = m.size;
+  return 1;
+}
+
+/* Store the contents of <filename> in the object store and write its id
+ * into <id>.
+ *
+ * Returns 1 if a new object was written, 0 if it was already stored.
+ */
+int object_write_file(const char* filename, char id[OBJECT_ID_SIZE]) {
+  cryptohash_file(filename, id);
+  return object_store_file(filename, id, NULL);
+}
+
+/* Create the fan-out directory object <id> goes into. */
+static void object_fanout_create(const char* id) {
+  char fanout[sizeof(OBJECT_DIR) + 3];
+  sprintf(fanout, "%s/%.2s", OBJECT_DIR, id);
+  int ret = mkdir(fanout, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  ASSERT_ERROR_MESSAGE(ret == 0 || errno == EEXIST, "creating object directory failed");
+}
+
+/* Create a temporary file for a new object <id> and store its name in
+ * <tmp>. Returns its descriptor.
+ */
+static int object_tmp_open(const char* id, char tmp[sizeof(OBJECT_DIR) + 16]) {
+  object_store_init();
+  object_fanout_create(id);
+
+  sprintf(tmp, "%s/tmp_XXXXXX", OBJECT_DIR);
+  int fd = mkstemp(tmp);
+  ASSERT_ERROR_MESSAGE(fd != -1, "creating temporary object failed");
+  fs_tmp_mode(fd);
+  return fd;
+}
+
+/* Move the finished temporary object <tmp> into place as object <id>, now
+ * or, with transaction <t>, when it commits.
+ */
+static void object_tmp_finish(const char* tmp, const char* id, struct txn* t) {
+  char path[OBJECT_PATH_SIZE];
+  object_path(id, path);
+  if (t) {
+    txn_rename(t, tmp, path);
+  } else {
+    fs_mv(tmp, path);
+  }
+}
+
+static void object_write_header(int out, int type, int codec, int level, uint64_t size) {
+  unsigned char header[OBJECT_HEADER_SIZE];
+  memcpy(header, OBJECT_MAGIC, 4);
+  header[4] = OBJECT_VERSION;
+  header[5] = type;
+  header[6] = codec;
+  header[7] = level;
+  for (int i = 0; i < 8; i++) {
+    header[8 + i] = size >> (56 - 8 * i);
+  }
+  ASSERT_ERROR_MESSAGE(pwrite(out, header, sizeof(header), 0) == sizeof(header),
+                       "writing object failed");
+}
+
+/* Compress <source> with the codec and level of the "compression" setting
+ * into object file <out>, header first. Returns 1 if that was worth it: the
+ * object is smaller than the contents, or the contents start with the
+ * magic and can't be stored as a plain copy. Otherwise <out> holds garbage
+ * and the caller stores a plain copy instead.
+ */
+static int object_encode(codec_source source, void* arg, int plain, int out) {
+  int level;
+  const struct codec* c = codec_setting(&level);
+  if (c->id == CODEC_NONE && plain) {
+    return 0;
+  }
+  ASSERT_ERROR_MESSAGE(lseek(out, OBJECT_HEADER_SIZE, SEEK_SET) == OBJECT_HEADER_SIZE,
+                       "writing object failed");
+  struct trace_span span;
+  trace_begin(&span, "compress");
+  span.detail = c->name;
+  uint64_t size = c->compress(source, arg, level, codec_sink_fd, &out);
+  trace_count(TRACE_FILES, 2);
+  trace_end(&span);
+  object_write_header(out, PACK_OBJ_BLOB, c->id, level, size);
+
+  struct stat st;
+  ASSERT_ERROR_MESSAGE(fstat(out, &st) == 0, "writing object failed");
+  return !plain || (uint64_t) st.st_size < size;
+}
+
+/* Store chunk <id>, the <size> bytes at <data>, as a blob object. */
+static void object_store_chunk(const char* id, const unsigned char* data, size_t size,
+                               struct txn* t) {
+  char tmp[sizeof(OBJECT_DIR) + 16];
+  int fd = object_tmp_open(id, tmp);
+  struct codec_buffer b = { data, size };
+  int plain = size < 4 || memcmp(data, OBJECT_MAGIC, 4) != 0;
+  if (!object_encode(codec_source_buffer, &b, plain, fd)) {
+    ASSERT_ERROR_MESSAGE(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0,
+                         "writing object failed");
+    codec_sink_fd(&fd, data, size);
+  }
+  ASSERT_ERROR_MESSAGE(close(fd) == 0, "writing object failed");
+  object_tmp_finish(tmp, id, t);
+}
+
+/* Store <filename> as object <id> in chunks (see chunk.h): every chunk that
+ * isn't stored yet becomes an object, and the object <id> itself is the
+ * chunk list. Each chunk is copied out of the file before it is hashed and
+ * stored, and the file is hashed from the copies into <id>.
+ */
+static void object_store_chunked(const char* filename, char id[OBJECT_ID_SIZE], struct txn* t) {
+  struct trace_span span;
+  trace_begin(&span, "chunk");
+  struct fs_view v;
+  ASSERT_ERROR_MESSAGE(fs_view_open(filename, &v), "couldn't open source file");
+  const unsigned char* data = (const unsigned char*) v.data;
+
+  // Chunks stored by this call aren't visible to object_exists() before
+  // the transaction commits, so repeats within the file are found here.
+  size_t max_chunks = v.size / CHUNK_MIN + 1;
+  size_t table_size = 1;
+  while (table_size < 2 * max_chunks) {
+    table_size <<= 1;
+  }
+  size_t* table = calloc(table_size, sizeof(size_t));
+  unsigned char* list = malloc(OBJECT_HEADER_SIZE + max_chunks * OBJECT_CHUNK_ENTRY_SIZE);
+  unsigned char* chunk = malloc(CHUNK_MAX);
+  ASSERT_ERROR_MESSAGE(table != NULL && list != NULL && chunk != NULL, "out of memory");
+  struct hash_ctx file_hash;
+  hash_init(&file_hash, HASH_SHA1);
+
+  size_t count = 0;
+  for (size_t off = 0; off < v.size; count++) {
+    size_t len = chunk_next(data + off, v.size - off);
+    memcpy(chunk, data + off, len);
+    hash_update(&file_hash, chunk, len);
+    unsigned char* e = list + OBJECT_HEADER_SIZE + count * OBJECT_CHUNK_ENTRY_SIZE;
+    hash_buffer(HASH_SHA1, chunk, len, e);
+    e[20] = len >> 24;
+    e[21] = len >> 16;
+    e[22] = len >> 8;
+    e[23] = len;
+
+    size_t slot;
+    memcpy(&slot, e, sizeof(slot));
+    int repeat = 0;
+    for (slot &= table_size - 1; table[slot]; slot = (slot + 1) & (table_size - 1)) {
+      const unsigned char* other = list + OBJECT_HEADER_SIZE
+          + (table[slot] - 1) * OBJECT_CHUNK_ENTRY_SIZE;
+      if (memcmp(other, e, SHA_DIGEST_LENGTH) == 0) {
+        repeat = 1;
+        break;
+      }
+    }
+    if (!repeat) {
+      table[slot] = count + 1;
+      char chunk_id[OBJECT_ID_SIZE];
+      hash_to_hex(e, SHA_DIGEST_LENGTH, chunk_id);
+      if (!object_freshen_blob(chunk_id)) {
+        object_store_chunk(chunk_id, chunk, len, t);
+      }
+    }
+    off += len;
+  }
+  unsigned char raw[SHA_DIGEST_LENGTH];
+  hash_final(&file_hash, raw);
+  hash_to_hex(raw, SHA_DIGEST_LENGTH, id);
+
+  char tmp[sizeof(OBJECT_DIR) + 16];
+  int fd = object_tmp_open(id, tmp);
+  size_t list_size = OBJECT_HEADER_SIZE + count * OBJECT_CHUNK_ENTRY_SIZE;
+  codec_sink_fd(&fd, list, list_size);
+  object_write_header(fd, OBJECT_TYPE_CHUNKS, CODEC_NONE, 0, v.size);
+  ASSERT_ERROR_MESSAGE(close(fd) == 0, "writing object failed");
+  object_tmp_finish(tmp, id, t);
+
+  free(chunk);
+  free(list);
+  free(table);
+  fs_view_close(&v);
+  trace_end(&span);
+}
+
+struct object_hash_source {
+  int fd;
+  struct hash_ctx hash;
+};
+
+/* Read the next block from a file and hash it on the way. */
+static size_t object_source_hashed(void* arg, unsigned char* buf, size_t size) {
+  struct object_hash_source* s = arg;
+  size_t n = codec_source_fd(&s->fd, buf, size);
+  hash_update(&s->hash, buf, n);
+  return n;
+}
+
+/* Store the contents of <filename>, which the caller already hashed to
+ * <id>, in the object store.
+ *
+ * Objects are immutable, so nothing is written if an object with the same
+ * id already exists; it is only freshened. New objects are written to a
+ * temporary file first and renamed into place, so a reader never sees a
+ * partially written object; with transaction <t> (else NULL), the rename
+ * waits for it to commit.
+ *
+ * Files of chunk_threshold() bytes or more are stored in chunks. Other
+ * contents are compressed as the "compression" setting asks; if that
+ * doesn't make the object smaller than the file, the file is copied
+ * instead, which fs_cp() can often do without reading it.
+ *
+ * The contents are hashed again as they are written. If the file changed
+ * since the caller hashed it, the object is stored under the new id, which
+ * replaces <id>.
+ *
+ * Returns 1 if a new object was written, 0 if it was already stored.
+ */
+int object_store_file(const char* filename, char id[OBJECT_ID_SIZE], struct txn* t) {
+  if (object_freshen(id)) {
+    return 0;
+  }
+
+  int in = open(filename, O_RDONLY);
+  ASSERT_ERROR_MESSAGE(in != -1, "couldn't open source file");
+  struct stat st;
+  ASSERT_ERROR_MESSAGE(fstat(in, &st) == 0, "couldn't open source file");
+  if ((uint64_t) st.st_size >= chunk_threshold()) {
+    close(in);
+    object_store_chunked(filename, id, t);
+    return 1;
+  }
+
+  char tmp[sizeof(OBJECT_DIR) + 16];
+  int fd = object_tmp_open(id, tmp);
+  // A plain copy of a file that starts with the magic would look like a
+  // compressed object, so such files always get a header.
+  char magic[4];
+  int plain = pread(in, magic, 4, 0) != 4 || memcmp(magic, OBJECT_MAGIC, 4) != 0;
+  struct object_hash_source source = { in };
+  hash_init(&source.hash, HASH_SHA1);
+  int encoded = object_encode(object_source_hashed, &source, plain, fd);
+  close(in);
+  ASSERT_ERROR_MESSAGE(close(fd) == 0, "writing object failed");
+  unsigned char raw[SHA_DIGEST_LENGTH];
+  if (encoded) {
+    hash_final(&source.hash, raw);
+  } else {
+    // The copy is hashed itself: the file may have changed since it was
+    // compressed.
+    fs_cp(filename, tmp);
+    fd = open(tmp, O_RDONLY);
+    ASSERT_ERROR_MESSAGE(fd != -1 && hash_fd(fd, HASH_SHA1, raw), "reading object failed");
+    close(fd);
+  }
+  char stored[OBJECT_ID_SIZE];
+  hash_to_hex(raw, SHA_DIGEST_LENGTH, stored);
+  if (strcmp(stored, id) != 0) {
+    object_fanout_create(stored);
+    strcpy(id, stored);
+  }
+  object_tmp_finish(tmp, id, t);
+  return 1;
+}
+
+/* Write all of <iov> to <fd>, continuing after partial writes. */
+static void object_writev(int fd, struct iovec* iov, int count) {
+  while (count > 0) {
+    ssize_t n = writev(fd, iov, count);
+    if (n < 0) {
+      ASSERT_ERROR_MESSAGE(errno == EINTR, "writing destination file failed");
+      continue;
+    }
+    while (count > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+/* Put chunked object <path> back together into <out>: chunks are read
+ * OBJECT_CHUNK_BATCH at a time and written with one writev() per batch.
+ *
+ * Returns 1 on success, 0 if a chunk is missing from the object store.
+ */
+static int object_checkout_chunks(const char* path, const struct object_header* h, int out) {
+  struct trace_span span;
+  trace_begin(&span, "reassemble");
+  struct fs_view v;
+  size_t count = object_chunks_open(path, &v);
+  uint64_t total = 0;
+  int missing = 0;
+  for (size_t first = 0; first < count && !missing; first += OBJECT_CHUNK_BATCH) {
+    struct iovec iov[OBJECT_CHUNK_BATCH];
+    int n = count - first < OBJECT_CHUNK_BATCH ? count - first : OBJECT_CHUNK_BATCH;
+    for (int i = 0; i < n; i++) {
+      char chunk_id[OBJECT_ID_SIZE];
+      size_t chunk_size;
+      unsigned char* chunk = NULL;
+      object_chunk_entry(&v, first + i, chunk_id, &chunk_size);
+      if (!object_read(chunk_id, &chunk, &iov[i].iov_len) || iov[i].iov_len != chunk_size) {
+        free(chunk);
+        chunk = NULL;
+        iov[i].iov_len = 0;
+        missing = 1;
+      }
+      iov[i].iov_base = chunk;
+      total += chunk_size;
+    }
+    if (missing) {
+      for (int i = 0; i < n; i++) {
+        free(iov[i].iov_base);
+      }
+      break;
+    }
+    // object_writev() advances the iovecs; keep the buffers to free them.
+    void* buffers[OBJECT_CHUNK_BATCH];
+    for (int i = 0; i < n; i++) {
+      buffers[i] = iov[i].iov_base;
+    }
+    object_writev(out, iov, n);
+    for (int i = 0; i < n; i++) {
+      free(buffers[i]);
+    }
+  }
+  fs_view_close(&v);
+  trace_count(TRACE_FILES, 1 + count);
+  trace_end(&span);
+  if (missing) {
+    return 0;
+  }
+  ASSERT_ERROR_MESSAGE(total == h->size, "corrupt chunk list");
+  return 1;
+}
+
+/* Write the contents of object <id> to <dst>, overwriting <dst>. Plain
+ * loose objects are copied, compressed ones are decompressed as they are
+ * read, chunked ones are put back together, and packed ones are unpacked.
+ *
+ * The contents go to a temporary file next to <dst>, which keeps the mode
+ * of the file it replaces, and are renamed over <dst> once complete: an
+ * object that turns out to be unreadable leaves <dst> as it was.
+ */
+void object_checkout(const char* id, const char* dst) {
+  char path[OBJECT_PATH_SIZE];
+  object_path(id, path);
+  struct object_header h;
+  int fd = object_open(path, &h);
+  unsigned char* data = NULL;
+  size_t size;
+  int type;
+  if (fd == -1) {
+    ASSERT_ERROR_MESSAGE(pack_read(id, &type, &data, &size) && type == PACK_OBJ_BLOB,
+                         "object is missing from the object store");
+  }
+
+  const char* slash = strrchr(dst, '/');
+  int dir_len = slash ? (int) (slash - dst + 1) : 0;
+  char tmp[dir_len + 32];
+  sprintf(tmp, "%.*s.beargit_tmp_XXXXXX", dir_len, dst);
+  int out = mkstemp(tmp);
+  ASSERT_ERROR_MESSAGE(out != -1, "couldn't open destination file");
+  struct stat st;
+  if (stat(dst, &st) == 0) {
+    ASSERT_ERROR_MESSAGE(fchmod(out, st.st_mode & 07777) == 0, "changing file mode failed");
+  } else {
+    fs_tmp_mode(out);
+  }
+
+  if (fd != -1 && !h.codec) {
+    close(fd);
+    close(out);
+    fs_cp(path, tmp);
+  } else if (fd != -1) {
+    if (h.type == OBJECT_TYPE_CHUNKS && !object_checkout_chunks(path, &h, out)) {
+      close(out);
+      unlink(tmp);
+      ASSERT_ERROR_MESSAGE(0, "chunk is missing from the object store");
+    } else if (h.type != OBJECT_TYPE_CHUNKS) {
+      object_decode(fd, &h, codec_sink_fd, &out);
+    }
+    close(fd);
+    ASSERT_ERROR_MESSAGE(close(out) == 0, "writing destination file failed");
+  } else {
+    codec_sink_fd(&out, data, size);
+    ASSERT_ERROR_MESSAGE(close(out) == 0, "writing destination file failed");
+    free(data);
+  }
+  fs_mv(tmp, dst);
+}
@@ -0,0 +1,61 @@
+/**
+ * Content-addressed object store.
+ *
+ * File contents are stored once under .beargit/objects/, keyed by the SHA-1
+ * of their contents: the object with id "ab12..." lives in
+ * .beargit/objects/ab/12...  Commits only reference objects by id, so a
+ * commit writes just the objects it has not seen before. beargit repack
+ * moves objects into packfiles (see pack.h); readers look there when an
+ * object isn't loose.
+ *
+ * Loose objects are compressed with the codec the "compression" setting
+ * picks (codec.h). A compressed object starts with a header: the magic
+ * "\0BGO", a version byte, the object type (PACK_OBJ_BLOB), the codec id,
+ * the level it was written at, and the size of the contents as an 8-byte
+ * network order integer, followed by the codec's stream. Objects that are
+ * stored uncompressed (with "none", or because compressing them didn't
+ * save anything) are plain copies of the file, like the objects of older
+ * versions, unless the file itself starts with the magic.
+ *
+ * Large files are stored in chunks (chunk.h). Their object is a chunk list:
+ * the header, with type OBJECT_TYPE_CHUNKS, codec "none" and the size of
+ * the whole file, followed by the raw SHA-1 id and 4-byte length of each
+ * chunk in order. Each chunk is a blob object of its own. Chunk lists stay
+ * loose when the repository is repacked, so their chunks stay shared.
+ */
+#ifndef _BEARGIT_OBJECT_H_
+#define _BEARGIT_OBJECT_H_
+
+#include "txn.h"
+#include "util.h"
+
+#define OBJECT_DIR ".beargit/objects"
+
+#define OBJECT_MAGIC "\0BGO"
+#define OBJECT_VERSION 1
+#define OBJECT_HEADER_SIZE 16
+
+// Header type of chunk lists, next to the blob, commit and delta types of
+// pack.h
+#define OBJECT_TYPE_CHUNKS 4
+#define OBJECT_CHUNK_ENTRY_SIZE (SHA_DIGEST_LENGTH + 4)
+
+// Number of bytes in an object id (hex encoded) and its string size
+#define OBJECT_ID_BYTES SHA_HEX_BYTES
+#define OBJECT_ID_SIZE (OBJECT_ID_BYTES+1)
+
+// Size of an object path: OBJECT_DIR "/" xx "/" remaining id bytes
+#define OBJECT_PATH_SIZE (sizeof(OBJECT_DIR) + OBJECT_ID_BYTES + 2)
+
+void object_store_init(void);
+void object_path(const char* id, char path[OBJECT_PATH_SIZE]);
+int object_exists(const char* id);
+int object_read(const char* id, unsigned char** data, size_t* size);
+int object_loose_size(const char* id, size_t* size);
+int object_is_chunked(const char* id);
+size_t object_chunk_ids(const char* id, char (**ids)[OBJECT_ID_SIZE]);
+int object_write_file(const char* filename, char id[OBJECT_ID_SIZE]);
+int object_store_file(const char* filename, char id[OBJECT_ID_SIZE], struct txn* t);
+void object_checkout(const char* id, const char* dst);
+
+#endif // _BEARGIT_OBJECT_H_
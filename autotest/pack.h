@@ -0,0 +1,67 @@
+/**
+ * Packfiles.
+ *
+ * beargit repack stores every reachable commit and object in a single
+ * packfile, .beargit/objects/pack/pack-<sha>.pack, with an index
+ * pack-<sha>.idx next to it. Both are memory-mapped when read.
+ *
+ * The pack is a header ("BPAK", version, object count) followed by the
+ * objects and a SHA-1 of everything before it. Each object starts with a
+ * type byte and its size as a varint; deltas then give the distance back
+ * to their base object, also as a varint. The rest is a zlib stream of
+ * the object's contents, or of the delta for deltas.
+ *
+ * A delta starts with the sizes of its base and of the result (varints),
+ * followed by instructions: a byte with the high bit set copies a range of
+ * the base (offset and length follow as varints), any other byte n inserts
+ * the next n bytes of the delta.
+ *
+ * The index is a header ("BPIX", version, object count), a 256-entry
+ * fan-out table (number of objects whose id starts with a byte <= i), the
+ * sorted raw object ids, the 8-byte pack offset of each object, and the
+ * SHA-1 of the pack and of the index itself. All integers are stored in
+ * network byte order.
+ */
+#ifndef _BEARGIT_PACK_H_
+#define _BEARGIT_PACK_H_
+
+#include <stddef.h>
+
+#include "object.h"
+
+#define PACK_DIR OBJECT_DIR "/pack"
+
+// Object types
+#define PACK_OBJ_BLOB 1
+#define PACK_OBJ_COMMIT 2
+#define PACK_OBJ_DELTA 3
+
+// An object to be written by pack_write()
+struct pack_object {
+  char id[OBJECT_ID_SIZE];
+  int type;
+  // Filename of the object, so that versions of a file are delta candidates
+  const char* name;
+  // Contents of the object, if they aren't in the object store (commits)
+  unsigned char* data;
+  size_t size;
+  // File holding the contents, if they aren't in the object store
+  const char* source;
+  // Position in the caller's list, to keep commits in history order
+  int order;
+};
+
+struct pack_stats {
+  int objects;
+  int deltas;
+  size_t bytes;
+};
+
+int pack_lookup(const char* id, int* type);
+int pack_read(const char* id, int* type, unsigned char** data, size_t* size);
+void pack_write(struct pack_object* objects, int count, char name[OBJECT_ID_SIZE],
+                struct pack_stats* stats);
+void pack_reload(void);
+int pack_list(char*** names);
+
+#endif // _BEARGIT_PACK_H_
@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+static int requested_jobs = 0;
+
+struct pool_loop {
+  pool_fn fn;
+  void* arg;
+  int count;
+  int next;
+};
+
+/* Set the number of jobs (0 restores the default). */
+void pool_set_jobs(int jobs) {
+  requested_jobs = jobs;
+}
+
+int pool_jobs(void) {
+  int jobs = requested_jobs;
+  if (jobs <= 0) {
+    const char* env = getenv("BEARGIT_JOBS");
+    jobs = env ? atoi(env) : 0;
+  }
+  if (jobs <= 0) {
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (jobs < 1) {
+    jobs = 1;
+  }
+  return jobs > POOL_MAX_JOBS ? POOL_MAX_JOBS : jobs;
+}
+
+static void* pool_worker(void* data) {
+  struct pool_loop* loop = data;
+  int item;
+  while ((item = __atomic_fetch_add(&loop->next, 1, __ATOMIC_RELAXED)) < loop->count) {
+    loop->fn(loop->arg, item);
+  }
+  return NULL;
+}
+
+/* Call fn(arg, i) for every i in [0, count). No thread is started for
+ * fewer than <min_items_per_job> items per job, since the thread startup
+ * would cost more than it saves.
+ */
+void pool_for(int count, int min_items_per_job, pool_fn fn, void* arg) {
+  struct pool_loop loop = { fn, arg, count, 0 };
+
+  int jobs = pool_jobs();
+  if (min_items_per_job > 0 && count / min_items_per_job < jobs) {
+    jobs = count / min_items_per_job;
+  }
+
+  pthread_t threads[POOL_MAX_JOBS];
+  int started = 0;
+  while (started < jobs - 1
+         && pthread_create(&threads[started], NULL, pool_worker, &loop) == 0) {
+    started++;
+  }
+
+  pool_worker(&loop);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
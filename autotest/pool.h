@@ -0,0 +1,25 @@
+/**
+ * A small worker pool for data-parallel loops over the index.
+ *
+ * pool_for() calls a function once for every item in [0, count), spread
+ * over up to pool_jobs() threads (including the calling thread). Items are
+ * handed out through a shared counter, so a slow item doesn't hold up the
+ * rest of a worker's share. With one job, or if no thread can be started,
+ * the loop simply runs on the calling thread.
+ *
+ * The number of jobs is taken from pool_set_jobs() (commit -j), else from
+ * the BEARGIT_JOBS environment variable, else the number of online CPUs.
+ */
+#ifndef _BEARGIT_POOL_H_
+#define _BEARGIT_POOL_H_
+
+// Upper bound on the number of threads of one loop
+#define POOL_MAX_JOBS 64
+
+typedef void (*pool_fn)(void* arg, int item);
+
+void pool_set_jobs(int jobs);
+int pool_jobs(void);
+void pool_for(int count, int min_items_per_job, pool_fn fn, void* arg);
+
+#endif // _BEARGIT_POOL_H_
@@ -0,0 +1,45 @@
+/**
+ * Branch refs.
+ *
+ * A branch is a ref: a name and the commit id of the branch's head. Refs
+ * live in two places:
+ *
+ * - Loose refs: .beargit/refs/<name>, holding "<commit_id>\n". Creating
+ *   or moving a branch writes its loose ref.
+ * - Packed refs: .beargit/packed-refs, one "<commit_id> <name>" line per
+ *   ref, sorted by name and searched with a binary search over the
+ *   memory-mapped file. beargit pack-refs moves loose refs there.
+ *
+ * A loose ref overrides a packed ref with the same name. Every file is
+ * updated by writing <file>.lock (created exclusively, so concurrent
+ * updates fail instead of interleaving) and renaming it into place; loose
+ * refs as part of a transaction (see txn.h).
+ *
+ * Repositories from before refs kept branches in .beargit/.branches and
+ * .beargit/.branch_<name>; they are moved to packed-refs on first use.
+ */
+#ifndef _BEARGIT_REFS_H_
+#define _BEARGIT_REFS_H_
+
+#include "beargit.h"
+#include "txn.h"
+
+#define REFS_DIR ".beargit/refs"
+#define PACKED_REFS_FILE ".beargit/packed-refs"
+
+struct ref {
+  char name[BRANCHNAME_SIZE];
+  char id[COMMIT_ID_SIZE];
+};
+
+int refs_check_name(const char* name);
+int refs_read(const char* name, char id[COMMIT_ID_SIZE]);
+int refs_find_conflict(const char* name, char conflict[BRANCHNAME_SIZE]);
+int refs_update(const char* name, const char* id);
+int refs_stage_update(struct txn* t, const char* name, const char* id);
+int refs_delete(const char* name);
+int refs_list(struct ref** refs);
+int refs_pack(void);
+void refs_cache_refresh(void);
+
+#endif // _BEARGIT_REFS_H_
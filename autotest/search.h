@@ -0,0 +1,71 @@
+/**
+ * Commit message search index (beargit log --grep).
+ *
+ * An inverted index from the trigrams of commit messages (every three
+ * consecutive bytes, lowercased) to the commit-graph positions (graph.h)
+ * of the commits whose message contains them. A pattern can only match a
+ * message that holds every trigram of the literal parts it requires, so
+ * intersecting their postings gives a small set of candidates; the caller
+ * runs the real regular expression on those only. Trigrams rather than
+ * words keep substring matches ("bear" in "bears") exact.
+ *
+ * The index is kept like an LSM tree: immutable segment files in
+ * SEARCH_DIR, each covering a range of graph positions, named
+ * seg-<start>-<end> in hex. A segment is a header ("BSRC", version, start,
+ * end, number of trigrams, raw id of the commit at end - 1), a table of
+ * (trigram, postings offset, postings count) sorted by trigram, and the
+ * postings: ascending positions as varint deltas (the first from start).
+ * Integers are in network byte order.
+ *
+ * search_update() runs after each commit. Once SEARCH_BATCH commits are
+ * missing from the index it writes a segment for them, then merges the
+ * newest segment into the one before it while that one is no more than
+ * twice its size, so there are O(log n) segments and each commit is
+ * rewritten O(log n) times. The commits not indexed yet, fewer than
+ * SEARCH_BATCH, are scanned directly. A merged segment is renamed into
+ * place before its inputs are deleted; readers use the longest segment at
+ * each start, so a crash in between leaves a usable index.
+ *
+ * Positions are only stable for the life of the graph: graph_add()
+ * deletes the index when it starts a new graph, and a segment whose last
+ * commit doesn't match the graph is ignored.
+ */
+#ifndef _BEARGIT_SEARCH_H_
+#define _BEARGIT_SEARCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "graph.h"
+
+#define SEARCH_DIR ".beargit/search"
+
+// Commits indexed at a time; fewer are scanned instead
+#define SEARCH_BATCH 64
+
+// Most commits a new segment covers, which bounds the memory of a rebuild
+#define SEARCH_MAX_BUILD (1 << 16)
+
+struct search_segment;
+
+struct search {
+  struct graph* g;
+  uint32_t* trigrams;
+  int num_trigrams;
+  struct search_segment* segments;
+  int num_segments;
+  int next_segment;     // newest segment not read yet, or -1
+  uint32_t covered;     // positions below this are in segments
+  uint32_t tail;        // positions [covered, tail) are still to be returned
+  uint32_t* candidates; // of the segment read last, ascending
+  size_t num_candidates;
+  size_t capacity;
+};
+
+int search_begin(struct search* s, struct graph* g, const char* pattern);
+uint32_t search_next(struct search* s);
+void search_end(struct search* s);
+void search_update(void);
+void search_reset(void);
+
+#endif // _BEARGIT_SEARCH_H_
@@ -0,0 +1,155 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "util.h"
+
+int trace_enabled = 0;
+uint64_t trace_counters[TRACE_NUM_COUNTERS];
+
+static const char* trace_counter_names[TRACE_NUM_COUNTERS] = {
+  "files", "fopen", "bytes copied", "bytes hashed",
+  "arena allocs", "arena peak bytes", "paths",
+};
+
+struct trace_event {
+  const char* name;
+  const char* detail;
+  uint64_t start;
+  uint64_t duration;
+  int tid;
+};
+
+static const char* trace_filename;
+static struct trace_span trace_command;
+static struct trace_event* trace_events;
+static size_t trace_num_events;
+static size_t trace_capacity;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void trace_span_start(struct trace_span* span, const char* name) {
+  span->name = name;
+  span->detail = NULL;
+  span->start = trace_now();
+}
+
+void trace_span_finish(struct trace_span* span) {
+  uint64_t end = trace_now();
+  int tid = syscall(SYS_gettid);
+  pthread_mutex_lock(&trace_lock);
+  if (trace_num_events == trace_capacity) {
+    trace_capacity = trace_capacity ? trace_capacity * 2 : 1024;
+    trace_events = realloc(trace_events, trace_capacity * sizeof(struct trace_event));
+    ASSERT_ERROR_MESSAGE(trace_events != NULL, "out of memory");
+  }
+  struct trace_event* e = &trace_events[trace_num_events++];
+  e->name = span->name;
+  e->detail = span->detail;
+  e->start = span->start;
+  e->duration = end - span->start;
+  e->tid = tid;
+  pthread_mutex_unlock(&trace_lock);
+}
+
+// Print <ns> as microseconds, the unit of trace-event timestamps.
+static void trace_print_us(FILE* f, uint64_t ns) {
+  fprintf(f, "%llu.%03u", (unsigned long long) (ns / 1000), (unsigned) (ns % 1000));
+}
+
+// Print <s> as a JSON string, quoted and escaped: details hold paths
+// and command names as given on the command line.
+static void trace_print_string(FILE* f, const char* s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      fprintf(f, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(f, "\\u%04x", c);
+    } else {
+      fputc(c, f);
+    }
+  }
+  fputc('"', f);
+}
+
+// Write counters [first, last) as one counter event.
+static void trace_write_counters(FILE* f, int pid, uint64_t ts, const char* name,
+                                 int first, int last) {
+  fprintf(f, "{\"name\": \"%s\", \"cat\": \"beargit\", \"ph\": \"C\", \"pid\": %d, \"ts\": ",
+          name, pid);
+  trace_print_us(f, ts);
+  fprintf(f, ", \"args\": {");
+  for (int c = first; c < last; c++) {
+    fprintf(f, "%s\"%s\": %llu", c > first ? ", " : "", trace_counter_names[c],
+            (unsigned long long) trace_counters[c]);
+  }
+  fprintf(f, "}}");
+}
+
+/* Close the command's span and write all events. Runs at exit. */
+static void trace_write(void) {
+  trace_span_finish(&trace_command);
+  uint64_t end = trace_now();
+  trace_enabled = 0;
+
+  FILE* f = strcmp(trace_filename, "-") == 0 ? stderr : fopen(trace_filename, "w");
+  if (f == NULL) {
+    return;
+  }
+  int pid = getpid();
+  fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  pthread_mutex_lock(&trace_lock);
+  for (size_t i = 0; i < trace_num_events; i++) {
+    struct trace_event* e = &trace_events[i];
+    fprintf(f, "{\"name\": ");
+    trace_print_string(f, e->name);
+    fprintf(f, ", \"cat\": \"beargit\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": ",
+            pid, e->tid);
+    trace_print_us(f, e->start);
+    fprintf(f, ", \"dur\": ");
+    trace_print_us(f, e->duration);
+    if (e->detail) {
+      fprintf(f, ", \"args\": {\"detail\": ");
+      trace_print_string(f, e->detail);
+      fprintf(f, "}");
+    }
+    fprintf(f, "},\n");
+  }
+  pthread_mutex_unlock(&trace_lock);
+
+  trace_write_counters(f, pid, end, "io", 0, TRACE_FIRST_MEMORY_COUNTER);
+  fprintf(f, ",\n");
+  trace_write_counters(f, pid, end, "memory", TRACE_FIRST_MEMORY_COUNTER, TRACE_NUM_COUNTERS);
+  fprintf(f, "\n]}\n");
+  if (f != stderr) {
+    fclose(f);
+  }
+}
+
+/* Turn tracing on if BEARGIT_TRACE is set. The span of <command> starts
+ * now and ends when the process exits, when the trace is written.
+ */
+void trace_init(const char* command) {
+  const char* name = getenv("BEARGIT_TRACE");
+  if (name == NULL || *name == '\0') {
+    return;
+  }
+  trace_filename = name;
+  trace_enabled = 1;
+  trace_span_start(&trace_command, "command");
+  trace_command.detail = command;
+  atexit(trace_write);
+}
@@ -0,0 +1,112 @@
+/**
+ * This file contains utility functions to use in the homework. Do not modify!
+ */
+#ifndef _BEARGIT_UTIL_H_
+#define _BEARGIT_UTIL_H_
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <limits.h>
+#include <openssl/sha.h>
+
+int fake_print(char* fmt, ...);
+int fake_fprint(FILE* stream, char* fmt, ...);
+int is_sane_path(const char* path);
+
+/* In testing mode (initialized with -DTESTING fed to gcc and done automatically
+ * when you run make beargit-unittest), we need to replace printf and fprintf 
+ * with "fakes" that redirect your output to files, which you can read from 
+ * in your testing code.
+ */
+#ifdef TESTING
+#define printf fake_print
+#define fprintf fake_fprint
+#endif
+
+/* fopen() calls are counted for tracing (see trace.h). (fopen)(...) calls
+ * the real one.
+ */
+FILE* fs_fopen(const char* filename, const char* mode);
+#define fopen(filename, mode) fs_fopen(filename, mode)
+
+static const char* path = "";
+static const char* dirname = "";
+static const char* filename = "";
+static const char* src = "";
+static const char* dst = "";
+
+#define PRINT_FILENAME(fn) \
+  if (strlen(fn) > 0) \
+    fprintf(stderr, "  * %s = %s\n", # fn, fn);
+
+#define ASSERT_ERROR_MESSAGE(fn, msg) \
+  if (!(fn)) { \
+    fprintf(stderr, "\n        *** AN ERROR OCCURRED IN %s ***\n\n", __func__); \
+    fprintf(stderr, "  This should not happen. Most likely, you tried to access\n"); \
+    fprintf(stderr, "  or manipulate a file that doesn't exist, or create one\n"); \
+    fprintf(stderr, "  that already does. You should first try to delete the\n"); \
+    fprintf(stderr, "  .beargit directory and start over; maybe a previous run\n"); \
+    fprintf(stderr, "  corrupted it. If not, you need to fix the problem in\n"); \
+    fprintf(stderr, "  your program -- the following error message might give\n"); \
+    fprintf(stderr, "  more information about what went wrong:\n\n"); \
+    fprintf(stderr, "  Error in %s: %s\n\n", __func__, msg); \
+    fprintf(stderr, "  Non-empty variables in scope:\n"); \
+    PRINT_FILENAME(path) \
+    PRINT_FILENAME(dirname) \
+    PRINT_FILENAME(filename) \
+    PRINT_FILENAME(src) \
+    PRINT_FILENAME(dst) \
+    fprintf(stderr, "\n"); \
+    exit(1); \
+  }
+
+void fs_mkdir(const char* dirname);
+void fs_mkdir_parents(const char* path);
+void fs_rm(const char* filename);
+void fs_rm_tree(const char* dirname);
+void fs_force_rm_beargit_dir();
+void fs_mv(const char* src, const char* dst);
+void fs_tmp_mode(int fd);
+void fs_cp(const char* src, const char* dst);
+
+// Copy methods of fs_cp_using(), in the order FS_CP_AUTO tries them
+#define FS_CP_AUTO 0
+#define FS_CP_CLONE 1
+#define FS_CP_RANGE 2
+#define FS_CP_SENDFILE 3
+#define FS_CP_READ_WRITE 4
+
+extern const char* fs_cp_method_names[];
+int fs_cp_using(const char* src, const char* dst, int method);
+void write_string_to_file(const char* filename, const char* str);
+void read_string_from_file(const char* filename, char* str, int size);
+unsigned char* fs_read_file(const char* filename, size_t* size);
+
+// Files at least this large are mapped by fs_view_open(); smaller ones
+// are cheaper to read.
+#define FS_VIEW_MMAP_MIN (16 << 10)
+
+// A read-only view of the contents of a file
+struct fs_view {
+  const char* data;
+  size_t size;
+  // Length of the mapping at <data>, or 0 if <data> was read into memory
+  size_t mapped;
+};
+
+int fs_view_open(const char* filename, struct fs_view* v);
+void fs_view_close(struct fs_view* v);
+int fs_view_line(const struct fs_view* v, size_t* off, const char** line, size_t* len);
+size_t fs_view_strlen(const struct fs_view* v);
+int fs_check_dir_exists(const char* dirname);
+
+#define SHA_HEX_BYTES (SHA_DIGEST_LENGTH * 2)
+
+void cryptohash(const char* str, char dst[SHA_HEX_BYTES + 1]);
+void cryptohash_file(const char* filename, char dst[SHA_HEX_BYTES + 1]);
+
+#endif // _BEARGIT_UTIL_H_
@@ -1,10 +1,28 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <dirent.h>
+#include <regex.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
 #include "beargit.h"
+#include "bloom.h"
+#include "commit.h"
+#include "gc.h"
+#include "graph.h"
+#include "hash.h"
+#include "index.h"
+#include "manifest.h"
+#include "object.h"
+#include "pack.h"
+#include "refs.h"
+#include "search.h"
+#include "trace.h"
+#include "txn.h"
+#include "pool.h"
 #include "util.h"
 
 /* Implementation Notes:
@@ -21,8 +39,10 @@
  *   * fs_cp(src,dst): copy file <src> to <dst>, overwriting <dst> if it exists
  *   * write_string_to_file(filename,str): write <str> to filename (overwriting contents)
  *   * read_string_from_file(filename,str,size): read a string of at most <size> (incl.
- *     NULL character) from file <filename> and store it into <str>. Note that <str>
- *     needs to be large enough to hold that string.
+ *     NULL character) from file <filename> and store it into <str>. A longer string
+ *     is an error rather than being cut off.
+ *   * fs_view_open(filename,view): view the whole file <filename> without copying
+ *     it (mapped if large); walk its lines with fs_view_line()
  *  - You NEED to test your code. The autograder we provide does not contain the
  *    full set of tests that we will run on your code. See "Step 5" in the project spec.
  */
@@ -30,8 +50,10 @@
 /* beargit init
  *
  * - Create .beargit directory
- * - Create empty .beargit/.index file
+ * - Create .beargit/objects directory for the object store
+ * - Create empty .beargit/.index file (see index.h for the format)
  * - Create .beargit/.prev file containing 0..0 commit id
+ * - Create branch master, pointing at the 0..0 commit id (see refs.h)
  *
  * Output (to stdout):
  * - None if successful
@@ -39,15 +61,15 @@
 
 int beargit_init(void) {
   fs_mkdir(".beargit");
+  object_store_init();
 
-  FILE* findex = fopen(".beargit/.index", "w");
-  fclose(findex);
+  struct index idx;
+  index_init(&idx);
+  index_write(&idx);
+  index_free(&idx);
 
-  FILE* fbranches = fopen(".beargit/.branches", "w");
-  fprintf(fbranches, "%s\n", "master");
-  fclose(fbranches);
-
-  write_string_to_file(".beargit/.prev", "0000000000000000000000000000000000000000");
+  refs_update("master", NULL_COMMIT_ID);
+  write_string_to_file(".beargit/.prev", NULL_COMMIT_ID);
   write_string_to_file(".beargit/.current_branch", "master");
 
   return 0;
@@ -55,9 +77,70 @@ int beargit_init(void) {
 
 
 
+/* A growable list of paths, used to collect the files of bulk add/rm. */
+struct path_list {
+  char** paths;
+  int count;
+  int capacity;
+};
+
+static void path_list_append(struct path_list* list, const char* path) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 64;
+    list->paths = realloc(list->paths, list->capacity * sizeof(char*));
+    ASSERT_ERROR_MESSAGE(list->paths != NULL, "out of memory");
+  }
+  list->paths[list->count] = strdup(path);
+  ASSERT_ERROR_MESSAGE(list->paths[list->count] != NULL, "out of memory");
+  list->count++;
+}
+
+static void path_list_free(struct path_list* list) {
+  for (int i = 0; i < list->count; i++) {
+    free(list->paths[i]);
+  }
+  free(list->paths);
+}
+
+static int path_cmp(const void* a, const void* b) {
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/* Append every regular file below directory <dir> to <list>. Files and
+ * directories whose name starts with '.' (including .beargit) are skipped.
+ */
+static void collect_dir_files(const char* dir, struct path_list* list) {
+  DIR* d = opendir(dir);
+  ASSERT_ERROR_MESSAGE(d != NULL, "couldn't open directory");
+
+  struct dirent* de;
+  while ((de = readdir(d)) != NULL) {
+    if (de->d_name[0] == '.') {
+      continue;
+    }
+
+    char path[PATH_MAX];
+    int len = strcmp(dir, ".") == 0
+        ? snprintf(path, sizeof(path), "%s", de->d_name)
+        : snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+    ASSERT_ERROR_MESSAGE(len < PATH_MAX, "path too long");
+
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+      continue;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      collect_dir_files(path, list);
+    } else if (S_ISREG(st.st_mode)) {
+      path_list_append(list, path);
+    }
+  }
+  closedir(d);
+}
+
 /* beargit add <filename>
  *
- * - Append filename to list in .beargit/.index if it isn't in there yet
+ * - Add filename to .beargit/.index if it isn't in there yet
  *
  * Possible errors (to stderr):
  * >> ERROR:  File <filename> has already been added.
@@ -67,28 +150,54 @@ int beargit_init(void) {
  */
 
 int beargit_add(const char* filename) {
-  FILE* findex = fopen(".beargit/.index", "r");
-  FILE *fnewindex = fopen(".beargit/.newindex", "w");
-
-  char line[FILENAME_SIZE];
-  while(fgets(line, sizeof(line), findex)) {
-    strtok(line, "\n");
-    if (strcmp(line, filename) == 0) {
-      fprintf(stderr, "ERROR:  File %s has already been added.\n", filename);
-      fclose(findex);
-      fclose(fnewindex);
-      fs_rm(".beargit/.newindex");
-      return 3;
+  return beargit_add_paths(1, &filename);
+}
+
+/* beargit add <path>... [--stdin]
+ *
+ * - Add every given file to .beargit/.index. Directories are added
+ *   recursively; files inside them that are already tracked are skipped.
+ * - The index is loaded and written once, no matter how many paths are
+ *   given. If any path fails, the index is left unchanged.
+ *
+ * Possible errors (to stderr):
+ * >> ERROR:  File <filename> has already been added.
+ *
+ * Output (to stdout):
+ * - None if successful
+ */
+
+int beargit_add_paths(int count, const char** paths) {
+  struct index idx;
+  index_load(&idx);
+
+  struct path_list found = { NULL, 0, 0 };
+  for (int i = 0; i < count; i++) {
+    struct stat st;
+    if (lstat(paths[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+      collect_dir_files(paths[i], &found);
+      continue;
     }
 
-    fprintf(fnewindex, "%s\n", line);
+    if (index_find(&idx, paths[i])) {
+      fprintf(stderr, "ERROR:  File %s has already been added.\n", paths[i]);
+      path_list_free(&found);
+      index_free(&idx);
+      return 3;
+    }
+    path_list_append(&found, paths[i]);
   }
 
-  fprintf(fnewindex, "%s\n", filename);
-  fclose(findex);
-  fclose(fnewindex);
+  // Adding the new files in order keeps the index sorted whenever they all
+  // sort after the existing entries.
+  qsort(found.paths, found.count, sizeof(char*), path_cmp);
+  for (int i = 0; i < found.count; i++) {
+    index_add(&idx, found.paths[i]);
+  }
 
-  fs_mv(".beargit/.newindex", ".beargit/.index");
+  index_write(&idx);
+  path_list_free(&found);
+  index_free(&idx);
 
   return 0;
 }
@@ -97,6 +206,17 @@ int beargit_add(const char* filename) {
  *
  * See "Step 1" in the project spec.
  *
+ * After the list of tracked files, status reports tracked files whose
+ * contents differ from the last commit and tracked files that no longer
+ * exist:
+ *
+ * Changes since last commit:
+ *
+ *    modified: <filename>
+ *    deleted:  <filename>
+ *
+ * Files are only hashed if their stat data changed since the index last
+ * saw them; the refreshed stat data is written back to the index.
  */
 
 int beargit_status() {
@@ -104,16 +224,52 @@ int beargit_status() {
   int counter = 0;
   fprintf(stdout, "Tracked files:\n\n");
 
-  FILE* findex = fopen(".beargit/.index", "r");
+  struct index idx;
+  index_load(&idx);
 
-  char line[FILENAME_SIZE];
-  while(fgets(line, sizeof(line), findex)) {
-    strtok(line, "\n");
-    fprintf(stdout, "%s\n", line);
+  for (int i = 0; i < idx.count; i++) {
+    fprintf(stdout, "%s\n", idx.entries[i].filename);
     counter += 1;
   }
   fprintf(stdout, "\nThere are %d files total.\n", counter);
-  fclose(findex);
+
+  char commit_id[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", commit_id, COMMIT_ID_SIZE);
+  struct manifest head;
+  manifest_load(commit_id, &head);
+
+  // Under beargit daemon, only files the filesystem monitor saw change are
+  // checked.
+  int monitored = index_fsmonitor_begin(&idx);
+  int changes = 0;
+  for (int i = 0; i < idx.count; i++) {
+    struct index_entry* e = &idx.entries[i];
+    struct manifest_entry* committed = manifest_find(&head, e->filename);
+    const char* change = NULL;
+    int valid = e->flags & INDEX_ENTRY_VALID;
+    int refresh = index_entry_maybe_dirty(e, monitored) ? index_refresh_entry(e) : INDEX_CLEAN;
+    if (refresh == INDEX_REHASHED || (refresh == INDEX_DELETED && valid)) {
+      idx.changed = 1;
+    }
+    if (refresh == INDEX_DELETED) {
+      change = "deleted: ";
+    } else if (committed && strcmp(committed->id, e->id) != 0) {
+      change = "modified:";
+    }
+
+    if (change) {
+      if (!changes++) {
+        fprintf(stdout, "\nChanges since last commit:\n\n");
+      }
+      fprintf(stdout, "   %s %s\n", change, e->filename);
+    }
+  }
+
+  if (idx.changed) {
+    index_write(&idx);
+  }
+  manifest_free(&head);
+  index_free(&idx);
   return 0;
 }
 
@@ -125,30 +281,59 @@ int beargit_status() {
 
 int beargit_rm(const char* filename) {
   /* COMPLETE THE REST */
-  int if_contain = 1;
+  return beargit_rm_paths(1, &filename);
+}
+
+/* beargit rm <path>... [--stdin]
+ *
+ * - Remove every given file from .beargit/.index. A directory removes all
+ *   tracked files below it.
+ * - The index is loaded and written once. If any path is not tracked, the
+ *   index is left unchanged.
+ *
+ * Possible errors (to stderr):
+ * >> ERROR:  File <filename> not tracked.
+ */
 
-  FILE* findex = fopen(".beargit/.index", "r");
-  FILE *fnewindex = fopen(".beargit/.newindex", "w");
+int beargit_rm_paths(int count, const char** paths) {
+  struct index idx;
+  index_load(&idx);
 
-  char line[FILENAME_SIZE];
-  while(fgets(line, sizeof(line), findex)) {
-    strtok(line, "\n");
-    if (strcmp(line,filename) == 0) {
-      if_contain = 0;
-    } else {
-      fprintf(fnewindex, "%s\n", line);
+  struct path_list found = { NULL, 0, 0 };
+  for (int i = 0; i < count; i++) {
+    if (index_find(&idx, paths[i])) {
+      path_list_append(&found, paths[i]);
+      continue;
+    }
+
+    // Not a tracked file; maybe a directory containing tracked files.
+    size_t len = strlen(paths[i]);
+    int matched = 0;
+    for (int j = 0; j < idx.count; j++) {
+      const char* tracked = idx.entries[j].filename;
+      if (strncmp(tracked, paths[i], len) == 0 && tracked[len] == '/') {
+        path_list_append(&found, tracked);
+        matched = 1;
+      }
+    }
+
+    if (!matched) {
+      fprintf(stderr, "ERROR:  File %s not tracked.\n", paths[i]);
+      path_list_free(&found);
+      index_free(&idx);
+      return 1;
     }
-  }
-  if (if_contain == 1) {
-    fprintf(stderr, "ERROR:  File %s not tracked.\n", filename);
   }
 
-  fclose(findex);
-  fclose(fnewindex);
+  for (int i = 0; i < found.count; i++) {
+    index_remove(&idx, found.paths[i]);
+  }
 
-  fs_mv(".beargit/.newindex", ".beargit/.index");
+  index_write(&idx);
+  path_list_free(&found);
+  index_free(&idx);
 
-  return if_contain;
+  return 0;
 }
 
 
@@ -202,6 +387,43 @@ void next_commit_id(char* commit_id) {
   cryptohash(hash, commit_id);
 }
 
+/* The commit snapshot runs as a pipeline over the index entries: the stat
+ * and hash stages refresh the cached object id of every entry, then the
+ * store stage copies contents that aren't in the object store yet. Each
+ * stage is spread over the worker pool (see pool.h); only the per-entry
+ * state is touched by the workers, and the manifest is written afterwards
+ * in index order, so the result is the same as a serial run.
+ */
+
+// Don't start a worker for fewer entries than this
+#define COMMIT_MIN_ENTRIES_PER_JOB 64
+
+struct commit_snapshot {
+  struct index* idx;
+  int* refresh;
+  struct txn* txn;
+  // Whether the filesystem monitor tells which entries may have changed
+  int monitored;
+};
+
+static void commit_refresh_entry(void* arg, int i) {
+  struct commit_snapshot* snap = arg;
+  struct index_entry* e = &snap->idx->entries[i];
+  snap->refresh[i] = index_entry_maybe_dirty(e, snap->monitored)
+                     ? index_refresh_entry(e) : INDEX_CLEAN;
+}
+
+static void commit_store_entry(void* arg, int i) {
+  struct commit_snapshot* snap = arg;
+  struct index_entry* e = &snap->idx->entries[i];
+  if (!(e->flags & INDEX_ENTRY_STORED)) {
+    // Updates e->id if the file was edited after the refresh hashed it.
+    object_store_file(e->filename, e->id, snap->txn);
+    e->flags |= INDEX_ENTRY_STORED;
+    snap->refresh[i] = INDEX_REHASHED;
+  }
+}
+
 int beargit_commit(const char* msg) {
   if (!is_commit_msg_ok(msg)) {
     fprintf(stderr, "ERROR:  Message must contain \"%s\"\n", go_bears);
@@ -215,85 +437,332 @@ int beargit_commit(const char* msg) {
     return 1;
   }
 
+  // Bring the cached object id of every tracked file up to date. Only files
+  // whose stat data changed since they were last hashed are read, and under
+  // beargit daemon only files the filesystem monitor saw change are checked.
+  struct index idx;
+  index_load(&idx);
+  struct commit_snapshot snap = { &idx, calloc(idx.count + 1, sizeof(int)) };
+  ASSERT_ERROR_MESSAGE(snap.refresh != NULL, "out of memory");
+  snap.monitored = index_fsmonitor_begin(&idx);
+  struct trace_span span;
+  trace_begin(&span, "refresh");
+  pool_for(idx.count, COMMIT_MIN_ENTRIES_PER_JOB, commit_refresh_entry, &snap);
+  trace_end(&span);
+  for (int i = 0; i < idx.count; i++) {
+    if (snap.refresh[i] == INDEX_DELETED) {
+      fprintf(stderr, "ERROR:  Tracked file %s does not exist.\n", idx.entries[i].filename);
+      free(snap.refresh);
+      index_free(&idx);
+      return 1;
+    }
+  }
+
   char commit_id[COMMIT_ID_SIZE];
   read_string_from_file(".beargit/.prev", commit_id, COMMIT_ID_SIZE);
   next_commit_id(commit_id);
 
   /* COMPLETE THE REST */
 
+  // The commit is built in a temporary directory and, with its new
+  // objects, only renamed into place once the data is on disk (see txn.h);
+  // the branch and .prev are updated last, so they never name a partially
+  // written commit.
+  struct txn t;
+  txn_begin(&t);
+  snap.txn = &t;
   char folder[COMMIT_ID_SIZE + 9];
-  char index[COMMIT_ID_SIZE + 16];
+  char tmp_folder[] = ".beargit/tmp_commit_XXXXXX";
+  char manifest[COMMIT_ID_SIZE + 19];
   char message[COMMIT_ID_SIZE + 10 + MSG_SIZE];
   char prev[COMMIT_ID_SIZE + 15];
   sprintf(folder, "%s%s", ".beargit/", commit_id);
-  sprintf(index, "%s/.index", folder);
-  sprintf(message, "%s/.msg", folder);
-  sprintf(prev, "%s/.prev", folder);
-  fs_mkdir(folder);
-  fs_cp(".beargit/.index", index);
+  ASSERT_ERROR_MESSAGE(mkdtemp(tmp_folder) != NULL && chmod(tmp_folder, 0755) == 0,
+                       "creating commit directory failed");
+  sprintf(manifest, "%s/.manifest", tmp_folder);
+  sprintf(message, "%s/.msg", tmp_folder);
+  sprintf(prev, "%s/.prev", tmp_folder);
   write_string_to_file(message, msg);
   fs_cp(".beargit/.prev", prev);
-  char line[FILENAME_SIZE];
-  FILE *findex = fopen(".beargit/.index", "r");
-  while(fgets(line, sizeof(line), findex)) {
-    strtok(line, "\n");   
-    char file[COMMIT_ID_SIZE + 10 + FILENAME_SIZE];
-    sprintf(file, "%s/%s", folder, line);
-    fs_cp(line, file);
-  }
-  fclose(findex);
-  write_string_to_file(".beargit/.prev", commit_id);
+  txn_add(&t, message);
+  txn_add(&t, prev);
+
+  // Store the contents of each tracked file that isn't in the object store
+  // yet and record its object id in the commit's manifest.
+  trace_begin(&span, "store");
+  pool_for(idx.count, COMMIT_MIN_ENTRIES_PER_JOB, commit_store_entry, &snap);
+  trace_end(&span);
+  trace_begin(&span, "manifest write");
+  FILE *fmanifest = fopen(manifest, "w");
+  for (int i = 0; i < idx.count; i++) {
+    if (snap.refresh[i] != INDEX_CLEAN) {
+      idx.changed = 1;
+    }
+    fprintf(fmanifest, "%s %s\n", idx.entries[i].id, idx.entries[i].filename);
+  }
+  fclose(fmanifest);
+  txn_add(&t, manifest);
+  trace_end(&span);
+  free(snap.refresh);
+
+  // A commit with this id that the commit graph doesn't know was left by a
+  // commit that crashed before updating its branch; nothing refers to it.
+  if (fs_check_dir_exists(folder)) {
+    struct graph g;
+    graph_open(&g);
+    int known = graph_find(&g, commit_id) != GRAPH_NONE;
+    graph_close(&g);
+    ASSERT_ERROR_MESSAGE(!known, "commit already exists");
+    fs_rm_tree(folder);
+  }
+  txn_rename(&t, tmp_folder, folder);
+  if (refs_stage_update(&t, branch, commit_id)) {
+    txn_abort(&t);
+    index_free(&idx);
+    return 1;
+  }
+  txn_write_string(&t, ".beargit/.prev", commit_id);
+  txn_commit(&t);
+
+  if (idx.changed) {
+    index_write(&idx);
+  }
+  index_free(&idx);
+  // The graph is only a cache of the commits; a commit missing from it is
+  // picked up by the next graph_add().
+  trace_begin(&span, "graph update");
+  graph_add(commit_id);
+  trace_end(&span);
+  trace_begin(&span, "search update");
+  search_update();
+  trace_end(&span);
+  trace_begin(&span, "bloom update");
+  bloom_update();
+  trace_end(&span);
+  gc_auto();
   return 0;
 }
 
 
-/* beargit log
+/* beargit log [-n <limit>] [--grep <pattern>] [-- <path>]
  *
  * See "Step 4" in the project spec.
  *
+ * - With --grep, only list the commits whose message matches the POSIX
+ *   extended regular expression <pattern>; -n then limits the matches
+ * - The search index (see search.h) narrows the commits whose message is
+ *   matched against the pattern; patterns it can't help with, and history
+ *   the commit graph doesn't know, are scanned
+ * - With a <path>, only list the commits that added, removed or changed
+ *   that file, or a file below that directory. The changed-path Bloom
+ *   filters (see bloom.h) rule out most commits; the manifests of the
+ *   others are compared with their parent's
+ *
+ * Errors:
+ * - "ERROR:  Invalid pattern <pattern>." if <pattern> doesn't compile
  */
 
-int beargit_log(int limit) {
+static void log_print(const char* commit_id, const char* msg, size_t len) {
+  fprintf(stdout, "commit %s\n   %.*s\n\n", commit_id, (int) len, msg);
+}
+
+// Whether the <len> bytes at <msg> match <re>, or there is no pattern.
+static int log_matches(const regex_t* re, const char* msg, size_t len) {
+  if (!re) {
+    return 1;
+  }
+  regmatch_t range = { 0, len };
+  return regexec(re, msg, 1, &range, REG_STARTEND) == 0;
+}
+
+/* List up to <limit> commits of the history of <head> in graph <g> whose
+ * messages match <re>, newest first, taking the candidates from search <s>.
+ */
+static void log_search(struct graph* g, uint32_t head, const regex_t* re, struct search* s,
+                       int limit) {
+  uint32_t head_generation = graph_generation(g, head);
+  uint32_t pos;
+  for (int n = 0; n < limit && (pos = search_next(s)) != GRAPH_NONE; ) {
+    // Ancestors are older than <head>, and on its line of history.
+    uint32_t generation = pos <= head ? graph_generation(g, pos) : 0;
+    if (pos > head || generation > head_generation
+        || graph_ancestor_at(g, head, generation) != pos) {
+      continue;
+    }
+    char commit_id[COMMIT_ID_SIZE];
+    graph_commit_id(g, pos, commit_id);
+    const char* msg;
+    size_t len;
+    if (graph_msg(g, pos, &msg, &len)) {
+      if (log_matches(re, msg, len)) {
+        log_print(commit_id, msg, len);
+        n++;
+      }
+    } else {
+      struct commit_object c;
+      ASSERT_ERROR_MESSAGE(commit_load(commit_id, &c), "commit is missing");
+      if (log_matches(re, c.msg, c.msg_len)) {
+        log_print(commit_id, c.msg, c.msg_len);
+        n++;
+      }
+      commit_free(&c);
+    }
+  }
+}
+
+// The range of entries of sorted manifest <m> that are <path> or below it
+static void log_path_entries(struct manifest* m, const char* path, int* first, int* last) {
+  size_t len = strlen(path);
+  int lo = 0, hi = m->count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (strcmp(m->entries[mid].filename, path) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  *first = lo;
+  // "<path>" sorts before "<path>/...", but "<path>.c" may come between.
+  for (*last = lo; *last < m->count; (*last)++) {
+    const char* name = m->entries[*last].filename;
+    if (strncmp(name, path, len) != 0) {
+      break;
+    }
+  }
+}
+
+/* Whether commit <commit_id> changed <path> (a file, or a directory) in
+ * its manifest against that of <prev>. The filter of its graph position
+ * <pos>, unless GRAPH_NONE, can rule that out without reading either.
+ */
+static int log_touches(struct bloom* b, uint32_t pos, const struct bloom_key* key,
+                       const char* commit_id, const char* prev, const char* path) {
+  if (pos != GRAPH_NONE && !bloom_maybe(b, pos, key)) {
+    return 0;
+  }
+  struct manifest m, pm;
+  manifest_load(commit_id, &m);
+  manifest_load(prev, &pm);
+  int i, i_end, j, j_end;
+  log_path_entries(&m, path, &i, &i_end);
+  log_path_entries(&pm, path, &j, &j_end);
+  size_t len = strlen(path);
+  int touched = 0;
+  while (!touched && (i < i_end || j < j_end)) {
+    // Skip "<path>.c" and the like, which only share the prefix.
+    if (i < i_end && m.entries[i].filename[len] != '\0' && m.entries[i].filename[len] != '/') {
+      i++;
+    } else if (j < j_end && pm.entries[j].filename[len] != '\0'
+               && pm.entries[j].filename[len] != '/') {
+      j++;
+    } else if (i == i_end || j == j_end) {
+      touched = 1;
+    } else {
+      touched = strcmp(m.entries[i].filename, pm.entries[j].filename) != 0
+                || strcmp(m.entries[i].id, pm.entries[j].id) != 0;
+      i++;
+      j++;
+    }
+  }
+  manifest_free(&m);
+  manifest_free(&pm);
+  return touched;
+}
+
+int beargit_log(int limit, const char* pattern, const char* path) {
   /* COMPLETE THE REST */
   char commit_id[COMMIT_ID_SIZE];
   read_string_from_file(".beargit/.prev", commit_id, COMMIT_ID_SIZE);
-  if(commit_id[0] == '0') {
+  if (strcmp(commit_id, NULL_COMMIT_ID) == 0) {
   	fprintf(stderr, "ERROR:  There are no commits.\n");
   	return 1;
   }
-  char msg[MSG_SIZE];
-  char name[FILENAME_SIZE];
-  while (commit_id[0] != '0') {
-    fprintf(stdout, "commit %s\n", commit_id);
-    sprintf(name, ".beargit/%s/.msg", commit_id);
-    read_string_from_file(name, msg, MSG_SIZE);
-    fprintf(stdout, "   %s", msg);
-    sprintf(name, ".beargit/%s/.prev", commit_id);
-    read_string_from_file(name, commit_id, COMMIT_ID_SIZE);
-    fprintf(stdout, "\n\n");
+  regex_t re;
+  if (pattern && regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+    fprintf(stderr, "ERROR:  Invalid pattern %s.\n", pattern);
+    return 1;
   }
-  return 0;
-}
-
-// This helper function returns the branch number for a specific branch, or
-// returns -1 if the branch does not exist.
-int get_branch_number(const char* branch_name) {
-  FILE* fbranches = fopen(".beargit/.branches", "r");
-
-  int branch_index = -1;
-  int counter = 0;
-  char line[FILENAME_SIZE];
-  while(fgets(line, sizeof(line), fbranches)) {
-    strtok(line, "\n");
-    if (strcmp(line, branch_name) == 0) {
-      branch_index = counter;
+  const regex_t* filter = pattern ? &re : NULL;
+  // "./dir/" is the same path as "dir", and "." is every path.
+  char* clean = NULL;
+  if (path) {
+    while (strncmp(path, "./", 2) == 0) {
+      path += 2;
+    }
+    clean = strdup(path);
+    ASSERT_ERROR_MESSAGE(clean != NULL, "out of memory");
+    for (size_t len = strlen(clean); len > 0 && clean[len - 1] == '/'; len--) {
+      clean[len - 1] = '\0';
     }
-    counter++;
+    path = clean[0] && strcmp(clean, ".") != 0 ? clean : NULL;
   }
 
-  fclose(fbranches);
+  // Walk the commit graph; commits it doesn't know (yet) are read from
+  // the commit itself.
+  struct graph g;
+  graph_open(&g);
+  uint32_t pos = graph_find(&g, commit_id);
+  struct search s;
+  if (pattern && !path && pos != GRAPH_NONE && search_begin(&s, &g, pattern)) {
+    log_search(&g, pos, filter, &s, limit);
+    search_end(&s);
+    limit = 0;
+  }
+  struct bloom b;
+  struct bloom_key key;
+  if (path) {
+    bloom_open(&b);
+    bloom_key(path, strlen(path), &key);
+  }
+  for (int n = 0; n < limit && strcmp(commit_id, NULL_COMMIT_ID) != 0; ) {
+    const char* msg;
+    size_t len;
+    char prev[COMMIT_ID_SIZE];
+    struct commit_object c;
+    int loaded = 0;
+    uint32_t parent = pos == GRAPH_NONE ? GRAPH_NONE : graph_parent(&g, pos);
+    if (pos != GRAPH_NONE && graph_msg(&g, pos, &msg, &len)
+        && (parent == GRAPH_NONE || parent < pos)) {
+      if (parent == GRAPH_NONE) {
+        strcpy(prev, NULL_COMMIT_ID);
+      } else {
+        graph_commit_id(&g, parent, prev);
+      }
+    } else {
+      ASSERT_ERROR_MESSAGE(commit_load(commit_id, &c), "commit is missing");
+      loaded = 1;
+      msg = c.msg;
+      len = c.msg_len;
+      snprintf(prev, COMMIT_ID_SIZE, "%s", c.prev);
+    }
+    if (log_matches(filter, msg, len)
+        && (!path || log_touches(&b, pos, &key, commit_id, prev, path))) {
+      log_print(commit_id, msg, len);
+      n++;
+    }
+    if (loaded) {
+      commit_free(&c);
+    }
+    pos = loaded ? graph_find(&g, prev) : parent;
+    strcpy(commit_id, prev);
+  }
+  if (path) {
+    bloom_close(&b);
+  }
+  free(clean);
+  graph_close(&g);
+  if (pattern) {
+    regfree(&re);
+  }
+  return 0;
+}
 
-  return branch_index;
+// This helper function returns 0 if the branch exists, or -1 if it does
+// not. Branches are no longer numbered; see refs.h.
+int get_branch_number(const char* branch_name) {
+  char commit_id[COMMIT_ID_SIZE];
+  return refs_read(branch_name, commit_id) ? 0 : -1;
 }
 
 /* beargit branch
@@ -303,22 +772,63 @@ int get_branch_number(const char* branch_name) {
  */
 
 int beargit_branch() {
-  /* COMPLETE THE REST */
-  FILE* fbranches = fopen(".beargit/.branches", "r");
+  struct ref* refs;
+  int count = refs_list(&refs);
   char current_branch[BRANCHNAME_SIZE];
   read_string_from_file(".beargit/.current_branch", current_branch, BRANCHNAME_SIZE);
-  char size[FILENAME_SIZE];
-  while(fgets(size, sizeof(size), fbranches)) {
-  	strtok(size, "\n");
-  	if (strcmp(size, current_branch) == 0) {
-  		fprintf(stdout, "*  "); 
-  	} else {
-  		fprintf(stdout, "   ");
-  	}
-  	fprintf(stdout, "%s\n", size);
+  for (int i = 0; i < count; i++) {
+    if (strcmp(refs[i].name, current_branch) == 0) {
+      fprintf(stdout, "*  ");
+    } else {
+      fprintf(stdout, "   ");
+    }
+    fprintf(stdout, "%s\n", refs[i].name);
   }
-  fclose(fbranches);
-  return 0;  	
+  free(refs);
+  return 0;
+}
+
+/* beargit branch -d <name>
+ *
+ * - Delete branch <name>. The commits of the branch stay in the repository.
+ *
+ * Output (to stdout):
+ * - None if successful
+ *
+ * Errors (to stderr):
+ * - "ERROR:  No branch <name> exists." if there is no such branch
+ * - "ERROR:  Cannot delete the current branch <name>." if on that branch
+ */
+
+int beargit_branch_delete(const char* name) {
+  char current_branch[BRANCHNAME_SIZE];
+  read_string_from_file(".beargit/.current_branch", current_branch, BRANCHNAME_SIZE);
+  if (get_branch_number(name) == -1) {
+    fprintf(stderr, "ERROR:  No branch %s exists.\n", name);
+    return 1;
+  }
+  if (strcmp(name, current_branch) == 0) {
+    fprintf(stderr, "ERROR:  Cannot delete the current branch %s.\n", name);
+    return 1;
+  }
+  return refs_delete(name);
+}
+
+/* beargit pack-refs
+ *
+ * - Move all loose refs into .beargit/packed-refs (see refs.h)
+ *
+ * Output (to stdout):
+ * - "Packed <n> refs."
+ */
+
+int beargit_pack_refs(void) {
+  int packed = refs_pack();
+  if (packed < 0) {
+    return 1;
+  }
+  fprintf(stdout, "Packed %d refs.\n", packed);
+  return 0;
 }
 
 /* beargit checkout
@@ -327,69 +837,106 @@ int beargit_branch() {
  *
  */
 
+/* Checkout compares the manifest of HEAD, the manifest of the target
+ * commit and the index, and only writes the files that differ:
+ *
+ * - A file of the target commit is written unless the working copy
+ *   already has its contents (checked through the index's stat cache, so
+ *   unchanged files aren't even read).
+ * - A tracked file that isn't in the target commit is deleted if it is
+ *   unmodified since HEAD; otherwise it stays on disk, untracked.
+ * - The target commit's files become the index, which is written once.
+ */
+
+// Delete <filename> and any parent directories this leaves empty.
+static void checkout_remove_file(const char* filename) {
+  fs_rm(filename);
+  char dir[strlen(filename) + 1];
+  strcpy(dir, filename);
+  char* slash;
+  while ((slash = strrchr(dir, '/')) != NULL) {
+    *slash = '\0';
+    if (rmdir(dir) != 0) {
+      break;
+    }
+  }
+}
+
 int checkout_commit(const char* commit_id) {
-  FILE *file_index = fopen(".beargit/.index", "r");
-  char l1[FILENAME_SIZE];
-  int result = strcmp(commit_id, "0000000000000000000000000000000000000000");
-  char file_name[FILENAME_SIZE];
-  char new[2000] = ".beargit/";
-  int flag = 1;  
-  for(int i = 0; fgets(l1, sizeof(l1), file_index); i++) {
-    strtok(l1, "\n");
-    beargit_rm(l1);  
-  }
-
-  if(result == 0) {
-    write_string_to_file(".beargit/.prev", commit_id);
-    return 0;
-  } else {
-    FILE *file_new_index = fopen(".beargit/.index", "r");
-    fs_cp(strcat(strcat(new,commit_id), "/.index"), ".beargit/.index");
-    for(int j = 0; fgets(file_name, sizeof(file_name), file_new_index); j++) {
-      if (flag == 1) {
-        strtok(file_name, "\n");
-        char copy[2000] = ".beargit/";
-        fs_cp(strcat(strcat(strcat(copy,commit_id), "/"), file_name), file_name);        
-      } else {
-        int nothing = 0;
+  char head_id[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", head_id, COMMIT_ID_SIZE);
+
+  struct manifest head, target;
+  struct index idx;
+  struct trace_span span;
+  trace_begin(&span, "manifest load");
+  manifest_load(head_id, &head);
+  manifest_load(commit_id, &target);
+  trace_end(&span);
+  index_load(&idx);
+
+  trace_begin(&span, "checkout files");
+  for (int j = 0; j < target.count; j++) {
+    struct manifest_entry* t = &target.entries[j];
+    struct index_entry* e = index_find(&idx, t->filename);
+    if (e) {
+      int refresh = index_refresh_entry(e);
+      if (refresh == INDEX_REHASHED) {
+        idx.changed = 1;
       }
+      if (refresh != INDEX_DELETED && strcmp(e->id, t->id) == 0) {
+        continue;
+      }
+    } else {
+      e = index_add(&idx, t->filename);
+    }
+    manifest_checkout(&target, t, t->filename);
+    index_entry_checked_out(&idx, e, t->id);
+  }
 
+  // Tracked files the target commit doesn't have.
+  struct path_list removed = { NULL, 0, 0 };
+  for (int i = 0; i < idx.count; i++) {
+    if (!manifest_find(&target, idx.entries[i].filename)) {
+      path_list_append(&removed, idx.entries[i].filename);
     }
-    fclose(file_new_index); 
   }
+  for (int i = 0; i < removed.count; i++) {
+    struct index_entry* e = index_find(&idx, removed.paths[i]);
+    struct manifest_entry* h = manifest_find(&head, removed.paths[i]);
+    if (h && index_refresh_entry(e) != INDEX_DELETED && strcmp(e->id, h->id) == 0) {
+      checkout_remove_file(removed.paths[i]);
+    }
+    index_remove(&idx, removed.paths[i]);
+    idx.changed = 1;
+  }
+  trace_end(&span);
+
+  if (idx.changed) {
+    index_write(&idx);
+  }
+  path_list_free(&removed);
+  index_free(&idx);
+  manifest_free(&head);
+  manifest_free(&target);
 
-  fclose(file_index);
   write_string_to_file(".beargit/.prev", commit_id);
   return 0;
 }
 
 int is_it_a_commit_id(const char* commit_id) {
   /* COMPLETE THE REST */
-    char commit_dir[FILENAME_SIZE];
-    sprintf(commit_dir, ".beargit/%s", commit_id);
-    if (fs_check_dir_exists(commit_dir)) {
-      return 1;
-    } else {
-      return 0;
-    }
+    return commit_exists(commit_id);
 }
 
 int beargit_checkout(const char* arg, int new_branch) {
-  // Get the current branch
-  char current_branch[BRANCHNAME_SIZE];
-  read_string_from_file(".beargit/.current_branch", current_branch, BRANCHNAME_SIZE);
-
-  // If not detached, leave the current branch by storing the current HEAD into that branch's file...
-  if (strlen(current_branch)) {
-    char current_branch_file[BRANCHNAME_SIZE+50];
-    sprintf(current_branch_file, ".beargit/.branch_%s", current_branch);
-    fs_cp(".beargit/.prev", current_branch_file);
-  }
+  // The current branch's ref is moved by every commit, so leaving it
+  // needs no update.
 
    // Check whether the argument is a commit ID. If yes, we just change to detached mode
   // without actually having to change into any other branch.
   if (is_it_a_commit_id(arg)) {
-    char commit_dir[FILENAME_SIZE] = ".beargit/";
+    char commit_dir[PATH_MAX] = ".beargit/";
     strcat(commit_dir, arg);
     // ...and setting the current branch to none (i.e., detached).
     write_string_to_file(".beargit/.current_branch", "");
@@ -399,8 +946,9 @@ int beargit_checkout(const char* arg, int new_branch) {
 
 
 
-  // Read branches file (giving us the HEAD commit id for that branch).
-  int branch_exists = (get_branch_number(arg) >= 0);
+  // Read the branch's ref (giving us the HEAD commit id for that branch).
+  char branch_head_commit_id[COMMIT_ID_SIZE];
+  int branch_exists = refs_read(arg, branch_head_commit_id);
 
   // Check for errors.
   if (!(!branch_exists || !new_branch)) {
@@ -409,29 +957,29 @@ int beargit_checkout(const char* arg, int new_branch) {
   } else if (!branch_exists && !new_branch) {
     fprintf(stderr, "ERROR:  No branch or commit %s exists.\n", arg);
     return 1;
+  } else if (new_branch && !refs_check_name(arg)) {
+    fprintf(stderr, "ERROR:  Invalid branch name %s.\n", arg);
+    return 1;
+  }
+  char conflict[BRANCHNAME_SIZE];
+  if (new_branch && refs_find_conflict(arg, conflict)) {
+    fprintf(stderr, "ERROR:  Branch %s conflicts with existing branch %s.\n", arg, conflict);
+    return 1;
   }
 
   // Just a better name, since we now know the argument is a branch name.
   const char* branch_name = arg;
 
-  // File for the branch we are changing into.
-  char branch_file[BRANCHNAME_SIZE+50] = ".beargit/.branch_"; 
-  strcat(branch_file, branch_name);
-
-  // Update the branch file if new branch is created (now it can't go wrong anymore)
+  // Create the branch at HEAD if requested (now it can only fail on a lock)
   if (new_branch) {
-    FILE* fbranches = fopen(".beargit/.branches", "a");
-    fprintf(fbranches, "%s\n", branch_name);
-    fclose(fbranches);
-    fs_cp(".beargit/.prev", branch_file); 
+    read_string_from_file(".beargit/.prev", branch_head_commit_id, COMMIT_ID_SIZE);
+    if (refs_update(branch_name, branch_head_commit_id)) {
+      return 1;
+    }
   }
 
   write_string_to_file(".beargit/.current_branch", branch_name);
 
-  // Read the head commit ID of this branch.
-  char branch_head_commit_id[COMMIT_ID_SIZE];
-  read_string_from_file(branch_file, branch_head_commit_id, COMMIT_ID_SIZE);
-
   // Check out the actual commit.
   return checkout_commit(branch_head_commit_id);
 }
@@ -448,111 +996,426 @@ int beargit_reset(const char* commit_id, const char* filename) {
       return 1;
   }
 
-  // Check if the file is in the commit directory
-  char path[COMMIT_ID_SIZE + 50];
-  char c_index[COMMIT_ID_SIZE + 50];
-  sprintf(path, ".beargit/%s", commit_id);
-  sprintf(c_index, "%s/.index", path);
-  int check = 0;
-  char line[FILENAME_SIZE];
-  FILE *index = fopen(".beargit/.index", "r");
-  while(fgets(line, sizeof(line), index)) {
-    strtok(line, "\n");
-    if (!strcmp(line, filename)) {
-      check = 1;
-      break;
-    }
-  }
-  fclose(index);
-
-  if (!check) {
+  // Check if the file is in the commit's manifest
+  struct manifest m;
+  manifest_load(commit_id, &m);
+  struct manifest_entry* entry = manifest_find(&m, filename);
+  if (!entry) {
     fprintf(stderr, "ERROR:  %s is not in the index of commit %s.\n", filename, commit_id);
+    manifest_free(&m);
     return 1;
-  }   
-
-  // Copy the file to the current working directory
-  char file[COMMIT_ID_SIZE + 50];
-  sprintf(file, "%s/%s", path, filename);
-  fs_cp(file, filename);
-
-  // Add the file if it wasn't already there
-  index = fopen(".beargit/.index", "w");
-  while(fgets(line, sizeof(line), index)) {
-    strtok(line, "\n");
-    if (!strcmp(line, filename)) {
-      check = 1;
-      break;
-    }
-  }   
-  if (!check) {
-    fprintf(index, "%s\n", filename);
   }
-  fclose(index);
+
+  // Copy the file to the current working directory and add it to the
+  // index if it wasn't already there
+  struct index idx;
+  index_load(&idx);
+  manifest_checkout(&m, entry, filename);
+  index_entry_checked_out(&idx, index_add(&idx, filename), entry->id);
+  index_write(&idx);
+  index_free(&idx);
+  manifest_free(&m);
   return 0;
 }
 
+// Store the commit id <arg> names, a commit id or a branch, in
+// <commit_id>. Returns 1 if it names neither.
+static int resolve_commit(const char* arg, char commit_id[COMMIT_ID_SIZE]) {
+  if (is_it_a_commit_id(arg)) {
+    snprintf(commit_id, COMMIT_ID_SIZE, "%s", arg);
+    return 0;
+  }
+  return !refs_read(arg, commit_id);
+}
+
 /* beargit merge
  *
  * See "Step 8" in the project spec.
  *
+ * The merge is three-way: every path is compared between the merge base
+ * (the newest commit both HEAD and the merged commit descend from), the
+ * working copy as tracked by the index ("ours") and the merged commit
+ * ("theirs"):
+ *
+ * - Unchanged on one side: the other side's version wins. A new file of
+ *   theirs is "added", a changed one "updated", and a file they deleted
+ *   is "removed" (untracked, and deleted if it is unmodified).
+ * - The same on both sides: nothing to do.
+ * - Changed differently on both sides: their version is written to
+ *   <file>.<commit_id> as a "conflicted copy".
+ *
+ * The base and theirs are walked together in filename order; ours is
+ * looked up in the index's hash table. The index is written once.
  */
 
 int beargit_merge(const char* arg) {
   // Get the commit_id or throw an error
   char commit_id[COMMIT_ID_SIZE];
-  if (!is_it_a_commit_id(arg)) {
-      if (get_branch_number(arg) == -1) {
-            fprintf(stderr, "ERROR:  No branch or commit %s exists.\n", arg);
-            return 1;
+  if (resolve_commit(arg, commit_id)) {
+      fprintf(stderr, "ERROR:  No branch or commit %s exists.\n", arg);
+      return 1;
+  }
+
+  // Nothing to do if the commit is already part of our history.
+  char head_id[COMMIT_ID_SIZE];
+  char base_id[COMMIT_ID_SIZE] = NULL_COMMIT_ID;
+  read_string_from_file(".beargit/.prev", head_id, COMMIT_ID_SIZE);
+  if (graph_is_ancestor(commit_id, head_id)) {
+    return 0;
+  }
+  graph_merge_base(head_id, commit_id, base_id);
+
+  struct manifest base, theirs;
+  struct index idx;
+  manifest_load(base_id, &base);
+  manifest_load(commit_id, &theirs);
+  index_load(&idx);
+
+  int i = 0, j = 0;
+  while (i < base.count || j < theirs.count) {
+    int cmp = i == base.count ? 1 : j == theirs.count ? -1
+              : strcmp(base.entries[i].filename, theirs.entries[j].filename);
+    struct manifest_entry* o = cmp <= 0 ? &base.entries[i++] : NULL;
+    struct manifest_entry* t = cmp >= 0 ? &theirs.entries[j++] : NULL;
+    const char* file = o ? o->filename : t->filename;
+
+    // Our version; a tracked file that is gone from disk matches nothing.
+    struct index_entry* e = index_find(&idx, file);
+    const char* ours = NULL;
+    if (e) {
+      int refresh = index_refresh_entry(e);
+      idx.changed |= refresh == INDEX_REHASHED;
+      ours = refresh == INDEX_DELETED ? "" : e->id;
+    }
+
+    if (t && ours && strcmp(ours, t->id) == 0) {
+      continue;
+    } else if (!t) {
+      // Deleted by them; if we changed it, our version stays.
+      if (ours && strcmp(ours, o->id) == 0) {
+        checkout_remove_file(file);
+        index_remove(&idx, file);
+        idx.changed = 1;
+        fprintf(stdout, "%s removed\n", file);
+      }
+    } else if (o && strcmp(o->id, t->id) == 0) {
+      // Only we changed (or deleted) it.
+      continue;
+    } else if (!ours && !o) {
+      manifest_checkout(&theirs, t, file);
+      index_entry_checked_out(&idx, index_add(&idx, file), t->id);
+      fprintf(stdout, "%s added\n", file);
+    } else if (ours && o && strcmp(ours, o->id) == 0) {
+      manifest_checkout(&theirs, t, file);
+      index_entry_checked_out(&idx, e, t->id);
+      fprintf(stdout, "%s updated\n", file);
+    } else {
+      char conflict[strlen(file) + COMMIT_ID_SIZE + 2];
+      sprintf(conflict, "%s.%s", file, commit_id);
+      manifest_checkout(&theirs, t, conflict);
+      fprintf(stdout, "%s conflicted copy created\n", file);
+    }
+  }
+
+  if (idx.changed) {
+    index_write(&idx);
+  }
+  index_free(&idx);
+  manifest_free(&base);
+  manifest_free(&theirs);
+  return 0;
+}
+
+/* beargit merge-base
+ *
+ * - Find the newest commit that both <arg1> and <arg2> (commit ids or
+ *   branch names) descend from
+ * - With is_ancestor set, only check whether <arg1> is <arg2> or one of
+ *   its ancestors, and report the answer through the return value
+ *
+ * Output (to stdout):
+ * - The commit id of the merge base
+ *
+ * Errors:
+ * - "ERROR:  No branch or commit <arg> exists." for an unknown argument
+ * - "ERROR:  <arg1> and <arg2> have no common ancestor." if their
+ *   histories don't meet
+ */
+
+int beargit_merge_base(const char* arg1, const char* arg2, int is_ancestor) {
+  char a[COMMIT_ID_SIZE], b[COMMIT_ID_SIZE];
+  if (resolve_commit(arg1, a) || resolve_commit(arg2, b)) {
+    fprintf(stderr, "ERROR:  No branch or commit %s exists.\n",
+            resolve_commit(arg1, a) ? arg1 : arg2);
+    return 1;
+  }
+
+  if (is_ancestor) {
+    return !graph_is_ancestor(a, b);
+  }
+
+  char base[COMMIT_ID_SIZE];
+  if (!graph_merge_base(a, b, base)) {
+    fprintf(stderr, "ERROR:  %s and %s have no common ancestor.\n", arg1, arg2);
+    return 1;
+  }
+  fprintf(stdout, "%s\n", base);
+  return 0;
+}
+
+/* beargit repack
+ *
+ * - Collect every commit reachable from a branch or from HEAD, and every
+ *   object those commits reference
+ * - Write them into a single new packfile (see pack.h), delta-encoding
+ *   versions of the same file against each other
+ * - Delete the loose objects, commit directories and old packs that are
+ *   now in the new pack
+ *
+ * Output (to stdout):
+ * - "Packed <n> commits and <m> objects (<d> deltas) into pack-<sha>."
+ * - "Nothing to pack." if there are no commits
+ */
+
+// Set of object ids, to visit shared history and objects only once
+struct id_set {
+  char (*ids)[OBJECT_ID_SIZE];
+  int count;
+  int* table;
+  int table_size;
+};
+
+static unsigned int id_hash(const char* id) {
+  char prefix[9];
+  snprintf(prefix, sizeof(prefix), "%s", id);
+  return strtoul(prefix, NULL, 16);
+}
+
+static int id_set_add(struct id_set* set, const char* id) {
+  if (2 * (set->count + 1) > set->table_size) {
+    int size = set->table_size ? set->table_size * 2 : 1024;
+    int* table = malloc(size * sizeof(int));
+    set->ids = realloc(set->ids, size / 2 * sizeof(*set->ids));
+    ASSERT_ERROR_MESSAGE(table != NULL && set->ids != NULL, "out of memory");
+    memset(table, 0xff, size * sizeof(int));
+    for (int i = 0; i < set->count; i++) {
+      unsigned int slot = id_hash(set->ids[i]) & (size - 1);
+      for (; table[slot] != -1; slot = (slot + 1) & (size - 1)) {
+      }
+      table[slot] = i;
+    }
+    free(set->table);
+    set->table = table;
+    set->table_size = size;
+  }
+
+  unsigned int slot = id_hash(id) & (set->table_size - 1);
+  for (; set->table[slot] != -1;
+       slot = (slot + 1) & (set->table_size - 1)) {
+    if (strcmp(set->ids[set->table[slot]], id) == 0) {
+      return 0;
+    }
+  }
+  set->table[slot] = set->count;
+  snprintf(set->ids[set->count++], OBJECT_ID_SIZE, "%s", id);
+  return 1;
+}
+
+static void id_set_free(struct id_set* set) {
+  free(set->ids);
+  free(set->table);
+}
+
+struct repack_list {
+  struct pack_object* objects;
+  int count;
+  int capacity;
+};
+
+static struct pack_object* repack_list_append(struct repack_list* list) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 64;
+    list->objects = realloc(list->objects, list->capacity * sizeof(struct pack_object));
+    ASSERT_ERROR_MESSAGE(list->objects != NULL, "out of memory");
+  }
+  struct pack_object* o = &list->objects[list->count];
+  memset(o, 0, sizeof(struct pack_object));
+  o->order = list->count++;
+  return o;
+}
+
+/* Add commit <commit_id> and its ancestors, and all objects they
+ * reference, to <list>, stopping at commits that are already in <seen>.
+ */
+static void repack_walk(const char* commit_id, struct id_set* seen, struct repack_list* list,
+                        int* commits) {
+  char id[COMMIT_ID_SIZE];
+  snprintf(id, COMMIT_ID_SIZE, "%s", commit_id);
+  while (strcmp(id, NULL_COMMIT_ID) != 0 && commit_exists(id) && id_set_add(seen, id)) {
+    struct manifest m;
+    manifest_load(id, &m);
+    for (int i = 0; i < m.count; i++) {
+      // Chunked objects stay loose (see object.h).
+      if (!id_set_add(seen, m.entries[i].id) || object_is_chunked(m.entries[i].id)) {
+        continue;
       }
-      char branch_file[FILENAME_SIZE];
-      snprintf(branch_file, FILENAME_SIZE, ".beargit/.branch_%s", arg);
-      read_string_from_file(branch_file, commit_id, COMMIT_ID_SIZE);
-  } else {
-      snprintf(commit_id, COMMIT_ID_SIZE, "%s", arg);
-  }
-
-  // Iterate through each line of the commit_id index and determine how you
-  // should copy the index file over
-   /* COMPLETE THE REST */
-  char commit_path[COMMIT_ID_SIZE + 50];
-  char index_path[COMMIT_ID_SIZE + 50];
-  sprintf(commit_path, ".beargit/%s", commit_id);
-  sprintf(index_path, "%s/.index", commit_path);
-
-  FILE *commit_index = fopen(index_path, "r");
-  char file1[FILENAME_SIZE];
-  while(fgets(file1, sizeof(file1), commit_index)) {
-    strtok(file1, "\n");
-    int check = 0;
-
-    char conflict[FILENAME_SIZE + COMMIT_ID_SIZE + 50];
-    sprintf(conflict, "%s.%s", file1, commit_id);
-    char src[FILENAME_SIZE + COMMIT_ID_SIZE + 50];
-    sprintf(src, "%s/%s", commit_path, file1);
-
-    char file2[FILENAME_SIZE];
-    FILE *index = fopen(".beargit/.index", "r");
-    while (fgets(file2, sizeof(file2), index)) {
-      strtok(file2, "\n");
-      if (strcmp(file1, file2) == 0) {
-        check = 1;
-        fs_cp(src, conflict);
-        fprintf(stdout, "%s conflicted copy created\n", file1);
-        break;
+      struct pack_object* o = repack_list_append(list);
+      snprintf(o->id, OBJECT_ID_SIZE, "%s", m.entries[i].id);
+      o->type = PACK_OBJ_BLOB;
+      o->name = strdup(m.entries[i].filename);
+      if (m.legacy) {
+        char source[COMMIT_ID_SIZE + strlen(m.entries[i].filename) + 10];
+        sprintf(source, ".beargit/%s/%s", id, m.entries[i].filename);
+        o->source = strdup(source);
       }
     }
-    fclose(index);
 
-    if (!check) {
-      fs_cp(src, file1);
-      index = fopen(".beargit/.index", "a");
-      fprintf(index, "%s\n", file1);
-      fclose(index);
-      fprintf(stdout, "%s added\n", file1);
+    struct pack_object* o = repack_list_append(list);
+    int order = o->order;
+    commit_pack(id, &m, o);
+    o->order = order;
+    (*commits)++;
+    manifest_free(&m);
+
+    struct commit_object c;
+    ASSERT_ERROR_MESSAGE(commit_load(id, &c), "commit is missing");
+    snprintf(id, COMMIT_ID_SIZE, "%s", c.prev);
+    commit_free(&c);
+  }
+}
+
+int beargit_repack(void) {
+  struct id_set seen;
+  struct repack_list list;
+  memset(&seen, 0, sizeof(seen));
+  memset(&list, 0, sizeof(list));
+  int commits = 0;
+
+  char head[COMMIT_ID_SIZE];
+  read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+  repack_walk(head, &seen, &list, &commits);
+
+  struct ref* refs;
+  int num_refs = refs_list(&refs);
+  for (int i = 0; i < num_refs; i++) {
+    repack_walk(refs[i].id, &seen, &list, &commits);
+  }
+  free(refs);
+
+  if (commits == 0) {
+    fprintf(stdout, "Nothing to pack.\n");
+    id_set_free(&seen);
+    return 0;
+  }
+
+  char** old_packs;
+  int num_old_packs = pack_list(&old_packs);
+  char name[OBJECT_ID_SIZE];
+  struct pack_stats stats;
+  pack_write(list.objects, list.count, name, &stats);
+
+  // Everything reachable is in the new pack now; drop the loose copies.
+  for (int i = 0; i < list.count; i++) {
+    struct pack_object* o = &list.objects[i];
+    char path[OBJECT_PATH_SIZE + COMMIT_ID_SIZE];
+    struct stat st;
+    if (o->type == PACK_OBJ_COMMIT) {
+      sprintf(path, ".beargit/%s", o->id);
+      if (fs_check_dir_exists(path)) {
+        fs_rm_tree(path);
+      }
+    } else {
+      object_path(o->id, path);
+      if (stat(path, &st) == 0) {
+        fs_rm(path);
+      }
+    }
+    free((char*) o->name);
+    free((char*) o->source);
+    free(o->data);
+  }
+  // Empty fan-out directories stay, as in beargit gc: a concurrent commit
+  // may be about to rename an object into one.
+  for (int i = 0; i < num_old_packs; i++) {
+    if (strcmp(old_packs[i], name) != 0) {
+      char path[sizeof(PACK_DIR) + OBJECT_ID_BYTES + 16];
+      sprintf(path, "%s/pack-%s.idx", PACK_DIR, old_packs[i]);
+      fs_rm(path);
+      sprintf(path, "%s/pack-%s.pack", PACK_DIR, old_packs[i]);
+      fs_rm(path);
     }
+    free(old_packs[i]);
+  }
+  free(old_packs);
+  pack_reload();
+
+  fprintf(stdout, "Packed %d commits and %d objects (%d deltas) into pack-%s.\n",
+          commits, stats.objects - commits, stats.deltas, name);
+  free(list.objects);
+  id_set_free(&seen);
+  return 0;
+}
+
+/* beargit gc [--grace <seconds>] [--budget <ms>]
+ *
+ * - Delete the loose commits and objects that no branch, HEAD or the index
+ *   reaches, and the temporary files of interrupted commands (see gc.h)
+ * - Keep anything modified less than <seconds> ago (default: 14 days)
+ * - With --budget, run incrementally in about <ms> milliseconds, sweeping
+ *   only part of the object store
+ *
+ * Output (to stdout):
+ * - "Removed <c> commits, <o> objects and <t> temporary files (<m> reachable)."
+ *
+ * Errors:
+ * - "ERROR:  Another beargit gc is running." if one holds the gc lock
+ * - "ERROR:  Ran out of time while marking; nothing was removed." if the
+ *   budget is too small to finish the mark phase
+ */
+
+int beargit_gc(long grace, int budget_ms) {
+  struct gc_stats stats;
+  int result = gc_run(grace, budget_ms, &stats);
+  if (result == GC_BUSY) {
+    fprintf(stderr, "ERROR:  Another beargit gc is running.\n");
+    return 1;
+  } else if (result == GC_OUT_OF_TIME) {
+    fprintf(stderr, "ERROR:  Ran out of time while marking; nothing was removed.\n");
+    return 1;
   }
+  fprintf(stdout, "Removed %d commits, %d objects and %d temporary files (%d reachable).\n",
+          stats.commits, stats.objects, stats.temporaries, stats.marked);
+  return 0;
+}
 
-  fclose(commit_index);
+/* beargit hash-object
+ *
+ * - Hash the contents of each given file with SHA-1 (the object id the
+ *   file would get) or SHA-256
+ * - Does not need a repository and doesn't store anything
+ *
+ * Output (to stdout):
+ * - The hex digest of each file, one per line
+ *
+ * Errors:
+ * - "ERROR:  Could not read <file>." if a file can't be read
+ */
+
+int beargit_hash_object(int count, const char** paths, int algo) {
+  for (int i = 0; i < count; i++) {
+    unsigned char raw[HASH_MAX_RAW];
+    char hex[HASH_MAX_HEX + 1];
+    int fd = open(paths[i], O_RDONLY);
+    int ok = fd != -1 && hash_fd(fd, algo, raw);
+    if (fd != -1) {
+      close(fd);
+    }
+    if (!ok) {
+      fprintf(stderr, "ERROR:  Could not read %s.\n", paths[i]);
+      return 1;
+    }
+    hash_to_hex(raw, hash_size(algo), hex);
+    fprintf(stdout, "%s\n", hex);
+  }
   return 0;
 }
@@ -1,15 +1,26 @@
+#ifndef _BEARGIT_H_
+#define _BEARGIT_H_
+
 #include "util.h"
 
 int beargit_init(void);
 int beargit_add(const char* filename);
 int beargit_rm(const char* filename);
+int beargit_add_paths(int count, const char** paths);
+int beargit_rm_paths(int count, const char** paths);
 int beargit_commit(const char* message);
 int beargit_status();
-int beargit_log(int limit);
+int beargit_log(int limit, const char* pattern, const char* path);
 int beargit_branch();
+int beargit_branch_delete(const char* name);
+int beargit_pack_refs(void);
 int beargit_checkout(const char* arg, int new_branch);
 int beargit_reset(const char* commit_id, const char* filename);
 int beargit_merge(const char* arg);
+int beargit_merge_base(const char* arg1, const char* arg2, int is_ancestor);
+int beargit_repack(void);
+int beargit_gc(long grace, int budget_ms);
+int beargit_hash_object(int count, const char** paths, int algo);
 
 // Helper functions
 int get_branch_number(const char* branch_name);
@@ -18,10 +29,14 @@ void next_commit_id(char* commit_id);
 // Number of bytes in a commit id
 #define COMMIT_ID_BYTES SHA_HEX_BYTES
 
+// Commit id of "no commit", the parent of the first commit
+#define NULL_COMMIT_ID "0000000000000000000000000000000000000000"
+
 // Preprocessor macros capturing the maximum size of different  structures
-#define FILENAME_SIZE 512
 #define COMMIT_ID_SIZE (COMMIT_ID_BYTES+1)
 #define MSG_SIZE 512
 
 #define BRANCHNAME_SIZE 128
 #define COMMIT_ID_BRANCH_BYTES 10
+
+#endif // _BEARGIT_H_
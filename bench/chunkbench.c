@@ -0,0 +1,193 @@
+/**
+ * Benchmark of content-defined chunking.
+ *
+ * Usage: chunkbench [-s <size_mb>] [-v <versions>] [-e <edits>] [-i <file>]
+ *
+ * A file of <size_mb> MiB of random data (or <file>) is edited into
+ * <versions> versions, each with <edits> small edits at random places over
+ * the previous one: overwrites, insertions and deletions of up to 64
+ * bytes. Every version is cut into chunks with chunk_next(), and for
+ * reference into fixed CHUNK_AVG blocks, whose cut points an insertion
+ * shifts. One JSON object is printed per method with the throughput of the
+ * cutting alone and with SHA-1 hashing of the chunks, the average chunk
+ * size, and the dedup ratio: bytes of all versions over bytes of distinct
+ * chunks, which is what the object store would hold.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "chunk.h"
+#include "hash.h"
+#include "util.h"
+
+static unsigned long long rng_state = 61;
+
+static unsigned long long rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Distinct chunk ids seen so far, in an open-addressing table where an
+// all-zero id marks a free slot
+struct chunk_set {
+  unsigned char (*ids)[SHA_DIGEST_LENGTH];
+  size_t capacity;
+  size_t count;
+  unsigned long long bytes;
+};
+
+static const unsigned char empty[SHA_DIGEST_LENGTH];
+
+static void chunk_set_add(struct chunk_set* set, const unsigned char* id, size_t size) {
+  if (2 * (set->count + 1) > set->capacity) {
+    struct chunk_set bigger = { NULL, set->capacity ? 2 * set->capacity : 1024, 0, set->bytes };
+    bigger.ids = calloc(bigger.capacity, SHA_DIGEST_LENGTH);
+    ASSERT_ERROR_MESSAGE(bigger.ids != NULL, "out of memory");
+    for (size_t i = 0; i < set->capacity; i++) {
+      if (memcmp(set->ids[i], empty, SHA_DIGEST_LENGTH) != 0) {
+        chunk_set_add(&bigger, set->ids[i], 0);
+      }
+    }
+    free(set->ids);
+    *set = bigger;
+  }
+  size_t slot;
+  memcpy(&slot, id, sizeof(slot));
+  for (slot &= set->capacity - 1; memcmp(set->ids[slot], empty, SHA_DIGEST_LENGTH) != 0;
+       slot = (slot + 1) & (set->capacity - 1)) {
+    if (memcmp(set->ids[slot], id, SHA_DIGEST_LENGTH) == 0) {
+      return;
+    }
+  }
+  memcpy(set->ids[slot], id, SHA_DIGEST_LENGTH);
+  set->count++;
+  set->bytes += size;
+}
+
+static size_t fixed_next(const unsigned char* data, size_t size) {
+  return size < CHUNK_AVG ? size : CHUNK_AVG;
+}
+
+/* Apply <edits> random edits to the <*size> bytes at <data>, which has
+ * room for <capacity> bytes.
+ */
+static void edit(unsigned char* data, size_t* size, size_t capacity, int edits) {
+  for (int e = 0; e < edits; e++) {
+    size_t len = 1 + rng() % 64;
+    size_t at = rng() % (*size - len);
+    int kind = rng() % 3;
+    if (kind == 0) {
+      for (size_t i = 0; i < len; i++) {
+        data[at + i] = rng();
+      }
+    } else if (kind == 1 && *size + len <= capacity) {
+      memmove(data + at + len, data + at, *size - at);
+      for (size_t i = 0; i < len; i++) {
+        data[at + i] = rng();
+      }
+      *size += len;
+    } else {
+      memmove(data + at, data + at + len, *size - at - len);
+      *size -= len;
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  long size_mb = 64;
+  int versions = 10, edits = 20;
+  const char* input = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:v:e:i:")) != -1) {
+    if (opt == 's') {
+      size_mb = atol(optarg);
+    } else if (opt == 'v') {
+      versions = atoi(optarg);
+    } else if (opt == 'e') {
+      edits = atoi(optarg);
+    } else if (opt == 'i') {
+      input = optarg;
+    } else {
+      fprintf(stderr, "Usage: %s [-s <size_mb>] [-v <versions>] [-e <edits>] [-i <file>]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (optind != argc || size_mb <= 0 || versions <= 0 || edits < 0) {
+    fprintf(stderr, "Usage: %s [-s <size_mb>] [-v <versions>] [-e <edits>] [-i <file>]\n", argv[0]);
+    return 2;
+  }
+
+  size_t size;
+  unsigned char* base;
+  if (input) {
+    base = fs_read_file(input, &size);
+  } else {
+    size = (size_t) size_mb << 20;
+    base = malloc(size);
+    ASSERT_ERROR_MESSAGE(base != NULL, "out of memory");
+    for (size_t i = 0; i < size; i++) {
+      base[i] = rng();
+    }
+  }
+  ASSERT_ERROR_MESSAGE(size > 4096, "input is too small");
+  size_t capacity = size + (size_t) versions * edits * 64 + 1;
+  unsigned char* data = malloc(capacity);
+  ASSERT_ERROR_MESSAGE(data != NULL, "out of memory");
+
+  const char* names[] = { "fastcdc", "fixed" };
+  size_t (*methods[])(const unsigned char*, size_t) = { chunk_next, fixed_next };
+  for (int m = 0; m < 2; m++) {
+    memcpy(data, base, size);
+    size_t data_size = size;
+    rng_state = 62;
+    struct chunk_set set = { NULL, 0, 0, 0 };
+    unsigned long long bytes = 0, chunks = 0;
+    double cut = 0, hashed = 0;
+    for (int v = 0; v < versions; v++) {
+      if (v > 0) {
+        edit(data, &data_size, capacity, edits);
+      }
+      double start = now();
+      for (size_t off = 0; off < data_size; ) {
+        off += methods[m](data + off, data_size - off);
+      }
+      cut += now() - start;
+
+      start = now();
+      for (size_t off = 0; off < data_size; chunks++) {
+        size_t len = methods[m](data + off, data_size - off);
+        unsigned char id[SHA_DIGEST_LENGTH];
+        hash_buffer(HASH_SHA1, data + off, len, id);
+        chunk_set_add(&set, id, len);
+        off += len;
+      }
+      hashed += now() - start;
+      bytes += data_size;
+    }
+
+    double mb = (double) bytes / (1 << 20);
+    printf("{\"method\": \"%s\", \"size_mb\": %.1f, \"versions\": %d, \"edits\": %d, "
+           "\"chunks\": %llu, \"avg_chunk\": %llu, \"unique_chunks\": %zu, "
+           "\"stored_mb\": %.1f, \"dedup_ratio\": %.2f, \"cut_mb_per_s\": %.1f, "
+           "\"cut_hash_mb_per_s\": %.1f}\n",
+           names[m], (double) size / (1 << 20), versions, edits, chunks, bytes / chunks,
+           set.count, (double) set.bytes / (1 << 20), (double) bytes / set.bytes,
+           mb / cut, mb / hashed);
+    free(set.ids);
+  }
+  free(data);
+  free(base);
+  return 0;
+}
@@ -0,0 +1,128 @@
+/**
+ * Benchmark of the object codecs.
+ *
+ * Usage: compressbench [-s <size_mb>] [-n <rounds>] [-i <file>] <dir>
+ *
+ * A source file of <size_mb> MiB is generated in <dir> (program-like text
+ * lines built from a small vocabulary), or <file> is used instead. It is
+ * then compressed and decompressed <rounds> times with every codec at every
+ * level, through the same file descriptor streaming object.c uses. One JSON
+ * object is printed per codec and level with the compression ratio and the
+ * throughput of both directions, in MB of uncompressed data per second.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "codec.h"
+#include "util.h"
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char* words[] = {
+  "int", "char*", "return", "if", "else", "for", "while", "struct", "const",
+  "size_t", "static", "void", "NULL", "data", "size", "index", "entry", "id",
+  "path", "commit", "object", "(", ")", "{", "}", ";", "=", "==", "+", "->",
+};
+
+static void make_source(const char* path, long size) {
+  FILE* f = fopen(path, "w");
+  ASSERT_ERROR_MESSAGE(f != NULL, "couldn't create source file");
+  unsigned int seed = 61;
+  long done = 0;
+  while (done < size) {
+    int indent = rand_r(&seed) % 4 * 2;
+    done += fprintf(f, "%*s", indent, "");
+    for (int w = rand_r(&seed) % 10; w >= 0; w--) {
+      done += fprintf(f, "%s ", words[rand_r(&seed) % (sizeof(words) / sizeof(words[0]))]);
+    }
+    done += fprintf(f, "%d\n", rand_r(&seed) % 1000);
+  }
+  fclose(f);
+  ASSERT_ERROR_MESSAGE(truncate(path, size) == 0, "couldn't create source file");
+}
+
+int main(int argc, char** argv) {
+  long size_mb = 64;
+  int rounds = 3;
+  const char* input = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:n:i:")) != -1) {
+    if (opt == 's') {
+      size_mb = atol(optarg);
+    } else if (opt == 'n') {
+      rounds = atoi(optarg);
+    } else if (opt == 'i') {
+      input = optarg;
+    } else {
+      fprintf(stderr, "Usage: %s [-s <size_mb>] [-n <rounds>] [-i <file>] <dir>\n", argv[0]);
+      return 2;
+    }
+  }
+  if (optind + 1 != argc || size_mb <= 0 || rounds <= 0) {
+    fprintf(stderr, "Usage: %s [-s <size_mb>] [-n <rounds>] [-i <file>] <dir>\n", argv[0]);
+    return 2;
+  }
+
+  char src[4096], packed[4096], dst[4096];
+  snprintf(src, sizeof(src), "%s/compressbench.src", argv[optind]);
+  snprintf(packed, sizeof(packed), "%s/compressbench.z", argv[optind]);
+  snprintf(dst, sizeof(dst), "%s/compressbench.dst", argv[optind]);
+  if (!input) {
+    make_source(src, size_mb << 20);
+    input = src;
+  }
+
+  for (int i = 0; i < num_codecs; i++) {
+    const struct codec* c = &codecs[i];
+    for (int level = c->min_level; level <= c->max_level; level++) {
+      uint64_t size = 0;
+      double compress = 0, decompress = 0;
+      for (int r = 0; r < rounds; r++) {
+        int in = open(input, O_RDONLY);
+        int out = open(packed, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ASSERT_ERROR_MESSAGE(in != -1 && out != -1, "couldn't open benchmark files");
+        double start = now();
+        size = c->compress(codec_source_fd, &in, level, codec_sink_fd, &out);
+        compress += now() - start;
+        close(in);
+        close(out);
+
+        in = open(packed, O_RDONLY);
+        out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ASSERT_ERROR_MESSAGE(in != -1 && out != -1, "couldn't open benchmark files");
+        start = now();
+        ASSERT_ERROR_MESSAGE(c->decompress(in, size, codec_sink_fd, &out), "round trip failed");
+        decompress += now() - start;
+        close(in);
+        close(out);
+      }
+
+      struct stat st;
+      ASSERT_ERROR_MESSAGE(stat(packed, &st) == 0, "couldn't stat compressed file");
+      double mb = (double) size * rounds / (1 << 20);
+      printf("{\"codec\": \"%s\", \"level\": %d, \"bytes\": %llu, \"compressed\": %lld, "
+             "\"ratio\": %.3f, \"rounds\": %d, \"compress_mb_per_s\": %.1f, "
+             "\"decompress_mb_per_s\": %.1f}\n",
+             c->name, level, (unsigned long long) size, (long long) st.st_size,
+             st.st_size ? (double) size / st.st_size : 0.0, rounds,
+             mb / compress, mb / decompress);
+    }
+  }
+
+  unlink(packed);
+  unlink(dst);
+  if (input == src) {
+    unlink(src);
+  }
+  return 0;
+}
@@ -0,0 +1,129 @@
+/**
+ * Benchmark of the fs_cp() copy methods.
+ *
+ * Usage: copybench [-s <size_mb>] [-n <copies>] <dir>...
+ *
+ * For every directory (put them on different filesystems, e.g. a tmpfs,
+ * an ext4 and a btrfs or xfs mount) a source file of <size_mb> MiB is
+ * copied <copies> times with each method of fs_cp_using(), plus the old
+ * stdio loop with a 4 KiB buffer for reference. One JSON object is printed
+ * per directory and method.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+
+#include "util.h"
+
+#ifndef XFS_SUPER_MAGIC
+#define XFS_SUPER_MAGIC 0x58465342
+#endif
+
+static const char* fs_type_name(const char* dir) {
+  struct statfs fs;
+  if (statfs(dir, &fs) != 0) {
+    return "unknown";
+  }
+  switch (fs.f_type) {
+    case TMPFS_MAGIC: return "tmpfs";
+    case EXT4_SUPER_MAGIC: return "ext4";
+    case BTRFS_SUPER_MAGIC: return "btrfs";
+    case XFS_SUPER_MAGIC: return "xfs";
+    case NFS_SUPER_MAGIC: return "nfs";
+    case OVERLAYFS_SUPER_MAGIC: return "overlayfs";
+    default: return "other";
+  }
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The fs_cp() of older versions, for comparison. */
+static void stdio_copy(const char* src, const char* dst) {
+  FILE* fin = fopen(src, "r");
+  FILE* fout = fopen(dst, "w");
+  char buffer[4096];
+  size_t size;
+  while ((size = fread(buffer, 1, sizeof(buffer), fin)) > 0) {
+    fwrite(buffer, 1, size, fout);
+  }
+  fclose(fin);
+  fclose(fout);
+}
+
+static void make_source(const char* path, long size) {
+  FILE* f = fopen(path, "w");
+  ASSERT_ERROR_MESSAGE(f != NULL, "couldn't create source file");
+  unsigned int seed = 61;
+  char block[65536];
+  for (long done = 0; done < size; done += sizeof(block)) {
+    for (size_t i = 0; i < sizeof(block); i++) {
+      block[i] = rand_r(&seed);
+    }
+    fwrite(block, 1, size - done < (long) sizeof(block) ? size - done : sizeof(block), f);
+  }
+  fclose(f);
+}
+
+int main(int argc, char** argv) {
+  long size_mb = 64;
+  int copies = 10;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:n:")) != -1) {
+    if (opt == 's') {
+      size_mb = atol(optarg);
+    } else if (opt == 'n') {
+      copies = atoi(optarg);
+    } else {
+      fprintf(stderr, "Usage: %s [-s <size_mb>] [-n <copies>] <dir>...\n", argv[0]);
+      return 2;
+    }
+  }
+  if (optind == argc || size_mb <= 0 || copies <= 0) {
+    fprintf(stderr, "Usage: %s [-s <size_mb>] [-n <copies>] <dir>...\n", argv[0]);
+    return 2;
+  }
+
+  for (int d = optind; d < argc; d++) {
+    char src[4096], dst[4096];
+    snprintf(src, sizeof(src), "%s/copybench.src", argv[d]);
+    snprintf(dst, sizeof(dst), "%s/copybench.dst", argv[d]);
+    make_source(src, size_mb << 20);
+
+    // Method 0 is FS_CP_AUTO; FS_CP_READ_WRITE + 1 stands for stdio_copy().
+    for (int method = FS_CP_AUTO; method <= FS_CP_READ_WRITE + 1; method++) {
+      const char* name = method <= FS_CP_READ_WRITE ? fs_cp_method_names[method] : "stdio-4k";
+      int used = method;
+      double start = now();
+      for (int i = 0; i < copies && used != -1; i++) {
+        if (method <= FS_CP_READ_WRITE) {
+          used = fs_cp_using(src, dst, method);
+        } else {
+          stdio_copy(src, dst);
+        }
+      }
+      double elapsed = now() - start;
+
+      printf("{\"dir\": \"%s\", \"fs\": \"%s\", \"method\": \"%s\", ", argv[d], fs_type_name(argv[d]), name);
+      if (used == -1) {
+        printf("\"supported\": false}\n");
+      } else {
+        printf("\"supported\": true, \"chosen\": \"%s\", \"size_mb\": %ld, \"copies\": %d, "
+               "\"seconds\": %.6f, \"mb_per_s\": %.1f}\n",
+               method <= FS_CP_READ_WRITE ? fs_cp_method_names[used] : name,
+               size_mb, copies, elapsed, size_mb * copies / elapsed);
+      }
+      unlink(dst);
+    }
+    unlink(src);
+  }
+  return 0;
+}
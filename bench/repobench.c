@@ -0,0 +1,279 @@
+/**
+ * Benchmark of beargit commands on a generated repository.
+ *
+ * Usage: repobench [-x <beargit>] [-f <files>] [-s <min>-<max>] [-d <depth>]
+ *                  [-b <branches>] [-S <seed>] [-k] <dir>
+ *
+ * A repository with <files> files (spread over directories of 256 files,
+ * sizes drawn log-uniformly from <min> to <max> bytes) is generated in a
+ * new directory below <dir>. The beargit binary then runs init, add and the
+ * first commit, <depth> more commits each changing 1% of the files, status,
+ * log, log --grep, log -- <file>, reset, and for each of <branches> branches a checkout -b,
+ * a commit and a checkout back, and finally a merge of every branch.
+ *
+ * Each command runs in a child process. Its wall time, CPU time and peak
+ * RSS come from wait4(); its read and write syscalls and bytes come from
+ * /proc/<pid>/io, read before the child is reaped. One JSON object is
+ * printed per command with the sums over its runs. The repository is
+ * deleted afterwards unless -k is given.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "beargit.h"
+
+#define FILES_PER_DIR 256
+
+struct op_stats {
+  const char* name;
+  int runs;
+  int failed;
+  double wall;
+  double user;
+  double sys;
+  long long syscr;
+  long long syscw;
+  long long rchar;
+  long long wchar;
+  long long write_bytes;
+  long maxrss_kb;
+};
+
+enum { OP_INIT, OP_ADD, OP_COMMIT_FIRST, OP_COMMIT, OP_STATUS, OP_LOG, OP_LOG_GREP,
+       OP_LOG_PATH, OP_RESET, OP_CHECKOUT_NEW, OP_CHECKOUT, OP_MERGE, NUM_OPS };
+
+static struct op_stats ops[NUM_OPS] = {
+  { "init" }, { "add" }, { "commit-first" }, { "commit" }, { "status" }, { "log" },
+  { "log-grep" }, { "log-path" }, { "reset" }, { "checkout-new" }, { "checkout" }, { "merge" },
+};
+
+static const char* beargit = "./beargit";
+static unsigned long long rng_state;
+
+static unsigned long long rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void file_name(int i, char* path, size_t size) {
+  snprintf(path, size, "d%04d/f%07d.txt", i / FILES_PER_DIR, i);
+}
+
+/* Write file <i> with <size> bytes of lowercase text lines. The text
+ * depends on <version>, so rewriting a file with a new version changes it.
+ */
+static void write_file(int i, long size, int version) {
+  char path[64];
+  file_name(i, path, sizeof(path));
+  if (i % FILES_PER_DIR == 0) {
+    char dir[16];
+    snprintf(dir, sizeof(dir), "d%04d", i / FILES_PER_DIR);
+    mkdir(dir, 0755);
+  }
+  char* buf = malloc(size + 1);
+  ASSERT_ERROR_MESSAGE(buf != NULL, "out of memory");
+  int len = snprintf(buf, size + 1, "%d %d\n", i, version);
+  for (long j = len; j < size; j++) {
+    buf[j] = (j % 64 == 63) ? '\n' : 'a' + rng() % 26;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_ERROR_MESSAGE(fd != -1, "couldn't create file");
+  ASSERT_ERROR_MESSAGE(write(fd, buf, size) == size, "couldn't write file");
+  close(fd);
+  free(buf);
+}
+
+static long file_size(long min, long max) {
+  double r = (double) (rng() >> 11) / (1ULL << 53);
+  return (long) (min * exp(r * log((double) max / min)));
+}
+
+static long long io_field(const char* io, const char* field) {
+  const char* p = strstr(io, field);
+  return p ? atoll(p + strlen(field)) : 0;
+}
+
+/* Run beargit with <args> (NULL-terminated) and add its costs to <op>. */
+static void run(int op, const char** args) {
+  const char* argv[8] = { beargit };
+  for (int i = 0; args[i]; i++) {
+    argv[i + 1] = args[i];
+  }
+
+  double start = now();
+  pid_t pid = fork();
+  ASSERT_ERROR_MESSAGE(pid != -1, "fork failed");
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    execv(beargit, (char**) argv);
+    _exit(127);
+  }
+
+  // Wait without reaping so /proc/<pid>/io is still there.
+  siginfo_t info;
+  waitid(P_PID, pid, &info, WEXITED | WNOWAIT);
+  double wall = now() - start;
+  char path[64], io[1024] = "";
+  snprintf(path, sizeof(path), "/proc/%d/io", (int) pid);
+  int fd = open(path, O_RDONLY);
+  if (fd != -1) {
+    ssize_t n = read(fd, io, sizeof(io) - 1);
+    io[n > 0 ? n : 0] = '\0';
+    close(fd);
+  }
+  int status;
+  struct rusage ru;
+  wait4(pid, &status, 0, &ru);
+
+  struct op_stats* s = &ops[op];
+  s->runs++;
+  s->failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  s->wall += wall;
+  s->user += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+  s->sys += ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+  s->syscr += io_field(io, "syscr: ");
+  s->syscw += io_field(io, "syscw: ");
+  s->rchar += io_field(io, "rchar: ");
+  s->wchar += io_field(io, "wchar: ");
+  s->write_bytes += io_field(io, "\nwrite_bytes: ");
+  if (ru.ru_maxrss > s->maxrss_kb) {
+    s->maxrss_kb = ru.ru_maxrss;
+  }
+}
+
+#define RUN(op, ...) run(op, (const char*[]) { __VA_ARGS__, NULL })
+
+/* Rewrite 1% of the files, at least one, starting at file <first>. */
+static void change_files(int files, int first, int version, long min, long max) {
+  int count = files / 100 ? files / 100 : 1;
+  for (int i = 0; i < count; i++) {
+    write_file((first + i * 97) % files, file_size(min, max), version);
+  }
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "Usage: %s [-x <beargit>] [-f <files>] [-s <min>-<max>] [-d <depth>] "
+          "[-b <branches>] [-S <seed>] [-k] <dir>\n", prog);
+}
+
+int main(int argc, char** argv) {
+  int files = 1000, depth = 10, branches = 2, keep = 0;
+  long min_size = 256, max_size = 16384;
+  unsigned long long seed = 61;
+  int opt;
+  while ((opt = getopt(argc, argv, "x:f:s:d:b:S:k")) != -1) {
+    if (opt == 'x') {
+      beargit = optarg;
+    } else if (opt == 'f') {
+      files = atoi(optarg);
+    } else if (opt == 's' && sscanf(optarg, "%ld-%ld", &min_size, &max_size) == 2) {
+      continue;
+    } else if (opt == 'd') {
+      depth = atoi(optarg);
+    } else if (opt == 'b') {
+      branches = atoi(optarg);
+    } else if (opt == 'S') {
+      seed = strtoull(optarg, NULL, 10);
+    } else if (opt == 'k') {
+      keep = 1;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (optind + 1 != argc || files <= 0 || depth < 0 || branches < 0
+      || min_size <= 0 || max_size < min_size) {
+    usage(argv[0]);
+    return 2;
+  }
+  rng_state = seed ? seed : 61;
+
+  char bin[4096];
+  ASSERT_ERROR_MESSAGE(realpath(beargit, bin) != NULL, "beargit binary not found");
+  beargit = bin;
+  char dir[4096];
+  snprintf(dir, sizeof(dir), "%s/repobench.XXXXXX", argv[optind]);
+  ASSERT_ERROR_MESSAGE(mkdtemp(dir) != NULL, "couldn't create repository directory");
+  ASSERT_ERROR_MESSAGE(chdir(dir) == 0, "couldn't enter repository directory");
+
+  double start = now();
+  long long bytes = 0;
+  for (int i = 0; i < files; i++) {
+    long size = file_size(min_size, max_size);
+    write_file(i, size, 0);
+    bytes += size;
+  }
+  double generate = now() - start;
+
+  RUN(OP_INIT, "init");
+  RUN(OP_ADD, "add", ".");
+  RUN(OP_COMMIT_FIRST, "commit", "-m", "THIS IS BEAR TERRITORY! 0");
+  char first_commit[COMMIT_ID_SIZE] = "";
+  read_string_from_file(".beargit/.prev", first_commit, COMMIT_ID_SIZE);
+  for (int i = 1; i <= depth; i++) {
+    change_files(files, i, i, min_size, max_size);
+    RUN(OP_COMMIT, "commit", "-m", "THIS IS BEAR TERRITORY! master");
+  }
+  RUN(OP_STATUS, "status");
+  RUN(OP_LOG, "log");
+  RUN(OP_LOG_GREP, "log", "--grep", "TERRITORY! master$");
+
+  // Log and reset a file the first of the later commits changed.
+  char path[64];
+  file_name(1 % files, path, sizeof(path));
+  RUN(OP_LOG_PATH, "log", "--", path);
+  RUN(OP_RESET, "reset", first_commit, path);
+
+  for (int b = 0; b < branches; b++) {
+    char name[32];
+    snprintf(name, sizeof(name), "bench%d", b);
+    RUN(OP_CHECKOUT_NEW, "checkout", "-b", name);
+    change_files(files, files / 2 + b * 13, depth + b + 1, min_size, max_size);
+    RUN(OP_COMMIT, "commit", "-m", "THIS IS BEAR TERRITORY! branch");
+    RUN(OP_CHECKOUT, "checkout", "master");
+  }
+  for (int b = 0; b < branches; b++) {
+    char name[32];
+    snprintf(name, sizeof(name), "bench%d", b);
+    RUN(OP_MERGE, "merge", name);
+  }
+
+  printf("{\"op\": \"generate\", \"files\": %d, \"bytes\": %lld, \"seconds\": %.6f}\n",
+         files, bytes, generate);
+  for (int op = 0; op < NUM_OPS; op++) {
+    struct op_stats* s = &ops[op];
+    if (s->runs == 0) {
+      continue;
+    }
+    printf("{\"op\": \"%s\", \"files\": %d, \"depth\": %d, \"branches\": %d, "
+           "\"runs\": %d, \"failed\": %d, \"wall_s\": %.6f, \"user_s\": %.6f, "
+           "\"sys_s\": %.6f, \"syscr\": %lld, \"syscw\": %lld, \"rchar\": %lld, "
+           "\"wchar\": %lld, \"write_bytes\": %lld, \"maxrss_kb\": %ld}\n",
+           s->name, files, depth, branches, s->runs, s->failed, s->wall, s->user,
+           s->sys, s->syscr, s->syscw, s->rchar, s->wchar, s->write_bytes, s->maxrss_kb);
+  }
+
+  if (!keep) {
+    ASSERT_ERROR_MESSAGE(chdir("/") == 0, "couldn't leave repository directory");
+    fs_rm_tree(dir);
+  }
+  return 0;
+}
@@ -0,0 +1,51 @@
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+/* Stamp <path> as it is now. Returns 0 if it doesn't exist, leaving
+ * <stamp> empty.
+ */
+int cache_stamp_fill(struct cache_stamp* stamp, const char* path) {
+  cache_stamp_clear(stamp);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return 0;
+  }
+  struct timespec now;
+  if (fstat(fd, &stamp->st) != 0 || clock_gettime(CLOCK_REALTIME_COARSE, &now) != 0) {
+    close(fd);
+    return 0;
+  }
+  stamp->fd = fd;
+  stamp->racy = stamp->st.st_mtim.tv_sec > now.tv_sec
+                || (stamp->st.st_mtim.tv_sec == now.tv_sec
+                    && stamp->st.st_mtim.tv_nsec >= now.tv_nsec);
+  return 1;
+}
+
+/* Returns 1 if <path> is still the file <stamp> was filled from and
+ * hasn't changed since.
+ */
+int cache_stamp_valid(const struct cache_stamp* stamp, const char* path) {
+  struct stat st;
+  if (stamp->fd == -1 || stamp->racy || stat(path, &st) != 0) {
+    return 0;
+  }
+  return st.st_dev == stamp->st.st_dev && st.st_ino == stamp->st.st_ino
+         && st.st_size == stamp->st.st_size
+         && st.st_mtim.tv_sec == stamp->st.st_mtim.tv_sec
+         && st.st_mtim.tv_nsec == stamp->st.st_mtim.tv_nsec
+         && st.st_ctim.tv_sec == stamp->st.st_ctim.tv_sec
+         && st.st_ctim.tv_nsec == stamp->st.st_ctim.tv_nsec;
+}
+
+void cache_stamp_clear(struct cache_stamp* stamp) {
+  if (stamp->fd != -1) {
+    close(stamp->fd);
+  }
+  memset(stamp, 0, sizeof(struct cache_stamp));
+  stamp->fd = -1;
+}
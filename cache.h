@@ -0,0 +1,36 @@
+/**
+ * Validation of in-memory copies of repository files.
+ *
+ * beargit daemon keeps the parsed index, the commit graph and packed-refs
+ * in memory between commands. Each copy has a stamp of the file it was
+ * read from, and is only used while the file still matches the stamp:
+ *
+ * - The stamp holds the file open, so its inode can't be reused by a
+ *   different file while the copy is cached. A file replaced by rename
+ *   (as beargit writes the index and refs) has a new inode.
+ * - Size, mtime and ctime catch files modified in place.
+ * - A file whose mtime is in the same clock tick as the moment it was
+ *   stamped is "racy": a second write in that tick wouldn't change its
+ *   mtime, so the copy is never trusted and is read again next time.
+ *
+ * Stamps are filled before the file is read, so a change while reading
+ * makes the copy stale rather than wrongly valid.
+ */
+#ifndef _BEARGIT_CACHE_H_
+#define _BEARGIT_CACHE_H_
+
+#include <sys/stat.h>
+
+struct cache_stamp {
+  int fd;  // -1 if the stamp is empty
+  int racy;
+  struct stat st;
+};
+
+#define CACHE_STAMP_EMPTY { -1, 0 }
+
+int cache_stamp_fill(struct cache_stamp* stamp, const char* path);
+int cache_stamp_valid(const struct cache_stamp* stamp, const char* path);
+void cache_stamp_clear(struct cache_stamp* stamp);
+
+#endif // _BEARGIT_CACHE_H_
@@ -0,0 +1,37 @@
+/**
+ * Content-defined chunking of large files.
+ *
+ * Files of at least chunk_threshold() bytes are not stored as one object
+ * but cut into chunks, each stored as an object of its own, plus a chunk
+ * list that names them (see object.h). An edit to a large file then only
+ * adds the chunks around the edit; the others are already stored.
+ *
+ * Cut points are chosen by the contents, FastCDC style: a Gear rolling hash
+ * (h = (h << 1) + gear[byte]) runs over the data, and a chunk ends where
+ * the top bits of the hash are zero. Inserting or removing bytes thus only
+ * moves the cut points next to the edit. Chunks are at least CHUNK_MIN and
+ * at most CHUNK_MAX bytes. Below CHUNK_AVG a cut needs more zero bits than
+ * above it, which pulls chunk sizes towards the average.
+ *
+ * The Gear table is derived from a fixed seed: changing it (or the sizes)
+ * would cut files differently and stop new chunks from matching old ones.
+ *
+ * The "chunking" setting (config.h) is "off" or the threshold in bytes,
+ * with an optional K, M or G suffix. The default is 8M.
+ */
+#ifndef _BEARGIT_CHUNK_H_
+#define _BEARGIT_CHUNK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHUNK_MIN (16 << 10)
+#define CHUNK_AVG (64 << 10)
+#define CHUNK_MAX (256 << 10)
+
+#define CHUNK_DEFAULT_THRESHOLD "8M"
+
+size_t chunk_next(const unsigned char* data, size_t size);
+uint64_t chunk_threshold(void);
+
+#endif // _BEARGIT_CHUNK_H_
@@ -0,0 +1,68 @@
+/**
+ * Compression codecs for stored objects.
+ *
+ * A codec compresses a source (a file descriptor or a buffer) into a
+ * stream of output blocks and a file descriptor back, a block of at most
+ * CODEC_BLOCK_SIZE bytes at a time, so neither side ever holds a whole
+ * object in memory. Every object records the id of
+ * the codec it was written with (see object.h), so a repository can mix
+ * codecs and settings can change at any time.
+ *
+ * The "compression" setting (config.h) picks the codec and level for new
+ * objects: "none", "<codec>" (at its default level) or "<codec>:<level>",
+ * or "fast" or "best" for the lowest and highest level of zlib. Without
+ * the setting, objects are written with "fast".
+ *
+ * Only zlib is built in. Codec ids 2 and 3 are reserved for zstd and LZ4;
+ * adding one is an entry in the codec table of codec.c.
+ */
+#ifndef _BEARGIT_CODEC_H_
+#define _BEARGIT_CODEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Codec ids, as stored in object headers
+#define CODEC_NONE 0
+#define CODEC_ZLIB 1
+
+#define CODEC_BLOCK_SIZE (128 << 10)
+
+// Called with each block of output of a codec
+typedef void (*codec_sink)(void* arg, const unsigned char* data, size_t size);
+// Called for each block of input of a codec; returns the number of bytes
+// stored in <buf>, 0 at the end of the input
+typedef size_t (*codec_source)(void* arg, unsigned char* buf, size_t size);
+
+// Input of a codec from a buffer
+struct codec_buffer {
+  const unsigned char* data;
+  size_t size;
+};
+
+struct codec {
+  const char* name;
+  int id;
+  int min_level;
+  int max_level;
+  int default_level;
+  // Compress all of <source> at <level> into <sink>. Returns the number
+  // of bytes read from <source>.
+  uint64_t (*compress)(codec_source source, void* source_arg, int level,
+                       codec_sink sink, void* sink_arg);
+  // Decompress the rest of <in> into <sink>. Returns 1 if it held a
+  // complete stream of exactly <size> bytes, 0 if it is corrupt.
+  int (*decompress)(int in, uint64_t size, codec_sink sink, void* arg);
+};
+
+extern const struct codec codecs[];
+extern const int num_codecs;
+
+const struct codec* codec_find(int id);
+const struct codec* codec_parse(const char* setting, int* level);
+const struct codec* codec_setting(int* level);
+void codec_sink_fd(void* arg, const unsigned char* data, size_t size);
+size_t codec_source_fd(void* arg, unsigned char* buf, size_t size);
+size_t codec_source_buffer(void* arg, unsigned char* buf, size_t size);
+
+#endif // _BEARGIT_CODEC_H_
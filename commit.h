@@ -0,0 +1,42 @@
+/**
+ * Commit access.
+ *
+ * A commit is either a directory .beargit/<commit_id> holding its .prev,
+ * .msg and .manifest (or .index and file copies for old commits, see
+ * manifest.h), or, after beargit repack, an object of type
+ * PACK_OBJ_COMMIT in a packfile. A packed commit is
+ *
+ *   <prev commit id>\n<length of msg>\n<msg><manifest lines>
+ *
+ * where the manifest lines are the same as in a .manifest file. Readers
+ * should go through commit_exists() and commit_load() rather than looking
+ * at the commit directory.
+ */
+#ifndef _BEARGIT_COMMIT_H_
+#define _BEARGIT_COMMIT_H_
+
+#include <stddef.h>
+
+#include "beargit.h"
+#include "manifest.h"
+#include "pack.h"
+
+struct commit_object {
+  char prev[COMMIT_ID_SIZE];
+  // The message, in the .msg file or the packed object (not NUL-terminated)
+  const char* msg;
+  size_t msg_len;
+  // Loose commits only: the .msg file
+  struct fs_view msg_view;
+  // Packed commits only: the object, and the manifest lines inside it
+  unsigned char* data;
+  const char* manifest;
+  size_t manifest_size;
+};
+
+int commit_exists(const char* commit_id);
+int commit_load(const char* commit_id, struct commit_object* c);
+void commit_free(struct commit_object* c);
+void commit_pack(const char* commit_id, struct manifest* m, struct pack_object* o);
+
+#endif // _BEARGIT_COMMIT_H_
@@ -0,0 +1,22 @@
+/**
+ * Repository settings (.beargit/config).
+ *
+ * One "<key> = <value>" setting per line. Blank lines and lines starting
+ * with '#' are ignored, as is whitespace around keys and values. Unknown
+ * keys are ignored too. Settings:
+ *
+ *   durability = none | normal | full   what a crash can lose (txn.h)
+ *   compression = none | fast | best | <codec>[:<level>]
+ *                                       how new objects are compressed (codec.h)
+ *   chunking = off | <size>[K|M|G]      from which size files are chunked (chunk.h)
+ *   autogc = off | <ms>                 incremental gc after each commit (gc.h)
+ */
+#ifndef _BEARGIT_CONFIG_H_
+#define _BEARGIT_CONFIG_H_
+
+#define CONFIG_FILE ".beargit/config"
+#define CONFIG_VALUE_SIZE 256
+
+int config_get(const char* key, char value[CONFIG_VALUE_SIZE]);
+
+#endif // _BEARGIT_CONFIG_H_
@@ -0,0 +1,324 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "daemon.h"
+#include "fsmonitor.h"
+#include "graph.h"
+#include "index.h"
+#include "manifest.h"
+#include "refs.h"
+#include "trace.h"
+#include "util.h"
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+static const char* const daemon_env[] = DAEMON_ENV;
+
+static void daemon_handle_signal(int sig) {
+  daemon_stop = 1;
+}
+
+static int daemon_connect(void) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", DAEMON_SOCKET);
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock != -1 && connect(sock, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+    close(sock);
+    sock = -1;
+  }
+  return sock;
+}
+
+static int write_all(int fd, const void* buf, size_t size) {
+  for (size_t done = 0; done < size; ) {
+    ssize_t n = write(fd, (const char*) buf + done, size - done);
+    if (n <= 0 && errno != EINTR) {
+      return 0;
+    }
+    done += n > 0 ? n : 0;
+  }
+  return 1;
+}
+
+static int read_all(int fd, void* buf, size_t size) {
+  for (size_t done = 0; done < size; ) {
+    ssize_t n = read(fd, (char*) buf + done, size - done);
+    if (n == 0 || (n < 0 && errno != EINTR)) {
+      return 0;
+    }
+    done += n > 0 ? n : 0;
+  }
+  return 1;
+}
+
+/* Run the command <argv> (without the program name) in the daemon, if one
+ * is running, and store its exit status in <status>. Returns 0 if there
+ * is no daemon, so the caller should run the command itself.
+ */
+int daemon_forward(int argc, char** argv, int* status) {
+  int sock = daemon_connect();
+  if (sock == -1) {
+    return 0;
+  }
+
+  size_t args_size = 0, env_size = 0;
+  for (int i = 0; i < argc; i++) {
+    args_size += strlen(argv[i]) + 1;
+  }
+  for (int i = 0; daemon_env[i]; i++) {
+    const char* value = getenv(daemon_env[i]);
+    env_size += value ? strlen(daemon_env[i]) + strlen(value) + 2 : 0;
+  }
+  size_t size = args_size + env_size;
+  char* buf = malloc(8 + size);
+  ASSERT_ERROR_MESSAGE(buf != NULL, "out of memory");
+  uint32_t len[2] = { htonl(args_size), htonl(env_size) };
+  memcpy(buf, len, 8);
+  size_t off = 8;
+  for (int i = 0; i < argc; i++) {
+    size_t n = strlen(argv[i]) + 1;
+    memcpy(buf + off, argv[i], n);
+    off += n;
+  }
+  for (int i = 0; daemon_env[i]; i++) {
+    const char* value = getenv(daemon_env[i]);
+    if (value) {
+      off += sprintf(buf + off, "%s=%s", daemon_env[i], value) + 1;
+    }
+  }
+
+  // The descriptors go with the lengths; the arguments follow.
+  int fds[3] = { 0, 1, 2 };
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = { buf, 8 };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                        .msg_control = control, .msg_controllen = sizeof(control) };
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  uint32_t result;
+  int ok = sendmsg(sock, &msg, MSG_NOSIGNAL) == 8 && write_all(sock, buf + 8, size)
+           && read_all(sock, &result, 4);
+  free(buf);
+  close(sock);
+  if (!ok) {
+    fprintf(stderr, "ERROR:  Lost the connection to beargit daemon.\n");
+    *status = 1;
+  } else {
+    *status = ntohl(result);
+  }
+  return 1;
+}
+
+/* Read a request from <conn> into a newly allocated argument vector,
+ * starting with "beargit", its environment into a newly allocated
+ * NULL-terminated array <envp>, and its descriptors into <fds>. Returns
+ * the number of arguments, or 0 for an invalid request.
+ */
+static int daemon_read_request(int conn, char*** argv, char*** envp, int fds[3]) {
+  uint32_t len[2];
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  struct iovec iov = { len, 8 };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                        .msg_control = control, .msg_controllen = sizeof(control) };
+  ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (n != 8 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+    return 0;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+  size_t args_size = ntohl(len[0]), env_size = ntohl(len[1]);
+  size_t size = args_size + env_size;
+  char* args = args_size > 0 && env_size <= DAEMON_MAX_REQUEST && size <= DAEMON_MAX_REQUEST
+               ? malloc(size) : NULL;
+  if (!args || !read_all(conn, args, size) || args[args_size - 1] != '\0'
+      || args[size - 1] != '\0') {
+    free(args);
+    for (int i = 0; i < 3; i++) {
+      close(fds[i]);
+    }
+    return 0;
+  }
+
+  int argc = 1, envc = 0;
+  for (size_t i = 0; i < size; i++) {
+    argc += args[i] == '\0' && i < args_size;
+    envc += args[i] == '\0' && i >= args_size;
+  }
+  *argv = malloc((argc + 1) * sizeof(char*));
+  *envp = malloc((envc + 1) * sizeof(char*));
+  ASSERT_ERROR_MESSAGE(*argv != NULL && *envp != NULL, "out of memory");
+  (*argv)[0] = "beargit";
+  for (size_t i = 0, arg = 1; i < args_size; i += strlen(args + i) + 1) {
+    (*argv)[arg++] = args + i;
+  }
+  (*argv)[argc] = NULL;
+  for (size_t i = args_size, var = 0; i < size; i += strlen(args + i) + 1) {
+    (*envp)[var++] = args + i;
+  }
+  (*envp)[envc] = NULL;
+  return argc;
+}
+
+/* Give the variables in DAEMON_ENV the values in <envp>, the client's, and
+ * unset those the client didn't set.
+ */
+static void daemon_setenv(char** envp) {
+  for (int i = 0; daemon_env[i]; i++) {
+    unsetenv(daemon_env[i]);
+  }
+  for (int i = 0; envp[i]; i++) {
+    char* eq = strchr(envp[i], '=');
+    for (int j = 0; eq && daemon_env[j]; j++) {
+      size_t n = strlen(daemon_env[j]);
+      if ((size_t) (eq - envp[i]) == n && strncmp(envp[i], daemon_env[j], n) == 0) {
+        setenv(daemon_env[j], eq + 1, 1);
+      }
+    }
+  }
+}
+
+/* Bring the in-memory copies up to date with the repository.
+ *
+ * The index and the manifest share interned paths (see arena.h), so if
+ * either is out of date, both are dropped along with the paths, and read
+ * again into a fresh arena. The daemon then only holds the paths of the
+ * current index and manifest.
+ */
+static void daemon_refresh(void) {
+  char head[COMMIT_ID_SIZE] = "";
+  read_string_from_file(".beargit/.prev", head, COMMIT_ID_SIZE);
+  if (!index_cache_current() || !manifest_cache_current(head)) {
+    index_cache_clear();
+    manifest_cache_clear();
+    path_intern_reset();
+  }
+  manifest_cache_refresh(head);
+  index_cache_refresh();
+  graph_cache_refresh();
+  refs_cache_refresh();
+}
+
+/* Run one command: fork, let the child run it on the client's
+ * descriptors, and return its exit status.
+ */
+static int daemon_run(int listener, int (*run)(int argc, char** argv),
+                      int argc, char** argv, char** envp, int fds[3]) {
+  fflush(NULL);
+  fsmonitor_poll();
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(listener);
+    fsmonitor_forked();
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    for (int i = 0; i < 3; i++) {
+      dup2(fds[i], i);
+    }
+    daemon_setenv(envp);
+    trace_init(argv[1]);
+    exit(run(argc, argv));
+  }
+
+  int status = 1;
+  if (pid != -1) {
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  }
+  return status;
+}
+
+/* beargit daemon
+ *
+ * Serve commands on DAEMON_SOCKET until SIGTERM or SIGINT, watching the
+ * working tree with the filesystem monitor (see fsmonitor.h).
+ *
+ * Errors (to stderr):
+ * - "ERROR:  A beargit daemon is already running." if there is one
+ */
+int daemon_serve(int (*run)(int argc, char** argv)) {
+  int sock = daemon_connect();
+  if (sock != -1) {
+    close(sock);
+    fprintf(stderr, "ERROR:  A beargit daemon is already running.\n");
+    return 1;
+  }
+
+  unlink(DAEMON_SOCKET);
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", DAEMON_SOCKET);
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  ASSERT_ERROR_MESSAGE(listener != -1, "creating daemon socket failed");
+  ASSERT_ERROR_MESSAGE(bind(listener, (struct sockaddr*) &addr, sizeof(addr)) == 0
+                       && listen(listener, 64) == 0, "listening on daemon socket failed");
+
+  // No SA_RESTART, so that accept() returns when asked to stop.
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = daemon_handle_signal;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  fsmonitor_start();
+
+  while (!daemon_stop) {
+    daemon_refresh();
+    // Keep draining the filesystem monitor while idle, so its queue
+    // doesn't overflow.
+    struct pollfd pfds[2] = { { listener, POLLIN, 0 }, { fsmonitor_fd(), POLLIN, 0 } };
+    if (poll(pfds, 2, -1) <= 0) {
+      continue;
+    }
+    if (pfds[1].revents & POLLIN) {
+      fsmonitor_poll();
+    }
+    if (!(pfds[0].revents & POLLIN)) {
+      continue;
+    }
+    int conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1) {
+      continue;
+    }
+
+    char** argv;
+    char** envp;
+    int fds[3];
+    int argc = daemon_read_request(conn, &argv, &envp, fds);
+    if (argc > 0) {
+      // Another process may have changed the repository while we waited.
+      daemon_refresh();
+      uint32_t status = htonl(daemon_run(listener, run, argc, argv, envp, fds));
+      write_all(conn, &status, 4);
+      for (int i = 0; i < 3; i++) {
+        close(fds[i]);
+      }
+      free(argv[1]);
+      free(argv);
+      free(envp);
+    }
+    close(conn);
+  }
+
+  close(listener);
+  unlink(DAEMON_SOCKET);
+  return 0;
+}
@@ -0,0 +1,35 @@
+/**
+ * beargit daemon: serve commands from a long-running process.
+ *
+ * The daemon listens on the Unix domain socket .beargit/daemon.sock and
+ * keeps the parsed index, the commit graph and packed-refs in memory (see
+ * cache.h). A client sends its arguments and its stdin, stdout and stderr
+ * file descriptors (SCM_RIGHTS); the daemon forks a child that runs the
+ * command on those descriptors, starting from the in-memory copies, and
+ * sends back its exit status. Commands run one at a time, in the order
+ * they arrive. The daemon also runs the filesystem monitor, so status and
+ * commit only check the files that changed (see fsmonitor.h).
+ *
+ * Request:  length of the arguments and length of the environment (4 bytes
+ *           each), then the arguments and the client's settings of the
+ *           variables in DAEMON_ENV as NAME=value, each NUL-terminated
+ * Response: exit status (4 bytes)
+ *
+ * Integers are big-endian. Without a running daemon, commands run in the
+ * calling process as before.
+ */
+#ifndef _BEARGIT_DAEMON_H_
+#define _BEARGIT_DAEMON_H_
+
+#define DAEMON_SOCKET ".beargit/daemon.sock"
+
+// Environment variables a command runs with, NULL-terminated
+#define DAEMON_ENV { "BEARGIT_TRACE", "BEARGIT_JOBS", NULL }
+
+// Longest request the daemon accepts
+#define DAEMON_MAX_REQUEST (64 << 20)
+
+int daemon_forward(int argc, char** argv, int* status);
+int daemon_serve(int (*run)(int argc, char** argv));
+
+#endif // _BEARGIT_DAEMON_H_
@@ -0,0 +1,274 @@
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "beargit.h"
+#include "fsmonitor.h"
+#include "util.h"
+
+#define FSMONITOR_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE \
+                          | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF \
+                          | IN_ONLYDIR | IN_EXCL_UNLINK)
+
+struct fsmonitor_path {
+  char* path;  // NULL for a free slot
+  uint64_t seq;
+  int is_dir;
+};
+
+static int inotify_fd = -1;
+// Whether this process has the daemon's monitor state
+static int active = 0;
+static char instance[32];
+static uint64_t seq;
+// Last sequence in which events were lost, or 0
+static uint64_t overflow_seq;
+// Last sequence with a directory event
+static uint64_t dir_seq;
+
+// Open-addressing hash table of the paths events named
+static struct fsmonitor_path* paths;
+static size_t paths_size;
+static size_t paths_count;
+
+// Directory of each watch descriptor, "" for the root
+static char** watches;
+static int watches_size;
+
+// The sequence fsmonitor_begin() asked about
+static uint64_t since;
+
+/* FNV-1a hash of the first <len> bytes of <path>. */
+static size_t fsmonitor_hash(const char* path, size_t len) {
+  size_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char) path[i]) * 16777619u;
+  }
+  return h;
+}
+
+static struct fsmonitor_path* fsmonitor_slot(const char* path, size_t len) {
+  size_t i = fsmonitor_hash(path, len) & (paths_size - 1);
+  while (paths[i].path && (strncmp(paths[i].path, path, len) != 0 || paths[i].path[len])) {
+    i = (i + 1) & (paths_size - 1);
+  }
+  return &paths[i];
+}
+
+static void fsmonitor_mark(const char* path, int is_dir, uint64_t batch) {
+  if (paths_count * 2 >= paths_size) {
+    struct fsmonitor_path* old = paths;
+    size_t old_size = paths_size;
+    paths_size = paths_size ? paths_size * 2 : 1024;
+    paths = calloc(paths_size, sizeof(struct fsmonitor_path));
+    ASSERT_ERROR_MESSAGE(paths != NULL, "out of memory");
+    for (size_t i = 0; i < old_size; i++) {
+      if (old[i].path) {
+        *fsmonitor_slot(old[i].path, strlen(old[i].path)) = old[i];
+      }
+    }
+    free(old);
+  }
+
+  struct fsmonitor_path* p = fsmonitor_slot(path, strlen(path));
+  if (!p->path) {
+    p->path = strdup(path);
+    ASSERT_ERROR_MESSAGE(p->path != NULL, "out of memory");
+    paths_count++;
+  }
+  p->seq = batch;
+  p->is_dir |= is_dir;
+  if (is_dir) {
+    dir_seq = batch;
+  }
+}
+
+/* Watch directory <dir> ("" for the root) and everything below it, except
+ * hidden entries like .beargit. Returns 0 if the kernel ran out of
+ * watches.
+ */
+static int fsmonitor_watch_tree(const char* dir) {
+  int wd = inotify_add_watch(inotify_fd, *dir ? dir : ".", FSMONITOR_EVENTS);
+  if (wd == -1) {
+    return errno != ENOSPC;
+  }
+  if (wd >= watches_size) {
+    int old_size = watches_size;
+    watches_size = wd * 2 + 16;
+    watches = realloc(watches, watches_size * sizeof(char*));
+    ASSERT_ERROR_MESSAGE(watches != NULL, "out of memory");
+    memset(watches + old_size, 0, (watches_size - old_size) * sizeof(char*));
+  }
+  // A moved directory keeps its watch; this updates its path.
+  free(watches[wd]);
+  watches[wd] = strdup(dir);
+  ASSERT_ERROR_MESSAGE(watches[wd] != NULL, "out of memory");
+
+  DIR* d = opendir(*dir ? dir : ".");
+  struct dirent* de;
+  int ok = 1;
+  while (ok && d && (de = readdir(d)) != NULL) {
+    if (de->d_name[0] == '.' || (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)) {
+      continue;
+    }
+    char path[PATH_MAX];
+    if (snprintf(path, PATH_MAX, "%s%s%s", dir, *dir ? "/" : "", de->d_name) >= PATH_MAX
+        || (de->d_type == DT_UNKNOWN && !fs_check_dir_exists(path))) {
+      continue;
+    }
+    ok = fsmonitor_watch_tree(path);
+  }
+  if (d) {
+    closedir(d);
+  }
+  return ok;
+}
+
+/* Start watching the working tree. Returns 0, after printing a warning,
+ * if it is too large to watch; commands then always scan everything.
+ */
+int fsmonitor_start(void) {
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd != -1 && fsmonitor_watch_tree("")) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    snprintf(instance, sizeof(instance), "%x%llx", (unsigned) getpid(),
+             (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec);
+    seq = 1;
+    active = 1;
+    return 1;
+  }
+
+  fprintf(stderr, "WARNING:  Could not watch the working tree; raise "
+          "fs.inotify.max_user_watches to enable the filesystem monitor.\n");
+  if (inotify_fd != -1) {
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+  return 0;
+}
+
+/* The inotify descriptor, to poll() for events, or -1. */
+int fsmonitor_fd(void) {
+  return inotify_fd;
+}
+
+/* Record all pending events, as one new batch. */
+void fsmonitor_poll(void) {
+  if (inotify_fd == -1) {
+    return;
+  }
+  uint64_t batch = seq + 1;
+  int any = 0;
+  char buf[64 << 10] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+    any = 1;
+    for (char* p = buf; p < buf + n; ) {
+      struct inotify_event* ev = (struct inotify_event*) p;
+      p += sizeof(struct inotify_event) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        overflow_seq = batch;
+        continue;
+      }
+      const char* dir = ev->wd >= 0 && ev->wd < watches_size ? watches[ev->wd] : NULL;
+      if (!dir) {
+        continue;
+      }
+      if (ev->mask & IN_IGNORED) {
+        free(watches[ev->wd]);
+        watches[ev->wd] = NULL;
+        continue;
+      }
+      if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        if (!*dir) {
+          overflow_seq = batch;  // the whole tree went away
+        }
+        continue;
+      }
+      if (ev->len == 0 || ev->name[0] == '.') {
+        continue;
+      }
+
+      char path[PATH_MAX];
+      if (snprintf(path, PATH_MAX, "%s%s%s", dir, *dir ? "/" : "", ev->name) >= PATH_MAX) {
+        overflow_seq = batch;
+        continue;
+      }
+      int is_dir = (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM
+                                                         | IN_MOVED_TO));
+      if (is_dir && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && !fsmonitor_watch_tree(path)) {
+        overflow_seq = batch;
+      }
+      fsmonitor_mark(path, is_dir, batch);
+    }
+  }
+  if (any) {
+    seq = batch;
+  }
+}
+
+/* In a child of the daemon: keep the recorded events, but leave reading
+ * new ones to the daemon.
+ */
+void fsmonitor_forked(void) {
+  if (inotify_fd != -1) {
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+}
+
+/* Store the token for the events recorded so far in <token>, or "" if
+ * there is no monitor.
+ */
+void fsmonitor_token(char token[FSMONITOR_TOKEN_SIZE]) {
+  if (active) {
+    snprintf(token, FSMONITOR_TOKEN_SIZE, "%s:%" PRIu64, instance, seq);
+  } else {
+    token[0] = '\0';
+  }
+}
+
+/* Prepare fsmonitor_is_dirty() for changes after <token>. Returns 0 if the
+ * monitor can't tell them, so every path must be checked.
+ */
+int fsmonitor_begin(const char* token) {
+  const char* colon = strchr(token, ':');
+  if (!active || !colon || (size_t) (colon - token) != strlen(instance)
+      || strncmp(token, instance, colon - token) != 0) {
+    return 0;
+  }
+  since = strtoull(colon + 1, NULL, 10);
+  return since <= seq && overflow_seq <= since;
+}
+
+/* Returns 1 if <path> may have changed after the token given to
+ * fsmonitor_begin().
+ */
+int fsmonitor_is_dirty(const char* path) {
+  if (paths_count == 0) {
+    return 0;
+  }
+  struct fsmonitor_path* p = fsmonitor_slot(path, strlen(path));
+  if (p->path && p->seq > since) {
+    return 1;
+  }
+  if (dir_seq > since) {
+    for (const char* slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+      p = fsmonitor_slot(path, slash - path);
+      if (p->path && p->is_dir && p->seq > since) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
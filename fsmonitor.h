@@ -0,0 +1,38 @@
+/**
+ * Filesystem monitor: which tracked files may have changed.
+ *
+ * beargit daemon watches every directory of the working tree with
+ * inotify and records, for each path an event names, the sequence number
+ * of the last batch of events that touched it. A token names a point in
+ * that history: "<instance>:<sequence>", where the instance identifies
+ * the daemon process. The index stores the token up to which its cached
+ * stat data was checked (see index.h).
+ *
+ * Commands run by the daemon ask which paths changed after the index's
+ * token and only stat those; every other entry is known to be unchanged.
+ * The answer is "everything" (a full scan) when
+ *
+ * - there is no daemon, or the token is from an earlier daemon (restart),
+ * - the kernel dropped events since the token (IN_Q_OVERFLOW), or the
+ *   root of the tree was moved or deleted.
+ *
+ * A created, deleted or moved directory marks everything below it. The
+ * monitor may report paths that didn't change, but never misses one.
+ */
+#ifndef _BEARGIT_FSMONITOR_H_
+#define _BEARGIT_FSMONITOR_H_
+
+#define FSMONITOR_TOKEN_SIZE 64
+
+// In the daemon
+int fsmonitor_start(void);
+int fsmonitor_fd(void);
+void fsmonitor_poll(void);
+void fsmonitor_forked(void);
+
+// In commands
+void fsmonitor_token(char token[FSMONITOR_TOKEN_SIZE]);
+int fsmonitor_begin(const char* token);
+int fsmonitor_is_dirty(const char* path);
+
+#endif // _BEARGIT_FSMONITOR_H_
@@ -0,0 +1,93 @@
+/**
+ * Commit-graph cache.
+ *
+ * .beargit/commit-graph lists commits in the order they were added, each
+ * as a fixed-size record, so that history can be walked in a single
+ * memory-mapped file instead of opening two files per commit. The file is
+ * a header ("BCGR", version) followed by 44-byte records:
+ *
+ *   raw commit id (20 bytes)
+ *   position of the parent record (4 bytes, GRAPH_NONE for the first commit)
+ *   generation number: 1 for the first commit, parent's + 1 otherwise (4 bytes)
+ *   position of the jump record, an older ancestor (4 bytes, see graph_add())
+ *   offset (8 bytes) and length (4 bytes) of the message in the message file
+ *
+ * Messages are stored back to back, without terminators, in
+ * .beargit/commit-graph.msgs. All integers are in network byte order.
+ *
+ * Both files are only ever appended to; a parent is always added before its
+ * children. The graph is a cache: readers fall back to the commits
+ * themselves for commits it doesn't know, and graph_add() fills in any
+ * missing ancestors, so a deleted or truncated graph heals itself on the
+ * next commit. A graph of an older version is rebuilt the same way.
+ *
+ * Generation numbers and jump pointers answer ancestry questions
+ * (graph_is_ancestor(), graph_merge_base()) in O(log n) steps.
+ *
+ * Records are in commit order, so .beargit/commit-graph.lookup maps commit
+ * ids to positions for graph_find(), like git's OID fan-out and lookup
+ * chunks. It is a header ("BCGL", version, number of records n it covers,
+ * raw id of record n - 1), a fan-out table of 256 counts (entry b is the
+ * number of ids whose first byte is at most b) and n entries of raw id
+ * and position, sorted by id. Records from n on, fewer than
+ * GRAPH_LOOKUP_BATCH, are scanned; once that many are missing, graph_add()
+ * merges them in and renames a new lookup into place.
+ *
+ * Writers of the graph and of the indexes built on its positions (search.h,
+ * bloom.h) hold an exclusive flock() on GRAPH_LOCK_FILE, taken with
+ * graph_lock(), so that commits on two branches don't interleave their
+ * appends. Readers don't lock.
+ */
+#ifndef _BEARGIT_GRAPH_H_
+#define _BEARGIT_GRAPH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "beargit.h"
+
+#define GRAPH_FILE ".beargit/commit-graph"
+#define GRAPH_MSGS_FILE ".beargit/commit-graph.msgs"
+#define GRAPH_LOOKUP_FILE ".beargit/commit-graph.lookup"
+#define GRAPH_LOCK_FILE ".beargit/commit-graph.lock"
+
+// Most records graph_find() scans instead of looking them up
+#define GRAPH_LOOKUP_BATCH 1024
+
+// Parent position of commits without a parent
+#define GRAPH_NONE 0xffffffffu
+
+struct graph {
+  const unsigned char* records;
+  uint32_t count;
+  const char* msgs;
+  size_t msgs_size;
+  // Fan-out table of the lookup, followed by its entries
+  const unsigned char* lookup;
+  uint32_t lookup_count;
+  // Mappings, for graph_close()
+  void* map;
+  size_t map_size;
+  void* msgs_map;
+  void* lookup_map;
+  size_t lookup_map_size;
+};
+
+void graph_open(struct graph* g);
+void graph_close(struct graph* g);
+void graph_cache_refresh(void);
+uint32_t graph_find(struct graph* g, const char* commit_id);
+void graph_commit_id(struct graph* g, uint32_t pos, char commit_id[COMMIT_ID_SIZE]);
+uint32_t graph_parent(struct graph* g, uint32_t pos);
+uint32_t graph_generation(struct graph* g, uint32_t pos);
+uint32_t graph_jump(struct graph* g, uint32_t pos);
+uint32_t graph_ancestor_at(struct graph* g, uint32_t pos, uint32_t generation);
+uint32_t graph_lca(struct graph* g, uint32_t a, uint32_t b);
+int graph_merge_base(const char* a, const char* b, char base[COMMIT_ID_SIZE]);
+int graph_is_ancestor(const char* a, const char* b);
+int graph_msg(struct graph* g, uint32_t pos, const char** msg, size_t* len);
+void graph_add(const char* commit_id);
+int graph_lock(void);
+void graph_unlock(int lock);
+
+#endif // _BEARGIT_GRAPH_H_
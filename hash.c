@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "trace.h"
+#include "util.h"
+
+// Read size of hash_fd(); large enough that syscalls don't show up
+#define HASH_READ_SIZE (256 << 10)
+
+/* Returns the digest size of <algo> in bytes. */
+size_t hash_size(int algo) {
+  return algo == HASH_SHA256 ? SHA256_DIGEST_LENGTH : SHA_DIGEST_LENGTH;
+}
+
+void hash_init(struct hash_ctx* ctx, int algo) {
+  ctx->algo = algo;
+  if (algo == HASH_SHA256) {
+    SHA256_Init(&ctx->u.sha256);
+  } else {
+    SHA1_Init(&ctx->u.sha1);
+  }
+}
+
+void hash_update(struct hash_ctx* ctx, const void* data, size_t size) {
+  if (ctx->algo == HASH_SHA256) {
+    SHA256_Update(&ctx->u.sha256, data, size);
+  } else {
+    SHA1_Update(&ctx->u.sha1, data, size);
+  }
+}
+
+/* Write the digest to <raw> and return its size. */
+size_t hash_final(struct hash_ctx* ctx, unsigned char* raw) {
+  if (ctx->algo == HASH_SHA256) {
+    SHA256_Final(raw, &ctx->u.sha256);
+  } else {
+    SHA1_Final(raw, &ctx->u.sha1);
+  }
+  return hash_size(ctx->algo);
+}
+
+/* Hash <size> bytes at <data> in one go. */
+void hash_buffer(int algo, const void* data, size_t size, unsigned char* raw) {
+  struct hash_ctx ctx;
+  hash_init(&ctx, algo);
+  hash_update(&ctx, data, size);
+  hash_final(&ctx, raw);
+}
+
+/* Hash everything that can be read from <fd> and write the digest to
+ * <raw>.
+ *
+ * Returns 1 on success, 0 if reading failed.
+ */
+int hash_fd(int fd, int algo, unsigned char* raw) {
+  static __thread unsigned char* buf = NULL;
+  if (!buf) {
+    buf = malloc(HASH_READ_SIZE);
+    ASSERT_ERROR_MESSAGE(buf != NULL, "out of memory");
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  struct trace_span span;
+  trace_begin(&span, "hash");
+  struct hash_ctx ctx;
+  hash_init(&ctx, algo);
+  ssize_t n;
+  while ((n = read(fd, buf, HASH_READ_SIZE)) > 0) {
+    hash_update(&ctx, buf, n);
+    trace_count(TRACE_BYTES_HASHED, n);
+  }
+  hash_final(&ctx, raw);
+  trace_end(&span);
+  return n == 0;
+}
+
+/* Hex-encode the <size> bytes of <raw> into <hex>, NUL-terminated.
+ *
+ * Each nibble n maps to '0' + n, plus the distance from '9' + 1 to 'a'
+ * when n > 9; the comparison is computed as a mask, so there is no branch
+ * or table lookup per digit.
+ */
+void hash_to_hex(const unsigned char* raw, size_t size, char* hex) {
+  for (size_t i = 0; i < size; i++) {
+    unsigned int hi = raw[i] >> 4;
+    unsigned int lo = raw[i] & 0xf;
+    hex[2 * i] = '0' + hi + (((9 - hi) >> 8) & ('a' - '9' - 1));
+    hex[2 * i + 1] = '0' + lo + (((9 - lo) >> 8) & ('a' - '9' - 1));
+  }
+  hex[2 * size] = '\0';
+}
+
+/* Value of hex digit <c>, or -1 if it isn't one. */
+static int hex_value(unsigned char c) {
+  unsigned int digit = c - '0';
+  unsigned int letter = (c | 0x20) - 'a';
+  int is_digit = digit < 10;
+  int is_letter = letter < 6;
+  return ((int) digit & -is_digit) | ((int) (letter + 10) & -is_letter)
+         | -!(is_digit | is_letter);
+}
+
+/* Decode the first 2 * <size> hex digits of <hex> into <raw>.
+ *
+ * Returns 1 on success, 0 if <hex> is shorter or not hex.
+ */
+int hex_to_hash(const char* hex, size_t size, unsigned char* raw) {
+  for (size_t i = 0; i < size; i++) {
+    int hi = hex_value(hex[2 * i]);
+    // Stop at a NUL before looking at the byte after it
+    if (hi < 0) {
+      return 0;
+    }
+    int lo = hex_value(hex[2 * i + 1]);
+    if (lo < 0) {
+      return 0;
+    }
+    raw[i] = (hi << 4) | lo;
+  }
+  return 1;
+}
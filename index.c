@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <endian.h>
+
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "hash.h"
+#include "index.h"
+#include "trace.h"
+#include "util.h"
+
+#define INDEX_HEADER_SIZE 12
+// Fixed part of a version 2 entry: inode, size, mtime, id, flags, length
+#define INDEX_ENTRY_SIZE (8 + 8 + 8 + SHA_DIGEST_LENGTH + 2 + 2)
+// Signature and length of an extension
+#define INDEX_EXTENSION_HEADER_SIZE 8
+#define INDEX_EXTENSION_FSMONITOR "FSMN"
+
+/* FNV-1a hash of a filename. */
+static unsigned int index_hash(const char* filename) {
+  unsigned int h = 2166136261u;
+  for (const unsigned char* p = (const unsigned char*) filename; *p; p++) {
+    h = (h ^ *p) * 16777619u;
+  }
+  return h;
+}
+
+/* Returns the hash table slot holding <filename>, or the free slot where it
+ * would be inserted.
+ */
+static int* index_slot(struct index* idx, const char* filename) {
+  unsigned int mask = idx->table_size - 1;
+  for (unsigned int i = index_hash(filename) & mask; ; i = (i + 1) & mask) {
+    int pos = idx->table[i];
+    if (pos == 0 || idx->entries[pos - 1].filename == filename
+        || strcmp(idx->entries[pos - 1].filename, filename) == 0) {
+      return &idx->table[i];
+    }
+  }
+}
+
+/* (Re)build the hash table so that it is at most half full. */
+static void index_rehash(struct index* idx, int min_entries) {
+  int size = 16;
+  while (size < 2 * min_entries) {
+    size *= 2;
+  }
+
+  free(idx->table);
+  idx->table = calloc(size, sizeof(int));
+  ASSERT_ERROR_MESSAGE(idx->table != NULL, "out of memory");
+  idx->table_size = size;
+
+  for (int i = 0; i < idx->count; i++) {
+    *index_slot(idx, idx->entries[i].filename) = i + 1;
+  }
+}
+
+void index_init(struct index* idx) {
+  idx->entries = NULL;
+  idx->count = 0;
+  idx->capacity = 0;
+  idx->table = NULL;
+  idx->table_size = 0;
+  idx->sorted = 1;
+  idx->changed = 0;
+  idx->fsmonitor_token[0] = '\0';
+  index_rehash(idx, 0);
+}
+
+static void index_append(struct index* idx, const char* filename, size_t len) {
+  if (idx->count == idx->capacity) {
+    idx->capacity = idx->capacity ? idx->capacity * 2 : 16;
+    idx->entries = realloc(idx->entries, idx->capacity * sizeof(struct index_entry));
+    ASSERT_ERROR_MESSAGE(idx->entries != NULL, "out of memory");
+  }
+
+  struct index_entry* e = &idx->entries[idx->count];
+  e->filename = path_intern(filename, len);
+  e->ino = e->size = e->mtime_ns = 0;
+  e->id[0] = '\0';
+  e->flags = 0;
+
+  if (idx->count > 0 && strcmp(idx->entries[idx->count - 1].filename, e->filename) >= 0) {
+    idx->sorted = 0;
+  }
+  idx->count++;
+}
+
+static uint32_t read_u32(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohl(v);
+}
+
+static uint16_t read_u16(const unsigned char* p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohs(v);
+}
+
+static uint64_t read_u64(const unsigned char* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return be64toh(v);
+}
+
+static void write_u64(unsigned char* p, uint64_t v) {
+  v = htobe64(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+/* Parse a binary index held in <buf>. */
+static void index_parse(struct index* idx, const unsigned char* buf, size_t size) {
+  ASSERT_ERROR_MESSAGE(size >= INDEX_HEADER_SIZE + SHA_DIGEST_LENGTH, "index file is truncated");
+  uint32_t version = read_u32(buf + 4);
+  ASSERT_ERROR_MESSAGE(version == 1 || version == INDEX_VERSION, "unsupported index version");
+
+  unsigned char checksum[SHA_DIGEST_LENGTH];
+  size -= SHA_DIGEST_LENGTH;
+  hash_buffer(HASH_SHA1, buf, size, checksum);
+  ASSERT_ERROR_MESSAGE(memcmp(checksum, buf + size, SHA_DIGEST_LENGTH) == 0,
+                       "index file checksum mismatch");
+
+  uint32_t count = read_u32(buf + 8);
+  size_t off = INDEX_HEADER_SIZE;
+  for (uint32_t i = 0; i < count; i++) {
+    if (version == 1) {
+      // No stat data: every entry is hashed again on first use.
+      ASSERT_ERROR_MESSAGE(off + 2 <= size, "index file is truncated");
+      uint16_t len = read_u16(buf + off);
+      off += 2;
+      ASSERT_ERROR_MESSAGE(off + len <= size, "index file is truncated");
+      index_append(idx, (const char*) buf + off, len);
+      off += len;
+      continue;
+    }
+
+    ASSERT_ERROR_MESSAGE(off + INDEX_ENTRY_SIZE <= size, "index file is truncated");
+    const unsigned char* p = buf + off;
+    uint16_t len = read_u16(p + INDEX_ENTRY_SIZE - 2);
+    off += INDEX_ENTRY_SIZE;
+    ASSERT_ERROR_MESSAGE(off + len <= size, "index file is truncated");
+    index_append(idx, (const char*) buf + off, len);
+    off += len;
+
+    struct index_entry* e = &idx->entries[idx->count - 1];
+    e->ino = read_u64(p);
+    e->size = read_u64(p + 8);
+    e->mtime_ns = read_u64(p + 16);
+    hash_to_hex(p + 24, SHA_DIGEST_LENGTH, e->id);
+    e->flags = read_u16(p + 24 + SHA_DIGEST_LENGTH);
+  }
+
+  while (off + INDEX_EXTENSION_HEADER_SIZE <= size) {
+    uint32_t len = read_u32(buf + off + 4);
+    ASSERT_ERROR_MESSAGE(len <= size - off - INDEX_EXTENSION_HEADER_SIZE, "index file is truncated");
+    const unsigned char* data = buf + off + INDEX_EXTENSION_HEADER_SIZE;
+    if (memcmp(buf + off, INDEX_EXTENSION_FSMONITOR, 4) == 0 && len < FSMONITOR_TOKEN_SIZE) {
+      memcpy(idx->fsmonitor_token, data, len);
+      idx->fsmonitor_token[len] = '\0';
+    }
+    off += INDEX_EXTENSION_HEADER_SIZE + len;
+  }
+}
+
+static int index_entry_cmp(const void* a, const void* b) {
+  return strcmp(((const struct index_entry*) a)->filename,
+                ((const struct index_entry*) b)->filename);
+}
+
+// Put the entries of <idx> back in filename order.
+static void index_sort(struct index* idx) {
+  if (!idx->sorted) {
+    qsort(idx->entries, idx->count, sizeof(struct index_entry), index_entry_cmp);
+    idx->sorted = 1;
+    index_rehash(idx, idx->count);
+  }
+}
+
+/* Parse an index in the old one-filename-per-line text format. Unlike the
+ * binary format, nothing guarantees that it is free of duplicates or in
+ * filename order, which manifests written from it rely on.
+ */
+static void index_parse_legacy(struct index* idx, const struct fs_view* v) {
+  size_t off = 0, len;
+  const char* line;
+  while (fs_view_line(v, &off, &line, &len)) {
+    if (len > 0) {
+      index_add(idx, path_intern(line, len));
+    }
+  }
+  index_sort(idx);
+}
+
+/* Load .beargit/.index into <idx>. */
+static void index_read(struct index* idx) {
+  struct trace_span span;
+  trace_begin(&span, "index load");
+  index_init(idx);
+
+  struct fs_view v;
+  ASSERT_ERROR_MESSAGE(fs_view_open(INDEX_FILE, &v), "couldn't open index file");
+  if (v.size >= 4 && memcmp(v.data, INDEX_SIGNATURE, 4) == 0) {
+    index_parse(idx, (const unsigned char*) v.data, v.size);
+    index_rehash(idx, idx->count);
+  } else {
+    index_parse_legacy(idx, &v);
+  }
+  fs_view_close(&v);
+  trace_end(&span);
+}
+
+// The index kept by beargit daemon (see index_cache_refresh())
+static struct index index_cached;
+static struct cache_stamp index_stamp = CACHE_STAMP_EMPTY;
+
+void index_load(struct index* idx) {
+  // A forked daemon child takes over the daemon's copy.
+  if (cache_stamp_valid(&index_stamp, INDEX_FILE)) {
+    *idx = index_cached;
+    memset(&index_cached, 0, sizeof(struct index));
+    cache_stamp_clear(&index_stamp);
+    return;
+  }
+  index_read(idx);
+}
+
+/* Returns 1 if the copy of the index in memory is up to date. */
+int index_cache_current(void) {
+  return cache_stamp_valid(&index_stamp, INDEX_FILE);
+}
+
+/* Drop the copy of the index in memory. */
+void index_cache_clear(void) {
+  if (index_cached.entries) {
+    index_free(&index_cached);
+  }
+  cache_stamp_clear(&index_stamp);
+}
+
+/* Read the index into memory for index_load() in processes forked from
+ * now on, unless the copy in memory is still up to date.
+ */
+void index_cache_refresh(void) {
+  if (cache_stamp_valid(&index_stamp, INDEX_FILE)) {
+    return;
+  }
+  if (index_cached.entries) {
+    index_free(&index_cached);
+  }
+  if (cache_stamp_fill(&index_stamp, INDEX_FILE)) {
+    index_read(&index_cached);
+  }
+}
+
+/* Write <idx> to .beargit/.index.
+ *
+ * The new index is written to .beargit/.newindex and renamed over the old
+ * one, so readers see either the old or the new index, never a mix.
+ */
+void index_write(struct index* idx) {
+  struct trace_span span;
+  trace_begin(&span, "index write");
+  index_sort(idx);
+
+  FILE* fnewindex = fopen(".beargit/.newindex", "w");
+  ASSERT_ERROR_MESSAGE(fnewindex != NULL, "couldn't open new index file");
+
+  // Entries modified in the same timestamp tick as (or after) the new index
+  // file can't be told apart from later modifications; forget their stat
+  // data so they are hashed again.
+  struct stat st;
+  ASSERT_ERROR_MESSAGE(fstat(fileno(fnewindex), &st) == 0, "couldn't stat new index file");
+  uint64_t index_mtime_ns = st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+
+  size_t token_len = strlen(idx->fsmonitor_token);
+  size_t size = INDEX_HEADER_SIZE + SHA_DIGEST_LENGTH;
+  if (token_len) {
+    size += INDEX_EXTENSION_HEADER_SIZE + token_len;
+  }
+  for (int i = 0; i < idx->count; i++) {
+    size += INDEX_ENTRY_SIZE + strlen(idx->entries[i].filename);
+    if (idx->entries[i].mtime_ns >= index_mtime_ns) {
+      idx->entries[i].flags &= ~INDEX_ENTRY_VALID;
+    }
+  }
+
+  unsigned char* buf = malloc(size);
+  ASSERT_ERROR_MESSAGE(buf != NULL, "out of memory");
+  memcpy(buf, INDEX_SIGNATURE, 4);
+  uint32_t v = htonl(INDEX_VERSION);
+  memcpy(buf + 4, &v, 4);
+  v = htonl(idx->count);
+  memcpy(buf + 8, &v, 4);
+
+  size_t off = INDEX_HEADER_SIZE;
+  for (int i = 0; i < idx->count; i++) {
+    struct index_entry* e = &idx->entries[i];
+    size_t len = strlen(e->filename);
+    ASSERT_ERROR_MESSAGE(len <= UINT16_MAX, "filename too long for index");
+
+    unsigned char* p = buf + off;
+    write_u64(p, e->ino);
+    write_u64(p + 8, e->size);
+    write_u64(p + 16, e->mtime_ns);
+    if (e->flags & INDEX_ENTRY_VALID) {
+      hex_to_hash(e->id, SHA_DIGEST_LENGTH, p + 24);
+    } else {
+      memset(p + 24, 0, SHA_DIGEST_LENGTH);
+    }
+    uint16_t v16 = htons(e->flags & INDEX_ENTRY_VALID ? e->flags : 0);
+    memcpy(p + 24 + SHA_DIGEST_LENGTH, &v16, 2);
+    v16 = htons(len);
+    memcpy(p + 26 + SHA_DIGEST_LENGTH, &v16, 2);
+    memcpy(p + INDEX_ENTRY_SIZE, e->filename, len);
+    off += INDEX_ENTRY_SIZE + len;
+  }
+  if (token_len) {
+    memcpy(buf + off, INDEX_EXTENSION_FSMONITOR, 4);
+    v = htonl(token_len);
+    memcpy(buf + off + 4, &v, 4);
+    memcpy(buf + off + INDEX_EXTENSION_HEADER_SIZE, idx->fsmonitor_token, token_len);
+    off += INDEX_EXTENSION_HEADER_SIZE + token_len;
+  }
+  hash_buffer(HASH_SHA1, buf, off, buf + off);
+
+  ASSERT_ERROR_MESSAGE(fwrite(buf, 1, size, fnewindex) == size, "couldn't write index file");
+  fclose(fnewindex);
+  free(buf);
+
+  fs_mv(".beargit/.newindex", INDEX_FILE);
+  trace_end(&span);
+}
+
+void index_clear(struct index* idx) {
+  idx->count = 0;
+  idx->sorted = 1;
+  memset(idx->table, 0, idx->table_size * sizeof(int));
+}
+
+void index_free(struct index* idx) {
+  index_clear(idx);
+  free(idx->entries);
+  free(idx->table);
+  idx->entries = NULL;
+  idx->table = NULL;
+  idx->capacity = 0;
+  idx->table_size = 0;
+}
+
+/* Returns the entry for <filename>, or NULL if it isn't tracked. */
+struct index_entry* index_find(struct index* idx, const char* filename) {
+  int pos = *index_slot(idx, filename);
+  return pos ? &idx->entries[pos - 1] : NULL;
+}
+
+/* Track <filename> and return its entry. If it is already tracked, the
+ * existing entry is returned.
+ */
+struct index_entry* index_add(struct index* idx, const char* filename) {
+  int* slot = index_slot(idx, filename);
+  if (*slot) {
+    return &idx->entries[*slot - 1];
+  }
+
+  index_append(idx, filename, strlen(filename));
+  if (2 * idx->count > idx->table_size) {
+    index_rehash(idx, idx->count);
+  } else {
+    *slot = idx->count;
+  }
+  return &idx->entries[idx->count - 1];
+}
+
+/* Stop tracking <filename>. Returns 1 if it was tracked, 0 otherwise. */
+int index_remove(struct index* idx, const char* filename) {
+  int* slot = index_slot(idx, filename);
+  if (!*slot) {
+    return 0;
+  }
+  int pos = *slot - 1;
+
+  // Backward-shift deletion keeps every probe sequence intact without
+  // leaving tombstones behind.
+  unsigned int mask = idx->table_size - 1;
+  unsigned int i = slot - idx->table;
+  for (unsigned int j = (i + 1) & mask; idx->table[j]; j = (j + 1) & mask) {
+    unsigned int k = index_hash(idx->entries[idx->table[j] - 1].filename) & mask;
+    if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+      idx->table[i] = idx->table[j];
+      i = j;
+    }
+  }
+  idx->table[i] = 0;
+
+  // Move the last entry into the freed position.
+  int last = idx->count - 1;
+  if (pos != last) {
+    idx->entries[pos] = idx->entries[last];
+    *index_slot(idx, idx->entries[pos].filename) = pos + 1;
+    idx->sorted = 0;
+  }
+  idx->count--;
+  return 1;
+}
+
+/* Returns 1 if the cached stat data of <e> matches <st>. */
+int index_entry_uptodate(const struct index_entry* e, const struct stat* st) {
+  return (e->flags & INDEX_ENTRY_VALID)
+      && e->ino == (uint64_t) st->st_ino
+      && e->size == (uint64_t) st->st_size
+      && e->mtime_ns == st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec;
+}
+
+/* Cache <st> and object id <id> for entry <e>.
+ *
+ * This only touches <e>, so entries can be refreshed from several threads;
+ * the caller marks the index as changed.
+ */
+void index_entry_set_stat(struct index_entry* e, const struct stat* st, const char* id) {
+  e->ino = st->st_ino;
+  e->size = st->st_size;
+  e->mtime_ns = st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec;
+  if (strcmp(e->id, id) != 0) {
+    snprintf(e->id, OBJECT_ID_SIZE, "%s", id);
+    e->flags &= ~INDEX_ENTRY_STORED;
+  }
+  e->flags |= INDEX_ENTRY_VALID;
+}
+
+/* Make sure the cached object id of <e> matches the file on disk, hashing
+ * the file only if its stat data changed.
+ *
+ * Returns INDEX_CLEAN if the cached data was up to date, INDEX_REHASHED if
+ * the file had to be hashed again and INDEX_DELETED if it no longer exists.
+ * A deleted file loses its cached data, so that the filesystem monitor
+ * doesn't hide it once the index takes a newer token.
+ */
+int index_refresh_entry(struct index_entry* e) {
+  struct stat st;
+  if (lstat(e->filename, &st) != 0) {
+    e->flags &= ~INDEX_ENTRY_VALID;
+    return INDEX_DELETED;
+  }
+  if (index_entry_uptodate(e, &st)) {
+    return INDEX_CLEAN;
+  }
+
+  char id[OBJECT_ID_SIZE];
+  cryptohash_file(e->filename, id);
+  index_entry_set_stat(e, &st, id);
+  return INDEX_REHASHED;
+}
+
+/* Ask the filesystem monitor which entries of <idx> may have changed
+ * since its stat data was last checked. Returns 1 if it can tell (see
+ * index_entry_maybe_dirty()), 0 if every entry must be checked.
+ *
+ * Either way the index takes the current token: the caller is about to
+ * check every entry that may have changed. After a full scan the index is
+ * marked as changed, so the next command can rely on the monitor.
+ */
+int index_fsmonitor_begin(struct index* idx) {
+  int monitored = fsmonitor_begin(idx->fsmonitor_token);
+  char token[FSMONITOR_TOKEN_SIZE];
+  fsmonitor_token(token);
+  if (token[0] && strcmp(token, idx->fsmonitor_token) != 0) {
+    snprintf(idx->fsmonitor_token, FSMONITOR_TOKEN_SIZE, "%s", token);
+    idx->changed |= !monitored;
+  }
+  return monitored;
+}
+
+/* Returns 1 if the file of <e> must be checked: always, unless
+ * <monitored> by index_fsmonitor_begin() and the monitor saw no change to
+ * it since its stat data was cached.
+ */
+int index_entry_maybe_dirty(const struct index_entry* e, int monitored) {
+  return !monitored || !(e->flags & INDEX_ENTRY_VALID) || fsmonitor_is_dirty(e->filename);
+}
+
+/* Record that the contents of object <id> were just written to the file of
+ * entry <e>, so the next refresh doesn't need to hash it.
+ */
+void index_entry_checked_out(struct index* idx, struct index_entry* e, const char* id) {
+  struct stat st;
+  ASSERT_ERROR_MESSAGE(lstat(e->filename, &st) == 0, "couldn't stat checked out file");
+  index_entry_set_stat(e, &st, id);
+  e->flags |= INDEX_ENTRY_STORED;
+  idx->changed = 1;
+}
@@ -0,0 +1,706 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "hash.h"
+#include "pack.h"
+#include "util.h"
+
+#define PACK_SIGNATURE "BPAK"
+#define PACK_IDX_SIGNATURE "BPIX"
+#define PACK_VERSION 1
+#define PACK_HEADER_SIZE 12
+#define PACK_IDX_HEADER_SIZE (12 + 256 * 4)
+
+// Objects compared against each object when looking for a delta base
+#define PACK_WINDOW 10
+// Longest chain of deltas a read has to resolve
+#define PACK_MAX_DEPTH 16
+// Objects larger than this are only compressed, never delta-encoded
+#define PACK_MAX_DELTA_SIZE (64 << 20)
+// Block size the delta encoder matches on
+#define DELTA_BLOCK 16
+
+struct pack {
+  char name[OBJECT_ID_SIZE];
+  const unsigned char* idx;
+  size_t idx_size;
+  const unsigned char* data;
+  size_t data_size;
+  uint32_t count;
+};
+
+static struct pack* packs = NULL;
+static int num_packs = 0;
+static int packs_loaded = 0;
+static pthread_mutex_t packs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ---- Encoding helpers ---- */
+
+static size_t varint_put(unsigned char* p, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+static int varint_get(const unsigned char** p, const unsigned char* end, uint64_t* v) {
+  *v = 0;
+  for (int shift = 0; *p < end && shift < 64; shift += 7) {
+    unsigned char b = *(*p)++;
+    *v |= (uint64_t) (b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static uint32_t get_u32(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohl(v);
+}
+
+static void put_u32(unsigned char* p, uint32_t v) {
+  v = htonl(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+/* ---- Reading ---- */
+
+static const void* map_file(const char* path, size_t* size) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  struct stat st;
+  void* map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    *size = st.st_size;
+  }
+  close(fd);
+  return map == MAP_FAILED ? NULL : map;
+}
+
+static void packs_unload(void) {
+  for (int i = 0; i < num_packs; i++) {
+    munmap((void*) packs[i].idx, packs[i].idx_size);
+    munmap((void*) packs[i].data, packs[i].data_size);
+  }
+  free(packs);
+  packs = NULL;
+  num_packs = 0;
+}
+
+/* Map the index and pack of every pack-<sha>.idx in PACK_DIR. */
+static void packs_load(void) {
+  pthread_mutex_lock(&packs_lock);
+  if (packs_loaded) {
+    pthread_mutex_unlock(&packs_lock);
+    return;
+  }
+
+  DIR* d = opendir(PACK_DIR);
+  struct dirent* de;
+  while (d && (de = readdir(d)) != NULL) {
+    size_t len = strlen(de->d_name);
+    if (len != 5 + OBJECT_ID_BYTES + 4 || strncmp(de->d_name, "pack-", 5) != 0
+        || strcmp(de->d_name + len - 4, ".idx") != 0) {
+      continue;
+    }
+
+    struct pack p;
+    snprintf(p.name, OBJECT_ID_SIZE, "%.*s", OBJECT_ID_BYTES, de->d_name + 5);
+    char path[sizeof(PACK_DIR) + OBJECT_ID_BYTES + 16];
+    sprintf(path, "%s/pack-%s.idx", PACK_DIR, p.name);
+    p.idx = map_file(path, &p.idx_size);
+    sprintf(path, "%s/pack-%s.pack", PACK_DIR, p.name);
+    p.data = map_file(path, &p.data_size);
+
+    int ok = p.idx && p.data
+        && p.idx_size >= PACK_IDX_HEADER_SIZE + 2 * SHA_DIGEST_LENGTH
+        && memcmp(p.idx, PACK_IDX_SIGNATURE, 4) == 0
+        && get_u32(p.idx + 4) == PACK_VERSION
+        && p.data_size >= PACK_HEADER_SIZE + SHA_DIGEST_LENGTH
+        && memcmp(p.data, PACK_SIGNATURE, 4) == 0;
+    if (ok) {
+      p.count = get_u32(p.idx + 8);
+      ok = p.idx_size == PACK_IDX_HEADER_SIZE + (size_t) p.count * (SHA_DIGEST_LENGTH + 8)
+                         + 2 * SHA_DIGEST_LENGTH;
+    }
+    if (!ok) {
+      // Half-written or foreign file; repack will replace it.
+      if (p.idx) munmap((void*) p.idx, p.idx_size);
+      if (p.data) munmap((void*) p.data, p.data_size);
+      continue;
+    }
+
+    packs = realloc(packs, (num_packs + 1) * sizeof(struct pack));
+    ASSERT_ERROR_MESSAGE(packs != NULL, "out of memory");
+    packs[num_packs++] = p;
+  }
+  if (d) {
+    closedir(d);
+  }
+
+  packs_loaded = 1;
+  pthread_mutex_unlock(&packs_lock);
+}
+
+/* Forget the mapped packs, so that the next lookup sees the packs that
+ * are on disk now.
+ */
+void pack_reload(void) {
+  pthread_mutex_lock(&packs_lock);
+  packs_unload();
+  packs_loaded = 0;
+  pthread_mutex_unlock(&packs_lock);
+}
+
+/* Find the pack and offset of the object with raw id <raw>. */
+static int pack_find(const unsigned char* raw, struct pack** found, uint64_t* offset) {
+  packs_load();
+  for (int i = 0; i < num_packs; i++) {
+    struct pack* p = &packs[i];
+    const unsigned char* fanout = p->idx + 12;
+    uint32_t lo = raw[0] ? get_u32(fanout + 4 * (raw[0] - 1)) : 0;
+    uint32_t hi = get_u32(fanout + 4 * raw[0]);
+    const unsigned char* ids = p->idx + PACK_IDX_HEADER_SIZE;
+
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      int cmp = memcmp(ids + (size_t) mid * SHA_DIGEST_LENGTH, raw, SHA_DIGEST_LENGTH);
+      if (cmp == 0) {
+        uint64_t off;
+        memcpy(&off, ids + (size_t) p->count * SHA_DIGEST_LENGTH + (size_t) mid * 8, 8);
+        *found = p;
+        *offset = be64toh(off);
+        return 1;
+      } else if (cmp < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+  }
+  return 0;
+}
+
+static unsigned char* delta_apply(const unsigned char* base, size_t base_size,
+                                  const unsigned char* delta, size_t delta_size,
+                                  size_t* result_size);
+
+/* Read the object at <offset> of pack <p>, resolving deltas. */
+static unsigned char* pack_read_at(struct pack* p, uint64_t offset, int depth,
+                                   int* type, size_t* size) {
+  ASSERT_ERROR_MESSAGE(depth <= PACK_MAX_DEPTH && offset < p->data_size, "corrupt pack");
+  const unsigned char* cur = p->data + offset;
+  const unsigned char* end = p->data + p->data_size - SHA_DIGEST_LENGTH;
+
+  int obj_type = *cur++;
+  uint64_t obj_size, distance = 0;
+  ASSERT_ERROR_MESSAGE(varint_get(&cur, end, &obj_size), "corrupt pack");
+  if (obj_type == PACK_OBJ_DELTA) {
+    ASSERT_ERROR_MESSAGE(varint_get(&cur, end, &distance) && distance <= offset, "corrupt pack");
+  }
+
+  unsigned char* data = malloc(obj_size ? obj_size : 1);
+  ASSERT_ERROR_MESSAGE(data != NULL, "out of memory");
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  ASSERT_ERROR_MESSAGE(inflateInit(&zs) == Z_OK, "inflateInit failed");
+  zs.next_in = (unsigned char*) cur;
+  zs.avail_in = end - cur;
+  zs.next_out = data;
+  zs.avail_out = obj_size;
+  int ret = inflate(&zs, Z_FINISH);
+  inflateEnd(&zs);
+  ASSERT_ERROR_MESSAGE(ret == Z_STREAM_END && zs.total_out == obj_size, "corrupt pack object");
+
+  if (obj_type != PACK_OBJ_DELTA) {
+    *type = obj_type;
+    *size = obj_size;
+    return data;
+  }
+
+  size_t base_size;
+  unsigned char* base = pack_read_at(p, offset - distance, depth + 1, type, &base_size);
+  unsigned char* result = delta_apply(base, base_size, data, obj_size, size);
+  free(base);
+  free(data);
+  return result;
+}
+
+/* Returns 1 if object <id> is in a pack, and stores its type in <type>. */
+int pack_lookup(const char* id, int* type) {
+  unsigned char raw[SHA_DIGEST_LENGTH];
+  struct pack* p;
+  uint64_t offset;
+  if (strlen(id) != OBJECT_ID_BYTES || !hex_to_hash(id, SHA_DIGEST_LENGTH, raw) || !pack_find(raw, &p, &offset)) {
+    return 0;
+  }
+
+  // Deltas are typed by their base; follow the chain without inflating.
+  const unsigned char* end = p->data + p->data_size;
+  for (int depth = 0; depth <= PACK_MAX_DEPTH; depth++) {
+    const unsigned char* cur = p->data + offset;
+    uint64_t v;
+    int t = *cur++;
+    if (t != PACK_OBJ_DELTA) {
+      *type = t;
+      return 1;
+    }
+    ASSERT_ERROR_MESSAGE(varint_get(&cur, end, &v) && varint_get(&cur, end, &v) && v <= offset,
+                         "corrupt pack");
+    offset -= v;
+  }
+  ASSERT_ERROR_MESSAGE(0, "delta chain too long");
+  return 0;
+}
+
+/* Read packed object <id> into a newly allocated buffer. Returns 0 if the
+ * object isn't packed.
+ */
+int pack_read(const char* id, int* type, unsigned char** data, size_t* size) {
+  unsigned char raw[SHA_DIGEST_LENGTH];
+  struct pack* p;
+  uint64_t offset;
+  if (strlen(id) != OBJECT_ID_BYTES || !hex_to_hash(id, SHA_DIGEST_LENGTH, raw) || !pack_find(raw, &p, &offset)) {
+    return 0;
+  }
+  *data = pack_read_at(p, offset, 0, type, size);
+  return 1;
+}
+
+/* Return the names (<sha> of pack-<sha>) of all packs. */
+int pack_list(char*** names) {
+  packs_load();
+  *names = malloc((num_packs + 1) * sizeof(char*));
+  ASSERT_ERROR_MESSAGE(*names != NULL, "out of memory");
+  for (int i = 0; i < num_packs; i++) {
+    (*names)[i] = strdup(packs[i].name);
+  }
+  return num_packs;
+}
+
+/* ---- Deltas ---- */
+
+static unsigned char* delta_apply(const unsigned char* base, size_t base_size,
+                                  const unsigned char* delta, size_t delta_size,
+                                  size_t* result_size) {
+  const unsigned char* cur = delta;
+  const unsigned char* end = delta + delta_size;
+  uint64_t expected_base, size;
+  ASSERT_ERROR_MESSAGE(varint_get(&cur, end, &expected_base) && expected_base == base_size
+                       && varint_get(&cur, end, &size), "corrupt delta");
+
+  unsigned char* result = malloc(size ? size : 1);
+  ASSERT_ERROR_MESSAGE(result != NULL, "out of memory");
+  size_t out = 0;
+  while (cur < end) {
+    unsigned char op = *cur++;
+    if (op & 0x80) {
+      uint64_t off, len;
+      ASSERT_ERROR_MESSAGE(varint_get(&cur, end, &off) && varint_get(&cur, end, &len)
+                           && off + len <= base_size && out + len <= size, "corrupt delta");
+      memcpy(result + out, base + off, len);
+      out += len;
+    } else {
+      ASSERT_ERROR_MESSAGE(op > 0 && cur + op <= end && out + op <= size, "corrupt delta");
+      memcpy(result + out, cur, op);
+      cur += op;
+      out += op;
+    }
+  }
+  ASSERT_ERROR_MESSAGE(out == size, "corrupt delta");
+  *result_size = size;
+  return result;
+}
+
+#define DELTA_PRIME 0x01000193u
+
+static uint32_t block_hash(const unsigned char* p) {
+  uint32_t h = 0;
+  for (int i = 0; i < DELTA_BLOCK; i++) {
+    h = h * DELTA_PRIME + p[i];
+  }
+  return h;
+}
+
+struct delta_buf {
+  unsigned char* data;
+  size_t size;
+  size_t max;
+};
+
+static int delta_put(struct delta_buf* d, const unsigned char* p, size_t n) {
+  if (d->size + n > d->max) {
+    return 0;
+  }
+  memcpy(d->data + d->size, p, n);
+  d->size += n;
+  return 1;
+}
+
+static int delta_put_insert(struct delta_buf* d, const unsigned char* p, size_t n) {
+  while (n > 0) {
+    unsigned char len = n > 127 ? 127 : n;
+    if (!delta_put(d, &len, 1) || !delta_put(d, p, len)) {
+      return 0;
+    }
+    p += len;
+    n -= len;
+  }
+  return 1;
+}
+
+static int delta_put_copy(struct delta_buf* d, uint64_t off, uint64_t len) {
+  unsigned char op[21];
+  op[0] = 0x80;
+  size_t n = 1 + varint_put(op + 1, off);
+  n += varint_put(op + n, len);
+  return delta_put(d, op, n);
+}
+
+/* Encode <target> as a delta against <base>. Returns NULL if the delta
+ * would not be smaller than <max_size> bytes.
+ *
+ * The base is indexed in DELTA_BLOCK-byte blocks; a rolling hash over the
+ * target finds matching blocks, which are then extended in both
+ * directions.
+ */
+static unsigned char* delta_create(const unsigned char* base, size_t base_size,
+                                   const unsigned char* target, size_t target_size,
+                                   size_t max_size, size_t* delta_size) {
+  if (base_size < DELTA_BLOCK || target_size < DELTA_BLOCK) {
+    return NULL;
+  }
+
+  size_t blocks = base_size / DELTA_BLOCK;
+  size_t table_size = 16;
+  while (table_size < 2 * blocks) {
+    table_size *= 2;
+  }
+  int64_t* table = malloc(table_size * sizeof(int64_t));
+  ASSERT_ERROR_MESSAGE(table != NULL, "out of memory");
+  memset(table, 0xff, table_size * sizeof(int64_t));
+  for (size_t b = 0; b < blocks; b++) {
+    uint32_t h = block_hash(base + b * DELTA_BLOCK);
+    int64_t* slot = &table[h & (table_size - 1)];
+    if (*slot == -1) {
+      *slot = b * DELTA_BLOCK;
+    }
+  }
+
+  struct delta_buf d = { malloc(max_size + 32), 0, max_size };
+  ASSERT_ERROR_MESSAGE(d.data != NULL, "out of memory");
+  unsigned char header[20];
+  size_t n = varint_put(header, base_size);
+  n += varint_put(header + n, target_size);
+  int ok = delta_put(&d, header, n);
+
+  uint32_t top = 1;
+  for (int i = 0; i < DELTA_BLOCK - 1; i++) {
+    top *= DELTA_PRIME;
+  }
+
+  size_t pos = 0;
+  size_t pending = 0;  // start of bytes not yet emitted
+  uint32_t h = block_hash(target);
+  while (ok && pos + DELTA_BLOCK <= target_size) {
+    int64_t cand = table[h & (table_size - 1)];
+    if (cand >= 0 && memcmp(base + cand, target + pos, DELTA_BLOCK) == 0) {
+      size_t b = cand, t = pos;
+      while (t > pending && b > 0 && base[b - 1] == target[t - 1]) {
+        b--;
+        t--;
+      }
+      size_t len = pos - t + DELTA_BLOCK;
+      while (b + len < base_size && t + len < target_size && base[b + len] == target[t + len]) {
+        len++;
+      }
+
+      ok = delta_put_insert(&d, target + pending, t - pending) && delta_put_copy(&d, b, len);
+      pos = pending = t + len;
+      if (pos + DELTA_BLOCK <= target_size) {
+        h = block_hash(target + pos);
+      }
+      continue;
+    }
+
+    if (pos + DELTA_BLOCK < target_size) {
+      h = (h - target[pos] * top) * DELTA_PRIME + target[pos + DELTA_BLOCK];
+    }
+    pos++;
+  }
+  ok = ok && delta_put_insert(&d, target + pending, target_size - pending);
+  free(table);
+
+  if (!ok) {
+    free(d.data);
+    return NULL;
+  }
+  *delta_size = d.size;
+  return d.data;
+}
+
+/* ---- Writing ---- */
+
+struct pack_writer {
+  FILE* f;
+  struct hash_ctx ctx;
+  uint64_t offset;
+};
+
+static void writer_put(struct pack_writer* w, const void* data, size_t size) {
+  ASSERT_ERROR_MESSAGE(fwrite(data, 1, size, w->f) == size, "writing pack failed");
+  hash_update(&w->ctx, data, size);
+  w->offset += size;
+}
+
+static void writer_put_object(struct pack_writer* w, int type, const unsigned char* data,
+                              size_t size, uint64_t distance) {
+  unsigned char header[21];
+  header[0] = type;
+  size_t n = 1 + varint_put(header + 1, size);
+  if (type == PACK_OBJ_DELTA) {
+    n += varint_put(header + n, distance);
+  }
+  writer_put(w, header, n);
+
+  uLongf zsize = compressBound(size);
+  unsigned char* z = malloc(zsize);
+  ASSERT_ERROR_MESSAGE(z != NULL, "out of memory");
+  ASSERT_ERROR_MESSAGE(compress2(z, &zsize, data, size, Z_DEFAULT_COMPRESSION) == Z_OK,
+                       "compressing object failed");
+  writer_put(w, z, zsize);
+  free(z);
+}
+
+/* Load the contents of an object to be packed. */
+static unsigned char* pack_object_load(struct pack_object* o, size_t* size) {
+  unsigned char* data;
+  if (o->data) {
+    data = malloc(o->size ? o->size : 1);
+    ASSERT_ERROR_MESSAGE(data != NULL, "out of memory");
+    memcpy(data, o->data, o->size);
+    *size = o->size;
+  } else if (o->source) {
+    data = fs_read_file(o->source, size);
+  } else {
+    ASSERT_ERROR_MESSAGE(object_read(o->id, &data, size), "object to pack is missing");
+  }
+  return data;
+}
+
+static int pack_object_cmp(const void* a, const void* b) {
+  const struct pack_object* x = a;
+  const struct pack_object* y = b;
+  if (x->type != y->type) {
+    return x->type - y->type;
+  }
+  // Versions of the same file next to each other, largest first (deltas
+  // that remove data are smaller than deltas that add it).
+  if (x->type == PACK_OBJ_BLOB) {
+    int cmp = strcmp(x->name ? x->name : "", y->name ? y->name : "");
+    if (cmp != 0) {
+      return cmp;
+    }
+    if (x->size != y->size) {
+      return x->size < y->size ? 1 : -1;
+    }
+  }
+  return x->order - y->order;
+}
+
+struct pack_idx_entry {
+  unsigned char raw[SHA_DIGEST_LENGTH];
+  uint64_t offset;
+};
+
+static int pack_idx_entry_cmp(const void* a, const void* b) {
+  return memcmp(((const struct pack_idx_entry*) a)->raw,
+                ((const struct pack_idx_entry*) b)->raw, SHA_DIGEST_LENGTH);
+}
+
+struct window_slot {
+  unsigned char* data;
+  size_t size;
+  uint64_t offset;
+  int type;
+  int depth;
+};
+
+/* Write <objects> into a new pack in PACK_DIR and store the pack's name in
+ * <name>. The pack and index are written to temporary files and renamed
+ * into place, the index last, so readers never see a partial pack.
+ *
+ * Each object is delta-encoded against the best of the PACK_WINDOW
+ * objects before it (after sorting versions of the same file next to each
+ * other) if that saves at least half of its size.
+ */
+void pack_write(struct pack_object* objects, int count, char name[OBJECT_ID_SIZE],
+                struct pack_stats* stats) {
+  object_store_init();
+  if (!fs_check_dir_exists(PACK_DIR)) {
+    fs_mkdir(PACK_DIR);
+  }
+
+  // Sizes are only needed for sorting; loose objects are sized by their
+  // header (or by stat, if they aren't compressed).
+  for (int i = 0; i < count; i++) {
+    if (!objects[i].data && objects[i].type == PACK_OBJ_BLOB) {
+      struct stat st;
+      if (objects[i].source) {
+        objects[i].size = stat(objects[i].source, &st) == 0 ? st.st_size : 0;
+      } else if (!object_loose_size(objects[i].id, &objects[i].size)) {
+        objects[i].size = 0;
+      }
+    }
+  }
+  qsort(objects, count, sizeof(struct pack_object), pack_object_cmp);
+
+  char tmp_pack[sizeof(PACK_DIR) + 16];
+  sprintf(tmp_pack, "%s/tmp_XXXXXX", PACK_DIR);
+  int fd = mkstemp(tmp_pack);
+  ASSERT_ERROR_MESSAGE(fd != -1, "creating temporary pack failed");
+  fs_tmp_mode(fd);
+
+  struct pack_writer w;
+  w.f = fdopen(fd, "w");
+  ASSERT_ERROR_MESSAGE(w.f != NULL, "opening temporary pack failed");
+  hash_init(&w.ctx, HASH_SHA1);
+  w.offset = 0;
+
+  unsigned char header[PACK_HEADER_SIZE];
+  memcpy(header, PACK_SIGNATURE, 4);
+  put_u32(header + 4, PACK_VERSION);
+  put_u32(header + 8, count);
+  writer_put(&w, header, sizeof(header));
+
+  struct pack_idx_entry* entries = malloc((count + 1) * sizeof(struct pack_idx_entry));
+  ASSERT_ERROR_MESSAGE(entries != NULL, "out of memory");
+  struct window_slot window[PACK_WINDOW];
+  memset(window, 0, sizeof(window));
+  stats->objects = count;
+  stats->deltas = 0;
+
+  for (int i = 0; i < count; i++) {
+    struct pack_object* o = &objects[i];
+    size_t size;
+    unsigned char* data = pack_object_load(o, &size);
+    ASSERT_ERROR_MESSAGE(hex_to_hash(o->id, SHA_DIGEST_LENGTH, entries[i].raw), "invalid object id");
+    entries[i].offset = w.offset;
+
+    unsigned char* best = NULL;
+    size_t best_size = size / 2;
+    struct window_slot* best_base = NULL;
+    for (int j = 0; j < PACK_WINDOW && size <= PACK_MAX_DELTA_SIZE; j++) {
+      struct window_slot* s = &window[j];
+      if (!s->data || s->type != o->type || s->depth >= PACK_MAX_DEPTH) {
+        continue;
+      }
+      size_t delta_size;
+      unsigned char* delta = delta_create(s->data, s->size, data, size, best_size, &delta_size);
+      if (delta) {
+        free(best);
+        best = delta;
+        best_size = delta_size;
+        best_base = s;
+      }
+    }
+
+    int depth = 0;
+    if (best) {
+      writer_put_object(&w, PACK_OBJ_DELTA, best, best_size, entries[i].offset - best_base->offset);
+      depth = best_base->depth + 1;
+      stats->deltas++;
+      free(best);
+    } else {
+      writer_put_object(&w, o->type, data, size, 0);
+    }
+
+    struct window_slot* slot = &window[i % PACK_WINDOW];
+    free(slot->data);
+    slot->data = size <= PACK_MAX_DELTA_SIZE ? data : NULL;
+    slot->size = size;
+    slot->offset = entries[i].offset;
+    slot->type = o->type;
+    slot->depth = depth;
+    if (!slot->data) {
+      free(data);
+    }
+  }
+  for (int j = 0; j < PACK_WINDOW; j++) {
+    free(window[j].data);
+  }
+
+  unsigned char checksum[SHA_DIGEST_LENGTH];
+  hash_final(&w.ctx, checksum);
+  ASSERT_ERROR_MESSAGE(fwrite(checksum, 1, SHA_DIGEST_LENGTH, w.f) == SHA_DIGEST_LENGTH,
+                       "writing pack failed");
+  ASSERT_ERROR_MESSAGE(fclose(w.f) == 0, "writing pack failed");
+  stats->bytes = w.offset + SHA_DIGEST_LENGTH;
+  hash_to_hex(checksum, SHA_DIGEST_LENGTH, name);
+
+  // Index: fan-out table, sorted ids, offsets, checksums.
+  qsort(entries, count, sizeof(struct pack_idx_entry), pack_idx_entry_cmp);
+  char tmp_idx[sizeof(PACK_DIR) + 16];
+  sprintf(tmp_idx, "%s/tmp_XXXXXX", PACK_DIR);
+  fd = mkstemp(tmp_idx);
+  ASSERT_ERROR_MESSAGE(fd != -1, "creating temporary pack index failed");
+  fs_tmp_mode(fd);
+  w.f = fdopen(fd, "w");
+  ASSERT_ERROR_MESSAGE(w.f != NULL, "opening temporary pack index failed");
+  hash_init(&w.ctx, HASH_SHA1);
+  w.offset = 0;
+
+  unsigned char idx_header[PACK_IDX_HEADER_SIZE];
+  memcpy(idx_header, PACK_IDX_SIGNATURE, 4);
+  put_u32(idx_header + 4, PACK_VERSION);
+  put_u32(idx_header + 8, count);
+  int e = 0;
+  for (int b = 0; b < 256; b++) {
+    while (e < count && entries[e].raw[0] == b) {
+      e++;
+    }
+    put_u32(idx_header + 12 + 4 * b, e);
+  }
+  writer_put(&w, idx_header, sizeof(idx_header));
+  for (int i = 0; i < count; i++) {
+    writer_put(&w, entries[i].raw, SHA_DIGEST_LENGTH);
+  }
+  for (int i = 0; i < count; i++) {
+    uint64_t off = htobe64(entries[i].offset);
+    writer_put(&w, &off, sizeof(off));
+  }
+  writer_put(&w, checksum, SHA_DIGEST_LENGTH);
+  hash_final(&w.ctx, checksum);
+  ASSERT_ERROR_MESSAGE(fwrite(checksum, 1, SHA_DIGEST_LENGTH, w.f) == SHA_DIGEST_LENGTH,
+                       "writing pack index failed");
+  ASSERT_ERROR_MESSAGE(fclose(w.f) == 0, "writing pack index failed");
+  free(entries);
+
+  char path[sizeof(PACK_DIR) + OBJECT_ID_BYTES + 16];
+  sprintf(path, "%s/pack-%s.pack", PACK_DIR, name);
+  fs_mv(tmp_pack, path);
+  sprintf(path, "%s/pack-%s.idx", PACK_DIR, name);
+  fs_mv(tmp_idx, path);
+  pack_reload();
+}
@@ -0,0 +1,506 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "refs.h"
+#include "trace.h"
+#include "util.h"
+
+#define REFS_LINE_SIZE (COMMIT_ID_SIZE + BRANCHNAME_SIZE + 1)
+
+/* Returns 1 if <name> can be used as a branch name: not empty, no
+ * whitespace or control characters, no "." component or "..", no
+ * leading, trailing or double '/', and no ".lock" suffix.
+ */
+int refs_check_name(const char* name) {
+  size_t len = strlen(name);
+  if (len == 0 || len >= BRANCHNAME_SIZE || name[0] == '/' || name[len - 1] == '/'
+      || strstr(name, "..") || strstr(name, "//") || strstr(name, "/.") || name[0] == '.'
+      || (len >= 5 && strcmp(name + len - 5, ".lock") == 0)) {
+    return 0;
+  }
+  for (size_t i = 0; i < len; i++) {
+    if ((unsigned char) name[i] <= ' ' || name[i] == 0x7f) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Create <path>.lock for writing. Prints an error and returns -1 if it
+ * already exists, i.e. another beargit is updating <path>.
+ */
+static int lock_file(const char* path, char lock[PATH_MAX]) {
+  snprintf(lock, PATH_MAX, "%s.lock", path);
+  int fd = open(lock, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "ERROR:  Could not lock %s; is another beargit running?\n", path);
+  }
+  return fd;
+}
+
+/* Write <size> bytes of <data> to the lock file and rename it onto <path>. */
+static void commit_lock_file(int fd, const char* lock, const char* path,
+                             const char* data, size_t size) {
+  ASSERT_ERROR_MESSAGE(write(fd, data, size) == (ssize_t) size, "writing lock file failed");
+  ASSERT_ERROR_MESSAGE(close(fd) == 0, "writing lock file failed");
+  fs_mv(lock, path);
+}
+
+static int ref_cmp(const void* a, const void* b) {
+  return strcmp(((const struct ref*) a)->name, ((const struct ref*) b)->name);
+}
+
+/* Replace packed-refs with the <count> refs in <refs>, sorting them. */
+static int write_packed_refs(struct ref* refs, int count) {
+  char lock[PATH_MAX];
+  int fd = lock_file(PACKED_REFS_FILE, lock);
+  if (fd == -1) {
+    return 1;
+  }
+
+  qsort(refs, count, sizeof(struct ref), ref_cmp);
+  char* buf = malloc((size_t) count * REFS_LINE_SIZE + 1);
+  ASSERT_ERROR_MESSAGE(buf != NULL, "out of memory");
+  size_t size = 0;
+  for (int i = 0; i < count; i++) {
+    size += sprintf(buf + size, "%s %s\n", refs[i].id, refs[i].name);
+  }
+  commit_lock_file(fd, lock, PACKED_REFS_FILE, buf, size);
+  free(buf);
+  return 0;
+}
+
+/* Move branches of a repository from before refs into packed-refs. The
+ * old files are deleted only after packed-refs is written, so an
+ * interrupted migration simply runs again.
+ */
+static void refs_migrate(void) {
+  struct stat st;
+  if (stat(".beargit/.branches", &st) != 0) {
+    return;
+  }
+
+  char current_branch[BRANCHNAME_SIZE] = "";
+  read_string_from_file(".beargit/.current_branch", current_branch, BRANCHNAME_SIZE);
+  struct ref* refs = NULL;
+  int count = 0, capacity = 0;
+  struct fs_view v = { NULL, 0, 0 };
+  fs_view_open(".beargit/.branches", &v);
+  size_t off = 0, len;
+  const char* line;
+  while (v.data && fs_view_line(&v, &off, &line, &len)) {
+    char name[BRANCHNAME_SIZE];
+    if (len >= BRANCHNAME_SIZE) {
+      continue;
+    }
+    memcpy(name, line, len);
+    name[len] = '\0';
+    if (!refs_check_name(name)) {
+      continue;
+    }
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      refs = realloc(refs, capacity * sizeof(struct ref));
+      ASSERT_ERROR_MESSAGE(refs != NULL, "out of memory");
+    }
+
+    // The current branch's file is only written when leaving it.
+    struct ref* r = &refs[count++];
+    char branch_file[PATH_MAX];
+    snprintf(r->name, BRANCHNAME_SIZE, "%s", name);
+    snprintf(branch_file, PATH_MAX, ".beargit/.branch_%s", name);
+    snprintf(r->id, COMMIT_ID_SIZE, "%s", NULL_COMMIT_ID);
+    if (strcmp(name, current_branch) == 0 || stat(branch_file, &st) != 0) {
+      read_string_from_file(".beargit/.prev", r->id, COMMIT_ID_SIZE);
+    } else {
+      read_string_from_file(branch_file, r->id, COMMIT_ID_SIZE);
+    }
+  }
+  if (v.data) {
+    fs_view_close(&v);
+  }
+
+  if (write_packed_refs(refs, count) == 0) {
+    for (int i = 0; i < count; i++) {
+      char branch_file[PATH_MAX];
+      snprintf(branch_file, PATH_MAX, ".beargit/.branch_%s", refs[i].name);
+      unlink(branch_file);
+    }
+    fs_rm(".beargit/.branches");
+  }
+  free(refs);
+}
+
+static const char* packed_refs_map(size_t* size) {
+  int fd = open(PACKED_REFS_FILE, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  struct stat st;
+  const char* data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  *size = st.st_size;
+  return data == MAP_FAILED ? NULL : data;
+}
+
+// The packed-refs mapping kept by beargit daemon (see refs_cache_refresh())
+static const char* packed_refs_cached;
+static size_t packed_refs_cached_size;
+static struct cache_stamp packed_refs_stamp = CACHE_STAMP_EMPTY;
+
+/* Map packed-refs for lookups in processes forked from now on, unless the
+ * mapping is still up to date.
+ */
+void refs_cache_refresh(void) {
+  if (cache_stamp_valid(&packed_refs_stamp, PACKED_REFS_FILE)) {
+    return;
+  }
+  if (packed_refs_cached) {
+    munmap((void*) packed_refs_cached, packed_refs_cached_size);
+    packed_refs_cached = NULL;
+  }
+  if (cache_stamp_fill(&packed_refs_stamp, PACKED_REFS_FILE)) {
+    packed_refs_cached = packed_refs_map(&packed_refs_cached_size);
+  }
+}
+
+/* Look <name> up in packed-refs. Lines are sorted by name, so this is a
+ * binary search over byte offsets: each probe backs up to the start of
+ * the line it lands in.
+ */
+static int packed_refs_find(const char* name, char id[COMMIT_ID_SIZE]) {
+  size_t size;
+  const char* data;
+  int cached = packed_refs_cached && cache_stamp_valid(&packed_refs_stamp, PACKED_REFS_FILE);
+  if (cached) {
+    data = packed_refs_cached;
+    size = packed_refs_cached_size;
+  } else if ((data = packed_refs_map(&size)) == NULL) {
+    return 0;
+  }
+
+  size_t name_len = strlen(name);
+  size_t lo = 0, hi = size;
+  int found = 0;
+  while (lo < hi && !found) {
+    size_t start = lo + (hi - lo) / 2;
+    while (start > lo && data[start - 1] != '\n') {
+      start--;
+    }
+    const char* eol = memchr(data + start, '\n', size - start);
+    size_t end = eol ? (size_t) (eol - data) : size;
+    ASSERT_ERROR_MESSAGE(end - start > COMMIT_ID_BYTES + 1, "corrupt packed-refs");
+
+    const char* line_name = data + start + COMMIT_ID_BYTES + 1;
+    size_t line_len = end - start - COMMIT_ID_BYTES - 1;
+    int cmp = memcmp(name, line_name, name_len < line_len ? name_len : line_len);
+    if (cmp == 0) {
+      cmp = (name_len > line_len) - (name_len < line_len);
+    }
+    if (cmp == 0) {
+      memcpy(id, data + start, COMMIT_ID_BYTES);
+      id[COMMIT_ID_BYTES] = '\0';
+      found = 1;
+    } else if (cmp < 0) {
+      hi = start;
+    } else {
+      lo = end + 1;
+    }
+  }
+  if (!cached) {
+    munmap((void*) data, size);
+  }
+  return found;
+}
+
+static int loose_ref_read(const char* path, char id[COMMIT_ID_SIZE]) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return 0;
+  }
+  ssize_t n = read(fd, id, COMMIT_ID_BYTES);
+  close(fd);
+  id[COMMIT_ID_BYTES] = '\0';
+  return n == COMMIT_ID_BYTES;
+}
+
+/* Store the commit id of branch <name> in <id>. Returns 1 if the branch
+ * exists, 0 otherwise.
+ */
+int refs_read(const char* name, char id[COMMIT_ID_SIZE]) {
+  refs_migrate();
+  if (!refs_check_name(name)) {
+    return 0;
+  }
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/%s", REFS_DIR, name);
+  return loose_ref_read(path, id) || packed_refs_find(name, id);
+}
+
+/* Returns 1 if branch <name> can't coexist with an existing branch: one
+ * whose name is <name> followed by '/' and more, or the other way round.
+ * Their loose refs would be a file and a directory at the same path. The
+ * other branch's name is stored in <conflict>.
+ */
+int refs_find_conflict(const char* name, char conflict[BRANCHNAME_SIZE]) {
+  struct ref* refs;
+  int count = refs_list(&refs);
+  size_t len = strlen(name);
+  int found = 0;
+  for (int i = 0; i < count && !found; i++) {
+    size_t other_len = strlen(refs[i].name);
+    const char* longer = other_len > len ? refs[i].name : name;
+    size_t common = other_len > len ? len : other_len;
+    if (other_len != len && strncmp(name, refs[i].name, common) == 0 && longer[common] == '/') {
+      snprintf(conflict, BRANCHNAME_SIZE, "%s", refs[i].name);
+      found = 1;
+    }
+  }
+  free(refs);
+  return found;
+}
+
+/* Returns 1 if the loose ref file <path> can't be written because it is a
+ * directory or one of the directories above it is a file, i.e. a branch
+ * conflicting with it exists (see refs_find_conflict()).
+ */
+static int loose_ref_blocked(const char* path) {
+  struct stat st;
+  if (stat(path, &st) == 0) {
+    return S_ISDIR(st.st_mode);
+  }
+  char dir[PATH_MAX];
+  snprintf(dir, PATH_MAX, "%s", path);
+  for (char* slash = strchr(dir + strlen(REFS_DIR) + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    int file = stat(dir, &st) == 0 && !S_ISDIR(st.st_mode);
+    *slash = '/';
+    if (file) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Point branch <name> at commit <id> when <t> commits, creating the
+ * branch if needed. The ref stays locked until then.
+ *
+ * Returns 0 on success, 1 if the ref is locked or conflicts with another
+ * branch.
+ */
+int refs_stage_update(struct txn* t, const char* name, const char* id) {
+  refs_migrate();
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/%s", REFS_DIR, name);
+  if (loose_ref_blocked(path)) {
+    fprintf(stderr, "ERROR:  Branch %s conflicts with another branch.\n", name);
+    return 1;
+  }
+  struct trace_span span;
+  trace_begin(&span, "ref update");
+  if (!fs_check_dir_exists(REFS_DIR)) {
+    fs_mkdir(REFS_DIR);
+  }
+  if (strchr(name, '/')) {
+    fs_mkdir_parents(path);
+  }
+
+  char lock[PATH_MAX];
+  int fd = lock_file(path, lock);
+  if (fd != -1) {
+    char line[COMMIT_ID_SIZE + 1];
+    int len = snprintf(line, sizeof(line), "%s\n", id);
+    ASSERT_ERROR_MESSAGE(write(fd, line, len) == len && close(fd) == 0, "writing lock file failed");
+    txn_rename(t, lock, path);
+  }
+  trace_end(&span);
+  return fd == -1;
+}
+
+/* Point branch <name> at commit <id>, creating the branch if needed.
+ * Returns 0 on success, 1 if the ref is locked or conflicts with another
+ * branch.
+ */
+int refs_update(const char* name, const char* id) {
+  struct txn t;
+  txn_begin(&t);
+  if (refs_stage_update(&t, name, id)) {
+    txn_abort(&t);
+    return 1;
+  }
+  txn_commit(&t);
+  return 0;
+}
+
+// Remove the loose ref file <path> and the directories this leaves empty.
+static void loose_ref_remove(const char* path) {
+  fs_rm(path);
+  char dir[PATH_MAX];
+  snprintf(dir, PATH_MAX, "%s", path);
+  char* slash;
+  while ((slash = strrchr(dir, '/')) != NULL && slash > dir + strlen(REFS_DIR)) {
+    *slash = '\0';
+    if (rmdir(dir) != 0) {
+      break;
+    }
+  }
+}
+
+static void list_append(struct ref** refs, int* count, int* capacity,
+                        const char* name, const char* id) {
+  if (*count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 64;
+    *refs = realloc(*refs, *capacity * sizeof(struct ref));
+    ASSERT_ERROR_MESSAGE(*refs != NULL, "out of memory");
+  }
+  snprintf((*refs)[*count].name, BRANCHNAME_SIZE, "%s", name);
+  snprintf((*refs)[*count].id, COMMIT_ID_SIZE, "%s", id);
+  (*count)++;
+}
+
+// Append the loose refs under REFS_DIR/<prefix> to <refs>.
+static void list_loose(const char* prefix, struct ref** refs, int* count, int* capacity) {
+  char dir[PATH_MAX];
+  snprintf(dir, PATH_MAX, "%s%s%s", REFS_DIR, *prefix ? "/" : "", prefix);
+  DIR* d = opendir(dir);
+  struct dirent* de;
+  while (d && (de = readdir(d)) != NULL) {
+    size_t len = strlen(de->d_name);
+    if (de->d_name[0] == '.' || (len >= 5 && strcmp(de->d_name + len - 5, ".lock") == 0)) {
+      continue;
+    }
+    char name[PATH_MAX];
+    char path[PATH_MAX];
+    snprintf(name, PATH_MAX, "%s%s%s", prefix, *prefix ? "/" : "", de->d_name);
+    snprintf(path, PATH_MAX, "%s/%s", REFS_DIR, name);
+    if (fs_check_dir_exists(path)) {
+      list_loose(name, refs, count, capacity);
+      continue;
+    }
+    char id[COMMIT_ID_SIZE];
+    if (strlen(name) < BRANCHNAME_SIZE && loose_ref_read(path, id)) {
+      list_append(refs, count, capacity, name, id);
+    }
+  }
+  if (d) {
+    closedir(d);
+  }
+}
+
+// Append the refs in packed-refs to <refs>.
+static void list_packed(struct ref** refs, int* count, int* capacity) {
+  struct fs_view v;
+  if (!fs_view_open(PACKED_REFS_FILE, &v)) {
+    return;
+  }
+  size_t off = 0, len;
+  const char* line;
+  while (fs_view_line(&v, &off, &line, &len)) {
+    size_t name_len = len - COMMIT_ID_BYTES - 1;
+    ASSERT_ERROR_MESSAGE(len > COMMIT_ID_BYTES + 1 && line[COMMIT_ID_BYTES] == ' '
+                         && name_len < BRANCHNAME_SIZE, "corrupt packed-refs");
+    char id[COMMIT_ID_SIZE], name[BRANCHNAME_SIZE];
+    memcpy(id, line, COMMIT_ID_BYTES);
+    id[COMMIT_ID_BYTES] = '\0';
+    memcpy(name, line + COMMIT_ID_BYTES + 1, name_len);
+    name[name_len] = '\0';
+    list_append(refs, count, capacity, name, id);
+  }
+  fs_view_close(&v);
+}
+
+/* Store all branches, sorted by name, in a newly allocated array <refs>
+ * and return their number.
+ */
+int refs_list(struct ref** refs) {
+  refs_migrate();
+  *refs = NULL;
+  int count = 0, capacity = 0;
+  list_loose("", refs, &count, &capacity);
+  int loose = count;
+  list_packed(refs, &count, &capacity);
+
+  // Keep a packed ref only if no loose ref has its name.
+  qsort(*refs, loose, sizeof(struct ref), ref_cmp);
+  int out = loose;
+  for (int i = loose; i < count; i++) {
+    if (!bsearch(&(*refs)[i], *refs, loose, sizeof(struct ref), ref_cmp)) {
+      (*refs)[out++] = (*refs)[i];
+    }
+  }
+  qsort(*refs, out, sizeof(struct ref), ref_cmp);
+  return out;
+}
+
+/* Delete branch <name>, loose and packed. Returns 0 on success, 1 if
+ * packed-refs is locked.
+ */
+int refs_delete(const char* name) {
+  refs_migrate();
+  char id[COMMIT_ID_SIZE];
+  if (packed_refs_find(name, id)) {
+    struct ref* refs = NULL;
+    int count = 0, capacity = 0;
+    list_packed(&refs, &count, &capacity);
+    int out = 0;
+    for (int i = 0; i < count; i++) {
+      if (strcmp(refs[i].name, name) != 0) {
+        refs[out++] = refs[i];
+      }
+    }
+    int failed = write_packed_refs(refs, out);
+    free(refs);
+    if (failed) {
+      return 1;
+    }
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/%s", REFS_DIR, name);
+  struct stat st;
+  if (stat(path, &st) == 0) {
+    loose_ref_remove(path);
+  }
+  return 0;
+}
+
+/* Move all loose refs into packed-refs. Returns the number of refs that
+ * were moved, or -1 if packed-refs is locked.
+ */
+int refs_pack(void) {
+  struct ref* refs;
+  int count = refs_list(&refs);
+  if (write_packed_refs(refs, count) != 0) {
+    free(refs);
+    return -1;
+  }
+
+  // Packed-refs now has every branch; drop loose refs that still match.
+  struct ref* loose = NULL;
+  int num_loose = 0, capacity = 0;
+  list_loose("", &loose, &num_loose, &capacity);
+  int packed = 0;
+  for (int i = 0; i < num_loose; i++) {
+    char path[PATH_MAX];
+    struct ref* r = bsearch(&loose[i], refs, count, sizeof(struct ref), ref_cmp);
+    snprintf(path, PATH_MAX, "%s/%s", REFS_DIR, loose[i].name);
+    if (r && strcmp(r->id, loose[i].id) == 0) {
+      loose_ref_remove(path);
+      packed++;
+    }
+  }
+  free(loose);
+  free(refs);
+  return packed;
+}
@@ -0,0 +1,620 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "commit.h"
+#include "graph.h"
+#include "hash.h"
+#include "search.h"
+#include "util.h"
+
+#define SEARCH_SIGNATURE "BSRC"
+#define SEARCH_VERSION 1
+#define SEARCH_HEADER_SIZE 40
+#define SEARCH_ENTRY_SIZE 12
+
+// Larger than any trigram
+#define SEARCH_NO_TRIGRAM 0xffffffffu
+
+struct search_segment {
+  uint32_t start;
+  uint32_t end;
+  uint32_t count;
+  const unsigned char* table;
+  const unsigned char* postings;
+  const unsigned char* postings_end;
+  struct fs_view v;
+};
+
+static uint32_t get_u32(const unsigned char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohl(v);
+}
+
+static void put_u32(unsigned char* p, uint32_t v) {
+  v = htonl(v);
+  memcpy(p, &v, sizeof(v));
+}
+
+static size_t varint_put(unsigned char* p, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+static int varint_get(const unsigned char** p, const unsigned char* end, uint64_t* v) {
+  *v = 0;
+  for (int shift = 0; *p < end && shift < 64; shift += 7) {
+    unsigned char b = *(*p)++;
+    *v |= (uint64_t) (b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static uint32_t search_trigram(const char* p) {
+  return (uint32_t) tolower((unsigned char) p[0]) << 16
+         | (uint32_t) tolower((unsigned char) p[1]) << 8 | (uint32_t) tolower((unsigned char) p[2]);
+}
+
+static void search_segment_path(uint32_t start, uint32_t end, char path[sizeof(SEARCH_DIR) + 24]) {
+  sprintf(path, "%s/seg-%08x-%08x", SEARCH_DIR, start, end);
+}
+
+/* ---- Postings ---- */
+
+struct search_postings {
+  const unsigned char* p;
+  const unsigned char* end;
+  uint32_t left;
+  uint32_t pos;
+  uint32_t limit;
+};
+
+static void search_postings_open(const struct search_segment* s, uint32_t i,
+                                 struct search_postings* it) {
+  const unsigned char* entry = s->table + (size_t) i * SEARCH_ENTRY_SIZE;
+  uint32_t offset = get_u32(entry + 4);
+  ASSERT_ERROR_MESSAGE(offset <= s->postings_end - s->postings, "corrupt search index");
+  it->p = s->postings + offset;
+  it->end = s->postings_end;
+  it->left = get_u32(entry + 8);
+  it->pos = s->start;
+  it->limit = s->end;
+}
+
+// Store the next position in <pos>. Returns 0 at the end of the list.
+static int search_postings_next(struct search_postings* it, uint32_t* pos) {
+  if (it->left == 0) {
+    return 0;
+  }
+  uint64_t delta;
+  ASSERT_ERROR_MESSAGE(varint_get(&it->p, it->end, &delta) && delta < it->limit - it->pos,
+                       "corrupt search index");
+  it->pos += delta;
+  it->left--;
+  *pos = it->pos;
+  return 1;
+}
+
+/* Find <trigram> in the table of <s>. Returns 1 and its entry in <i> if
+ * it is there.
+ */
+static int search_segment_find(const struct search_segment* s, uint32_t trigram, uint32_t* i) {
+  uint32_t lo = 0, hi = s->count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (get_u32(s->table + (size_t) mid * SEARCH_ENTRY_SIZE) < trigram) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  *i = lo;
+  return lo < s->count && get_u32(s->table + (size_t) lo * SEARCH_ENTRY_SIZE) == trigram;
+}
+
+/* ---- Segments ---- */
+
+/* Open segment <start>-<end>. Returns 0 if it is missing, corrupt or
+ * doesn't match graph <g>.
+ */
+static int search_segment_open(struct graph* g, uint32_t start, uint32_t end,
+                               struct search_segment* s) {
+  char path[sizeof(SEARCH_DIR) + 24];
+  search_segment_path(start, end, path);
+  if (end > g->count || !fs_view_open(path, &s->v)) {
+    return 0;
+  }
+  const unsigned char* data = (const unsigned char*) s->v.data;
+  char id[COMMIT_ID_SIZE];
+  unsigned char raw[SHA_DIGEST_LENGTH];
+  graph_commit_id(g, end - 1, id);
+  hex_to_hash(id, SHA_DIGEST_LENGTH, raw);
+  if (s->v.size < SEARCH_HEADER_SIZE || memcmp(data, SEARCH_SIGNATURE, 4) != 0
+      || get_u32(data + 4) != SEARCH_VERSION || get_u32(data + 8) != start
+      || get_u32(data + 12) != end || memcmp(data + 20, raw, SHA_DIGEST_LENGTH) != 0
+      || (s->v.size - SEARCH_HEADER_SIZE) / SEARCH_ENTRY_SIZE < get_u32(data + 16)) {
+    fs_view_close(&s->v);
+    return 0;
+  }
+  s->start = start;
+  s->end = end;
+  s->count = get_u32(data + 16);
+  s->table = data + SEARCH_HEADER_SIZE;
+  s->postings = s->table + (size_t) s->count * SEARCH_ENTRY_SIZE;
+  s->postings_end = data + s->v.size;
+  return 1;
+}
+
+struct search_range {
+  uint32_t start;
+  uint32_t end;
+};
+
+// By start, and the longest first
+static int search_range_cmp(const void* a, const void* b) {
+  const struct search_range* ra = a;
+  const struct search_range* rb = b;
+  if (ra->start != rb->start) {
+    return ra->start < rb->start ? -1 : 1;
+  }
+  return ra->end > rb->end ? -1 : ra->end < rb->end;
+}
+
+/* Open the segments that cover graph positions 0 on without a gap into
+ * <*segments>, oldest first, and return how many there are. With <prune>,
+ * delete the segment files that aren't among them.
+ */
+static int search_open_segments(struct graph* g, struct search_segment** segments, int prune) {
+  *segments = NULL;
+  DIR* d = opendir(SEARCH_DIR);
+  if (!d) {
+    return 0;
+  }
+  struct search_range* ranges = NULL;
+  int num_ranges = 0, capacity = 0;
+  struct dirent* de;
+  while ((de = readdir(d)) != NULL) {
+    unsigned int start, end;
+    int n = 0;
+    if (sscanf(de->d_name, "seg-%8x-%8x%n", &start, &end, &n) == 2 && n == 21
+        && de->d_name[n] == '\0' && start < end) {
+      if (num_ranges == capacity) {
+        capacity = capacity ? 2 * capacity : 16;
+        ranges = realloc(ranges, capacity * sizeof(struct search_range));
+        ASSERT_ERROR_MESSAGE(ranges != NULL, "out of memory");
+      }
+      ranges[num_ranges].start = start;
+      ranges[num_ranges++].end = end;
+    }
+  }
+  closedir(d);
+  qsort(ranges, num_ranges, sizeof(struct search_range), search_range_cmp);
+
+  *segments = malloc((num_ranges ? num_ranges : 1) * sizeof(struct search_segment));
+  ASSERT_ERROR_MESSAGE(*segments != NULL, "out of memory");
+  int count = 0;
+  uint32_t covered = 0;
+  for (int i = 0; i < num_ranges; i++) {
+    if (ranges[i].start == covered
+        && search_segment_open(g, ranges[i].start, ranges[i].end, &(*segments)[count])) {
+      covered = (*segments)[count++].end;
+    } else if (prune) {
+      char path[sizeof(SEARCH_DIR) + 24];
+      search_segment_path(ranges[i].start, ranges[i].end, path);
+      unlink(path);
+    }
+  }
+  free(ranges);
+  return count;
+}
+
+static void search_close_segments(struct search_segment* segments, int count) {
+  for (int i = 0; i < count; i++) {
+    fs_view_close(&segments[i].v);
+  }
+  free(segments);
+}
+
+/* ---- Writing segments ---- */
+
+struct search_builder {
+  uint32_t start;
+  uint32_t count;
+  unsigned char* table;
+  size_t table_size;
+  size_t table_capacity;
+  unsigned char* postings;
+  size_t postings_size;
+  size_t postings_capacity;
+  uint32_t prev;  // last position of the current trigram
+};
+
+static void search_reserve(unsigned char** buf, size_t* capacity, size_t need) {
+  if (need > *capacity) {
+    *capacity = need > 2 * *capacity ? need : 2 * *capacity;
+    *buf = realloc(*buf, *capacity);
+    ASSERT_ERROR_MESSAGE(*buf != NULL, "out of memory");
+  }
+}
+
+// Start the postings of <trigram>, which must be larger than the last one.
+static void search_builder_trigram(struct search_builder* b, uint32_t trigram) {
+  search_reserve(&b->table, &b->table_capacity, b->table_size + SEARCH_ENTRY_SIZE);
+  unsigned char* entry = b->table + b->table_size;
+  put_u32(entry, trigram);
+  put_u32(entry + 4, b->postings_size);
+  put_u32(entry + 8, 0);
+  b->table_size += SEARCH_ENTRY_SIZE;
+  b->count++;
+  b->prev = b->start;
+}
+
+// Add <pos>, which must be larger than the last one, to the current trigram.
+static void search_builder_add(struct search_builder* b, uint32_t pos) {
+  search_reserve(&b->postings, &b->postings_capacity, b->postings_size + 5);
+  b->postings_size += varint_put(b->postings + b->postings_size, pos - b->prev);
+  b->prev = pos;
+  unsigned char* entry = b->table + b->table_size - SEARCH_ENTRY_SIZE;
+  put_u32(entry + 8, get_u32(entry + 8) + 1);
+}
+
+/* Write the segment built in <b>, which ends at position <end> of graph
+ * <g>, and free <b>.
+ */
+static void search_builder_write(struct search_builder* b, struct graph* g, uint32_t end) {
+  unsigned char header[SEARCH_HEADER_SIZE];
+  char id[COMMIT_ID_SIZE];
+  memcpy(header, SEARCH_SIGNATURE, 4);
+  put_u32(header + 4, SEARCH_VERSION);
+  put_u32(header + 8, b->start);
+  put_u32(header + 12, end);
+  put_u32(header + 16, b->count);
+  graph_commit_id(g, end - 1, id);
+  hex_to_hash(id, SHA_DIGEST_LENGTH, header + 20);
+
+  int ret = mkdir(SEARCH_DIR, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  ASSERT_ERROR_MESSAGE(ret == 0 || errno == EEXIST, "creating search index directory failed");
+  char tmp[] = SEARCH_DIR "/tmp_XXXXXX";
+  int fd = mkstemp(tmp);
+  ASSERT_ERROR_MESSAGE(fd != -1, "creating search index failed");
+  fs_tmp_mode(fd);
+  ASSERT_ERROR_MESSAGE(write(fd, header, sizeof(header)) == (ssize_t) sizeof(header)
+                       && write(fd, b->table, b->table_size) == (ssize_t) b->table_size
+                       && write(fd, b->postings, b->postings_size) == (ssize_t) b->postings_size
+                       && close(fd) == 0, "writing search index failed");
+  char path[sizeof(SEARCH_DIR) + 24];
+  search_segment_path(b->start, end, path);
+  fs_mv(tmp, path);
+  free(b->table);
+  free(b->postings);
+}
+
+static int search_key_cmp(const void* a, const void* b) {
+  uint64_t ka = *(const uint64_t*) a;
+  uint64_t kb = *(const uint64_t*) b;
+  return ka < kb ? -1 : ka > kb;
+}
+
+/* Write a segment for graph positions <start> to <end>. Each message is
+ * read from the graph, or from its commit if the graph lacks it.
+ */
+static void search_build(struct graph* g, uint32_t start, uint32_t end) {
+  // (trigram, position) pairs, sorted into postings order
+  uint64_t* keys = NULL;
+  size_t count = 0, capacity = 0;
+  for (uint32_t pos = start; pos < end; pos++) {
+    const char* msg;
+    size_t len;
+    struct commit_object c;
+    int loaded = 0;
+    if (!graph_msg(g, pos, &msg, &len)) {
+      char id[COMMIT_ID_SIZE];
+      graph_commit_id(g, pos, id);
+      if (!commit_load(id, &c)) {
+        continue;
+      }
+      loaded = 1;
+      msg = c.msg;
+      len = c.msg_len;
+    }
+    if (len >= 3 && count + len > capacity) {
+      capacity = count + len > 2 * capacity ? count + len : 2 * capacity;
+      keys = realloc(keys, capacity * sizeof(uint64_t));
+      ASSERT_ERROR_MESSAGE(keys != NULL, "out of memory");
+    }
+    for (size_t i = 0; i + 3 <= len; i++) {
+      keys[count++] = (uint64_t) search_trigram(msg + i) << 32 | pos;
+    }
+    if (loaded) {
+      commit_free(&c);
+    }
+  }
+  qsort(keys, count, sizeof(uint64_t), search_key_cmp);
+
+  struct search_builder b;
+  memset(&b, 0, sizeof(b));
+  b.start = start;
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0 && keys[i] == keys[i - 1]) {
+      continue;
+    }
+    if (i == 0 || keys[i] >> 32 != keys[i - 1] >> 32) {
+      search_builder_trigram(&b, keys[i] >> 32);
+    }
+    search_builder_add(&b, (uint32_t) keys[i]);
+  }
+  free(keys);
+  search_builder_write(&b, g, end);
+}
+
+/* Write segment <a> and the one after it, <b>, as one segment. */
+static void search_merge(struct graph* g, const struct search_segment* a,
+                         const struct search_segment* b) {
+  struct search_builder out;
+  memset(&out, 0, sizeof(out));
+  out.start = a->start;
+  uint32_t i = 0, j = 0;
+  while (i < a->count || j < b->count) {
+    uint32_t ta = i < a->count ? get_u32(a->table + (size_t) i * SEARCH_ENTRY_SIZE)
+                               : SEARCH_NO_TRIGRAM;
+    uint32_t tb = j < b->count ? get_u32(b->table + (size_t) j * SEARCH_ENTRY_SIZE)
+                               : SEARCH_NO_TRIGRAM;
+    uint32_t trigram = ta < tb ? ta : tb;
+    search_builder_trigram(&out, trigram);
+    struct search_postings it;
+    uint32_t pos;
+    if (ta == trigram) {
+      search_postings_open(a, i++, &it);
+      while (search_postings_next(&it, &pos)) {
+        search_builder_add(&out, pos);
+      }
+    }
+    if (tb == trigram) {
+      search_postings_open(b, j++, &it);
+      while (search_postings_next(&it, &pos)) {
+        search_builder_add(&out, pos);
+      }
+    }
+  }
+  search_builder_write(&out, g, b->end);
+}
+
+/* Bring the search index up to date with the commit graph (see the
+ * top of search.h).
+ */
+void search_update(void) {
+  int lock = graph_lock();
+  struct graph g;
+  graph_open(&g);
+  struct search_segment* segments;
+  int count = search_open_segments(&g, &segments, 1);
+  uint32_t covered = count ? segments[count - 1].end : 0;
+  if (g.count - covered < SEARCH_BATCH) {
+    search_close_segments(segments, count);
+    graph_close(&g);
+    graph_unlock(lock);
+    return;
+  }
+  search_close_segments(segments, count);
+  while (covered < g.count) {
+    uint32_t end = g.count - covered > SEARCH_MAX_BUILD ? covered + SEARCH_MAX_BUILD : g.count;
+    search_build(&g, covered, end);
+    covered = end;
+  }
+
+  count = search_open_segments(&g, &segments, 1);
+  while (count >= 2 && segments[count - 2].end - segments[count - 2].start
+                       <= 2 * (segments[count - 1].end - segments[count - 1].start)) {
+    struct search_segment* a = &segments[count - 2];
+    struct search_segment* b = &segments[count - 1];
+    search_merge(&g, a, b);
+    char path[sizeof(SEARCH_DIR) + 24];
+    search_segment_path(a->start, a->end, path);
+    unlink(path);
+    search_segment_path(b->start, b->end, path);
+    unlink(path);
+    uint32_t start = a->start, end = b->end;
+    fs_view_close(&a->v);
+    fs_view_close(&b->v);
+    count -= 2;
+    ASSERT_ERROR_MESSAGE(search_segment_open(&g, start, end, &segments[count]),
+                         "merged search index is missing");
+    count++;
+  }
+  search_close_segments(segments, count);
+  graph_close(&g);
+  graph_unlock(lock);
+}
+
+/* Delete the search index, for a graph whose positions changed. */
+void search_reset(void) {
+  if (fs_check_dir_exists(SEARCH_DIR)) {
+    fs_rm_tree(SEARCH_DIR);
+  }
+}
+
+/* ---- Queries ---- */
+
+// Add the trigrams of the <len> bytes at <run> to those <s> looks for.
+static void search_add_run(struct search* s, const char* run, size_t len) {
+  for (size_t i = 0; i + 3 <= len; i++) {
+    uint32_t trigram = search_trigram(run + i);
+    int seen = 0;
+    for (int j = 0; j < s->num_trigrams && !seen; j++) {
+      seen = s->trigrams[j] == trigram;
+    }
+    if (!seen) {
+      s->trigrams = realloc(s->trigrams, (s->num_trigrams + 1) * sizeof(uint32_t));
+      ASSERT_ERROR_MESSAGE(s->trigrams != NULL, "out of memory");
+      s->trigrams[s->num_trigrams++] = trigram;
+    }
+  }
+}
+
+/* Collect the trigrams that every message matching the extended regular
+ * expression <pattern> contains: those of the runs of literal characters
+ * outside groups. A character before *, ? or { is optional and ends a
+ * run; one before + is where the next run starts. A pattern with an
+ * alternation yields none.
+ */
+static void search_pattern_trigrams(struct search* s, const char* pattern) {
+  if (strchr(pattern, '|')) {
+    return;
+  }
+  char run[strlen(pattern) + 1];
+  size_t len = 0;
+  int depth = 0;
+  for (const char* p = pattern; *p; p++) {
+    char c = *p;
+    if (c == '\\' && p[1] && strchr(".[]()*+?{}|^$\\", p[1])) {
+      c = *++p;
+    } else if (c == '\\' || c == '.' || c == '^' || c == '$') {
+      p += c == '\\' && p[1];
+      search_add_run(s, run, len);
+      len = 0;
+      continue;
+    } else if (c == '[') {
+      p += p[1] == '^';
+      p += p[1] == ']';
+      while (p[1] && p[1] != ']') {
+        p++;
+      }
+      p += p[1] == ']';
+      search_add_run(s, run, len);
+      len = 0;
+      continue;
+    } else if (c == '(' || c == ')') {
+      depth += c == '(' ? 1 : depth > 0 ? -1 : 0;
+      search_add_run(s, run, len);
+      len = 0;
+      continue;
+    } else if (c == '*' || c == '?' || c == '{' || c == '+') {
+      char last = len ? run[len - 1] : 0;
+      len -= len && c != '+';
+      search_add_run(s, run, len);
+      len = 0;
+      if (c == '+' && last) {
+        run[len++] = last;
+      } else if (c == '{') {
+        while (p[1] && *p != '}') {
+          p++;
+        }
+      }
+      continue;
+    }
+    if (depth == 0) {
+      run[len++] = c;
+    }
+  }
+  search_add_run(s, run, len);
+}
+
+/* Start a search of graph <g> for the commits whose messages may match
+ * the extended regular expression <pattern>. Returns 0 if the index can't
+ * narrow the search for it (the pattern has no literal part of three or
+ * more characters); the caller then has to scan every message.
+ */
+int search_begin(struct search* s, struct graph* g, const char* pattern) {
+  memset(s, 0, sizeof(struct search));
+  s->g = g;
+  search_pattern_trigrams(s, pattern);
+  if (s->num_trigrams == 0) {
+    free(s->trigrams);
+    return 0;
+  }
+  s->num_segments = search_open_segments(g, &s->segments, 0);
+  s->covered = s->num_segments ? s->segments[s->num_segments - 1].end : 0;
+  s->tail = g->count;
+  s->next_segment = s->num_segments - 1;
+  return 1;
+}
+
+/* Set the candidates of <s> to the positions in <seg> that have every
+ * trigram. The shortest postings list is read first; every other one can
+ * only remove candidates.
+ */
+static void search_candidates(struct search* s, const struct search_segment* seg) {
+  s->num_candidates = 0;
+  uint32_t entries[s->num_trigrams];
+  int shortest = 0;
+  for (int t = 0; t < s->num_trigrams; t++) {
+    if (!search_segment_find(seg, s->trigrams[t], &entries[t])) {
+      return;
+    }
+    if (get_u32(seg->table + (size_t) entries[t] * SEARCH_ENTRY_SIZE + 8)
+        < get_u32(seg->table + (size_t) entries[shortest] * SEARCH_ENTRY_SIZE + 8)) {
+      shortest = t;
+    }
+  }
+
+  struct search_postings it;
+  search_postings_open(seg, entries[shortest], &it);
+  if (it.left > s->capacity) {
+    s->capacity = it.left;
+    free(s->candidates);
+    s->candidates = malloc(s->capacity * sizeof(uint32_t));
+    ASSERT_ERROR_MESSAGE(s->candidates != NULL, "out of memory");
+  }
+  uint32_t pos;
+  while (search_postings_next(&it, &pos)) {
+    s->candidates[s->num_candidates++] = pos;
+  }
+
+  for (int t = 0; t < s->num_trigrams && s->num_candidates > 0; t++) {
+    if (t == shortest) {
+      continue;
+    }
+    search_postings_open(seg, entries[t], &it);
+    size_t kept = 0;
+    int more = search_postings_next(&it, &pos);
+    for (size_t i = 0; i < s->num_candidates && more; i++) {
+      while (more && pos < s->candidates[i]) {
+        more = search_postings_next(&it, &pos);
+      }
+      if (more && pos == s->candidates[i]) {
+        s->candidates[kept++] = pos;
+      }
+    }
+    s->num_candidates = kept;
+  }
+}
+
+/* Returns the next candidate position, newest first, or GRAPH_NONE when
+ * there are no more. Commits the index doesn't cover yet are all
+ * candidates.
+ */
+uint32_t search_next(struct search* s) {
+  if (s->tail > s->covered) {
+    return --s->tail;
+  }
+  while (s->num_candidates == 0) {
+    if (s->next_segment < 0) {
+      return GRAPH_NONE;
+    }
+    search_candidates(s, &s->segments[s->next_segment--]);
+  }
+  return s->candidates[--s->num_candidates];
+}
+
+void search_end(struct search* s) {
+  search_close_segments(s->segments, s->num_segments);
+  free(s->trigrams);
+  free(s->candidates);
+  memset(s, 0, sizeof(struct search));
+}
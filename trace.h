@@ -0,0 +1,82 @@
+/**
+ * Tracing of commands, their phases and I/O.
+ *
+ * If the BEARGIT_TRACE environment variable names a file ("-" for
+ * stderr), every command records spans around its phases, counts its
+ * file I/O and arena memory (see arena.h), and writes them as Chrome
+ * trace-event JSON when it exits. The file can be loaded in
+ * chrome://tracing or https://ui.perfetto.dev.
+ *
+ *   struct trace_span span;
+ *   trace_begin(&span, "index load");
+ *   ...
+ *   trace_end(&span);
+ *
+ * Timestamps are CLOCK_MONOTONIC nanoseconds. Spans may be recorded from
+ * any thread. Span names and details are not copied, so they must be
+ * string literals or otherwise live until the process exits.
+ *
+ * With tracing off, trace_begin(), trace_end() and trace_count() only
+ * test trace_enabled, so instrumentation can stay in hot paths.
+ */
+#ifndef _BEARGIT_TRACE_H_
+#define _BEARGIT_TRACE_H_
+
+#include <stdint.h>
+
+// Counters
+#define TRACE_FILES 0         // files opened by util.c helpers and fopen()
+#define TRACE_FOPEN 1         // fopen() calls
+#define TRACE_BYTES_COPIED 2  // bytes copied by fs_cp()
+#define TRACE_BYTES_HASHED 3  // bytes read by hash_fd()
+#define TRACE_ARENA_ALLOCS 4  // arena_alloc() calls
+#define TRACE_ARENA_PEAK 5    // most bytes held by arenas at once
+#define TRACE_PATHS 6         // distinct paths interned
+#define TRACE_NUM_COUNTERS 7
+
+// Counters from here on are written as the "memory" counter event, the
+// ones before as "io"
+#define TRACE_FIRST_MEMORY_COUNTER TRACE_ARENA_ALLOCS
+
+struct trace_span {
+  const char* name;
+  const char* detail;  // shown as the span's "detail" argument, if set
+  uint64_t start;
+};
+
+extern int trace_enabled;
+extern uint64_t trace_counters[TRACE_NUM_COUNTERS];
+
+void trace_init(const char* command);
+void trace_span_start(struct trace_span* span, const char* name);
+void trace_span_finish(struct trace_span* span);
+
+static inline void trace_begin(struct trace_span* span, const char* name) {
+  if (__builtin_expect(trace_enabled, 0)) {
+    trace_span_start(span, name);
+  }
+}
+
+static inline void trace_end(struct trace_span* span) {
+  if (__builtin_expect(trace_enabled, 0)) {
+    trace_span_finish(span);
+  }
+}
+
+static inline void trace_count(int counter, uint64_t n) {
+  if (__builtin_expect(trace_enabled, 0)) {
+    __atomic_add_fetch(&trace_counters[counter], n, __ATOMIC_RELAXED);
+  }
+}
+
+// Raise <counter> to <n> if it is lower.
+static inline void trace_max(int counter, uint64_t n) {
+  if (__builtin_expect(trace_enabled, 0)) {
+    uint64_t old = __atomic_load_n(&trace_counters[counter], __ATOMIC_RELAXED);
+    while (old < n && !__atomic_compare_exchange_n(&trace_counters[counter], &old, n, 1,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+  }
+}
+
+#endif // _BEARGIT_TRACE_H_
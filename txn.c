@@ -0,0 +1,183 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "beargit.h"
+#include "config.h"
+#include "pool.h"
+#include "trace.h"
+#include "txn.h"
+#include "util.h"
+
+// Don't start a worker for fewer files than this
+#define TXN_MIN_FILES_PER_JOB 16
+
+static const char* durability_names[] = { "none", "normal", "full" };
+
+/* The durability setting of the repository. */
+int txn_durability(void) {
+  char value[CONFIG_VALUE_SIZE];
+  if (!config_get("durability", value)) {
+    return DURABILITY_NORMAL;
+  }
+  for (int i = DURABILITY_NONE; i <= DURABILITY_FULL; i++) {
+    if (strcmp(value, durability_names[i]) == 0) {
+      return i;
+    }
+  }
+  fprintf(stderr, "ERROR:  Invalid durability %s in %s; using normal.\n", value, CONFIG_FILE);
+  return DURABILITY_NORMAL;
+}
+
+void txn_begin(struct txn* t) {
+  t->durability = txn_durability();
+  t->files = NULL;
+  t->count = 0;
+  t->capacity = 0;
+  pthread_mutex_init(&t->lock, NULL);
+}
+
+static void txn_append(struct txn* t, const char* tmp, const char* path) {
+  pthread_mutex_lock(&t->lock);
+  if (t->count == t->capacity) {
+    t->capacity = t->capacity ? t->capacity * 2 : 16;
+    t->files = realloc(t->files, t->capacity * sizeof(struct txn_file));
+    ASSERT_ERROR_MESSAGE(t->files != NULL, "out of memory");
+  }
+  struct txn_file* f = &t->files[t->count++];
+  f->tmp = strdup(tmp);
+  f->path = path ? strdup(path) : NULL;
+  ASSERT_ERROR_MESSAGE(f->tmp != NULL && (!path || f->path != NULL), "out of memory");
+  pthread_mutex_unlock(&t->lock);
+}
+
+/* Flush file (or directory) <tmp>, which stays where it is, with the
+ * transaction. Safe to call from several threads.
+ */
+void txn_add(struct txn* t, const char* tmp) {
+  txn_append(t, tmp, NULL);
+}
+
+/* Rename the complete file or directory <tmp> onto <path> when <t>
+ * commits. Safe to call from several threads.
+ */
+void txn_rename(struct txn* t, const char* tmp, const char* path) {
+  txn_append(t, tmp, path);
+}
+
+/* Write <str> to <filename> (like write_string_to_file()) when <t>
+ * commits.
+ */
+void txn_write_string(struct txn* t, const char* filename, const char* str) {
+  char tmp[PATH_MAX];
+  snprintf(tmp, PATH_MAX, "%s.tmp", filename);
+  write_string_to_file(tmp, str);
+  txn_rename(t, tmp, filename);
+}
+
+static void txn_flush(const char* path) {
+  int fd = open(path, O_RDONLY);
+  ASSERT_ERROR_MESSAGE(fd != -1 && fdatasync(fd) == 0, "flushing file to disk failed");
+  close(fd);
+}
+
+static void txn_flush_file(void* arg, int i) {
+  txn_flush(((struct txn*) arg)->files[i].tmp);
+}
+
+static int dir_cmp(const void* a, const void* b) {
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+/* fsync() the directories that hold the renamed files, and their parents
+ * below .beargit (new object fan-out directories), once each.
+ */
+static void txn_flush_dirs(struct txn* t) {
+  char** dirs = NULL;
+  int count = 0, capacity = 0;
+  for (int i = 0; i < t->count; i++) {
+    if (!t->files[i].path) {
+      continue;
+    }
+    char dir[PATH_MAX];
+    snprintf(dir, PATH_MAX, "%s", t->files[i].path);
+    char* slash;
+    while ((slash = strrchr(dir, '/')) != NULL) {
+      *slash = '\0';
+      if (count == capacity) {
+        capacity = capacity ? capacity * 2 : 16;
+        dirs = realloc(dirs, capacity * sizeof(char*));
+        ASSERT_ERROR_MESSAGE(dirs != NULL, "out of memory");
+      }
+      dirs[count] = strdup(dir);
+      ASSERT_ERROR_MESSAGE(dirs[count] != NULL, "out of memory");
+      count++;
+    }
+  }
+  qsort(dirs, count, sizeof(char*), dir_cmp);
+  for (int i = 0; i < count; i++) {
+    if (i == 0 || strcmp(dirs[i], dirs[i - 1]) != 0) {
+      txn_flush(dirs[i]);
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    free(dirs[i]);
+  }
+  free(dirs);
+}
+
+static void txn_free(struct txn* t) {
+  for (int i = 0; i < t->count; i++) {
+    free(t->files[i].tmp);
+    free(t->files[i].path);
+  }
+  free(t->files);
+  pthread_mutex_destroy(&t->lock);
+}
+
+/* Flush the files of <t> as its durability asks, then rename them into
+ * place.
+ */
+void txn_commit(struct txn* t) {
+  struct trace_span span;
+  trace_begin(&span, "sync");
+  span.detail = durability_names[t->durability];
+  if (t->durability == DURABILITY_NORMAL) {
+    int fd = open(".beargit", O_RDONLY | O_DIRECTORY);
+    ASSERT_ERROR_MESSAGE(fd != -1 && syncfs(fd) == 0, "flushing repository to disk failed");
+    close(fd);
+  } else if (t->durability == DURABILITY_FULL) {
+    pool_for(t->count, TXN_MIN_FILES_PER_JOB, txn_flush_file, t);
+  }
+  trace_end(&span);
+
+  for (int i = 0; i < t->count; i++) {
+    if (t->files[i].path) {
+      fs_mv(t->files[i].tmp, t->files[i].path);
+    }
+  }
+  if (t->durability == DURABILITY_FULL) {
+    txn_flush_dirs(t);
+  }
+  txn_free(t);
+}
+
+/* Drop <t>, deleting its temporary files. */
+void txn_abort(struct txn* t) {
+  for (int i = t->count - 1; i >= 0; i--) {
+    struct stat st;
+    if (t->files[i].path && lstat(t->files[i].tmp, &st) == 0) {
+      if (S_ISDIR(st.st_mode)) {
+        fs_rm_tree(t->files[i].tmp);
+      } else {
+        unlink(t->files[i].tmp);
+      }
+    }
+  }
+  txn_free(t);
+}
@@ -0,0 +1,52 @@
+/**
+ * Transactions: crash-safe updates of the repository.
+ *
+ * A transaction collects new files written under temporary names, and
+ * renames them into place together in txn_commit(), in the order they
+ * were added. Renames are atomic, so readers see either the old or the
+ * new file. Before the renames, the data of all files is flushed in one
+ * go, according to the durability setting (see config.h):
+ *
+ * - none:   nothing is flushed. After a crash, files (refs included) may
+ *           name data that never reached the disk.
+ * - normal: one syncfs() flushes all data before the renames, so refs
+ *           never name a commit or object that is not on disk. A crash
+ *           may still lose the last transaction. This is the default.
+ * - full:   each file of the transaction is fdatasync()ed (in parallel)
+ *           before the renames and the directories holding them are
+ *           fsync()ed after, so the transaction is on disk once
+ *           txn_commit() returns. Unlike syncfs(), this leaves other
+ *           dirty data on the filesystem alone.
+ */
+#ifndef _BEARGIT_TXN_H_
+#define _BEARGIT_TXN_H_
+
+#include <pthread.h>
+
+#define DURABILITY_NONE 0
+#define DURABILITY_NORMAL 1
+#define DURABILITY_FULL 2
+
+struct txn_file {
+  char* tmp;
+  // Where <tmp> goes, or NULL if it only needs to be flushed
+  char* path;
+};
+
+struct txn {
+  int durability;
+  struct txn_file* files;
+  int count;
+  int capacity;
+  pthread_mutex_t lock;
+};
+
+int txn_durability(void);
+void txn_begin(struct txn* t);
+void txn_add(struct txn* t, const char* tmp);
+void txn_rename(struct txn* t, const char* tmp, const char* path);
+void txn_write_string(struct txn* t, const char* filename, const char* str);
+void txn_commit(struct txn* t);
+void txn_abort(struct txn* t);
+
+#endif // _BEARGIT_TXN_H_
@@ -2,6 +2,16 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include "hash.h"
+#include "trace.h"
 #include "util.h"
 const char * file_stdout = "TEST_STDOUT";
 const char * file_stderr = "TEST_STDERR";
@@ -13,6 +23,19 @@ void fs_mkdir(const char* dirname) {
   ASSERT_ERROR_MESSAGE(ret == 0, "creating directory failed");
 }
 
+void fs_mkdir_parents(const char* path) {
+  ASSERT_ERROR_MESSAGE(path != NULL, "path is not a valid string");
+  ASSERT_ERROR_MESSAGE(is_sane_path(path), "path is not a valid path within .beargit");
+  char dir[strlen(path) + 1];
+  strcpy(dir, path);
+  for (char* slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    int ret = mkdir(dir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    ASSERT_ERROR_MESSAGE(ret == 0 || errno == EEXIST, "creating parent directory failed");
+    *slash = '/';
+  }
+}
+
 void fs_rm(const char* filename) {
   ASSERT_ERROR_MESSAGE(filename != NULL, "filename is not a valid string");
   ASSERT_ERROR_MESSAGE(is_sane_path(filename), "filename is not a valid path within .beargit");
@@ -20,6 +43,18 @@ void fs_rm(const char* filename) {
   ASSERT_ERROR_MESSAGE(ret == 0, "deleting/unlinking file failed");
 }
 
+static int fs_rm_tree_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+  return remove(path);
+}
+
+/* Delete directory <dirname> and everything in it. */
+void fs_rm_tree(const char* dirname) {
+  ASSERT_ERROR_MESSAGE(dirname != NULL, "dirname is not a valid string");
+  ASSERT_ERROR_MESSAGE(is_sane_path(dirname), "dirname is not a valid path within .beargit");
+  int ret = nftw(dirname, fs_rm_tree_entry, 16, FTW_DEPTH | FTW_PHYS);
+  ASSERT_ERROR_MESSAGE(ret == 0, "deleting directory failed");
+}
+
 void fs_force_rm_beargit_dir() {
   // BAD HACK. Don't use this in real-world code.
   // This removes the .beargit directory and directs all output to /dev/null
@@ -35,25 +70,185 @@ void fs_mv(const char* src, const char* dst) {
   ASSERT_ERROR_MESSAGE(ret == 0, "renaming file failed");
 }
 
-void fs_cp(const char* src, const char* dst) {
+static mode_t fs_umask;
+static pthread_once_t fs_umask_once = PTHREAD_ONCE_INIT;
+
+// umask() can only be read by setting it, which would race with files
+// other threads create; /proc has it without that.
+static void fs_read_umask(void) {
+  FILE* f = (fopen)("/proc/self/status", "r");
+  char line[128];
+  unsigned int mask;
+  int found = 0;
+  while (f && !found && fgets(line, sizeof(line), f)) {
+    found = sscanf(line, "Umask: %o", &mask) == 1;
+  }
+  if (f) {
+    fclose(f);
+  }
+  if (found) {
+    fs_umask = mask;
+  } else {
+    fs_umask = umask(022);
+    umask(fs_umask);
+  }
+}
+
+/* Give <fd>, a file mkstemp() created with mode 0600, the mode open() and
+ * fopen() create files with: 0666 less the umask.
+ */
+void fs_tmp_mode(int fd) {
+  pthread_once(&fs_umask_once, fs_read_umask);
+  ASSERT_ERROR_MESSAGE(fchmod(fd, 0666 & ~fs_umask) == 0, "changing file mode failed");
+}
+
+const char* fs_cp_method_names[] = {
+  "auto", "clone", "copy_file_range", "sendfile", "read/write"
+};
+
+// Methods that failed with "not supported" are not tried again
+static int fs_cp_unsupported[FS_CP_READ_WRITE];
+
+// Errors meaning that a copy method doesn't work for this pair of files;
+// anything else is a real I/O error.
+static int fs_cp_is_unsupported(int err) {
+  return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP
+      || err == ENOTTY || err == EBADF || err == EPERM;
+}
+
+static void fs_cp_mark_unsupported(int method) {
+  __atomic_store_n(&fs_cp_unsupported[method], 1, __ATOMIC_RELAXED);
+}
+
+static int fs_cp_skip(int method, int wanted) {
+  if (wanted == FS_CP_AUTO) {
+    return __atomic_load_n(&fs_cp_unsupported[method], __ATOMIC_RELAXED);
+  }
+  return wanted != method;
+}
+
+/* Copy the rest of <in> to <out> with copy_file_range(), which lets the
+ * kernel (or the filesystem) move the data without a trip through user
+ * space. Returns 0 if the method isn't supported for these files.
+ */
+static int fs_cp_range(int in, int out) {
+  for (;;) {
+    ssize_t n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0);
+    if (n == 0) {
+      return 1;
+    } else if (n < 0 && errno != EINTR) {
+      ASSERT_ERROR_MESSAGE(fs_cp_is_unsupported(errno), "copy_file_range failed");
+      return 0;
+    }
+  }
+}
+
+/* Same as fs_cp_range(), with sendfile(). */
+static int fs_cp_sendfile(int in, int out) {
+  for (;;) {
+    ssize_t n = sendfile(out, in, NULL, 1 << 30);
+    if (n == 0) {
+      return 1;
+    } else if (n < 0 && errno != EINTR) {
+      ASSERT_ERROR_MESSAGE(fs_cp_is_unsupported(errno), "sendfile failed");
+      return 0;
+    }
+  }
+}
+
+/* Copy the rest of <in> to <out> through a user space buffer. */
+static void fs_cp_read_write(int in, int out) {
+  size_t size = 1 << 20;
+  char* buffer = malloc(size);
+  ASSERT_ERROR_MESSAGE(buffer != NULL, "out of memory");
+
+  ssize_t n;
+  while ((n = read(in, buffer, size)) != 0) {
+    if (n < 0) {
+      ASSERT_ERROR_MESSAGE(errno == EINTR, "reading source file failed");
+      continue;
+    }
+    for (ssize_t done = 0; done < n; ) {
+      ssize_t w = write(out, buffer + done, n - done);
+      ASSERT_ERROR_MESSAGE(w > 0 || errno == EINTR, "writing destination file failed");
+      done += w > 0 ? w : 0;
+    }
+  }
+  free(buffer);
+}
+
+/* Copy <src> to <dst> with copy method <method>, or with the fastest one
+ * that works if <method> is FS_CP_AUTO. The methods are tried in order:
+ *
+ * - clone:           share the source's data blocks (reflink; btrfs, xfs)
+ * - copy_file_range: copy inside the kernel, or server-side on NFS
+ * - sendfile:        copy inside the kernel
+ * - read/write:      copy through a 1 MiB buffer
+ *
+ * Every method continues from the current file offsets, so a method that
+ * stops working halfway through hands over to the next one. Returns the
+ * method that finished the copy, or -1 if <method> isn't supported.
+ */
+int fs_cp_using(const char* src, const char* dst, int method) {
   ASSERT_ERROR_MESSAGE(src != NULL, "src is not a valid string");
   ASSERT_ERROR_MESSAGE(dst != NULL, "dst is not a valid string");
   ASSERT_ERROR_MESSAGE(is_sane_path(dst), "dst is not a valid path within .beargit");
 
-  FILE* fin = fopen(src, "r");
-  ASSERT_ERROR_MESSAGE(fin != NULL, "couldn't open source file");
-  FILE* fout = fopen(dst, "w");
-  ASSERT_ERROR_MESSAGE(fout != NULL, "couldn't open destination file");
+  int in = open(src, O_RDONLY);
+  ASSERT_ERROR_MESSAGE(in != -1, "couldn't open source file");
+  int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  ASSERT_ERROR_MESSAGE(out != -1, "couldn't open destination file");
 
-  char buffer[4096];
-  int size;
+  int used = -1;
+  if (!fs_cp_skip(FS_CP_CLONE, method)) {
+    if (ioctl(out, FICLONE, in) == 0) {
+      used = FS_CP_CLONE;
+    } else {
+      ASSERT_ERROR_MESSAGE(fs_cp_is_unsupported(errno), "cloning file failed");
+      fs_cp_mark_unsupported(FS_CP_CLONE);
+    }
+  }
+  if (used == -1 && !fs_cp_skip(FS_CP_RANGE, method)) {
+    if (fs_cp_range(in, out)) {
+      used = FS_CP_RANGE;
+    } else {
+      fs_cp_mark_unsupported(FS_CP_RANGE);
+    }
+  }
+  if (used == -1 && !fs_cp_skip(FS_CP_SENDFILE, method)) {
+    if (fs_cp_sendfile(in, out)) {
+      used = FS_CP_SENDFILE;
+    } else {
+      fs_cp_mark_unsupported(FS_CP_SENDFILE);
+    }
+  }
+  if (used == -1 && (method == FS_CP_AUTO || method == FS_CP_READ_WRITE)) {
+    fs_cp_read_write(in, out);
+    used = FS_CP_READ_WRITE;
+  }
 
-  while ((size = fread(buffer, 1, 4096, fin)) > 0) {
-    fwrite(buffer, 1, size, fout);
+  struct stat st;
+  if (trace_enabled && fstat(out, &st) == 0) {
+    trace_count(TRACE_FILES, 2);
+    trace_count(TRACE_BYTES_COPIED, st.st_size);
   }
+  close(in);
+  ASSERT_ERROR_MESSAGE(close(out) == 0, "writing destination file failed");
+  return used;
+}
 
-  fclose(fin);
-  fclose(fout);
+void fs_cp(const char* src, const char* dst) {
+  struct trace_span span;
+  trace_begin(&span, "copy");
+  int method = fs_cp_using(src, dst, FS_CP_AUTO);
+  span.detail = fs_cp_method_names[method];
+  trace_end(&span);
+}
+
+FILE* fs_fopen(const char* filename, const char* mode) {
+  trace_count(TRACE_FILES, 1);
+  trace_count(TRACE_FOPEN, 1);
+  return (fopen)(filename, mode);
 }
 
 void write_string_to_file(const char* filename, const char* str) {
@@ -63,11 +258,114 @@ void write_string_to_file(const char* filename, const char* str) {
   fclose(fout);
 }
 
+/* Read the string in <filename> (up to a NUL or the end of the file) into
+ * <str>, which holds <size> bytes. A string that doesn't fit is an error,
+ * not silently cut off.
+ */
 void read_string_from_file(const char* filename, char* str, int size) {
-  FILE* fin = fopen(filename, "r");
-  ASSERT_ERROR_MESSAGE(fin != NULL, "couldn't open file");
-  fread(str, 1, size, fin);
-  fclose(fin);
+  struct fs_view v;
+  ASSERT_ERROR_MESSAGE(fs_view_open(filename, &v), "couldn't open file");
+  size_t len = fs_view_strlen(&v);
+  ASSERT_ERROR_MESSAGE(len < (size_t) size, "file contents too long");
+  memcpy(str, v.data, len);
+  str[len] = '\0';
+  fs_view_close(&v);
+}
+
+/* Open a view <v> of the whole of <filename>: the file is mapped if it is
+ * large, else read into memory. The data is not NUL-terminated.
+ *
+ * Returns 1 on success, 0 if the file can't be opened.
+ */
+int fs_view_open(const char* filename, struct fs_view* v) {
+  trace_count(TRACE_FILES, 1);
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    return 0;
+  }
+  struct stat st;
+  ASSERT_ERROR_MESSAGE(fstat(fd, &st) == 0, "couldn't stat file");
+  v->size = st.st_size;
+  v->mapped = 0;
+  if (v->size >= FS_VIEW_MMAP_MIN) {
+    void* map = mmap(NULL, v->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      v->data = map;
+      v->mapped = v->size;
+      close(fd);
+      return 1;
+    }
+  }
+
+  char* data = malloc(v->size + 1);
+  ASSERT_ERROR_MESSAGE(data != NULL, "out of memory");
+  size_t done = 0;
+  ssize_t n;
+  while (done < v->size && (n = read(fd, data + done, v->size - done)) != 0) {
+    ASSERT_ERROR_MESSAGE(n > 0 || errno == EINTR, "reading file failed");
+    done += n > 0 ? n : 0;
+  }
+  close(fd);
+  data[done] = '\0';
+  v->size = done;
+  v->data = data;
+  return 1;
+}
+
+void fs_view_close(struct fs_view* v) {
+  if (v->mapped) {
+    munmap((void*) v->data, v->mapped);
+  } else {
+    free((void*) v->data);
+  }
+  v->data = NULL;
+  v->size = 0;
+}
+
+/* Point <line> and <len> at the line of <v> starting at <*off>, without
+ * its '\n', and move <*off> to the next line. Returns 0 at the end.
+ */
+int fs_view_line(const struct fs_view* v, size_t* off, const char** line, size_t* len) {
+  if (*off >= v->size) {
+    return 0;
+  }
+  const char* start = v->data + *off;
+  const char* nl = memchr(start, '\n', v->size - *off);
+  *line = start;
+  *len = nl ? (size_t) (nl - start) : v->size - *off;
+  *off += *len + 1;
+  return 1;
+}
+
+/* Length of the string at the start of <v>: up to a NUL, as written by
+ * write_string_to_file(), or the end of the file.
+ */
+size_t fs_view_strlen(const struct fs_view* v) {
+  const char* nul = memchr(v->data, '\0', v->size);
+  return nul ? (size_t) (nul - v->data) : v->size;
+}
+
+/* Read all of <filename> into a newly allocated, NUL-terminated buffer and
+ * store its length in <size>.
+ */
+unsigned char* fs_read_file(const char* filename, size_t* size) {
+  trace_count(TRACE_FILES, 1);
+  int fd = open(filename, O_RDONLY);
+  ASSERT_ERROR_MESSAGE(fd != -1, "couldn't open file");
+  struct stat st;
+  ASSERT_ERROR_MESSAGE(fstat(fd, &st) == 0, "couldn't stat file");
+  unsigned char* data = malloc(st.st_size + 1);
+  ASSERT_ERROR_MESSAGE(data != NULL, "out of memory");
+  size_t done = 0;
+  while (done < (size_t) st.st_size) {
+    ssize_t n = read(fd, data + done, st.st_size - done);
+    ASSERT_ERROR_MESSAGE(n > 0, "reading file failed");
+    done += n;
+  }
+  close(fd);
+  data[done] = '\0';
+  *size = done;
+  return data;
 }
 
 int fs_check_dir_exists(const char* dirname) {
@@ -118,7 +416,7 @@ int fake_fprint(FILE* stream, char* fmt, ...) {
 }
 
 int is_sane_path(const char* path) {
-  if (strlen(path) > 512)
+  if (strlen(path) >= PATH_MAX)
     return 0;
 
   // Only allow modifying files in .beargit directory
@@ -130,10 +428,19 @@ int is_sane_path(const char* path) {
 }
 
 void cryptohash(const char* str, char dst[SHA_HEX_BYTES + 1]) {
-     char buf[SHA_DIGEST_LENGTH];
-     SHA1((unsigned char*)str, strlen(str), (unsigned char*) buf);
-     for (size_t i = 0; i < SHA_DIGEST_LENGTH; ++i) {
-          sprintf(&dst[i*2], "%02x", (unsigned char)buf[i]);
-     }
-     dst[SHA_HEX_BYTES] = '\0';
+     unsigned char raw[SHA_DIGEST_LENGTH];
+     hash_buffer(HASH_SHA1, str, strlen(str), raw);
+     hash_to_hex(raw, SHA_DIGEST_LENGTH, dst);
+}
+
+void cryptohash_file(const char* filename, char dst[SHA_HEX_BYTES + 1]) {
+     trace_count(TRACE_FILES, 1);
+     int fd = open(filename, O_RDONLY);
+     ASSERT_ERROR_MESSAGE(fd != -1, "couldn't open file to hash");
+
+     unsigned char raw[SHA_DIGEST_LENGTH];
+     int ok = hash_fd(fd, HASH_SHA1, raw);
+     close(fd);
+     ASSERT_ERROR_MESSAGE(ok, "reading file to hash failed");
+     hash_to_hex(raw, SHA_DIGEST_LENGTH, dst);
 }
@@ -27,6 +27,12 @@ int is_sane_path(const char* path);
 #define fprintf fake_fprint
 #endif
 
+/* fopen() calls are counted for tracing (see trace.h). (fopen)(...) calls
+ * the real one.
+ */
+FILE* fs_fopen(const char* filename, const char* mode);
+#define fopen(filename, mode) fs_fopen(filename, mode)
+
 static const char* path = "";
 static const char* dirname = "";
 static const char* filename = "";
@@ -59,16 +65,48 @@ static const char* dst = "";
   }
 
 void fs_mkdir(const char* dirname);
+void fs_mkdir_parents(const char* path);
 void fs_rm(const char* filename);
+void fs_rm_tree(const char* dirname);
 void fs_force_rm_beargit_dir();
 void fs_mv(const char* src, const char* dst);
+void fs_tmp_mode(int fd);
 void fs_cp(const char* src, const char* dst);
+
+// Copy methods of fs_cp_using(), in the order FS_CP_AUTO tries them
+#define FS_CP_AUTO 0
+#define FS_CP_CLONE 1
+#define FS_CP_RANGE 2
+#define FS_CP_SENDFILE 3
+#define FS_CP_READ_WRITE 4
+
+extern const char* fs_cp_method_names[];
+int fs_cp_using(const char* src, const char* dst, int method);
 void write_string_to_file(const char* filename, const char* str);
 void read_string_from_file(const char* filename, char* str, int size);
+unsigned char* fs_read_file(const char* filename, size_t* size);
+
+// Files at least this large are mapped by fs_view_open(); smaller ones
+// are cheaper to read.
+#define FS_VIEW_MMAP_MIN (16 << 10)
+
+// A read-only view of the contents of a file
+struct fs_view {
+  const char* data;
+  size_t size;
+  // Length of the mapping at <data>, or 0 if <data> was read into memory
+  size_t mapped;
+};
+
+int fs_view_open(const char* filename, struct fs_view* v);
+void fs_view_close(struct fs_view* v);
+int fs_view_line(const struct fs_view* v, size_t* off, const char** line, size_t* len);
+size_t fs_view_strlen(const struct fs_view* v);
 int fs_check_dir_exists(const char* dirname);
 
 #define SHA_HEX_BYTES (SHA_DIGEST_LENGTH * 2)
 
 void cryptohash(const char* str, char dst[SHA_HEX_BYTES + 1]);
+void cryptohash_file(const char* filename, char dst[SHA_HEX_BYTES + 1]);
 
 #endif // _BEARGIT_UTIL_H_